@@ -24,9 +24,56 @@
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
 
+/* esp-idf includes. */
+#include "esp_timer.h"
+
 /* Header include. */
 #include "freertos_agent_message.h"
 #include "core_mqtt_agent_message_interface.h"
+#include "core_mqtt_agent.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Lane of a command.
+ */
+static AgentMessageLane_t prvGetLane( const MQTTAgentMessageContext_t * pMsgCtx,
+                                      const MQTTAgentCommand_t * pCommand );
+
+/**
+ * @brief Takes the next command from the lanes, one is known to be queued.
+ */
+static bool prvReceiveFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                                 AgentLaneMessage_t * pMessage,
+                                 AgentMessageLane_t * pLane );
+
+/**
+ * @brief Adds the time a command waited in its lane to the stats.
+ */
+static void prvRecordWait( AgentLaneStats_t * pStats,
+                           int64_t waitUs );
+
+/*-----------------------------------------------------------*/
+
+void Agent_MessageInitLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                             QueueHandle_t controlQueue,
+                             QueueHandle_t bulkQueue,
+                             size_t bulkPublishSize,
+                             uint32_t controlBurst )
+{
+    UBaseType_t length = uxQueueSpacesAvailable( controlQueue ) + uxQueueSpacesAvailable( bulkQueue );
+
+    memset( pMsgCtx, 0x00, sizeof( MQTTAgentMessageContext_t ) );
+
+    pMsgCtx->lanes[ AgentMessageLaneControl ] = controlQueue;
+    pMsgCtx->lanes[ AgentMessageLaneBulk ] = bulkQueue;
+    pMsgCtx->bulkPublishSize = bulkPublishSize;
+    pMsgCtx->controlBurst = controlBurst;
+
+    /* Counts the commands queued in both lanes, the agent blocks on it. */
+    pMsgCtx->pending = xSemaphoreCreateCountingStatic( length, 0, &( pMsgCtx->pendingBuffer ) );
+    configASSERT( pMsgCtx->pending );
+}
 
 /*-----------------------------------------------------------*/
 
@@ -38,7 +85,22 @@ bool Agent_MessageSend( MQTTAgentMessageContext_t * pMsgCtx,
 
     if( ( pMsgCtx != NULL ) && ( pCommandToSend != NULL ) )
     {
-        queueStatus = xQueueSendToBack( pMsgCtx->queue, pCommandToSend, pdMS_TO_TICKS( blockTimeMs ) );
+        if( pMsgCtx->pending == NULL )
+        {
+            queueStatus = xQueueSendToBack( pMsgCtx->queue, pCommandToSend, pdMS_TO_TICKS( blockTimeMs ) );
+        }
+        else
+        {
+            AgentLaneMessage_t message = { .pCommand = *pCommandToSend, .queuedUs = esp_timer_get_time() };
+            AgentMessageLane_t lane = prvGetLane( pMsgCtx, *pCommandToSend );
+
+            queueStatus = xQueueSendToBack( pMsgCtx->lanes[ lane ], &message, pdMS_TO_TICKS( blockTimeMs ) );
+
+            if( queueStatus == pdPASS )
+            {
+                ( void ) xSemaphoreGive( pMsgCtx->pending );
+            }
+        }
     }
 
     return ( queueStatus == pdPASS ) ? true : false;
@@ -54,8 +116,127 @@ bool Agent_MessageReceive( MQTTAgentMessageContext_t * pMsgCtx,
 
     if( ( pMsgCtx != NULL ) && ( pReceivedCommand != NULL ) )
     {
-        queueStatus = xQueueReceive( pMsgCtx->queue, pReceivedCommand, pdMS_TO_TICKS( blockTimeMs ) );
+        if( pMsgCtx->pending == NULL )
+        {
+            queueStatus = xQueueReceive( pMsgCtx->queue, pReceivedCommand, pdMS_TO_TICKS( blockTimeMs ) );
+        }
+        else if( xSemaphoreTake( pMsgCtx->pending, pdMS_TO_TICKS( blockTimeMs ) ) == pdPASS )
+        {
+            AgentLaneMessage_t message = { 0 };
+            AgentMessageLane_t lane = AgentMessageLaneControl;
+
+            if( prvReceiveFromLanes( pMsgCtx, &message, &lane ) )
+            {
+                prvRecordWait( &( pMsgCtx->stats[ lane ] ), esp_timer_get_time() - message.queuedUs );
+                *pReceivedCommand = message.pCommand;
+                queueStatus = pdPASS;
+            }
+        }
     }
 
     return ( queueStatus == pdPASS ) ? true : false;
 }
+
+/*-----------------------------------------------------------*/
+
+void Agent_MessageGetLaneStats( MQTTAgentMessageContext_t * pMsgCtx,
+                                AgentMessageLane_t lane,
+                                AgentLaneStats_t * pStats )
+{
+    /* Updated by the agent task only, a copy taken meanwhile may be off by one command. */
+    *pStats = pMsgCtx->stats[ lane ];
+}
+
+/*-----------------------------------------------------------*/
+
+uint32_t Agent_MessageHistogramBoundMs( uint32_t bucket )
+{
+    return ( bucket < ( AGENT_MESSAGE_HISTOGRAM_BUCKETS - 1U ) ) ? ( 1UL << ( 2U * bucket ) ) : UINT32_MAX;
+}
+
+/*-----------------------------------------------------------*/
+
+static AgentMessageLane_t prvGetLane( const MQTTAgentMessageContext_t * pMsgCtx,
+                                      const MQTTAgentCommand_t * pCommand )
+{
+    AgentMessageLane_t lane = AgentMessageLaneControl;
+
+    if( ( pCommand->commandType == PUBLISH ) && ( pCommand->pArgs != NULL ) &&
+        ( ( ( const MQTTPublishInfo_t * ) pCommand->pArgs )->payloadLength >= pMsgCtx->bulkPublishSize ) )
+    {
+        lane = AgentMessageLaneBulk;
+    }
+
+    return lane;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvReceiveFromLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                                 AgentLaneMessage_t * pMessage,
+                                 AgentMessageLane_t * pLane )
+{
+    bool received = false;
+
+    /* A bulk command waiting behind a burst of control ones goes first. */
+    if( ( pMsgCtx->controlInARow >= pMsgCtx->controlBurst ) &&
+        ( xQueueReceive( pMsgCtx->lanes[ AgentMessageLaneBulk ], pMessage, 0 ) == pdPASS ) )
+    {
+        *pLane = AgentMessageLaneBulk;
+        received = true;
+    }
+    else if( xQueueReceive( pMsgCtx->lanes[ AgentMessageLaneControl ], pMessage, 0 ) == pdPASS )
+    {
+        *pLane = AgentMessageLaneControl;
+        received = true;
+    }
+    else if( xQueueReceive( pMsgCtx->lanes[ AgentMessageLaneBulk ], pMessage, 0 ) == pdPASS )
+    {
+        *pLane = AgentMessageLaneBulk;
+        received = true;
+    }
+
+    if( received )
+    {
+        /* Only control commands received while bulk ones wait count towards the burst. */
+        if( ( *pLane == AgentMessageLaneControl ) &&
+            ( uxQueueMessagesWaiting( pMsgCtx->lanes[ AgentMessageLaneBulk ] ) > 0U ) )
+        {
+            pMsgCtx->controlInARow++;
+        }
+        else
+        {
+            pMsgCtx->controlInARow = 0;
+        }
+    }
+
+    return received;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRecordWait( AgentLaneStats_t * pStats,
+                           int64_t waitUs )
+{
+    uint32_t bucket = 0;
+
+    if( waitUs < 0 )
+    {
+        waitUs = 0;
+    }
+
+    while( ( bucket < ( AGENT_MESSAGE_HISTOGRAM_BUCKETS - 1U ) ) &&
+           ( ( uint64_t ) waitUs >= ( ( uint64_t ) Agent_MessageHistogramBoundMs( bucket ) * 1000U ) ) )
+    {
+        bucket++;
+    }
+
+    pStats->messages++;
+    pStats->totalWaitUs += ( uint64_t ) waitUs;
+    pStats->histogram[ bucket ]++;
+
+    if( ( uint64_t ) waitUs > pStats->maxWaitUs )
+    {
+        pStats->maxWaitUs = ( uint32_t ) waitUs;
+    }
+}
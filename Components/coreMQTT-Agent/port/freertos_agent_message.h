@@ -24,6 +24,7 @@
 /* FreeRTOS includes. */
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 /* Include MQTT agent messaging interface. */
 #include "core_mqtt_agent_message_interface.h"
@@ -32,17 +33,104 @@
 extern "C" {
 #endif /* __cplusplus */
 
+/**
+ * @brief Lanes of the agent command queue.
+ *
+ * Publishes of at least bulkPublishSize bytes go to the bulk lane, every
+ * other command to the control lane, so OTA block requests, job updates and
+ * subscriptions do not wait behind an image upload.
+ */
+typedef enum AgentMessageLane
+{
+    AgentMessageLaneControl = 0,
+    AgentMessageLaneBulk,
+    AgentMessageLaneMax
+} AgentMessageLane_t;
+
+/**
+ * @brief Number of buckets of the queue wait time histogram of a lane.
+ * Bucket i counts waits shorter than 4^i ms, the last one the longer waits.
+ */
+#define AGENT_MESSAGE_HISTOGRAM_BUCKETS    8U
+
+/**
+ * @brief Element of the lane queues, the command and when it was queued.
+ */
+typedef struct AgentLaneMessage
+{
+    MQTTAgentCommand_t * pCommand;
+    int64_t queuedUs;
+} AgentLaneMessage_t;
+
+/**
+ * @brief Time commands of a lane waited in the queue.
+ */
+typedef struct AgentLaneStats
+{
+    uint32_t messages;
+    uint32_t maxWaitUs;
+    uint64_t totalWaitUs;
+    uint32_t histogram[ AGENT_MESSAGE_HISTOGRAM_BUCKETS ];
+} AgentLaneStats_t;
+
 /**
  * @ingroup mqtt_agent_struct_types
  * @brief Context with which tasks may deliver messages to the agent.
+ *
+ * With lanes set by Agent_MessageInitLanes(), queue is not used. Otherwise
+ * queue holds the command pointers in FIFO order, as the command pool does.
  */
 struct MQTTAgentMessageContext
 {
     QueueHandle_t queue;
+    QueueHandle_t lanes[ AgentMessageLaneMax ];
+    SemaphoreHandle_t pending;
+    StaticSemaphore_t pendingBuffer;
+    size_t bulkPublishSize;
+    uint32_t controlBurst;
+    uint32_t controlInARow;
+    AgentLaneStats_t stats[ AgentMessageLaneMax ];
 };
 
 /*-----------------------------------------------------------*/
 
+/**
+ * @brief Sets the lanes of a context.
+ *
+ * The agent always receives from the control lane first, but after
+ * controlBurst control commands in a row it takes one bulk command, so
+ * bulk publishes are not starved.
+ *
+ * @param[in] pMsgCtx An #MQTTAgentMessageContext_t.
+ * @param[in] controlQueue Queue of #AgentLaneMessage_t for control commands.
+ * @param[in] bulkQueue Queue of #AgentLaneMessage_t for large publishes.
+ * @param[in] bulkPublishSize Smallest payload of a bulk publish.
+ * @param[in] controlBurst Control commands received before a waiting bulk one.
+ */
+void Agent_MessageInitLanes( MQTTAgentMessageContext_t * pMsgCtx,
+                             QueueHandle_t controlQueue,
+                             QueueHandle_t bulkQueue,
+                             size_t bulkPublishSize,
+                             uint32_t controlBurst );
+
+/**
+ * @brief Copies the queue wait stats of a lane.
+ *
+ * @param[in] pMsgCtx An #MQTTAgentMessageContext_t with lanes.
+ * @param[in] lane Lane of the stats.
+ * @param[out] pStats Where to copy them.
+ */
+void Agent_MessageGetLaneStats( MQTTAgentMessageContext_t * pMsgCtx,
+                                AgentMessageLane_t lane,
+                                AgentLaneStats_t * pStats );
+
+/**
+ * @brief Upper bound of a bucket of the wait time histogram in ms, UINT32_MAX for the last one.
+ */
+uint32_t Agent_MessageHistogramBoundMs( uint32_t bucket );
+
+/*-----------------------------------------------------------*/
+
 /**
  * @brief Send a message to the specified context.
  * Must be thread safe.
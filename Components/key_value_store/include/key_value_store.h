@@ -21,5 +21,8 @@
 #define ENDPOINT_NVS_KEY          "Endpoint"
 #define THING_NAME_NVS_KEY        "ThingName"
 
+/* OTA Settings */
+#define OTA_SIGNER_CERTIFICATE_NVS_KEY "OtaSignerCert"
+
 char* LoadValueFromNVS(nvs_handle handle, const char* key, size_t* value_size);
 void LoadValueToNVS(const char* key, const char* value);
\ No newline at end of file
@@ -1,24 +1,51 @@
 #ifndef MQTT_SUBSCRIPTION_MANAGER_H
 #define MQTT_SUBSCRIPTION_MANAGER_H
 
+#include "sdkconfig.h"
+
 #include "core_mqtt.h"
 
-/* Maximum number of subscriptions maintained by the subscription manager simultaneously in a list. */
+/* Maximum number of subscriptions maintained by the subscription manager simultaneously. */
 #ifndef SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
-    #define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    4U
+    #if defined( CONFIG_SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+        #define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    CONFIG_SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
+    #else
+        #define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    32U
+    #endif
+#endif
+
+/* Maximum number of topic levels in the trie, over all the subscriptions. Filters sharing a prefix share its levels. */
+#ifndef SUBSCRIPTION_MANAGER_MAX_LEVELS
+    #if defined( CONFIG_SUBSCRIPTION_MANAGER_MAX_LEVELS )
+        #define SUBSCRIPTION_MANAGER_MAX_LEVELS    CONFIG_SUBSCRIPTION_MANAGER_MAX_LEVELS
+    #else
+        #define SUBSCRIPTION_MANAGER_MAX_LEVELS    64U
+    #endif
 #endif
 
+/* Longest level of a topic filter, the levels are copied into the trie. */
+#ifndef SUBSCRIPTION_MANAGER_LEVEL_SIZE
+    #if defined( CONFIG_SUBSCRIPTION_MANAGER_LEVEL_SIZE )
+        #define SUBSCRIPTION_MANAGER_LEVEL_SIZE    CONFIG_SUBSCRIPTION_MANAGER_LEVEL_SIZE
+    #else
+        #define SUBSCRIPTION_MANAGER_LEVEL_SIZE    64U
+    #endif
+#endif
+
+/* Index of no level or subscription, ending the lists of the pools. */
+#define SUBSCRIPTION_MANAGER_NONE    UINT16_MAX
+
 /* Callback function called when receiving a publish. */
 typedef void (* IncomingPubCallback_t )( void * pvIncomingPublishCallbackContext,
                                          MQTTPublishInfo_t * pxPublishInfo );
 
-/* 
- * An element in the list of subscriptions.
+/*
+ * A subscription, kept in the list of the trie level its filter ends at.
  * This implementation allows multiple tasks to subscribe to the same topic.
- * In this case, another element is added to the subscription list, differing
- * in the intended publish callback. The topic filters are not
- * copied in the subscription manager and hence the topic filter strings need to
- * stay in scope until unsubscribed.
+ * In this case, another element is added to the level, differing in the
+ * intended publish callback. The topic filters are not copied in the
+ * subscription manager and hence the topic filter strings need to stay in
+ * scope until unsubscribed.
  */
 typedef struct subscriptionElement
 {
@@ -26,25 +53,68 @@ typedef struct subscriptionElement
     void * pvIncomingPublishCallbackContext;
     uint16_t usFilterStringLength;
     const char * pcSubscriptionFilterString;
+    uint16_t usNext; /* Next subscription of the same level, or of the free list */
 } SubscriptionElement_t;
 
-/* Add a subscription to the subscription list.
+/*
+ * A level of a topic filter. Its children are the levels following it in some
+ * filter, found by a hash of their parent and name. The '+' and '#' wildcards
+ * are kept apart so a publish reaches them without looking them up.
+ */
+typedef struct subscriptionLevel
+{
+    uint32_t ulHash;
+    uint16_t usParent;
+    uint16_t usNextInBucket; /* Or next level of the free list */
+    uint16_t usChildren; /* Children other than the wildcards */
+    uint16_t usSingleLevelChild; /* '+' */
+    uint16_t usMultiLevelChild; /* '#' */
+    uint16_t usFirstSubscription; /* Subscriptions whose filter ends at this level */
+    uint16_t usLevelLength;
+    char cLevel[ SUBSCRIPTION_MANAGER_LEVEL_SIZE ];
+} SubscriptionLevel_t;
+
+/*
+ * The subscriptions, in a trie of the levels of their filters built from
+ * fixed pools. A publish walks down the levels of its topic, looking each one
+ * up in a hash table, so dispatching it costs its depth and not the number of
+ * subscriptions.
+ */
+typedef struct subscriptionManager
+{
+    SubscriptionLevel_t xLevels[ SUBSCRIPTION_MANAGER_MAX_LEVELS ]; /* The first one is the root */
+    SubscriptionElement_t xSubscriptions[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    uint16_t usBuckets[ SUBSCRIPTION_MANAGER_MAX_LEVELS ]; /* Chains of levels, by the hash of their parent and name */
+    uint16_t usFreeLevels;
+    uint16_t usFreeSubscriptions;
+    uint16_t usLevelsInUse;
+    uint16_t usSubscriptionsInUse;
+    bool xFanOut;
+} SubscriptionManager_t;
+
+/* Empties the trie. With fan out, a publish is handed to every matching
+ * subscription instead of only to the first one.
+ */
+void SubscriptionManager_Init( SubscriptionManager_t * pxSubscriptionManager,
+                               bool xFanOut );
+
+/* Add a subscription to the trie.
  * Multiple tasks can be subscribed to the same topic with different
  * context-callback pairs. However, a single context-callback pair may only be
  * associated to the same topic filter once.
  * Returns `true` if subscription added or exists, `false` if insufficient memory.
  */
-bool SubscriptionManager_AddSubscription( SubscriptionElement_t * pxSubscriptionList,
+bool SubscriptionManager_AddSubscription( SubscriptionManager_t * pxSubscriptionManager,
                                           const char * pcTopicFilterString,
                                           uint16_t usTopicFilterLength,
                                           IncomingPubCallback_t pxIncomingPublishCallback,
                                           void * pvIncomingPublishCallbackContext );
 
-/* Remove a subscription from the subscription list.
- * If the topic filter exists multiple times in the subscription list,
+/* Remove a subscription from the trie.
+ * If the topic filter exists multiple times in the trie,
  * then every instance of the subscription will be removed.
  */
-void SubscriptionManager_RemoveSubscription( SubscriptionElement_t * pxSubscriptionList,
+void SubscriptionManager_RemoveSubscription( SubscriptionManager_t * pxSubscriptionManager,
                                              const char * pcTopicFilterString,
                                              uint16_t usTopicFilterLength );
 
@@ -52,7 +122,7 @@ void SubscriptionManager_RemoveSubscription( SubscriptionElement_t * pxSubscript
  * for the incoming publish's topic filter.
  * Returns `true` if an application callback could be invoked; `false` otherwise.
  */
-bool SubscriptionManager_HandleIncomingPublishes( SubscriptionElement_t * pxSubscriptionList,
+bool SubscriptionManager_HandleIncomingPublishes( SubscriptionManager_t * pxSubscriptionManager,
                                                   MQTTPublishInfo_t * pxPublishInfo );
 
 #endif
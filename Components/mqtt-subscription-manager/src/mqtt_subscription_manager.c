@@ -4,129 +4,489 @@
 #include "mqtt_subscription_manager.h"
 #include "esp_log.h"
 
+#define ROOT_LEVEL    0U
+
+/* FNV-1a, 32 bits */
+#define FNV_OFFSET_BASIS    2166136261U
+#define FNV_PRIME           16777619U
+
 static const char* TAG = "Subscripcion_Manager";
 
-bool SubscriptionManager_AddSubscription( SubscriptionElement_t * pxSubscriptionList,
+static uint16_t prvFindFilterLevel( SubscriptionManager_t * pxSubscriptionManager,
+                                    const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength,
+                                    bool xCreate );
+static uint32_t prvHashLevel( uint16_t usParent,
+                              const char * pcLevel,
+                              uint16_t usLevelLength );
+static uint16_t prvFindChild( const SubscriptionManager_t * pxSubscriptionManager,
+                              uint16_t usLevel,
+                              const char * pcLevel,
+                              uint16_t usLevelLength );
+static uint16_t prvAddChild( SubscriptionManager_t * pxSubscriptionManager,
+                             uint16_t usLevel,
+                             const char * pcLevel,
+                             uint16_t usLevelLength );
+static void prvPruneLevel( SubscriptionManager_t * pxSubscriptionManager,
+                           uint16_t usLevel );
+static void prvMatchLevel( SubscriptionManager_t * pxSubscriptionManager,
+                           uint16_t usLevel,
+                           MQTTPublishInfo_t * pxPublishInfo,
+                           uint16_t usOffset,
+                           bool xTopicEnded,
+                           bool * pxPublishHandled );
+static void prvDispatch( SubscriptionManager_t * pxSubscriptionManager,
+                         uint16_t usLevel,
+                         MQTTPublishInfo_t * pxPublishInfo,
+                         bool * pxPublishHandled );
+
+void SubscriptionManager_Init( SubscriptionManager_t * pxSubscriptionManager,
+                               bool xFanOut )
+{
+    SubscriptionLevel_t * pxRoot = &( pxSubscriptionManager->xLevels[ ROOT_LEVEL ] );
+
+    memset( pxSubscriptionManager, 0x00, sizeof( SubscriptionManager_t ) );
+
+    /* Every level but the root, and every subscription, starts in its free list. */
+    for( uint16_t usIndex = 0; usIndex < SUBSCRIPTION_MANAGER_MAX_LEVELS; usIndex++ )
+    {
+        pxSubscriptionManager->xLevels[ usIndex ].usNextInBucket = ( usIndex + 1U < SUBSCRIPTION_MANAGER_MAX_LEVELS ) ? usIndex + 1U : SUBSCRIPTION_MANAGER_NONE;
+        pxSubscriptionManager->usBuckets[ usIndex ] = SUBSCRIPTION_MANAGER_NONE;
+    }
+
+    for( uint16_t usIndex = 0; usIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; usIndex++ )
+    {
+        pxSubscriptionManager->xSubscriptions[ usIndex ].usNext = ( usIndex + 1U < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) ? usIndex + 1U : SUBSCRIPTION_MANAGER_NONE;
+    }
+
+    pxSubscriptionManager->usFreeLevels = ( SUBSCRIPTION_MANAGER_MAX_LEVELS > 1U ) ? ROOT_LEVEL + 1U : SUBSCRIPTION_MANAGER_NONE;
+    pxSubscriptionManager->usFreeSubscriptions = 0;
+    pxSubscriptionManager->usLevelsInUse = 1U;
+    pxSubscriptionManager->xFanOut = xFanOut;
+
+    pxRoot->usParent = SUBSCRIPTION_MANAGER_NONE;
+    pxRoot->usNextInBucket = SUBSCRIPTION_MANAGER_NONE;
+    pxRoot->usSingleLevelChild = SUBSCRIPTION_MANAGER_NONE;
+    pxRoot->usMultiLevelChild = SUBSCRIPTION_MANAGER_NONE;
+    pxRoot->usFirstSubscription = SUBSCRIPTION_MANAGER_NONE;
+}
+
+bool SubscriptionManager_AddSubscription( SubscriptionManager_t * pxSubscriptionManager,
                                           const char * pcTopicFilterString,
                                           uint16_t usTopicFilterLength,
                                           IncomingPubCallback_t pxIncomingPublishCallback,
                                           void * pvIncomingPublishCallbackContext )
 {
-    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
     bool xReturnStatus = false;
+    uint16_t usLevel;
+    uint16_t usIndex;
+    uint16_t * pusLast;
 
-    if( ( pxSubscriptionList == NULL ) ||
+    if( ( pxSubscriptionManager == NULL ) ||
         ( pcTopicFilterString == NULL ) ||
         ( usTopicFilterLength == 0U )
          )
     {
-        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionManager=%p, pcTopicFilterString=%p,"
                       " usTopicFilterLength=%u, pxIncomingPublishCallback=%p.",
-                       pxSubscriptionList,
+                       pxSubscriptionManager,
                        pcTopicFilterString,
                        ( unsigned int ) usTopicFilterLength,
                        pxIncomingPublishCallback);
+        return false;
     }
-    else
+
+    usLevel = prvFindFilterLevel( pxSubscriptionManager, pcTopicFilterString, usTopicFilterLength, true );
+
+    if( usLevel == SUBSCRIPTION_MANAGER_NONE )
     {
-        /* Start at end of array, so that we will insert at the first available index.
-         * Scans backwards to find duplicates. */
-        for(int32_t lIndex = ( int32_t ) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS - 1; lIndex >= 0; lIndex-- )
-        {
-            if( pxSubscriptionList[ lIndex ].usFilterStringLength == 0 )
-            {
-                xAvailableIndex = lIndex;
-            }
-            else if( ( pxSubscriptionList[ lIndex ].usFilterStringLength == usTopicFilterLength ) &&
-                     ( strncmp( pcTopicFilterString, pxSubscriptionList[ lIndex ].pcSubscriptionFilterString, ( size_t ) usTopicFilterLength ) == 0 ) )
-            {
-                /* If a subscription already exists, don't do anything. */
-                if( ( pxSubscriptionList[ lIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
-                    ( pxSubscriptionList[ lIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
-                {
-                    ESP_LOGI( TAG, "Subscription already exists." );
-                    xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
-                    xReturnStatus = true;
-                    break;
-                }
-            }
-        }
+        ESP_LOGE( TAG, "No room for the levels of %.*s, %u of %u in use.", usTopicFilterLength, pcTopicFilterString,
+                  pxSubscriptionManager->usLevelsInUse, ( unsigned int ) SUBSCRIPTION_MANAGER_MAX_LEVELS );
+        return false;
+    }
+
+    /* Walks to the end of the level's list, appending keeps the dispatch in subscription order. */
+    pusLast = &( pxSubscriptionManager->xLevels[ usLevel ].usFirstSubscription );
 
-        if( xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+    while( *pusLast != SUBSCRIPTION_MANAGER_NONE )
+    {
+        SubscriptionElement_t * pxElement = &( pxSubscriptionManager->xSubscriptions[ *pusLast ] );
+
+        /* If a subscription already exists, don't do anything. */
+        if( ( pxElement->pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+            ( pxElement->pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
         {
-            
-            pxSubscriptionList[ xAvailableIndex ].pcSubscriptionFilterString = pcTopicFilterString;
-            pxSubscriptionList[ xAvailableIndex ].usFilterStringLength = usTopicFilterLength;
-            pxSubscriptionList[ xAvailableIndex ].pxIncomingPublishCallback = pxIncomingPublishCallback;
-            pxSubscriptionList[ xAvailableIndex ].pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
-            ESP_LOGI(TAG, "Topic added to subscribe list %s", pxSubscriptionList[ xAvailableIndex ].pcSubscriptionFilterString);
-            xReturnStatus = true;
+            ESP_LOGI( TAG, "Subscription already exists." );
+            return true;
         }
+
+        pusLast = &( pxElement->usNext );
+    }
+
+    usIndex = pxSubscriptionManager->usFreeSubscriptions;
+
+    if( usIndex == SUBSCRIPTION_MANAGER_NONE )
+    {
+        ESP_LOGE( TAG, "No room for the subscription to %.*s, %u in use.", usTopicFilterLength, pcTopicFilterString,
+                  ( unsigned int ) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS );
+        prvPruneLevel( pxSubscriptionManager, usLevel );
+    }
+    else
+    {
+        SubscriptionElement_t * pxElement = &( pxSubscriptionManager->xSubscriptions[ usIndex ] );
+
+        pxSubscriptionManager->usFreeSubscriptions = pxElement->usNext;
+        pxSubscriptionManager->usSubscriptionsInUse++;
+
+        pxElement->pcSubscriptionFilterString = pcTopicFilterString;
+        pxElement->usFilterStringLength = usTopicFilterLength;
+        pxElement->pxIncomingPublishCallback = pxIncomingPublishCallback;
+        pxElement->pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+        pxElement->usNext = SUBSCRIPTION_MANAGER_NONE;
+        *pusLast = usIndex;
+
+        ESP_LOGI(TAG, "Topic added to subscribe list %.*s, %u subscriptions over %u levels",
+                 usTopicFilterLength, pcTopicFilterString,
+                 pxSubscriptionManager->usSubscriptionsInUse, pxSubscriptionManager->usLevelsInUse);
+        xReturnStatus = true;
     }
 
     return xReturnStatus;
 }
 
-void SubscriptionManager_RemoveSubscription( SubscriptionElement_t * pxSubscriptionList,
+void SubscriptionManager_RemoveSubscription( SubscriptionManager_t * pxSubscriptionManager,
                                              const char * pcTopicFilterString,
                                              uint16_t usTopicFilterLength )
 {
-    if( ( pxSubscriptionList == NULL ) ||
+    uint16_t usLevel;
+    uint16_t usIndex;
+
+    if( ( pxSubscriptionManager == NULL ) ||
         ( pcTopicFilterString == NULL ) ||
         ( usTopicFilterLength == 0U ) )
     {
-        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,usTopicFilterLength=%u.", pxSubscriptionList, pcTopicFilterString, ( unsigned int ) usTopicFilterLength );
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionManager=%p, pcTopicFilterString=%p,usTopicFilterLength=%u.", pxSubscriptionManager, pcTopicFilterString, ( unsigned int ) usTopicFilterLength );
+        return;
     }
-    else
+
+    usLevel = prvFindFilterLevel( pxSubscriptionManager, pcTopicFilterString, usTopicFilterLength, false );
+
+    if( usLevel == SUBSCRIPTION_MANAGER_NONE )
+    {
+        return;
+    }
+
+    usIndex = pxSubscriptionManager->xLevels[ usLevel ].usFirstSubscription;
+
+    while( usIndex != SUBSCRIPTION_MANAGER_NONE )
     {
-        for(int32_t lIndex = 0; lIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; lIndex++ )
+        SubscriptionElement_t * pxElement = &( pxSubscriptionManager->xSubscriptions[ usIndex ] );
+        uint16_t usNext = pxElement->usNext;
+
+        memset( pxElement, 0x00, sizeof( SubscriptionElement_t ) );
+        pxElement->usNext = pxSubscriptionManager->usFreeSubscriptions;
+        pxSubscriptionManager->usFreeSubscriptions = usIndex;
+        pxSubscriptionManager->usSubscriptionsInUse--;
+
+        usIndex = usNext;
+    }
+
+    pxSubscriptionManager->xLevels[ usLevel ].usFirstSubscription = SUBSCRIPTION_MANAGER_NONE;
+    prvPruneLevel( pxSubscriptionManager, usLevel );
+}
+
+bool SubscriptionManager_HandleIncomingPublishes( SubscriptionManager_t * pxSubscriptionManager,
+                                                  MQTTPublishInfo_t * pxPublishInfo )
+{
+    bool publishHandled = false;
+
+    if( ( pxSubscriptionManager == NULL ) ||
+        ( pxPublishInfo == NULL ) )
+    {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionManager=%p, pxPublishInfo=%p,", pxSubscriptionManager, pxPublishInfo);
+    }
+    else if( ( pxPublishInfo->pTopicName != NULL ) && ( pxPublishInfo->topicNameLength > 0U ) )
+    {
+        prvMatchLevel( pxSubscriptionManager, ROOT_LEVEL, pxPublishInfo, 0, false, &publishHandled );
+    }
+
+    return publishHandled;
+}
+
+/*
+ * Walks the levels of a filter, '+' and '#' taken as wildcards only when they
+ * are a whole level. With xCreate the missing ones are added, and on running
+ * out of levels the ones added are released again.
+ */
+static uint16_t prvFindFilterLevel( SubscriptionManager_t * pxSubscriptionManager,
+                                    const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength,
+                                    bool xCreate )
+{
+    uint16_t usLevel = ROOT_LEVEL;
+    uint16_t usStart = 0;
+
+    while( usStart <= usTopicFilterLength )
+    {
+        const char * pcEnd = memchr( &pcTopicFilterString[ usStart ], '/', usTopicFilterLength - usStart );
+        uint16_t usEnd = ( pcEnd != NULL ) ? ( uint16_t ) ( pcEnd - pcTopicFilterString ) : usTopicFilterLength;
+        uint16_t usChild = prvFindChild( pxSubscriptionManager, usLevel, &pcTopicFilterString[ usStart ], usEnd - usStart );
+
+        if( ( usChild == SUBSCRIPTION_MANAGER_NONE ) && xCreate )
         {
-            if( pxSubscriptionList[ lIndex ].usFilterStringLength == usTopicFilterLength )
+            usChild = prvAddChild( pxSubscriptionManager, usLevel, &pcTopicFilterString[ usStart ], usEnd - usStart );
+
+            if( usChild == SUBSCRIPTION_MANAGER_NONE )
             {
-                if( strncmp( pxSubscriptionList[ lIndex ].pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 )
-                {
-                    memset( &( pxSubscriptionList[ lIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
-                }
+                prvPruneLevel( pxSubscriptionManager, usLevel );
             }
         }
+
+        if( usChild == SUBSCRIPTION_MANAGER_NONE )
+        {
+            return SUBSCRIPTION_MANAGER_NONE;
+        }
+
+        usLevel = usChild;
+        usStart = usEnd + 1U;
     }
+
+    return usLevel;
 }
 
-bool SubscriptionManager_HandleIncomingPublishes( SubscriptionElement_t * pxSubscriptionList,
-                                                  MQTTPublishInfo_t * pxPublishInfo )
+static uint16_t prvFindChild( const SubscriptionManager_t * pxSubscriptionManager,
+                              uint16_t usLevel,
+                              const char * pcLevel,
+                              uint16_t usLevelLength )
 {
-    bool isMatched = false, publishHandled = false;
-    
-    if( ( pxSubscriptionList == NULL ) ||
-        ( pxPublishInfo == NULL ) )
+    const SubscriptionLevel_t * pxLevel = &( pxSubscriptionManager->xLevels[ usLevel ] );
+    uint32_t ulHash;
+    uint16_t usChild;
+
+    if( ( usLevelLength == 1U ) && ( pcLevel[ 0 ] == '+' ) )
     {
-        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pxPublishInfo=%p,", pxSubscriptionList, pxPublishInfo);
-    }   
+        return pxLevel->usSingleLevelChild;
+    }
+
+    if( ( usLevelLength == 1U ) && ( pcLevel[ 0 ] == '#' ) )
+    {
+        return pxLevel->usMultiLevelChild;
+    }
 
+    if( pxLevel->usChildren == 0U )
+    {
+        return SUBSCRIPTION_MANAGER_NONE;
+    }
+
+    ulHash = prvHashLevel( usLevel, pcLevel, usLevelLength );
+
+    for( usChild = pxSubscriptionManager->usBuckets[ ulHash % SUBSCRIPTION_MANAGER_MAX_LEVELS ];
+         usChild != SUBSCRIPTION_MANAGER_NONE;
+         usChild = pxSubscriptionManager->xLevels[ usChild ].usNextInBucket )
+    {
+        const SubscriptionLevel_t * pxChild = &( pxSubscriptionManager->xLevels[ usChild ] );
+
+        if( ( pxChild->ulHash == ulHash ) &&
+            ( pxChild->usParent == usLevel ) &&
+            ( pxChild->usLevelLength == usLevelLength ) &&
+            ( memcmp( pxChild->cLevel, pcLevel, usLevelLength ) == 0 ) )
+        {
+            break;
+        }
+    }
+
+    return usChild;
+}
+
+static uint16_t prvAddChild( SubscriptionManager_t * pxSubscriptionManager,
+                             uint16_t usLevel,
+                             const char * pcLevel,
+                             uint16_t usLevelLength )
+{
+    SubscriptionLevel_t * pxLevel = &( pxSubscriptionManager->xLevels[ usLevel ] );
+    uint16_t usChild = pxSubscriptionManager->usFreeLevels;
+    SubscriptionLevel_t * pxChild;
+
+    if( ( usChild == SUBSCRIPTION_MANAGER_NONE ) || ( usLevelLength > SUBSCRIPTION_MANAGER_LEVEL_SIZE ) )
+    {
+        return SUBSCRIPTION_MANAGER_NONE;
+    }
+
+    pxChild = &( pxSubscriptionManager->xLevels[ usChild ] );
+    pxSubscriptionManager->usFreeLevels = pxChild->usNextInBucket;
+    pxSubscriptionManager->usLevelsInUse++;
+
+    memcpy( pxChild->cLevel, pcLevel, usLevelLength );
+    pxChild->usLevelLength = usLevelLength;
+    pxChild->usParent = usLevel;
+    pxChild->usChildren = 0;
+    pxChild->usNextInBucket = SUBSCRIPTION_MANAGER_NONE;
+    pxChild->usSingleLevelChild = SUBSCRIPTION_MANAGER_NONE;
+    pxChild->usMultiLevelChild = SUBSCRIPTION_MANAGER_NONE;
+    pxChild->usFirstSubscription = SUBSCRIPTION_MANAGER_NONE;
+
+    if( ( usLevelLength == 1U ) && ( pcLevel[ 0 ] == '+' ) )
+    {
+        pxLevel->usSingleLevelChild = usChild;
+    }
+    else if( ( usLevelLength == 1U ) && ( pcLevel[ 0 ] == '#' ) )
+    {
+        pxLevel->usMultiLevelChild = usChild;
+    }
     else
     {
-        for(int32_t lIndex = 0; lIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; lIndex++ )
+        uint16_t * pusBucket;
+
+        pxChild->ulHash = prvHashLevel( usLevel, pcLevel, usLevelLength );
+        pusBucket = &( pxSubscriptionManager->usBuckets[ pxChild->ulHash % SUBSCRIPTION_MANAGER_MAX_LEVELS ] );
+        pxChild->usNextInBucket = *pusBucket;
+        *pusBucket = usChild;
+        pxLevel->usChildren++;
+    }
+
+    return usChild;
+}
+
+/* Hashes the name of a level with its parent, so the children of every level share one table. */
+static uint32_t prvHashLevel( uint16_t usParent,
+                              const char * pcLevel,
+                              uint16_t usLevelLength )
+{
+    uint32_t ulHash = FNV_OFFSET_BASIS;
+
+    ulHash = ( ulHash ^ ( usParent & 0xFFU ) ) * FNV_PRIME;
+    ulHash = ( ulHash ^ ( usParent >> 8 ) ) * FNV_PRIME;
+
+    for( uint16_t usIndex = 0; usIndex < usLevelLength; usIndex++ )
+    {
+        ulHash = ( ulHash ^ ( uint8_t ) pcLevel[ usIndex ] ) * FNV_PRIME;
+    }
+
+    return ulHash;
+}
+
+/* Releases a level left without subscriptions or children, and then its parents that are left so. */
+static void prvPruneLevel( SubscriptionManager_t * pxSubscriptionManager,
+                           uint16_t usLevel )
+{
+    while( usLevel != ROOT_LEVEL )
+    {
+        SubscriptionLevel_t * pxLevel = &( pxSubscriptionManager->xLevels[ usLevel ] );
+        SubscriptionLevel_t * pxParent;
+        uint16_t * pusLink;
+
+        if( ( pxLevel->usFirstSubscription != SUBSCRIPTION_MANAGER_NONE ) ||
+            ( pxLevel->usChildren != 0U ) ||
+            ( pxLevel->usSingleLevelChild != SUBSCRIPTION_MANAGER_NONE ) ||
+            ( pxLevel->usMultiLevelChild != SUBSCRIPTION_MANAGER_NONE ) )
         {
-            if( pxSubscriptionList[ lIndex ].usFilterStringLength > 0 )
+            break;
+        }
+
+        pxParent = &( pxSubscriptionManager->xLevels[ pxLevel->usParent ] );
+
+        if( pxParent->usSingleLevelChild == usLevel )
+        {
+            pxParent->usSingleLevelChild = SUBSCRIPTION_MANAGER_NONE;
+        }
+        else if( pxParent->usMultiLevelChild == usLevel )
+        {
+            pxParent->usMultiLevelChild = SUBSCRIPTION_MANAGER_NONE;
+        }
+        else
+        {
+            for( pusLink = &( pxSubscriptionManager->usBuckets[ pxLevel->ulHash % SUBSCRIPTION_MANAGER_MAX_LEVELS ] );
+                 *pusLink != usLevel;
+                 pusLink = &( pxSubscriptionManager->xLevels[ *pusLink ].usNextInBucket ) )
             {
-                MQTT_MatchTopic( pxPublishInfo->pTopicName,
-                                 pxPublishInfo->topicNameLength,
-                                 pxSubscriptionList[ lIndex ].pcSubscriptionFilterString,
-                                 pxSubscriptionList[ lIndex ].usFilterStringLength,
-                                 &isMatched );
-                
-
-                if( isMatched == true )
-                {                    
-                    pxSubscriptionList[ lIndex ].pxIncomingPublishCallback( pxSubscriptionList[ lIndex ].pvIncomingPublishCallbackContext,
-                                                                            pxPublishInfo );
-
-                    publishHandled = true;
-                    break;
-                }
             }
+
+            *pusLink = pxLevel->usNextInBucket;
+            pxParent->usChildren--;
+        }
+
+        usLevel = pxLevel->usParent;
+
+        memset( pxLevel, 0x00, sizeof( SubscriptionLevel_t ) );
+        pxLevel->usNextInBucket = pxSubscriptionManager->usFreeLevels;
+        pxSubscriptionManager->usFreeLevels = ( uint16_t ) ( pxLevel - pxSubscriptionManager->xLevels );
+        pxSubscriptionManager->usLevelsInUse--;
+    }
+}
+
+/*
+ * Matches the topic from usOffset on against the children of a level, as
+ * MQTT_MatchTopic() would: '#' also matches its parent level, and topics
+ * starting with '$' are not matched by a wildcard on their first level.
+ */
+static void prvMatchLevel( SubscriptionManager_t * pxSubscriptionManager,
+                           uint16_t usLevel,
+                           MQTTPublishInfo_t * pxPublishInfo,
+                           uint16_t usOffset,
+                           bool xTopicEnded,
+                           bool * pxPublishHandled )
+{
+    const SubscriptionLevel_t * pxLevel = &( pxSubscriptionManager->xLevels[ usLevel ] );
+    const char * pcTopic = pxPublishInfo->pTopicName;
+    bool xWildcards = ( usLevel != ROOT_LEVEL ) || ( pcTopic[ 0 ] != '$' );
+    const char * pcEnd;
+    uint16_t usEnd;
+    uint16_t usChild;
+
+    if( xTopicEnded )
+    {
+        prvDispatch( pxSubscriptionManager, usLevel, pxPublishInfo, pxPublishHandled );
+
+        if( pxLevel->usMultiLevelChild != SUBSCRIPTION_MANAGER_NONE )
+        {
+            prvDispatch( pxSubscriptionManager, pxLevel->usMultiLevelChild, pxPublishInfo, pxPublishHandled );
         }
+
+        return;
     }
 
-    return publishHandled;
+    pcEnd = memchr( &pcTopic[ usOffset ], '/', pxPublishInfo->topicNameLength - usOffset );
+    usEnd = ( pcEnd != NULL ) ? ( uint16_t ) ( pcEnd - pcTopic ) : pxPublishInfo->topicNameLength;
+    usChild = prvFindChild( pxSubscriptionManager, usLevel, &pcTopic[ usOffset ], usEnd - usOffset );
+
+    if( usChild != SUBSCRIPTION_MANAGER_NONE )
+    {
+        prvMatchLevel( pxSubscriptionManager, usChild, pxPublishInfo, usEnd + 1U, pcEnd == NULL, pxPublishHandled );
+    }
+
+    if( !xWildcards || ( *pxPublishHandled && !pxSubscriptionManager->xFanOut ) )
+    {
+        return;
+    }
+
+    if( pxLevel->usSingleLevelChild != SUBSCRIPTION_MANAGER_NONE )
+    {
+        prvMatchLevel( pxSubscriptionManager, pxLevel->usSingleLevelChild, pxPublishInfo, usEnd + 1U, pcEnd == NULL, pxPublishHandled );
+    }
+
+    if( pxLevel->usMultiLevelChild != SUBSCRIPTION_MANAGER_NONE )
+    {
+        prvDispatch( pxSubscriptionManager, pxLevel->usMultiLevelChild, pxPublishInfo, pxPublishHandled );
+    }
+}
+
+/* Hands the publish to the subscriptions of a level, only to the first one of all without fan out. */
+static void prvDispatch( SubscriptionManager_t * pxSubscriptionManager,
+                         uint16_t usLevel,
+                         MQTTPublishInfo_t * pxPublishInfo,
+                         bool * pxPublishHandled )
+{
+    uint16_t usIndex = pxSubscriptionManager->xLevels[ usLevel ].usFirstSubscription;
+
+    while( ( usIndex != SUBSCRIPTION_MANAGER_NONE ) && ( pxSubscriptionManager->xFanOut || !*pxPublishHandled ) )
+    {
+        SubscriptionElement_t * pxElement = &( pxSubscriptionManager->xSubscriptions[ usIndex ] );
+
+        /* Read before the callback, which may change the subscriptions. */
+        usIndex = pxElement->usNext;
+
+        pxElement->pxIncomingPublishCallback( pxElement->pvIncomingPublishCallbackContext,
+                                              pxPublishInfo );
+        *pxPublishHandled = true;
+    }
 }
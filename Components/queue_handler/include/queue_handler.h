@@ -10,13 +10,119 @@
 /* FreeRTOS includes. */
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "freertos/timers.h"
 
+#include "shared_buffer.h"
+
 #define DELAY_TIME pdMS_TO_TICKS(1000U)
 
-QueueHandle_t InitEvent_FreeRTOS(UBaseType_t max_messages, UBaseType_t max_msg_size, uint8_t* ucQueueStorageArea, StaticQueue_t* xStaticQueue, const char* TAG);
-BaseType_t SendEvent_FreeRTOS(QueueHandle_t xQueue, const void* eventMsg, const char* TAG);
-BaseType_t ReceiveEvent_FreeRTOS(QueueHandle_t xQueue, void* eventMsg, TickType_t xTicksToWait, const char* TAG);
+#if defined(CONFIG_EVENT_BUS_SEND_DEADLINE_MS)
+    #define EVENT_BUS_SEND_DEADLINE_MS CONFIG_EVENT_BUS_SEND_DEADLINE_MS
+#else
+    #define EVENT_BUS_SEND_DEADLINE_MS 200U
+#endif
+
+/* Event types of a queue with their own statistics, over it they share the last ones. */
+#define EVENT_BUS_MAX_TYPES 16U
+
+/* Queues logged by EventBus_LogStats(). */
+#define EVENT_BUS_MAX_QUEUES 4U
+
+/* Bytes of storage for a queue of depth events of eventSize bytes. */
+#define EVENT_BUS_STORAGE_SIZE(depth, eventSize) ((depth) * (sizeof(EventSlot_t) + (eventSize)))
+
+/* What is done with an event sent to a full queue. */
+typedef enum EventPolicy {
+    EventPolicyBlock = 0,  /* Waits for room until the deadline of the queue, then the event is dropped */
+    EventPolicyDropOldest, /* Drops the oldest event of the queue to make room */
+    EventPolicyCoalesce,   /* Replaces a queued event of the same type, whether full or not, otherwise as EventPolicyBlock */
+} EventPolicy_t;
+
+/* Describes the events of a queue, which owns a copy of each one until received. */
+typedef struct EventQueueConfig {
+    const char* name;
+    size_t eventSize;
+    uint32_t depth;
+    uint32_t reserved; /* Slots of depth only the receiving task can fill, for the events it sends itself */
+    uint32_t typeCount;
+    uint32_t (*typeOf)(const void* event);
+    const EventPolicy_t* policies;      /* By type, NULL to block for every one */
+    const char* const* typeNames;       /* By type, for the logs, may be NULL */
+    void (*release)(const void* event); /* Releases what a dropped or coalesced event owns, may be NULL */
+    TickType_t deadline;                /* Longest wait for room of EventPolicyBlock */
+} EventQueueConfig_t;
+
+/* Header of each event in the storage of a queue. */
+typedef struct EventSlot {
+    uint32_t type;
+    int64_t sentUs;
+} EventSlot_t;
+
+typedef struct EventQueueStats {
+    uint32_t sent;
+    uint32_t received;
+    uint32_t dropped;       /* Sent to a full queue and not queued by the deadline */
+    uint32_t droppedOldest; /* Made room for a newer event */
+    uint32_t coalesced;     /* Merged into a queued event of the same type */
+    uint32_t highWater;     /* Most events queued at the same time */
+    uint32_t maxSendUs;     /* Longest time to queue an event, waiting for room included */
+    uint64_t totalSendUs;
+} EventQueueStats_t;
+
+/* Delivery of one type of event, from the sender to the receiving task. */
+typedef struct EventTypeStats {
+    uint32_t received;
+    uint32_t lost; /* Dropped, or made room for a newer event */
+    uint32_t maxLatencyUs;
+    uint64_t totalLatencyUs;
+} EventTypeStats_t;
+
+typedef struct EventQueue {
+    EventQueueConfig_t config;
+    uint8_t* storage;
+    uint32_t head; /* Oldest event */
+    uint32_t count;
+    TaskHandle_t receiver; /* Set by the first receive */
+    SemaphoreHandle_t xMutex;
+    SemaphoreHandle_t xSent;     /* Given on each event queued */
+    SemaphoreHandle_t xReceived; /* Given on each event received */
+    StaticSemaphore_t xMutexBuffer;
+    StaticSemaphore_t xSentBuffer;
+    StaticSemaphore_t xReceivedBuffer;
+    EventQueueStats_t stats;
+    EventTypeStats_t typeStats[EVENT_BUS_MAX_TYPES];
+} EventQueue_t;
+
+/*
+ * Initializes a queue over storage of EVENT_BUS_STORAGE_SIZE() bytes and adds
+ * it to the bus. Returns NULL if the bus has no room for it.
+ */
+EventQueue_t* EventBus_InitQueue(EventQueue_t* queue, const EventQueueConfig_t* config, uint8_t* storage);
+
+/*
+ * Copies an event into the queue, following the policy of its type if the
+ * queue is full. A task sending to the queue it receives from does not wait,
+ * it cannot make room, but has the reserved slots on top of the others. An
+ * event that is not queued is released, as is a queued event replaced by
+ * coalescing.
+ */
+bool EventBus_Send(EventQueue_t* queue, const void* event);
+
+/*
+ * Same as EventBus_Send() without ever waiting, for the queue to be free or for
+ * room in it, to be called from timer callbacks.
+ */
+bool EventBus_TrySend(EventQueue_t* queue, const void* event);
+
+/* Waits up to xTicksToWait for the oldest event. */
+bool EventBus_Receive(EventQueue_t* queue, void* event, TickType_t xTicksToWait);
+
+void EventBus_GetStats(EventQueue_t* queue, EventQueueStats_t* pStats);
+bool EventBus_GetTypeStats(EventQueue_t* queue, uint32_t type, EventTypeStats_t* pStats);
+
+/* Logs the statistics of every queue of the bus, and the delivery latency of their events. */
+void EventBus_LogStats(void);
 
-#endif
\ No newline at end of file
+#endif
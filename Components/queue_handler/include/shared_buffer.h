@@ -0,0 +1,71 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#if defined(CONFIG_SHARED_BUFFER_COUNT)
+    #define SHARED_BUFFER_COUNT CONFIG_SHARED_BUFFER_COUNT
+#else
+    #define SHARED_BUFFER_COUNT 4U
+#endif
+
+#if defined(CONFIG_SHARED_BUFFER_SIZE)
+    #define SHARED_BUFFER_SIZE CONFIG_SHARED_BUFFER_SIZE
+#else
+    #define SHARED_BUFFER_SIZE 6144U
+#endif
+
+/*
+ * A received message, shared by the tasks handling it instead of copied for
+ * each one. It is back in the pool when its last reference is released.
+ */
+typedef struct SharedBuffer {
+    uint32_t references; /* Free at 0 */
+    size_t length;       /* Bytes written in data */
+    uint8_t* data;       /* SHARED_BUFFER_SIZE bytes */
+} SharedBuffer_t;
+
+typedef struct SharedBufferStats {
+    uint32_t allocations;
+    uint32_t exhausted; /* Allocations failed with every buffer in use */
+    uint32_t tooLarge;  /* Allocations failed for a message larger than a buffer */
+    uint32_t inUse;
+    uint32_t highWater; /* Most buffers in use at the same time */
+    uint32_t held;      /* SharedBuffer_Hold() calls sharing a buffer, without copy */
+    uint32_t copied;    /* SharedBuffer_Hold() calls copying into a new buffer */
+} SharedBufferStats_t;
+
+/* Allocates the buffers of the pool, before any message is received. */
+void SharedBuffer_Init(void);
+
+/*
+ * Takes a free buffer for a message of the given length, with one reference
+ * owned by the caller. Returns NULL if the message is larger than a buffer or
+ * every buffer is in use.
+ */
+SharedBuffer_t* SharedBuffer_Alloc(size_t length);
+
+/*
+ * Keeps data received by a callback for another task: if it lies in a buffer
+ * of the pool, as the publishes handed to the deferred dispatch workers, that
+ * buffer gets one more reference. Otherwise, as data still in the network
+ * buffer of the MQTT agent, it is copied into a new one. *ppData is updated to
+ * where the data is kept. Returns NULL if no buffer is available.
+ */
+SharedBuffer_t* SharedBuffer_Hold(const uint8_t** ppData, size_t length);
+
+void SharedBuffer_Retain(SharedBuffer_t* buffer);
+
+/* Drops a reference, NULL is ignored. */
+void SharedBuffer_Release(SharedBuffer_t* buffer);
+
+void SharedBuffer_GetStats(SharedBufferStats_t* pStats);
+
+/* Logs the use of the pool, to size it. */
+void SharedBuffer_LogStats(void);
+
+#endif
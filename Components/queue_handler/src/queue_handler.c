@@ -1,55 +1,350 @@
 #include "queue_handler.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
-QueueHandle_t InitEvent_FreeRTOS(UBaseType_t max_messages, UBaseType_t max_msg_size, uint8_t* ucQueueStorageArea, StaticQueue_t* xStaticQueue, const char* TAG)
+static const char* TAG = "EVENT_BUS";
+
+static EventQueue_t* queues[EVENT_BUS_MAX_QUEUES];
+static uint32_t queueCount = 0;
+static portMUX_TYPE queuesLock = portMUX_INITIALIZER_UNLOCKED;
+
+static size_t prvSlotSize(const EventQueue_t* queue);
+static uint8_t* prvSlot(const EventQueue_t* queue, uint32_t index);
+static uint32_t prvTypeOf(const EventQueue_t* queue, const void* event);
+static EventPolicy_t prvPolicyOf(const EventQueue_t* queue, uint32_t type);
+static EventTypeStats_t* prvTypeStats(EventQueue_t* queue, uint32_t type);
+static const char* prvTypeName(const EventQueue_t* queue, uint32_t type);
+static bool prvCoalesce(EventQueue_t* queue, uint32_t type, const void* event);
+static void prvDropOldest(EventQueue_t* queue);
+static void prvPush(EventQueue_t* queue, uint32_t type, const void* event, int64_t sentUs);
+static void prvRelease(const EventQueue_t* queue, const void* event);
+static bool prvSend(EventQueue_t* queue, const void* event, TickType_t deadline, TickType_t mutexWait, bool fromReceiver);
+
+EventQueue_t* EventBus_InitQueue(EventQueue_t* queue, const EventQueueConfig_t* config, uint8_t* storage)
 {
-    QueueHandle_t xEventQueue;
+    bool added = false;
+
+    assert((config->typeOf != NULL) && (config->typeCount <= EVENT_BUS_MAX_TYPES));
+    assert(config->reserved < config->depth);
 
-    xEventQueue = xQueueCreateStatic(max_messages,
-                                     max_msg_size,
-                                     ucQueueStorageArea,
-                                     xStaticQueue);
+    memset(queue, 0x00, sizeof(EventQueue_t));
+
+    queue->config    = *config;
+    queue->storage   = storage;
+    queue->xMutex    = xSemaphoreCreateMutexStatic(&queue->xMutexBuffer);
+    queue->xSent     = xSemaphoreCreateBinaryStatic(&queue->xSentBuffer);
+    queue->xReceived = xSemaphoreCreateBinaryStatic(&queue->xReceivedBuffer);
+
+    taskENTER_CRITICAL(&queuesLock);
+    if (queueCount < EVENT_BUS_MAX_QUEUES) {
+        queues[queueCount++] = queue;
+        added                = true;
+    }
+    taskEXIT_CRITICAL(&queuesLock);
 
-    if (xEventQueue == NULL) {
-        ESP_LOGE(TAG, "Failed to create Event Queue.");
+    if (!added) {
+        ESP_LOGE(TAG, "No room in the bus for the %s queue", config->name);
         return NULL;
     }
 
-    ESP_LOGI(TAG, "Event Queue created.");
+    ESP_LOGI(TAG, "%s queue of %lu events created", config->name, config->depth);
 
-    return xEventQueue;
+    return queue;
 }
-BaseType_t SendEvent_FreeRTOS(QueueHandle_t xQueue, const void* eventMsg, const char* TAG)
+
+bool EventBus_Send(EventQueue_t* queue, const void* event)
 {
-    BaseType_t retVal = pdFALSE;
+    bool fromReceiver   = (xTaskGetCurrentTaskHandle() == queue->receiver);
+    TickType_t deadline = fromReceiver ? 0 : queue->config.deadline;
 
-    assert(eventMsg != NULL);
-    assert(xQueue != NULL);
+    return prvSend(queue, event, deadline, portMAX_DELAY, fromReceiver);
+}
 
-    retVal = xQueueSendToBack(xQueue, eventMsg, (TickType_t)0);
+bool EventBus_TrySend(EventQueue_t* queue, const void* event)
+{
+    return prvSend(queue, event, 0, 0, xTaskGetCurrentTaskHandle() == queue->receiver);
+}
 
-    if (retVal == pdTRUE) {
-        return retVal;
-    } else {
-        ESP_LOGE(TAG, "Failed to send event to Event Queue: "
-                 "xQueueSendToBack returned error: %d",
-                 retVal);
-        return retVal;
+bool EventBus_Receive(EventQueue_t* queue, void* event, TickType_t xTicksToWait)
+{
+    TimeOut_t timeOut;
+    bool received = false;
+
+    queue->receiver = xTaskGetCurrentTaskHandle();
+    vTaskSetTimeOutState(&timeOut);
+
+    while (true) {
+        xSemaphoreTake(queue->xMutex, portMAX_DELAY);
+
+        if (queue->count > 0U) {
+            uint8_t* slot = prvSlot(queue, queue->head);
+            EventSlot_t header;
+            uint32_t latencyUs;
+            EventTypeStats_t* pTypeStats;
+
+            memcpy(&header, slot, sizeof(EventSlot_t));
+            memcpy(event, &slot[sizeof(EventSlot_t)], queue->config.eventSize);
+
+            queue->head = (queue->head + 1U) % queue->config.depth;
+            queue->count--;
+            queue->stats.received++;
+
+            latencyUs  = (uint32_t)(esp_timer_get_time() - header.sentUs);
+            pTypeStats = prvTypeStats(queue, header.type);
+            pTypeStats->received++;
+            pTypeStats->totalLatencyUs += latencyUs;
+
+            if (latencyUs > pTypeStats->maxLatencyUs) {
+                pTypeStats->maxLatencyUs = latencyUs;
+            }
+            received = true;
+        }
+
+        xSemaphoreGive(queue->xMutex);
+
+        if (received) {
+            xSemaphoreGive(queue->xReceived);
+            return true;
+        }
+
+        if ((xTaskCheckForTimeOut(&timeOut, &xTicksToWait) == pdTRUE) ||
+            (xSemaphoreTake(queue->xSent, xTicksToWait) != pdTRUE)) {
+            /* A bounded wait expiring is expected by the caller. */
+            ESP_LOGD(TAG, "No event received from the %s queue", queue->config.name);
+            return false;
+        }
     }
 }
 
-BaseType_t ReceiveEvent_FreeRTOS(QueueHandle_t xQueue, void* eventMsg, TickType_t xTicksToWait, const char* TAG)
+void EventBus_GetStats(EventQueue_t* queue, EventQueueStats_t* pStats)
+{
+    xSemaphoreTake(queue->xMutex, portMAX_DELAY);
+    *pStats = queue->stats;
+    xSemaphoreGive(queue->xMutex);
+}
+
+bool EventBus_GetTypeStats(EventQueue_t* queue, uint32_t type, EventTypeStats_t* pStats)
 {
-    BaseType_t retVal = pdFALSE;
+    if (type >= queue->config.typeCount) {
+        return false;
+    }
 
-    retVal = xQueueReceive(xQueue, eventMsg, xTicksToWait);
+    xSemaphoreTake(queue->xMutex, portMAX_DELAY);
+    *pStats = *prvTypeStats(queue, type);
+    xSemaphoreGive(queue->xMutex);
+
+    return true;
+}
+
+void EventBus_LogStats(void)
+{
+    for (uint32_t i = 0; i < queueCount; i++) {
+        EventQueue_t* queue = queues[i];
+        EventQueueStats_t stats;
+
+        EventBus_GetStats(queue, &stats);
+
+        ESP_LOGI(TAG, "%s: %lu sent, %lu received, %lu of %lu queued at most, %lu dropped, %lu dropped for newer ones, "
+                      "%lu coalesced, sent in %lu us mean, %lu us max",
+                 queue->config.name,
+                 stats.sent,
+                 stats.received,
+                 stats.highWater,
+                 queue->config.depth,
+                 stats.dropped,
+                 stats.droppedOldest,
+                 stats.coalesced,
+                 (stats.sent > 0U) ? (uint32_t)(stats.totalSendUs / stats.sent) : 0U,
+                 stats.maxSendUs);
+
+        for (uint32_t type = 0; type < queue->config.typeCount; type++) {
+            EventTypeStats_t typeStats;
+
+            EventBus_GetTypeStats(queue, type, &typeStats);
+
+            if ((typeStats.received == 0U) && (typeStats.lost == 0U)) {
+                continue;
+            }
+
+            ESP_LOGI(TAG, "%s %s: %lu received in %lu us mean, %lu us max, %lu lost",
+                     queue->config.name,
+                     prvTypeName(queue, type),
+                     typeStats.received,
+                     (typeStats.received > 0U) ? (uint32_t)(typeStats.totalLatencyUs / typeStats.received) : 0U,
+                     typeStats.maxLatencyUs,
+                     typeStats.lost);
+        }
+    }
+}
+
+static size_t prvSlotSize(const EventQueue_t* queue)
+{
+    return sizeof(EventSlot_t) + queue->config.eventSize;
+}
+
+static uint8_t* prvSlot(const EventQueue_t* queue, uint32_t index)
+{
+    return &queue->storage[index * prvSlotSize(queue)];
+}
+
+static uint32_t prvTypeOf(const EventQueue_t* queue, const void* event)
+{
+    return queue->config.typeOf(event);
+}
+
+static EventPolicy_t prvPolicyOf(const EventQueue_t* queue, uint32_t type)
+{
+    if ((queue->config.policies == NULL) || (type >= queue->config.typeCount)) {
+        return EventPolicyBlock;
+    }
+
+    return queue->config.policies[type];
+}
 
-    if (retVal == pdTRUE) {
-        return retVal;
+static EventTypeStats_t* prvTypeStats(EventQueue_t* queue, uint32_t type)
+{
+    return &queue->typeStats[(type < EVENT_BUS_MAX_TYPES) ? type : (EVENT_BUS_MAX_TYPES - 1U)];
+}
+
+static const char* prvTypeName(const EventQueue_t* queue, uint32_t type)
+{
+    if ((queue->config.typeNames == NULL) || (type >= queue->config.typeCount)) {
+        return "unknown";
+    }
+
+    return queue->config.typeNames[type];
+}
+
+/*
+ * Replaces the queued event of the same type by the new one, which keeps its
+ * place and send time. Called with the mutex taken.
+ */
+static bool prvCoalesce(EventQueue_t* queue, uint32_t type, const void* event)
+{
+    for (uint32_t i = 0; i < queue->count; i++) {
+        uint8_t* slot = prvSlot(queue, (queue->head + i) % queue->config.depth);
+        EventSlot_t header;
+
+        memcpy(&header, slot, sizeof(EventSlot_t));
+
+        if (header.type == type) {
+            prvRelease(queue, &slot[sizeof(EventSlot_t)]);
+            memcpy(&slot[sizeof(EventSlot_t)], event, queue->config.eventSize);
+            queue->stats.coalesced++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Called with the mutex taken. */
+static void prvDropOldest(EventQueue_t* queue)
+{
+    uint8_t* slot = prvSlot(queue, queue->head);
+    EventSlot_t header;
+
+    memcpy(&header, slot, sizeof(EventSlot_t));
+
+    ESP_LOGW(TAG, "%s queue full, oldest %s event dropped", queue->config.name, prvTypeName(queue, header.type));
+    prvRelease(queue, &slot[sizeof(EventSlot_t)]);
+
+    queue->head = (queue->head + 1U) % queue->config.depth;
+    queue->count--;
+    queue->stats.droppedOldest++;
+    prvTypeStats(queue, header.type)->lost++;
+}
+
+/* Called with the mutex taken and room in the queue. */
+static void prvPush(EventQueue_t* queue, uint32_t type, const void* event, int64_t sentUs)
+{
+    uint8_t* slot      = prvSlot(queue, (queue->head + queue->count) % queue->config.depth);
+    EventSlot_t header = {.type = type, .sentUs = sentUs};
+
+    memcpy(slot, &header, sizeof(EventSlot_t));
+    memcpy(&slot[sizeof(EventSlot_t)], event, queue->config.eventSize);
+
+    if (++queue->count > queue->stats.highWater) {
+        queue->stats.highWater = queue->count;
+    }
+}
+
+static void prvRelease(const EventQueue_t* queue, const void* event)
+{
+    if (queue->config.release != NULL) {
+        queue->config.release(event);
+    }
+}
+
+/*
+ * Queues an event, waiting up to deadline for room and up to mutexWait for
+ * the queue itself. Only the receiver can fill the reserved slots.
+ */
+static bool prvSend(EventQueue_t* queue, const void* event, TickType_t deadline, TickType_t mutexWait, bool fromReceiver)
+{
+    uint32_t capacity    = fromReceiver ? queue->config.depth : (queue->config.depth - queue->config.reserved);
+    uint32_t type        = prvTypeOf(queue, event);
+    EventPolicy_t policy = prvPolicyOf(queue, type);
+    int64_t sentUs       = esp_timer_get_time();
+    TimeOut_t timeOut;
+    bool queued = false;
+    uint32_t elapsedUs;
+
+    assert(event != NULL);
+    assert(queue != NULL);
+
+    vTaskSetTimeOutState(&timeOut);
+
+    if (xSemaphoreTake(queue->xMutex, mutexWait) != pdTRUE) {
+        ESP_LOGW(TAG, "%s queue busy, %s event not sent", queue->config.name, prvTypeName(queue, type));
+        prvRelease(queue, event);
+        return false;
+    }
+
+    queue->stats.sent++;
+
+    if ((policy == EventPolicyCoalesce) && prvCoalesce(queue, type, event)) {
+        queued = true;
+    } else if ((policy == EventPolicyDropOldest) && (queue->count >= capacity)) {
+        prvDropOldest(queue);
+    }
+
+    /* Waits for the receiver to make room, with the mutex released. */
+    while (!queued && (queue->count >= capacity)) {
+        xSemaphoreGive(queue->xMutex);
+
+        if ((xTaskCheckForTimeOut(&timeOut, &deadline) == pdTRUE) ||
+            (xSemaphoreTake(queue->xReceived, deadline) != pdTRUE)) {
+            xSemaphoreTake(queue->xMutex, portMAX_DELAY);
+            break;
+        }
+
+        xSemaphoreTake(queue->xMutex, portMAX_DELAY);
+    }
+
+    if (!queued && (queue->count < capacity)) {
+        prvPush(queue, type, event, sentUs);
+        queued = true;
+    } else if (!queued) {
+        queue->stats.dropped++;
+        prvTypeStats(queue, type)->lost++;
+    }
+
+    elapsedUs = (uint32_t)(esp_timer_get_time() - sentUs);
+    queue->stats.totalSendUs += elapsedUs;
+
+    if (elapsedUs > queue->stats.maxSendUs) {
+        queue->stats.maxSendUs = elapsedUs;
+    }
+
+    xSemaphoreGive(queue->xMutex);
+
+    if (queued) {
+        xSemaphoreGive(queue->xSent);
     } else {
-        ESP_LOGE(TAG, "Failed to receive event or timeout from Event Queue: "
-                 "xQueueReceive returned error: %d",
-                 retVal);
-        return retVal;
+        ESP_LOGE(TAG, "%s queue full, %s event dropped", queue->config.name, prvTypeName(queue, type));
+        prvRelease(queue, event);
     }
-}
\ No newline at end of file
+
+    return queued;
+}
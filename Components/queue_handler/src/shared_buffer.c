@@ -0,0 +1,191 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "shared_buffer.h"
+
+static const char* TAG = "SHARED_BUFFER";
+
+static StaticSemaphore_t xMutexBuffer;
+static SemaphoreHandle_t xMutex = NULL;
+
+static SharedBuffer_t buffers[SHARED_BUFFER_COUNT];
+static uint32_t bufferCount = 0; /* Allocated at init */
+
+static SharedBufferStats_t stats = {0};
+static bool exhaustionLogged     = false;
+
+static SharedBuffer_t* prvTakeFreeBuffer(size_t length);
+static SharedBuffer_t* prvFindBuffer(const uint8_t* pData, size_t length);
+
+void SharedBuffer_Init(void)
+{
+    if (xMutex != NULL) {
+        return;
+    }
+
+    xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+
+    for (bufferCount = 0; bufferCount < SHARED_BUFFER_COUNT; bufferCount++) {
+        buffers[bufferCount].data = (uint8_t*)malloc(SHARED_BUFFER_SIZE);
+
+        if (buffers[bufferCount].data == NULL) {
+            break;
+        }
+    }
+
+    if (bufferCount < SHARED_BUFFER_COUNT) {
+        ESP_LOGE(TAG, "Only %lu of %u buffers could be allocated", bufferCount, SHARED_BUFFER_COUNT);
+    } else {
+        ESP_LOGI(TAG, "%u buffers of %u bytes", SHARED_BUFFER_COUNT, SHARED_BUFFER_SIZE);
+    }
+}
+
+SharedBuffer_t* SharedBuffer_Alloc(size_t length)
+{
+    SharedBuffer_t* buffer;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    buffer = prvTakeFreeBuffer(length);
+    xSemaphoreGive(xMutex);
+
+    return buffer;
+}
+
+SharedBuffer_t* SharedBuffer_Hold(const uint8_t** ppData, size_t length)
+{
+    SharedBuffer_t* buffer;
+    bool copy = false;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    buffer = prvFindBuffer(*ppData, length);
+
+    if (buffer != NULL) {
+        buffer->references++;
+        stats.held++;
+    } else {
+        buffer = prvTakeFreeBuffer(length);
+        copy   = (buffer != NULL);
+
+        if (copy) {
+            stats.copied++;
+        }
+    }
+
+    xSemaphoreGive(xMutex);
+
+    /* A new buffer is only referenced by the caller, it is filled out of the lock. */
+    if (copy) {
+        memcpy(buffer->data, *ppData, length);
+        buffer->length = length;
+        *ppData        = buffer->data;
+    }
+
+    return buffer;
+}
+
+void SharedBuffer_Retain(SharedBuffer_t* buffer)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    buffer->references++;
+    xSemaphoreGive(xMutex);
+}
+
+void SharedBuffer_Release(SharedBuffer_t* buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    assert(buffer->references > 0U);
+
+    if (--buffer->references == 0U) {
+        buffer->length = 0;
+        stats.inUse--;
+        exhaustionLogged = false;
+    }
+
+    xSemaphoreGive(xMutex);
+}
+
+void SharedBuffer_GetStats(SharedBufferStats_t* pStats)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    *pStats = stats;
+    xSemaphoreGive(xMutex);
+}
+
+void SharedBuffer_LogStats(void)
+{
+    SharedBufferStats_t current;
+
+    SharedBuffer_GetStats(&current);
+
+    ESP_LOGI(TAG, "%lu messages, %lu of %lu buffers in use, %lu at most, %lu failed with the pool exhausted, %lu too large, "
+                  "%lu kept without copy, %lu copied",
+             current.allocations,
+             current.inUse,
+             bufferCount,
+             current.highWater,
+             current.exhausted,
+             current.tooLarge,
+             current.held,
+             current.copied);
+}
+
+/* Called with the mutex taken. */
+static SharedBuffer_t* prvTakeFreeBuffer(size_t length)
+{
+    if (length > SHARED_BUFFER_SIZE) {
+        stats.tooLarge++;
+        ESP_LOGD(TAG, "A message of %u bytes does not fit in a buffer", length);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < bufferCount; i++) {
+        if (buffers[i].references == 0U) {
+            buffers[i].references = 1U;
+            buffers[i].length     = length;
+
+            stats.allocations++;
+
+            if (++stats.inUse > stats.highWater) {
+                stats.highWater = stats.inUse;
+            }
+            return &buffers[i];
+        }
+    }
+
+    stats.exhausted++;
+
+    /* Once until a buffer is released, the failures of a burst are counted. */
+    if (!exhaustionLogged) {
+        ESP_LOGW(TAG, "Every buffer is in use");
+        exhaustionLogged = true;
+    }
+
+    return NULL;
+}
+
+/* Called with the mutex taken. */
+static SharedBuffer_t* prvFindBuffer(const uint8_t* pData, size_t length)
+{
+    for (uint32_t i = 0; i < bufferCount; i++) {
+        if ((buffers[i].references > 0U) &&
+            (pData >= buffers[i].data) &&
+            ((pData + length) <= (buffers[i].data + SHARED_BUFFER_SIZE))) {
+            return &buffers[i];
+        }
+    }
+
+    return NULL;
+}
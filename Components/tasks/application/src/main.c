@@ -8,8 +8,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_camera.h"
+#include "esp_timer.h"
 #include "camera_pin.h"
 
+#include "mqtt_async_publish.h"
+#include "mqtt_bandwidth.h"
 #include "mqtt_common.h"
 
 int framesize;
@@ -41,6 +44,9 @@ int framesize;
 
 #define DELAY 300000
 
+/* Frame size of the pictures taken while an OTA download shares the connection. */
+#define DOWNSCALED_FRAMESIZE FRAMESIZE_QVGA
+
 camera_config_t camera_config = {
     .pin_pwdn = CAM_PIN_PWDN,
     .pin_reset = CAM_PIN_RESET,
@@ -72,12 +78,22 @@ camera_config_t camera_config = {
 
 static const char* TAG = "APP";
 
+/* An upload in flight, freed once the agent has sent it. */
+typedef struct PictureUpload {
+    char* buffer;
+    size_t length;
+    int64_t startUs;
+    uint32_t waitedMs;
+} PictureUpload_t;
+
 /* Only Debug to detect stack size */
 #if defined(CONFIG_ENABLE_STACK_WATERMARK)
     static UBaseType_t uxHighWaterMark;
 #endif
 
 static esp_err_t prInitCamera(int framesize);
+static void prSetUploadFrameSize(void);
+static void prUploadCompleteCallback(const PublishCompletion_t* pCompletion);
 static void prSendPictureToAWS(const char* pictureEncoded, size_t pictureEncodedLength);
 static esp_err_t camera_capture();
 
@@ -124,6 +140,8 @@ static esp_err_t camera_capture()
     size_t destLength = 0;
     size_t outlen;
 
+    prSetUploadFrameSize();
+
     for (int i = 0; i < 1; i++) {
         camera_fb_t* fb = esp_camera_fb_get();
         ESP_LOGI(TAG, "fb->len=%d", fb->len);
@@ -176,12 +194,71 @@ static void prSendPictureToAWS(const char* pictureEncoded, size_t pictureEncoded
              "}",
              pictureEncoded);
 
-    PublishToTopic(IMAGES_UPLOAD_TOPIC,
-                   IMAGES_UPLOAD_TOPIC_LENGTH,
-                   buffer,
-                   strlen(buffer),
-                   MQTTQoS0,
-                   TAG);
+    PictureUpload_t* upload = (PictureUpload_t*) malloc(sizeof(PictureUpload_t));
+
+    if (upload == NULL) {
+        ESP_LOGE(TAG, "Failed malloc");
+        free(buffer);
+        return;
+    }
+    upload->buffer = buffer;
+    upload->length = strlen(buffer);
+
+    /* Waits for the share of the connection uploads have, smaller while an OTA download runs. */
+    upload->startUs = esp_timer_get_time();
+    upload->waitedMs = BandwidthGovernor_Acquire(BandwidthClassUpload, upload->length);
+
+    /* The next picture is taken while this one is sent, the buffer is freed once it is. */
+    PublishCompletionTarget_t target = {.callback = prUploadCompleteCallback, .pContext = upload};
+
+    if (PublishToTopicAsync(IMAGES_UPLOAD_TOPIC,
+                            IMAGES_UPLOAD_TOPIC_LENGTH,
+                            buffer,
+                            upload->length,
+                            MQTTQoS0,
+                            &target,
+                            TAG) == PUBLISH_HANDLE_INVALID) {
+        PublishCompletion_t completion = {.pContext = upload};
+
+        completion.status = PublishToTopic(IMAGES_UPLOAD_TOPIC,
+                                           IMAGES_UPLOAD_TOPIC_LENGTH,
+                                           buffer,
+                                           upload->length,
+                                           MQTTQoS0,
+                                           TAG);
+        prUploadCompleteCallback(&completion);
+    }
+}
+
+/* Logs the latency of an upload and frees it, in the MQTT agent task for asynchronous ones. */
+static void prUploadCompleteCallback(const PublishCompletion_t* pCompletion)
+{
+    PictureUpload_t* upload = (PictureUpload_t*) pCompletion->pContext;
+
+    ESP_LOGI(TAG, "Upload of %d bytes %s in %lu ms, %lu ms waiting for bandwidth%s",
+             upload->length,
+             (pCompletion->status == MQTTSuccess) ? "sent" : "failed",
+             (uint32_t)((esp_timer_get_time() - upload->startUs) / 1000),
+             upload->waitedMs,
+             BandwidthGovernor_IsOtaActive() ? " during an OTA download" : "");
+
+    free(upload->buffer);
+    free(upload);
+}
+
+/* Takes smaller pictures while the bandwidth governor asks to downscale uploads. */
+static void prSetUploadFrameSize(void)
+{
+    static int currentFramesize = -1;
+    int wanted = BandwidthGovernor_ShouldDownscale() ? DOWNSCALED_FRAMESIZE : framesize;
+    sensor_t* sensor = esp_camera_sensor_get();
 
-    free(buffer);
+    if ((wanted == currentFramesize) || (sensor == NULL)) {
+        return;
+    }
+
+    if (sensor->set_framesize(sensor, (framesize_t)wanted) == 0) {
+        ESP_LOGI(TAG, "Frame size set to %d", wanted);
+        currentFramesize = wanted;
+    }
 }
\ No newline at end of file
@@ -5,7 +5,6 @@
 #include "mqtt_common.h"
 
 #define RENEW_JOB_DOC_SIZE  512U
-#define CERTIFICATE_LENGTH  1500
 #define OLD_REVOKE_MSG_SIZE 256
 #define TOPIC_FILTER_LENGTH 100
 
@@ -65,15 +64,16 @@ typedef enum {
     CertRenewEventMax
 } CertRenewEvent_t;
 
+/* A response of AWS IoT, such as the signed certificate, kept in the buffer it was received in. */
 typedef struct CertRenewDataEvent {
-    uint8_t data[CERTIFICATE_LENGTH]; /* Buffer to store the certificate */
+    const uint8_t* data;
     size_t dataLength;
-    bool bufferUsed;
+    SharedBuffer_t* buffer; /* Released once the event is handled */
 } CertRenewDataEvent_t;
 
 typedef struct CertRenewEventMsg {
-    CertRenewDataEvent_t* dataEvent;
-    JobEventData_t* jobEvent;
+    CertRenewDataEvent_t dataEvent;
+    JobEventData_t jobEvent;
     CertRenewEvent_t eventId;
 } CertRenewEventMsg_t;
 
@@ -12,42 +12,30 @@
 #include "gen_csr.h"
 #include "key_value_store.h"
 #include "mqtt_agent.h"
+#include "mqtt_async_publish.h"
 #include "mqtt_common.h"
+#include "mqtt_topic_registry.h"
 #include "queue_handler.h"
 
 #define MAX_COMMAND_SEND_BLOCK_TIME_MS 2000
-#define MAX_NUM_OF_DATA_BUFFERS        1U
-
-/* csr topics*/
-#define CREATE_CERTIFICATE_FROM_CSR_TOPIC "things/%s/certificate/create-from-csr/json"
-#define CREATE_CSR_ACCEPTED_TOPIC         "things/%s/certificate/create-from-csr/json/accepted"
-#define CREATE_CSR_REJECTED_TOPIC         "things/%s/certificate/create-from-csr/json/rejected"
-
-/* Certificate revoke topics*/
-#define CERT_REVOKE_TOPIC          "things/%s/certificate/revoke/json"
-#define CERT_REVOKE_ACCEPTED_TOPIC "things/%s/certificate/revoke/json/accepted"
-#define CERT_REVOKE_REJECTED_TOPIC "things/%s/certificate/revoke/json/rejected"
 
 #define SUCCESS_RENEWAL_STATUS_DETAILS "{\"Code\": \"200\", \"Message\": \"Successful certificate renewal\"}"
 #define FAILED_RENEWAL_STATUS_DETAILS  "{\"Code\": \"400\", \"Error\": \"Failed to renewal certificate\"}"
 #define FAILED_REVOKE_STATUS_DETAILS   "{\"Code\": \"400\", \"Error\": \"Failed to revoke certificate\"}"
 
 #define NUMBER_OF_SUBSCRIPTIONS 2
-#define MAX_MESSAGES            5
+#define MAX_MESSAGES            7
+#define RESERVED_MESSAGES       2
 #define MAX_MSG_SIZE            sizeof(CertRenewEventMsg_t)
 
 #define CERT_RENEWAL_OP "CertRotation"
 #define CERT_CLIENT     "client"
 
-/* Data buffers for Cert Renewal events */
-static CertRenewDataEvent_t dataBuffers[MAX_NUM_OF_DATA_BUFFERS] = {0};
-QueueHandle_t xCertRenewEventQueue;
-
-/* Array containing pointer to the Renewal event structures used to send events to the renew task. */
-static CertRenewEventMsg_t xqueueData[MAX_MESSAGES * MAX_MSG_SIZE];
+EventQueue_t* xCertRenewEventQueue;
+static EventQueue_t certRenewEventQueue;
 
-/* The variable used to hold the queue's data structure. */
-static StaticQueue_t xStaticQueue;
+/* Storage of the renewal event queue, the events are copied into it. */
+static uint8_t xqueueData[EVENT_BUS_STORAGE_SIZE(MAX_MESSAGES, MAX_MSG_SIZE)];
 
 static char jobId[JOB_ID_LENGTH] = {0};
 Operation_t operation            = {0};
@@ -55,9 +43,9 @@ char* certificateId              = NULL;
 
 /*
  * Topic Filters
- * Buffer used for subscription topics related to Cert Renew api responses
+ * Interned subscription topics related to Cert Renew api responses
  */
-static char* topic_filters[2] = {NULL, NULL};
+static TopicId_t topic_filters[2] = {TopicIdUnknown, TopicIdUnknown};
 
 const char* pRenewAgentState[CertRenewStateMax] = {
     "Init",
@@ -96,19 +84,24 @@ static const char* TAG = "CERT_RENEWAL_AGENT";
 extern AWSConnectSettings_t AWSConnectSettings;
 
 static void prvProcessingEvent();
+static void prvHandleEvent(const CertRenewEventMsg_t* recvEvent);
+static bool prvHoldResponse(const MQTTPublishInfo_t* pxPublishInfo, CertRenewDataEvent_t* dataEvent);
 static void prvCreateFromCSRIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo);
 static void prvCertRevokeIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo);
 static void prvMQTTTerminateCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo);
 static void prvJobDocumentParser(char* message, size_t messageLength, Operation_t* jobFields);
 static void prvSubscribeRevokeTopics();
+static void prvSubscribeTopics(TopicId_t acceptedTopic, TopicId_t rejectedTopic, void* callback);
 static void prvRevokeCertificate();
 static void prvStoreNewCredentials();
 static void prvSubscribeCreateFromCSRTopics();
 static void prvCreateCertificateFromCSR();
 static void prvUnSubscribeTopics();
-static JSONStatus_t prvReceivedCertificateParser(CertRenewDataEvent_t* certData);
+static void prvFreeRequestCallback(const PublishCompletion_t* pCompletion);
+static JSONStatus_t prvReceivedCertificateParser(const CertRenewDataEvent_t* certData);
 static void prvPrintErrorMessage(const char* message, const size_t messageLength);
-static bool isAcceptedTopic(char* receivedTopic);
+static uint32_t prvEventType(const void* event);
+static void prvReleaseEvent(const void* event);
 
 void renewAgentTask(void* parameters)
 {
@@ -116,11 +109,24 @@ void renewAgentTask(void* parameters)
     uxHighWaterMark = uxTaskGetStackHighWaterMark(NULL);
 #endif
     CertRenewEventMsg_t nextEvent = {0};
-    xCertRenewEventQueue          = InitEvent_FreeRTOS(MAX_MESSAGES, MAX_MSG_SIZE, (uint8_t*)xqueueData, &xStaticQueue, TAG);
+
+    /* Every event waits for room, none can be lost by the state machine. Its own transitions have reserved room. */
+    EventQueueConfig_t queueConfig = {
+        .name      = "CertRenew",
+        .eventSize = MAX_MSG_SIZE,
+        .depth     = MAX_MESSAGES,
+        .reserved  = RESERVED_MESSAGES,
+        .typeCount = CertRenewEventMax,
+        .typeOf    = prvEventType,
+        .typeNames = pRenewAgentEvent,
+        .release   = prvReleaseEvent,
+        .deadline  = pdMS_TO_TICKS(EVENT_BUS_SEND_DEADLINE_MS),
+    };
+    xCertRenewEventQueue = EventBus_InitQueue(&certRenewEventQueue, &queueConfig, xqueueData);
 
     nextEvent.eventId = CertRenewEventReady;
 
-    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+    EventBus_Send(xCertRenewEventQueue, &nextEvent);
 
     while (true) {
         prvProcessingEvent();
@@ -135,25 +141,37 @@ void renewAgentTask(void* parameters)
 */
 static void prvProcessingEvent()
 {
-    const char* statusDetails;
     CertRenewEventMsg_t recvEvent = {0};
+
+    if (!EventBus_Receive(xCertRenewEventQueue, &recvEvent, portMAX_DELAY)) {
+        return;
+    }
+    ESP_LOGI(TAG, "Current State: %s | Received Event: %s", pRenewAgentState[currentState], pRenewAgentEvent[recvEvent.eventId]);
+
+    prvHandleEvent(&recvEvent);
+
+    /* The event owned the references to the data it was received with. */
+    SharedBuffer_Release(recvEvent.jobEvent.buffer);
+    SharedBuffer_Release(recvEvent.dataEvent.buffer);
+}
+
+static void prvHandleEvent(const CertRenewEventMsg_t* recvEvent)
+{
+    const char* statusDetails;
     CertRenewEventMsg_t nextEvent = {0};
 
     Operation_t jobFields = {0};
 
-    ReceiveEvent_FreeRTOS(xCertRenewEventQueue, (void*)&recvEvent, portMAX_DELAY, TAG);
-    ESP_LOGI(TAG, "Current State: %s | Received Event: %s", pRenewAgentState[currentState], pRenewAgentEvent[recvEvent.eventId]);
-
-    switch (recvEvent.eventId) {
+    switch (recvEvent->eventId) {
         case CertRenewEventReady:
             currentState = CertRenewStateReady;
             break;
         case CertRenewEventReceivedJobDocument:
             currentState = CertRenewStateProcessingJob;
-            strncpy(jobId, recvEvent.jobEvent->jobId, JOB_ID_LENGTH);
+            strncpy(jobId, recvEvent->jobEvent.jobId, JOB_ID_LENGTH);
             ESP_LOGI(TAG, "Job Id %s", jobId);
-            ESP_LOGI(TAG, "Job document %s", recvEvent.jobEvent->jobData);
-            prvJobDocumentParser((char*)recvEvent.jobEvent->jobData, recvEvent.jobEvent->jobDataLength, &jobFields);
+            ESP_LOGI(TAG, "Job document %.*s", recvEvent->jobEvent.jobDataLength, recvEvent->jobEvent.jobData);
+            prvJobDocumentParser((char*)recvEvent->jobEvent.jobData, recvEvent->jobEvent.jobDataLength, &jobFields);
 
             assert(jobFields.operation != NULL);
             assert(jobFields.certName != NULL);
@@ -165,7 +183,7 @@ static void prvProcessingEvent()
                     SendUpdateForJob(InProgress, NULL);
 
                     nextEvent.eventId = CertRenewEventClientCertificateRenewal;
-                    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+                    EventBus_Send(xCertRenewEventQueue, &nextEvent);
                 } else {
                     SendUpdateForJob(Rejected, NULL);
                     ESP_LOGE(TAG, "Error: not certName found");
@@ -187,7 +205,7 @@ static void prvProcessingEvent()
             currentState = CertRenewStateRenewingClientCert;
 
             nextEvent.eventId = CertRenewEventWaitSignedCertificate;
-            SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+            EventBus_Send(xCertRenewEventQueue, &nextEvent);
 
             break;
 
@@ -198,7 +216,7 @@ static void prvProcessingEvent()
 
         case CertRenewEventRejectedCertificateSigningRequest:
             ESP_LOGE(TAG, "Certificate Signing request invalid");
-            prvPrintErrorMessage((char*)recvEvent.dataEvent->data, recvEvent.dataEvent->dataLength);
+            prvPrintErrorMessage((char*)recvEvent->dataEvent.data, recvEvent->dataEvent.dataLength);
 
             statusDetails = strndup(FAILED_RENEWAL_STATUS_DETAILS, strlen(FAILED_RENEWAL_STATUS_DETAILS));
 
@@ -216,7 +234,7 @@ static void prvProcessingEvent()
 
             currentState = CertRenewStateProcessingSignedCertificate;
 
-            if (prvReceivedCertificateParser(recvEvent.dataEvent) == JSONSuccess) {
+            if (prvReceivedCertificateParser(&recvEvent->dataEvent) == JSONSuccess) {
                 TerminateMQTTAgent(&prvMQTTTerminateCompleteCallback, TAG);
             } else {
                 statusDetails = strndup(FAILED_RENEWAL_STATUS_DETAILS, strlen(FAILED_RENEWAL_STATUS_DETAILS));
@@ -230,7 +248,7 @@ static void prvProcessingEvent()
 
                 free(certificateId);
                 nextEvent.eventId = CertRenewStateReady;
-                SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+                EventBus_Send(xCertRenewEventQueue, &nextEvent);
             }
             break;
         case CertRenewEventRejectedSignedCertificate:
@@ -246,7 +264,7 @@ static void prvProcessingEvent()
 
             nextEvent.eventId = CertRenewStateReady;
             ESP_LOGI(TAG, "Failed to renewal certificate");
-            SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+            EventBus_Send(xCertRenewEventQueue, &nextEvent);
             break;
         case CertRenewEventRevokeOldCertificate:
             prvUnSubscribeTopics();
@@ -279,12 +297,12 @@ static void prvProcessingEvent()
             free((void*)statusDetails);
 
             nextEvent.eventId = CertRenewEventReady;
-            SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+            EventBus_Send(xCertRenewEventQueue, &nextEvent);
             break;
         case CertRenewEventRejectedOldCertificateRevoke:
             prvUnSubscribeTopics();
             free(certificateId);
-            prvPrintErrorMessage((char*)recvEvent.dataEvent->data, recvEvent.dataEvent->dataLength);
+            prvPrintErrorMessage((char*)recvEvent->dataEvent.data, recvEvent->dataEvent.dataLength);
 
             statusDetails = strndup(FAILED_REVOKE_STATUS_DETAILS, strlen(FAILED_REVOKE_STATUS_DETAILS));
 
@@ -297,7 +315,7 @@ static void prvProcessingEvent()
             free((void*)statusDetails);
 
             nextEvent.eventId = CertRenewEventReady;
-            SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+            EventBus_Send(xCertRenewEventQueue, &nextEvent);
             break;
 
         default:
@@ -318,32 +336,29 @@ static void prvStoreNewCredentials()
  *   - things/<ThingName>/certificates/create-from-csr/json/rejected
 */
 static void prvSubscribeCreateFromCSRTopics()
+{
+    prvSubscribeTopics(TopicIdCreateFromCsrAccepted, TopicIdCreateFromCsrRejected, &prvCreateFromCSRIncomingPublishCallback);
+}
+
+/* Subscribes to the interned accepted and rejected topics of an API, which are unsubscribed by prvUnSubscribeTopics(). */
+static void prvSubscribeTopics(TopicId_t acceptedTopic, TopicId_t rejectedTopic, void* callback)
 {
     MQTTAgentSubscribeArgs_t xSubscribeArgs                       = {0};
     MQTTSubscribeInfo_t subscriptionList[NUMBER_OF_SUBSCRIPTIONS] = {0};
 
-    topic_filters[0] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-    topic_filters[1] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-
-    if (topic_filters[0] == NULL && topic_filters[1] == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for CreateFromCSR subscription topics");
-        assert(topic_filters[0] != NULL);
-        assert(topic_filters[1] != NULL);
-    }
-
-    snprintf(topic_filters[0], TOPIC_FILTER_LENGTH, CREATE_CSR_ACCEPTED_TOPIC, GetThingName());
-    snprintf(topic_filters[1], TOPIC_FILTER_LENGTH, CREATE_CSR_REJECTED_TOPIC, GetThingName());
+    topic_filters[0] = acceptedTopic;
+    topic_filters[1] = rejectedTopic;
 
     for (int i = 0; i < NUMBER_OF_SUBSCRIPTIONS; i++) {
-        ESP_LOGI(TAG, "Topic: %s", topic_filters[i]);
+        ESP_LOGI(TAG, "Topic: %s", TopicRegistry_Get(topic_filters[i]));
         subscriptionList[i].qos               = MQTTQoS0;
-        subscriptionList[i].pTopicFilter      = topic_filters[i];
-        subscriptionList[i].topicFilterLength = strlen(topic_filters[i]);
+        subscriptionList[i].pTopicFilter      = TopicRegistry_Get(topic_filters[i]);
+        subscriptionList[i].topicFilterLength = TopicRegistry_Length(topic_filters[i]);
     }
     xSubscribeArgs.numSubscriptions = NUMBER_OF_SUBSCRIPTIONS;
     xSubscribeArgs.pSubscribeInfo   = subscriptionList;
 
-    assert(SubscribeToTopic(&xSubscribeArgs, &prvCreateFromCSRIncomingPublishCallback, TAG) == MQTTSuccess);
+    assert(SubscribeToTopic(&xSubscribeArgs, callback, TAG) == MQTTSuccess);
 }
 
 static void prvUnSubscribeTopics()
@@ -354,17 +369,15 @@ static void prvUnSubscribeTopics()
     ESP_LOGI(TAG, "unsubscribing to the topics");
 
     for (int i = 0; i < NUMBER_OF_SUBSCRIPTIONS; i++) {
-        ESP_LOGI(TAG, "Topic: %s", topic_filters[i]);
+        ESP_LOGI(TAG, "Topic: %s", TopicRegistry_Get(topic_filters[i]));
         unSubscribeList[i].qos               = MQTTQoS0;
-        unSubscribeList[i].pTopicFilter      = topic_filters[i];
-        unSubscribeList[i].topicFilterLength = strlen(topic_filters[i]);
+        unSubscribeList[i].pTopicFilter      = TopicRegistry_Get(topic_filters[i]);
+        unSubscribeList[i].topicFilterLength = TopicRegistry_Length(topic_filters[i]);
     }
     xUnSubscribeArgs.numSubscriptions = NUMBER_OF_SUBSCRIPTIONS;
     xUnSubscribeArgs.pSubscribeInfo   = unSubscribeList;
 
     UnSubscribeToTopic(&xUnSubscribeArgs, TAG);
-    free(topic_filters[0]);
-    free(topic_filters[1]);
 }
 
 /*
@@ -374,7 +387,8 @@ static void prvUnSubscribeTopics()
 */
 static void prvCreateCertificateFromCSR()
 {
-    char topic_filter[TOPIC_FILTER_LENGTH] = {0};
+    const char* topic_filter = TopicRegistry_Get(TopicIdCreateFromCsr);
+    uint16_t topicLength     = TopicRegistry_Length(TopicIdCreateFromCsr);
 
     char* req_msg = (char*)calloc(CSR_BUFFER_SIZE, sizeof(char));
     assert(req_msg != NULL);
@@ -403,21 +417,28 @@ static void prvCreateCertificateFromCSR()
              CERTIFICATE_SIGNING_REQUEST_BODY,
              escaped_csr);
 
-    snprintf(topic_filter,
-             sizeof(topic_filter),
-             CREATE_CERTIFICATE_FROM_CSR_TOPIC,
-             GetThingName());
-
-    PublishToTopic(topic_filter,
-                   strlen(topic_filter),
-                   req_msg,
-                   strlen(req_msg),
-                   MQTTQoS0,
-                   TAG);
+    /* The request is freed once sent, the CSR buffers are released meanwhile. */
+    PublishCompletionTarget_t target = {.callback = prvFreeRequestCallback, .pContext = req_msg};
+
+    if (PublishToTopicAsync(topic_filter, topicLength, req_msg, strlen(req_msg), MQTTQoS0, &target, TAG) ==
+        PUBLISH_HANDLE_INVALID) {
+        PublishToTopic(topic_filter,
+                       topicLength,
+                       req_msg,
+                       strlen(req_msg),
+                       MQTTQoS0,
+                       TAG);
+        free(req_msg);
+    }
 
     free(csr_pem);
     free(escaped_csr);
-    free(req_msg);
+}
+
+/* Releases the buffer of an asynchronous publish, in the MQTT agent task. */
+static void prvFreeRequestCallback(const PublishCompletion_t* pCompletion)
+{
+    free(pCompletion->pContext);
 }
 
 /*
@@ -429,31 +450,7 @@ static void prvCreateCertificateFromCSR()
 */
 static void prvSubscribeRevokeTopics()
 {
-    MQTTAgentSubscribeArgs_t xSubscribeArgs                       = {0};
-    MQTTSubscribeInfo_t subscriptionList[NUMBER_OF_SUBSCRIPTIONS] = {0};
-
-    topic_filters[0] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-    topic_filters[1] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-
-    if (topic_filters[0] == NULL && topic_filters[1] == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for revoke subscription topics");
-        assert(topic_filters[0] != NULL);
-        assert(topic_filters[1] != NULL);
-    }
-
-    snprintf(topic_filters[0], TOPIC_FILTER_LENGTH, CERT_REVOKE_ACCEPTED_TOPIC, GetThingName());
-    snprintf(topic_filters[1], TOPIC_FILTER_LENGTH, CERT_REVOKE_REJECTED_TOPIC, GetThingName());
-
-    for (int i = 0; i < NUMBER_OF_SUBSCRIPTIONS; i++) {
-        ESP_LOGI(TAG, "Topic: %s", topic_filters[i]);
-        subscriptionList[i].qos               = MQTTQoS0;
-        subscriptionList[i].pTopicFilter      = topic_filters[i];
-        subscriptionList[i].topicFilterLength = strlen(topic_filters[i]);
-    }
-    xSubscribeArgs.numSubscriptions = NUMBER_OF_SUBSCRIPTIONS;
-    xSubscribeArgs.pSubscribeInfo   = subscriptionList;
-
-    assert(SubscribeToTopic(&xSubscribeArgs, &prvCertRevokeIncomingPublishCallback, TAG) == MQTTSuccess);
+    prvSubscribeTopics(TopicIdCertRevokeAccepted, TopicIdCertRevokeRejected, &prvCertRevokeIncomingPublishCallback);
 }
 
 /*
@@ -464,7 +461,8 @@ static void prvSubscribeRevokeTopics()
 static void prvRevokeCertificate()
 {
     char buffer[OLD_REVOKE_MSG_SIZE];
-    char topic_filter[TOPIC_FILTER_LENGTH] = {0};
+    const char* topic_filter = TopicRegistry_Get(TopicIdCertRevoke);
+    uint16_t topicLength     = TopicRegistry_Length(TopicIdCertRevoke);
 
     snprintf(buffer,
              sizeof(buffer),
@@ -473,24 +471,23 @@ static void prvRevokeCertificate()
              "}",
              certificateId);
 
-    snprintf(topic_filter,
-             sizeof(topic_filter),
-             CERT_REVOKE_TOPIC,
-             GetThingName());
-
-    PublishToTopic(topic_filter,
-                   strlen(topic_filter),
-                   buffer,
-                   strlen(buffer),
-                   MQTTQoS0,
-                   TAG);
+    /* The message is small enough to be copied, nothing waits for it to be sent. */
+    if (PublishToTopicAsync(topic_filter, topicLength, buffer, strlen(buffer), MQTTQoS0, NULL, TAG) ==
+        PUBLISH_HANDLE_INVALID) {
+        PublishToTopic(topic_filter,
+                       topicLength,
+                       buffer,
+                       strlen(buffer),
+                       MQTTQoS0,
+                       TAG);
+    }
 }
 
 /*
  * Parses the received JSON payload containing the signed certificate
  * and extracts the certificate ID and PEM certificate.
  */
-static JSONStatus_t prvReceivedCertificateParser(CertRenewDataEvent_t* certData)
+static JSONStatus_t prvReceivedCertificateParser(const CertRenewDataEvent_t* certData)
 {
     JSONStatus_t jsonResult = JSONNotFound;
     const char* jsonValue   = NULL;
@@ -604,6 +601,28 @@ static void prvPrintErrorMessage(const char* message, const size_t messageLength
     }
 }
 
+/*
+ * Keeps the payload of a response for the renewal task. It is referenced in the
+ * buffer of the publish when the callback runs in a deferred dispatch worker,
+ * and copied out of the network buffer otherwise.
+ */
+static bool prvHoldResponse(const MQTTPublishInfo_t* pxPublishInfo, CertRenewDataEvent_t* dataEvent)
+{
+    const uint8_t* data = (const uint8_t*)pxPublishInfo->pPayload;
+
+    dataEvent->buffer = SharedBuffer_Hold(&data, pxPublishInfo->payloadLength);
+
+    if (dataEvent->buffer == NULL) {
+        ESP_LOGE("MQTT_AGENT", "No buffer to keep the response on %.*s", pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName);
+        return false;
+    }
+
+    dataEvent->data       = data;
+    dataEvent->dataLength = pxPublishInfo->payloadLength;
+
+    return true;
+}
+
 /*
  * Callback executed when a response message from the CSR creation API
  * is received via MQTT. Processes the incoming message to determine
@@ -612,25 +631,20 @@ static void prvPrintErrorMessage(const char* message, const size_t messageLength
 static void prvCreateFromCSRIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
 {
     CertRenewEventMsg_t nextEvent = {0};
-    char topic_filter[80]         = {0};
 
     (void)pvIncomingPublishCallbackContext;
 
-    CertRenewDataEvent_t* dataBuf = &dataBuffers[0];
-
-    memcpy(topic_filter, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
-
-    memcpy(dataBuf->data, pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
-    nextEvent.dataEvent = dataBuf;
-    dataBuf->dataLength = pxPublishInfo->payloadLength;
+    if (!prvHoldResponse(pxPublishInfo, &nextEvent.dataEvent)) {
+        return;
+    }
 
-    if (isAcceptedTopic(topic_filter)) {
+    if (TopicRegistry_Classify(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength) == TopicIdCreateFromCsrAccepted) {
         nextEvent.eventId = CertRenewEventReceivedSignedCertificate;
-        ESP_LOGI("MQTT_AGENT", "Certificate received: %s\n", (char*)pxPublishInfo->pPayload);
+        ESP_LOGI("MQTT_AGENT", "Certificate received: %.*s\n", pxPublishInfo->payloadLength, (char*)pxPublishInfo->pPayload);
     } else {
         nextEvent.eventId = CertRenewEventRejectedCertificateSigningRequest;
     }
-    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, "MQTT_AGENT");
+    EventBus_Send(xCertRenewEventQueue, &nextEvent);
 }
 
 static void prvMQTTTerminateCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo)
@@ -645,35 +659,20 @@ static void prvMQTTTerminateCompleteCallback(MQTTAgentCommandContext_t* pxComman
 */ 
 static void prvCertRevokeIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
 {
-    CertRenewEventMsg_t nextEvent          = {0};
-    char topic_filter[TOPIC_FILTER_LENGTH] = {0};
+    CertRenewEventMsg_t nextEvent = {0};
 
     (void)pvIncomingPublishCallbackContext;
 
-    memcpy(topic_filter, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
-
-    CertRenewDataEvent_t* dataBuf = &dataBuffers[0];
-
-    memcpy(dataBuf->data, pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
-    nextEvent.dataEvent = dataBuf;
-    dataBuf->dataLength = pxPublishInfo->payloadLength;
+    if (!prvHoldResponse(pxPublishInfo, &nextEvent.dataEvent)) {
+        return;
+    }
 
-    if (isAcceptedTopic(topic_filter)) {
+    if (TopicRegistry_Classify(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength) == TopicIdCertRevokeAccepted) {
         nextEvent.eventId = CertRenewEventAcceptedOldCertificateRevoke;
     } else {
         nextEvent.eventId = CertRenewEventRejectedOldCertificateRevoke;
     }
-    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, "MQTT_AGENT");
-}
-
-/* Checks if a given topic corresponds to a acepted topic. */
-static bool isAcceptedTopic(char* receivedTopic)
-{
-    if (strstr(receivedTopic, JOBS_API_SUCCESS) != NULL) {
-        return true;
-    }
-
-    return false;
+    EventBus_Send(xCertRenewEventQueue, &nextEvent);
 }
 
 /*
@@ -684,5 +683,18 @@ void UpdateStatusRenew(BaseType_t status)
 {
     CertRenewEventMsg_t nextEvent = {0};
     nextEvent.eventId             = status;
-    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, "MQTT_AGENT");
-}
\ No newline at end of file
+    EventBus_Send(xCertRenewEventQueue, &nextEvent);
+}
+static uint32_t prvEventType(const void* event)
+{
+    return ((const CertRenewEventMsg_t*)event)->eventId;
+}
+
+/* Called by the event bus on an event it dropped. */
+static void prvReleaseEvent(const void* event)
+{
+    const CertRenewEventMsg_t* dropped = (const CertRenewEventMsg_t*)event;
+
+    SharedBuffer_Release(dropped->jobEvent.buffer);
+    SharedBuffer_Release(dropped->dataEvent.buffer);
+}
@@ -17,6 +17,7 @@ struct MQTTAgentCommandContext {
     TaskHandle_t xTaskToNotify;
     uint32_t ulNotificationValue;
     void* pxIncomingPublishCallback;
+    void* pvIncomingPublishCallbackContext;
     void* pArgs;
 };
 
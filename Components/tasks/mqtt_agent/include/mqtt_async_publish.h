@@ -0,0 +1,65 @@
+#ifndef MQTT_ASYNC_PUBLISH_H
+#define MQTT_ASYNC_PUBLISH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "core_mqtt.h"
+
+/* Topics and payloads up to these sizes are copied, so the caller can reuse its buffers at once. */
+#define ASYNC_PUBLISH_TOPIC_SIZE   160U
+#define ASYNC_PUBLISH_INLINE_SIZE  256U
+
+/* Identifies a publish in flight, never reused while it is. */
+typedef uint32_t PublishHandle_t;
+
+#define PUBLISH_HANDLE_INVALID 0U
+
+/* Posted to the completion queue of a publish. */
+typedef struct PublishCompletion {
+    PublishHandle_t handle;
+    MQTTStatus_t status;
+    void* pContext;
+} PublishCompletion_t;
+
+/* Runs in the MQTT agent task, so it must not block. */
+typedef void (*PublishCompleteCallback_t)(const PublishCompletion_t* pCompletion);
+
+/*
+ * Where the completion of a publish is delivered: to the callback, to the
+ * queue of PublishCompletion_t, to both or, without either, only logged on
+ * failure. The queue is sent to without blocking, it must have room.
+ */
+typedef struct PublishCompletionTarget {
+    PublishCompleteCallback_t callback;
+    QueueHandle_t queue;
+    void* pContext;
+} PublishCompletionTarget_t;
+
+void AsyncPublish_Init(void);
+
+/*
+ * Queues a publish on the MQTT agent and returns without waiting for it to be
+ * sent, or acknowledged for QoS 1. Returns PUBLISH_HANDLE_INVALID if every slot
+ * is in flight or the agent queue is full, then nothing is delivered.
+ *
+ * Payloads larger than ASYNC_PUBLISH_INLINE_SIZE are not copied and must stay
+ * valid until the completion, which is where they are usually freed.
+ */
+PublishHandle_t PublishToTopicAsync(const char* pcTopic,
+                                    uint16_t usTopicLen,
+                                    const char* pcMsg,
+                                    uint32_t ulMsgSize,
+                                    MQTTQoS_t xQoS,
+                                    const PublishCompletionTarget_t* pTarget,
+                                    const char* TASK);
+
+bool AsyncPublish_IsPending(PublishHandle_t handle);
+
+/* Publishes in flight, over all tasks. */
+uint32_t AsyncPublish_InFlight(void);
+
+#endif
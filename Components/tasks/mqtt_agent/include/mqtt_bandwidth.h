@@ -0,0 +1,70 @@
+#ifndef MQTT_BANDWIDTH_H
+#define MQTT_BANDWIDTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Bytes a class may send at once after being idle, as milliseconds of its rate. */
+#define BANDWIDTH_BURST_MS 500U
+
+/* Longest sleep of a blocked sender, so a new policy is applied soon. */
+#define BANDWIDTH_MAX_SLEEP_MS 1000U
+
+/* Traffic sharing the MQTT connection, and its single network buffer. */
+typedef enum BandwidthClass {
+    BandwidthClassOta = 0, /* Stream data of an OTA download, counted when requested */
+    BandwidthClassUpload,  /* Application uploads */
+    BandwidthClassMax
+} BandwidthClass_t;
+
+typedef struct BandwidthPolicy {
+    bool enabled;            /* Without the governor every sender goes at once, only the stats are kept */
+    uint32_t linkBytesPerS;  /* Rate of the connection shared by the classes */
+    uint8_t otaSharePercent; /* Share of the rate guaranteed to OTA while it downloads */
+    bool downscaleUploads;   /* Uploads are made smaller while OTA downloads */
+} BandwidthPolicy_t;
+
+typedef struct BandwidthStats {
+    uint32_t bytes;     /* Bytes consumed */
+    uint32_t grants;    /* Messages or requests consumed */
+    uint32_t deferrals; /* Times the class had to wait */
+    uint32_t waitMs;    /* Total time blocked senders waited */
+    uint32_t maxWaitMs;
+} BandwidthStats_t;
+
+/*
+ * Token bucket per class. While OTA downloads, it is refilled at otaSharePercent
+ * of the link rate and uploads at the rest; otherwise uploads get the whole rate.
+ * A bucket holds BANDWIDTH_BURST_MS of its rate, tokens beyond it go to the other
+ * class, so the link is not left idle by a class with nothing to send. A message
+ * larger than the bucket is sent as soon as the bucket is not in debt and puts it
+ * in debt, which the next message of the class waits for.
+ */
+void BandwidthGovernor_Init(void);
+
+/* Can be called at any time, the buckets are refilled at the new rates from now on. */
+void BandwidthGovernor_SetPolicy(const BandwidthPolicy_t* pPolicy);
+void BandwidthGovernor_GetPolicy(BandwidthPolicy_t* pPolicy);
+
+/* Set by the OTA agent for the time of a download. */
+void BandwidthGovernor_SetOtaActive(bool active);
+bool BandwidthGovernor_IsOtaActive(void);
+
+/* True when uploads should be made smaller now. */
+bool BandwidthGovernor_ShouldDownscale(void);
+
+/* Milliseconds until the class may send again, 0 if it may now. Never blocks. */
+uint32_t BandwidthGovernor_WaitTimeMs(BandwidthClass_t class);
+
+/* Takes bytes from the bucket of the class, which may go in debt. */
+void BandwidthGovernor_Consume(BandwidthClass_t class, uint32_t bytes);
+
+/* Waits until the class may send, then consumes bytes. Returns the time waited in ms. */
+uint32_t BandwidthGovernor_Acquire(BandwidthClass_t class, uint32_t bytes);
+
+void BandwidthGovernor_GetStats(BandwidthClass_t class, BandwidthStats_t* pStats);
+
+/* Logs the policy and the stats of every class. */
+void BandwidthGovernor_LogStats(void);
+
+#endif
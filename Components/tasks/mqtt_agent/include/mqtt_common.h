@@ -7,6 +7,8 @@
 #include "core_mqtt_agent.h"
 #include "jobs.h"
 
+#include "shared_buffer.h"
+
 #define AWS_ROOT_CA    1
 #define GOOGLE_ROOT_CA 2
 
@@ -18,7 +20,6 @@
 
 #define MQTT_PROCESS_LOOP_TIMEOUT_MS 5000U
 
-#define JOB_DOC_SIZE        1800U
 #define JOB_ID_LENGTH       80
 #define UPDATE_REQUEST_SIZE 150U
 #define JOB_UPDATE_SIZE     150U
@@ -26,10 +27,15 @@
 
 #define THING_NAME_LENGTH 20
 
+/*
+ * A job document sent to the agent handling it. The document is not copied
+ * out of the buffer it was received in, the event owns a reference to it.
+ */
 typedef struct JobEventData {
     char jobId[JOB_ID_LENGTH];
-    char jobData[JOB_DOC_SIZE];
+    const char* jobData; /* Not null terminated */
     size_t jobDataLength;
+    SharedBuffer_t* buffer; /* Released by the agent once the event is handled */
 } JobEventData_t;
 
 typedef struct TopicFilters {
@@ -43,6 +49,7 @@ typedef struct TopicFilters {
 
 MQTTStatus_t PublishToTopic(const char* pcTopic, uint16_t usTopicLen, const char* pcMsg, uint32_t ulMsgSize, MQTTQoS_t xQoS, const char* TASK);
 MQTTStatus_t SubscribeToTopic(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK);
+MQTTStatus_t SubscribeToTopicInAgentTask(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK);
 MQTTStatus_t UnSubscribeToTopic(MQTTAgentSubscribeArgs_t* pcSubsTopics, const char* TASK);
 MQTTStatus_t TerminateMQTTAgent(void* IncomingPublishCallback, const char* TASK);
 MQTTStatus_t SubscribeToNextJobTopic();
@@ -53,6 +60,7 @@ void ReplaceEscapedNewlines(char* str);
 void EscapeNewlines(const char* input, char* output);
 char* CreateStringCopy(const char* src, size_t srcLength);
 char* GetMacAddress();
+void LogCommandQueueStats(void);
 void SetJobId(const char* jobId);
 const char* GetJobId();
 char* GetThingName();
@@ -0,0 +1,62 @@
+#ifndef MQTT_DEFERRED_DISPATCH_H
+#define MQTT_DEFERRED_DISPATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core_mqtt.h"
+
+#include "mqtt_subscription_manager.h"
+
+/* Handlers registered at the same time, each subscription callback is one. */
+#define DEFERRED_DISPATCH_MAX_HANDLERS 8U
+
+/* Execution time of the publishes handed to a callback. */
+typedef struct DeferredHandlerStats {
+    uint32_t calls;
+    uint32_t inlineCalls; /* Run in the MQTT agent task, not deferred, deferring disabled or without a buffer */
+    uint32_t dropped;     /* Not run, no buffer or no room in the queue of its busy worker */
+    uint64_t totalUs;
+    uint32_t maxUs;
+    uint32_t maxQueuedUs; /* Longest wait for the worker */
+} DeferredHandlerStats_t;
+
+/* Starts the workers. SharedBuffer_Init() must have been called. */
+void DeferredDispatch_Init(void);
+
+/*
+ * Replaces a subscription callback by the one that defers it: the publish is
+ * copied into a shared buffer and handed to the worker of the
+ * callback, so the MQTT agent task returns to the socket at once. A callback
+ * always runs in the same worker, in the order of its publishes. A publish
+ * too large for a buffer, or arriving with none free or the worker queue
+ * still full after a short wait, is run in the agent task as before if the worker has none of the
+ * publishes of the callback, and dropped otherwise: the callback never runs
+ * twice at the same time.
+ *
+ * A callback wrapped with deferred false always runs in the agent task, only
+ * to be measured with the others.
+ *
+ * pCallback and ppContext are what to register in the subscription manager.
+ * If every handler is taken, they are the callback itself, run in the agent task.
+ */
+void DeferredDispatch_Wrap(IncomingPubCallback_t callback,
+                           const char* name,
+                           bool deferred,
+                           IncomingPubCallback_t* pCallback,
+                           void** ppContext);
+
+/*
+ * Called by the agent around the dispatch of a publish, so the callbacks it
+ * matches share one copy of it, released when the last one has run.
+ */
+void DeferredDispatch_BeginPublish(void);
+void DeferredDispatch_EndPublish(void);
+
+/* Returns false if the callback was never wrapped. */
+bool DeferredDispatch_GetStats(IncomingPubCallback_t callback, DeferredHandlerStats_t* pStats);
+
+/* Logs the execution time of every callback, to find the slow ones. */
+void DeferredDispatch_LogStats(void);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef MQTT_TOPIC_REGISTRY_H
+#define MQTT_TOPIC_REGISTRY_H
+
+#include <stdint.h>
+
+/* Longest topic of the registry, with its terminating null. */
+#define TOPIC_REGISTRY_TOPIC_SIZE 160U
+
+/* Topics of the device, the ones of a job or a stream are empty until it is set. */
+typedef enum TopicId {
+    TopicIdUnknown = 0,
+    TopicIdJobsNotifyNext,
+    TopicIdJobUpdate,
+    TopicIdJobUpdateAccepted,
+    TopicIdJobUpdateRejected,
+    TopicIdCreateFromCsr,
+    TopicIdCreateFromCsrAccepted,
+    TopicIdCreateFromCsrRejected,
+    TopicIdCertRevoke,
+    TopicIdCertRevokeAccepted,
+    TopicIdCertRevokeRejected,
+    TopicIdStreamData,
+    TopicIdStreamRejected,
+    TopicIdMax
+} TopicId_t;
+
+/*
+ * Formats every topic of the thing once, after connecting, when its name is
+ * known. The strings stay valid, so they can be kept by subscriptions and
+ * referenced by publishes without copying or formatting them again.
+ */
+void TopicRegistry_Init(const char* thingName);
+
+/* Sets the job update topics, for the job being run. */
+void TopicRegistry_SetJob(const char* jobId);
+
+/* Sets the stream data topics, for the OTA stream and encoding being downloaded. */
+void TopicRegistry_SetStream(const char* streamName, const char* dataType);
+
+/* Interned topic and its length, an empty string if it is not set. */
+const char* TopicRegistry_Get(TopicId_t id);
+uint16_t TopicRegistry_Length(TopicId_t id);
+
+/* Identifies a received topic by a hash of it, TopicIdUnknown if it is none of the registry. */
+TopicId_t TopicRegistry_Classify(const char* pTopic, uint16_t topicLength);
+
+#endif
@@ -9,8 +9,12 @@
 #include "core_mqtt_agent.h"
 
 #include "mqtt_agent.h"
+#include "mqtt_async_publish.h"
+#include "mqtt_bandwidth.h"
 #include "mqtt_common.h"
+#include "mqtt_deferred_dispatch.h"
 #include "mqtt_onboarding.h"
+#include "mqtt_topic_registry.h"
 #include "queue_handler.h"
 
 #include "cert_renew_agent.h"
@@ -61,6 +65,10 @@ void mqttAgentTask(void* parameters)
     NetworkContext_t xNetworkContext = {0};
     TransportInterface_t xTransport = {0};
 
+    BandwidthGovernor_Init();
+    AsyncPublish_Init();
+    SharedBuffer_Init();
+    DeferredDispatch_Init();
     initHardware();
     prvPrintRunningPartition();
 
@@ -70,6 +78,8 @@ void mqttAgentTask(void* parameters)
         ConnectToAWS(&xNetworkContext, &xTransport);
     }
 
+    /* The thing name is known once connected, onboarding may have just assigned it. */
+    TopicRegistry_Init(GetThingName());
     SubscribeToNextJobTopic();
     prvCheckFirmware();
     prvNotifyMainTask();
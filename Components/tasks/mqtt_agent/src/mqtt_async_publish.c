@@ -0,0 +1,188 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "core_mqtt_agent.h"
+
+#include "mqtt_agent.h"
+#include "mqtt_async_publish.h"
+
+#if defined(CONFIG_MQTT_ASYNC_PUBLISH_SLOTS)
+    #define ASYNC_PUBLISH_SLOTS CONFIG_MQTT_ASYNC_PUBLISH_SLOTS
+#else
+    #define ASYNC_PUBLISH_SLOTS 8U
+#endif
+
+#define MAX_COMMAND_SEND_BLOCK_TIME_MS 2000U
+
+/* Low bits of a handle are the slot, the rest its generation. */
+#define HANDLE_SLOT_BITS 8U
+#define HANDLE_SLOT_MASK ((1U << HANDLE_SLOT_BITS) - 1U)
+
+static const char* TAG = "MQTT_ASYNC_PUBLISH";
+
+/* A publish in flight, the agent keeps pointers to its publish info and command context. */
+typedef struct AsyncPublishSlot {
+    PublishHandle_t handle; /* PUBLISH_HANDLE_INVALID while free */
+    MQTTPublishInfo_t publishInfo;
+    MQTTAgentCommandContext_t commandContext;
+    PublishCompletionTarget_t target;
+    const char* pTask;
+    char topic[ASYNC_PUBLISH_TOPIC_SIZE];
+    char payload[ASYNC_PUBLISH_INLINE_SIZE];
+} AsyncPublishSlot_t;
+
+extern MQTTAgentContext_t globalMqttAgentContext;
+
+static StaticSemaphore_t xMutexBuffer;
+static SemaphoreHandle_t xMutex = NULL;
+
+static AsyncPublishSlot_t slots[ASYNC_PUBLISH_SLOTS];
+static uint32_t generation = 0;
+static uint32_t inFlight   = 0;
+
+static AsyncPublishSlot_t* prvAllocateSlot(void);
+static void prvReleaseSlot(AsyncPublishSlot_t* pSlot);
+static void prvAsyncPublishCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo);
+
+void AsyncPublish_Init(void)
+{
+    xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+    memset(slots, 0x00, sizeof(slots));
+    inFlight = 0;
+}
+
+PublishHandle_t PublishToTopicAsync(const char* pcTopic,
+                                    uint16_t usTopicLen,
+                                    const char* pcMsg,
+                                    uint32_t ulMsgSize,
+                                    MQTTQoS_t xQoS,
+                                    const PublishCompletionTarget_t* pTarget,
+                                    const char* TASK)
+{
+    MQTTAgentCommandInfo_t xCommandInformation = {0};
+    AsyncPublishSlot_t* pSlot;
+    PublishHandle_t handle;
+
+    if (usTopicLen > ASYNC_PUBLISH_TOPIC_SIZE) {
+        ESP_LOGE(TASK, "Topic of %u bytes is too long for an asynchronous publish", usTopicLen);
+        return PUBLISH_HANDLE_INVALID;
+    }
+
+    pSlot = prvAllocateSlot();
+
+    if (pSlot == NULL) {
+        ESP_LOGW(TASK, "Every asynchronous publish slot is in flight");
+        return PUBLISH_HANDLE_INVALID;
+    }
+    handle = pSlot->handle;
+
+    memcpy(pSlot->topic, pcTopic, usTopicLen);
+    pSlot->publishInfo.pTopicName      = pSlot->topic;
+    pSlot->publishInfo.topicNameLength = usTopicLen;
+    pSlot->publishInfo.qos             = xQoS;
+    pSlot->publishInfo.payloadLength   = ulMsgSize;
+
+    if (ulMsgSize <= ASYNC_PUBLISH_INLINE_SIZE) {
+        memcpy(pSlot->payload, pcMsg, ulMsgSize);
+        pSlot->publishInfo.pPayload = pSlot->payload;
+    } else {
+        pSlot->publishInfo.pPayload = pcMsg;
+    }
+
+    if (pTarget != NULL) {
+        pSlot->target = *pTarget;
+    }
+    pSlot->pTask                        = TASK;
+    pSlot->commandContext.pArgs         = pSlot;
+    pSlot->commandContext.xReturnStatus = MQTTSendFailed;
+
+    xCommandInformation.blockTimeMs                 = MAX_COMMAND_SEND_BLOCK_TIME_MS;
+    xCommandInformation.cmdCompleteCallback         = prvAsyncPublishCompleteCallback;
+    xCommandInformation.pCmdCompleteCallbackContext = &pSlot->commandContext;
+
+    if (MQTTAgent_Publish(&globalMqttAgentContext, &pSlot->publishInfo, &xCommandInformation) != MQTTSuccess) {
+        ESP_LOGE(TASK, "Failed to queue the publish to %.*s", usTopicLen, pcTopic);
+        prvReleaseSlot(pSlot);
+        return PUBLISH_HANDLE_INVALID;
+    }
+
+    return handle;
+}
+
+bool AsyncPublish_IsPending(PublishHandle_t handle)
+{
+    uint32_t index = (handle & HANDLE_SLOT_MASK) - 1U;
+
+    return (handle != PUBLISH_HANDLE_INVALID) && (index < ASYNC_PUBLISH_SLOTS) && (slots[index].handle == handle);
+}
+
+uint32_t AsyncPublish_InFlight(void)
+{
+    return inFlight;
+}
+
+static AsyncPublishSlot_t* prvAllocateSlot(void)
+{
+    AsyncPublishSlot_t* pSlot = NULL;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    for (uint32_t i = 0; i < ASYNC_PUBLISH_SLOTS; i++) {
+        if (slots[i].handle == PUBLISH_HANDLE_INVALID) {
+            pSlot = &slots[i];
+            memset(pSlot, 0x00, sizeof(AsyncPublishSlot_t));
+
+            generation++;
+            pSlot->handle = (generation << HANDLE_SLOT_BITS) | (i + 1U);
+            inFlight++;
+            break;
+        }
+    }
+
+    xSemaphoreGive(xMutex);
+
+    return pSlot;
+}
+
+static void prvReleaseSlot(AsyncPublishSlot_t* pSlot)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    pSlot->handle = PUBLISH_HANDLE_INVALID;
+    inFlight--;
+
+    xSemaphoreGive(xMutex);
+}
+
+/* Called by the agent once the publish is sent, or acknowledged for QoS 1, or failed. */
+static void prvAsyncPublishCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo)
+{
+    AsyncPublishSlot_t* pSlot      = (AsyncPublishSlot_t*)pxCommandContext->pArgs;
+    PublishCompletionTarget_t target = pSlot->target;
+    PublishCompletion_t completion = {
+        .handle   = pSlot->handle,
+        .status   = pxReturnInfo->returnCode,
+        .pContext = target.pContext,
+    };
+
+    if (completion.status != MQTTSuccess) {
+        ESP_LOGE(pSlot->pTask, "Failed to send publish packet to broker with error = %s.", MQTT_Status_strerror(completion.status));
+    }
+
+    /* The slot is free before the completion is seen, so it can be used again from it. */
+    prvReleaseSlot(pSlot);
+
+    if (target.callback != NULL) {
+        target.callback(&completion);
+    }
+
+    if ((target.queue != NULL) && (xQueueSend(target.queue, &completion, 0) != pdPASS)) {
+        ESP_LOGW(TAG, "Completion queue full, publish %lu completion lost", completion.handle);
+    }
+}
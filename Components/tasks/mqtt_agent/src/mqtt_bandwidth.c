@@ -0,0 +1,270 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mqtt_bandwidth.h"
+
+#if defined(CONFIG_MQTT_BANDWIDTH_GOVERNOR)
+    #define BANDWIDTH_GOVERNOR_ENABLED true
+#else
+    #define BANDWIDTH_GOVERNOR_ENABLED false
+#endif
+
+#if defined(CONFIG_MQTT_BANDWIDTH_LINK_RATE)
+    #define BANDWIDTH_LINK_RATE CONFIG_MQTT_BANDWIDTH_LINK_RATE
+#else
+    #define BANDWIDTH_LINK_RATE 32768U
+#endif
+
+#if defined(CONFIG_MQTT_BANDWIDTH_OTA_SHARE)
+    #define BANDWIDTH_OTA_SHARE CONFIG_MQTT_BANDWIDTH_OTA_SHARE
+#else
+    #define BANDWIDTH_OTA_SHARE 70U
+#endif
+
+#if defined(CONFIG_MQTT_BANDWIDTH_DOWNSCALE_UPLOADS)
+    #define BANDWIDTH_DOWNSCALE_UPLOADS true
+#else
+    #define BANDWIDTH_DOWNSCALE_UPLOADS false
+#endif
+
+static const char* TAG = "MQTT_BANDWIDTH";
+
+/* Tokens are millionths of a byte, so frequent refills at low rates lose nothing to rounding. */
+#define TOKENS_PER_BYTE 1000000LL
+
+typedef struct TokenBucket {
+    int64_t tokens; /* Negative while in debt */
+    uint32_t rate;  /* Bytes per second */
+    BandwidthStats_t stats;
+} TokenBucket_t;
+
+static const char* pClassNames[BandwidthClassMax] = {"OTA", "Upload"};
+
+static StaticSemaphore_t xMutexBuffer;
+static SemaphoreHandle_t xMutex = NULL;
+
+static BandwidthPolicy_t policy;
+static bool otaActive = false;
+static TokenBucket_t buckets[BandwidthClassMax];
+static int64_t lastRefillUs = 0;
+
+static void prvSetRates(void);
+static void prvRefill(void);
+static int64_t prvCapacity(const TokenBucket_t* pBucket);
+static uint32_t prvWaitTimeMs(const TokenBucket_t* pBucket);
+
+void BandwidthGovernor_Init(void)
+{
+    xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+
+    policy.enabled          = BANDWIDTH_GOVERNOR_ENABLED;
+    policy.linkBytesPerS    = BANDWIDTH_LINK_RATE;
+    policy.otaSharePercent  = BANDWIDTH_OTA_SHARE;
+    policy.downscaleUploads = BANDWIDTH_DOWNSCALE_UPLOADS;
+
+    memset(buckets, 0x00, sizeof(buckets));
+    lastRefillUs = esp_timer_get_time();
+    prvSetRates();
+
+    for (uint32_t i = 0; i < BandwidthClassMax; i++) {
+        buckets[i].tokens = prvCapacity(&buckets[i]);
+    }
+}
+
+void BandwidthGovernor_SetPolicy(const BandwidthPolicy_t* pPolicy)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    /* Tokens earned at the old rates are kept. */
+    prvRefill();
+    policy = *pPolicy;
+
+    if (policy.otaSharePercent > 100U) {
+        policy.otaSharePercent = 100U;
+    }
+    prvSetRates();
+
+    xSemaphoreGive(xMutex);
+
+    ESP_LOGI(TAG, "Policy: %s, %lu B/s, %u%% for OTA downloads, %s uploads", policy.enabled ? "enabled" : "disabled",
+             policy.linkBytesPerS, policy.otaSharePercent, policy.downscaleUploads ? "downscaled" : "deferred");
+}
+
+void BandwidthGovernor_GetPolicy(BandwidthPolicy_t* pPolicy)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    *pPolicy = policy;
+    xSemaphoreGive(xMutex);
+}
+
+void BandwidthGovernor_SetOtaActive(bool active)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    prvRefill();
+    otaActive = active;
+    prvSetRates();
+
+    xSemaphoreGive(xMutex);
+}
+
+bool BandwidthGovernor_IsOtaActive(void)
+{
+    return otaActive;
+}
+
+bool BandwidthGovernor_ShouldDownscale(void)
+{
+    return otaActive && policy.enabled && policy.downscaleUploads;
+}
+
+uint32_t BandwidthGovernor_WaitTimeMs(BandwidthClass_t class)
+{
+    uint32_t waitMs = 0;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    if (policy.enabled) {
+        prvRefill();
+        waitMs = prvWaitTimeMs(&buckets[class]);
+    }
+
+    xSemaphoreGive(xMutex);
+
+    return waitMs;
+}
+
+void BandwidthGovernor_Consume(BandwidthClass_t class, uint32_t bytes)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    prvRefill();
+    buckets[class].tokens -= (int64_t)bytes * TOKENS_PER_BYTE;
+    buckets[class].stats.bytes += bytes;
+    buckets[class].stats.grants++;
+
+    xSemaphoreGive(xMutex);
+}
+
+uint32_t BandwidthGovernor_Acquire(BandwidthClass_t class, uint32_t bytes)
+{
+    int64_t startUs = esp_timer_get_time();
+    uint32_t waitedMs;
+    uint32_t waitMs;
+
+    /* The policy may change while waiting, the wait is checked again after each sleep. */
+    while ((waitMs = BandwidthGovernor_WaitTimeMs(class)) > 0U) {
+        vTaskDelay(pdMS_TO_TICKS((waitMs > BANDWIDTH_MAX_SLEEP_MS) ? BANDWIDTH_MAX_SLEEP_MS : waitMs) + 1);
+    }
+
+    waitedMs = (uint32_t)((esp_timer_get_time() - startUs) / 1000);
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    if (waitedMs > 0U) {
+        buckets[class].stats.deferrals++;
+        buckets[class].stats.waitMs += waitedMs;
+
+        if (waitedMs > buckets[class].stats.maxWaitMs) {
+            buckets[class].stats.maxWaitMs = waitedMs;
+        }
+    }
+
+    xSemaphoreGive(xMutex);
+
+    BandwidthGovernor_Consume(class, bytes);
+
+    return waitedMs;
+}
+
+void BandwidthGovernor_GetStats(BandwidthClass_t class, BandwidthStats_t* pStats)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    *pStats = buckets[class].stats;
+    xSemaphoreGive(xMutex);
+}
+
+void BandwidthGovernor_LogStats(void)
+{
+    for (uint32_t i = 0; i < BandwidthClassMax; i++) {
+        BandwidthStats_t stats;
+
+        BandwidthGovernor_GetStats((BandwidthClass_t)i, &stats);
+
+        ESP_LOGI(TAG, "%s: %lu bytes in %lu messages, governor %s, deferred %lu times, %lu ms waited (%lu ms max)",
+                 pClassNames[i],
+                 stats.bytes,
+                 stats.grants,
+                 policy.enabled ? "on" : "off",
+                 stats.deferrals,
+                 stats.waitMs,
+                 stats.maxWaitMs);
+    }
+}
+
+/* Splits the link rate between the classes, OTA only has a share while it downloads. */
+static void prvSetRates(void)
+{
+    uint32_t otaRate = (uint32_t)(((uint64_t)policy.linkBytesPerS * policy.otaSharePercent) / 100U);
+
+    buckets[BandwidthClassOta].rate    = otaActive ? otaRate : policy.linkBytesPerS;
+    buckets[BandwidthClassUpload].rate = otaActive ? policy.linkBytesPerS - otaRate : policy.linkBytesPerS;
+}
+
+/* Adds the tokens earned since the last refill, what overflows a full bucket goes to the other class. */
+static void prvRefill(void)
+{
+    int64_t nowUs     = esp_timer_get_time();
+    int64_t elapsedUs = nowUs - lastRefillUs;
+    int64_t spill     = 0;
+
+    lastRefillUs = nowUs;
+
+    for (uint32_t i = 0; i < BandwidthClassMax; i++) {
+        TokenBucket_t* pBucket = &buckets[i];
+        int64_t capacity       = prvCapacity(pBucket);
+
+        pBucket->tokens += elapsedUs * pBucket->rate;
+
+        if (pBucket->tokens > capacity) {
+            spill += pBucket->tokens - capacity;
+            pBucket->tokens = capacity;
+        }
+    }
+
+    for (uint32_t i = 0; (i < BandwidthClassMax) && (spill > 0); i++) {
+        TokenBucket_t* pBucket = &buckets[i];
+        int64_t room           = prvCapacity(pBucket) - pBucket->tokens;
+
+        if (room > 0) {
+            int64_t given = (spill < room) ? spill : room;
+
+            pBucket->tokens += given;
+            spill -= given;
+        }
+    }
+}
+
+static int64_t prvCapacity(const TokenBucket_t* pBucket)
+{
+    return ((int64_t)pBucket->rate * BANDWIDTH_BURST_MS * TOKENS_PER_BYTE) / 1000;
+}
+
+/* A bucket in debt is paid back at its rate, a class without rate is paced by the rest of the link. */
+static uint32_t prvWaitTimeMs(const TokenBucket_t* pBucket)
+{
+    uint32_t rate = (pBucket->rate > 0U) ? pBucket->rate : policy.linkBytesPerS;
+
+    if ((pBucket->tokens >= 0) || (rate == 0U)) {
+        return 0U;
+    }
+    return (uint32_t)((-pBucket->tokens / ((int64_t)rate * 1000)) + 1);
+}
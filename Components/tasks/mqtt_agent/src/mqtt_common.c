@@ -5,11 +5,15 @@
 #include "jobs.h"
 
 #include "esp_mac.h"
+#include "freertos/semphr.h"
 
 #include "cert_renew_agent.h"
 #include "mqtt_agent.h"
+#include "mqtt_async_publish.h"
 #include "mqtt_common.h"
+#include "mqtt_deferred_dispatch.h"
 #include "mqtt_subscription_manager.h"
+#include "mqtt_topic_registry.h"
 #include "ota_agent.h"
 
 #define MAX_COMMAND_SEND_BLOCK_TIME_MS         2000U
@@ -17,18 +21,12 @@
 
 extern MQTTAgentContext_t globalMqttAgentContext;
 extern AWSConnectSettings_t AWSConnectSettings;
-extern SubscriptionElement_t globalSubscriptionList;
-extern QueueHandle_t xCertRenewEventQueue;
-extern QueueHandle_t xOtaEventQueue;
+extern EventQueue_t* xCertRenewEventQueue;
+extern EventQueue_t* xOtaEventQueue;
 
 static const char* TAG = "MQTT_AGENT";
 
-char* topic_filter = NULL;
-
-static JobEventData_t jobBuffers[1] = {0};
-char globalJobId[JOB_ID_LENGTH]     = {0};
-
-#define JOBS_NOTIFY_NEXT_TOPIC "$aws/things/%s/jobs/notify-next"
+char globalJobId[JOB_ID_LENGTH] = {0};
 
 static void prvMQTTPublishCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo);
 static void prvMQTTSubscribeCompleteCallback(MQTTAgentCommandContext_t* pxCommandContext, MQTTAgentReturnInfo_t* pxReturnInfo);
@@ -36,16 +34,23 @@ static void prvMQTTUnSubscribeCompleteCallback(MQTTAgentCommandContext_t* pxComm
 static void prvIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo);
 static bool prIsFreeRTOSOtaJob(const char* jobDoc, size_t jobDocLength);
 static bool prIsCertRenewalJob(const char* jobDoc, size_t jobDocLength);
-static void prvSendOTAJobDocument(JobEventData_t* jobDocument);
-static void prvSendRenewJobDocument(JobEventData_t* jobDocument);
+static bool prvHoldJobDocument(JobEventData_t* jobDocument, const char* jobDoc, size_t jobDocLength);
+static void prvSendOTAJobDocument(const JobEventData_t* jobDocument);
+static void prvSendRenewJobDocument(const JobEventData_t* jobDocument);
+static MQTTStatus_t prvSubscribe(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK, bool deferred);
 
-/* Publishes an MQTT message to the MQTT agent's message queue for delivery to AWS IoT Core. */
+/*
+ * Publishes an MQTT message to the MQTT agent's message queue for delivery to AWS IoT Core,
+ * and waits for it on a semaphore, so the task notification value is left to the caller.
+ */
 MQTTStatus_t PublishToTopic(const char* pcTopic, uint16_t usTopicLen, const char* pcMsg, uint32_t ulMsgSize, MQTTQoS_t xQoS, const char* TASK)
 {
     MQTTStatus_t xCommandAdded;
     MQTTAgentCommandInfo_t xCommandInformation = {0};
     MQTTAgentCommandContext_t xCommandContext;
     MQTTPublishInfo_t xPublishInfo;
+    StaticSemaphore_t xDoneBuffer;
+    SemaphoreHandle_t xDone = xSemaphoreCreateBinaryStatic(&xDoneBuffer);
 
     memset(&(xCommandContext), 0, sizeof(MQTTAgentCommandContext_t));
     memset(&(xPublishInfo), 0, sizeof(MQTTPublishInfo_t));
@@ -60,17 +65,14 @@ MQTTStatus_t PublishToTopic(const char* pcTopic, uint16_t usTopicLen, const char
     xCommandInformation.blockTimeMs                 = MAX_COMMAND_SEND_BLOCK_TIME_MS;
     xCommandInformation.cmdCompleteCallback         = prvMQTTPublishCompleteCallback;
     xCommandInformation.pCmdCompleteCallbackContext = &xCommandContext;
-    xCommandContext.xTaskToNotify                   = xTaskGetCurrentTaskHandle();
-    xCommandContext.pArgs                           = NULL;
+    xCommandContext.xTaskToNotify                   = NULL;
+    xCommandContext.pArgs                           = xDone;
     xCommandContext.xReturnStatus                   = MQTTSendFailed;
 
     xCommandAdded = MQTTAgent_Publish(&globalMqttAgentContext, &xPublishInfo, &xCommandInformation);
 
     if (xCommandAdded == MQTTSuccess) {
-        xTaskNotifyWait(0,
-                        0,
-                        NULL,
-                        portMAX_DELAY);
+        xSemaphoreTake(xDone, portMAX_DELAY);
 
         if (xCommandContext.xReturnStatus != MQTTSuccess) {
             ESP_LOGE(TASK, "Failed to send publish packet to broker with error = %s.", MQTT_Status_strerror(xCommandContext.xReturnStatus));
@@ -90,10 +92,26 @@ MQTTStatus_t PublishToTopic(const char* pcTopic, uint16_t usTopicLen, const char
  * message queue, enabling message delivery from AWS IoT Core to the client.
  */
 MQTTStatus_t SubscribeToTopic(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK)
+{
+    /* The callback runs in a worker, the agent task only hands it the publish. */
+    return prvSubscribe(pcSubsTopics, IncomingPublishCallback, TASK, true);
+}
+
+/*
+ * Same as SubscribeToTopic() for a callback that runs in the MQTT agent task, such as one that
+ * copies the publish out at once: deferring it would copy the publish twice.
+ */
+MQTTStatus_t SubscribeToTopicInAgentTask(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK)
+{
+    return prvSubscribe(pcSubsTopics, IncomingPublishCallback, TASK, false);
+}
+
+static MQTTStatus_t prvSubscribe(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* IncomingPublishCallback, const char* TASK, bool deferred)
 {
     MQTTStatus_t xCommandAdded;
     MQTTAgentCommandInfo_t xCommandInformation = {0};
     MQTTAgentCommandContext_t xCommandContext;
+    IncomingPubCallback_t xCallback;
 
     memset(&(xCommandContext), 0, sizeof(MQTTAgentCommandContext_t));
 
@@ -101,10 +119,12 @@ MQTTStatus_t SubscribeToTopic(MQTTAgentSubscribeArgs_t* pcSubsTopics, void* Inco
     xCommandInformation.cmdCompleteCallback         = prvMQTTSubscribeCompleteCallback;
     xCommandInformation.pCmdCompleteCallbackContext = &xCommandContext;
 
+    DeferredDispatch_Wrap((IncomingPubCallback_t)IncomingPublishCallback, TASK, deferred, &xCallback, &xCommandContext.pvIncomingPublishCallbackContext);
+
     xCommandContext.xTaskToNotify             = xTaskGetCurrentTaskHandle();
     xCommandContext.pArgs                     = pcSubsTopics;
     xCommandContext.xReturnStatus             = MQTTSendFailed;
-    xCommandContext.pxIncomingPublishCallback = IncomingPublishCallback;
+    xCommandContext.pxIncomingPublishCallback = xCallback;
 
     xCommandAdded = MQTTAgent_Subscribe(&globalMqttAgentContext, pcSubsTopics, &xCommandInformation);
 
@@ -178,11 +198,8 @@ static void prvMQTTPublishCompleteCallback(MQTTAgentCommandContext_t* pxCommandC
 
     // ESP_LOGI(pcTaskGetName(xTaskGetCurrentTaskHandle()), "In MQTTPublishCompleteCallback %s", MQTT_Status_strerror(pxReturnInfo->returnCode));
 
-    if (pxCommandContext->xTaskToNotify != NULL) {
-        xTaskNotify(pxCommandContext->xTaskToNotify,
-                    pxCommandContext->ulNotificationValue,
-                    eSetValueWithOverwrite);
-    }
+    /* Last access to the context, which is on the stack of the waiting task. */
+    xSemaphoreGive((SemaphoreHandle_t)pxCommandContext->pArgs);
 }
 
 /* 
@@ -201,20 +218,17 @@ static void prvMQTTSubscribeCompleteCallback(MQTTAgentCommandContext_t* pxComman
     if (pxReturnInfo->returnCode == MQTTSuccess) {
         /* Add subscription so that incoming publishes are routed to the application callback. */
         for (size_t i = 0; i < pxSubscribeArgs->numSubscriptions; i++) {
-            bool xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext,
+            bool xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionManager_t*)globalMqttAgentContext.pIncomingCallbackContext,
                                                                           pxSubscribeArgs->pSubscribeInfo[i].pTopicFilter,
                                                                           pxSubscribeArgs->pSubscribeInfo[i].topicFilterLength,
                                                                           pxApplicationDefinedContext->pxIncomingPublishCallback,
-                                                                          NULL);
+                                                                          pxApplicationDefinedContext->pvIncomingPublishCallbackContext);
 
             if (xSubscriptionAdded == false) {
                 ESP_LOGI(TAG, "Failed to register an incoming publish callback for topic %.*s.", pxSubscribeArgs->pSubscribeInfo[i].topicFilterLength, pxSubscribeArgs->pSubscribeInfo[i].pTopicFilter);
             } else {
                 ESP_LOGI(TAG, "Successful subscription %s\n", pxSubscribeArgs->pSubscribeInfo[i].pTopicFilter);
             }
-
-            ESP_LOGI(TAG, "Topic added: %s",
-                     ((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext)[i].pcSubscriptionFilterString);
         }
     }
 
@@ -238,7 +252,7 @@ static void prvMQTTUnSubscribeCompleteCallback(MQTTAgentCommandContext_t* pxComm
 
     if (pxReturnInfo->returnCode == MQTTSuccess) {
         for (size_t i = 0; i < pxSubscribeArgs->numSubscriptions; i++) {
-            SubscriptionManager_RemoveSubscription((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext,
+            SubscriptionManager_RemoveSubscription((SubscriptionManager_t*)globalMqttAgentContext.pIncomingCallbackContext,
                                                    pxSubscribeArgs->pSubscribeInfo[i].pTopicFilter,
                                                    pxSubscribeArgs->pSubscribeInfo[i].topicFilterLength);
         }
@@ -277,27 +291,28 @@ MQTTStatus_t SubscribeToNextJobTopic()
     uint16_t xPacketId;
     bool xSubscriptionAdded              = false;
     MQTTSubscribeInfo_t subscriptionList = {0};
-
-    topic_filter = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-
-    sprintf(topic_filter, JOBS_NOTIFY_NEXT_TOPIC, GetThingName());
+    IncomingPubCallback_t xCallback;
+    void* pvCallbackContext;
 
     subscriptionList.qos               = MQTTQoS0;
-    subscriptionList.pTopicFilter      = topic_filter;
-    subscriptionList.topicFilterLength = strlen(topic_filter);
+    subscriptionList.pTopicFilter      = TopicRegistry_Get(TopicIdJobsNotifyNext);
+    subscriptionList.topicFilterLength = TopicRegistry_Length(TopicIdJobsNotifyNext);
 
-    ESP_LOGI(TAG, "Subscribing to the topic %s", topic_filter);
+    ESP_LOGI(TAG, "Subscribing to the topic %s", subscriptionList.pTopicFilter);
 
     xPacketId = MQTT_GetPacketId(&(globalMqttAgentContext.mqttContext));
     xStatus   = MQTT_Subscribe(&(globalMqttAgentContext.mqttContext), &subscriptionList, 1, xPacketId);
 
     assert(xStatus == MQTTSuccess);
 
-    xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext,
+    /* Job documents are parsed in a worker, not in the agent task. */
+    DeferredDispatch_Wrap(&prvIncomingPublishCallback, "Jobs", true, &xCallback, &pvCallbackContext);
+
+    xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionManager_t*)globalMqttAgentContext.pIncomingCallbackContext,
                                                              subscriptionList.pTopicFilter,
                                                              subscriptionList.topicFilterLength,
-                                                             &prvIncomingPublishCallback,
-                                                             NULL);
+                                                             xCallback,
+                                                             pvCallbackContext);
 
     if (xSubscriptionAdded == false) {
         ESP_LOGI(TAG, "Failed to register an incoming publish callback for topic %.*s.", subscriptionList.topicFilterLength, subscriptionList.pTopicFilter);
@@ -322,7 +337,7 @@ MQTTStatus_t SubscribeToNextJobTopic()
  */
 static void prvIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
 {
-    char* jobDoc;
+    const char* jobDoc;
     const char* jobId;
     size_t jobIdLength         = 0U;
     JobEventData_t jobDocument = {0};
@@ -331,21 +346,24 @@ static void prvIncomingPublishCallback(void* pvIncomingPublishCallbackContext, M
 
     jobIdLength = Jobs_GetJobId((const char*)pxPublishInfo->pPayload, pxPublishInfo->payloadLength, &jobId);
 
-    if (jobIdLength > 0) {
-        size_t jobDocLength = Jobs_GetJobDocument((const char*)pxPublishInfo->pPayload, pxPublishInfo->payloadLength, (const char**)&jobDoc);
+    if (jobIdLength >= JOB_ID_LENGTH) {
+        ESP_LOGE(TAG, "Job id of %u characters is too long", jobIdLength);
+    } else if (jobIdLength > 0) {
+        size_t jobDocLength = Jobs_GetJobDocument((const char*)pxPublishInfo->pPayload, pxPublishInfo->payloadLength, &jobDoc);
 
         if (jobDocLength != 0U) {
-            strncpy(jobDocument.jobData, jobDoc, jobDocLength);
             strncpy(jobDocument.jobId, jobId, jobIdLength);
 
-            jobDocument.jobDataLength = jobDocLength;
-
-            ESP_LOGI(TAG, "JobDocument: %s\n", jobDocument.jobData);
+            ESP_LOGI(TAG, "JobDocument: %.*s\n", jobDocLength, jobDoc);
 
             if (prIsFreeRTOSOtaJob(jobDoc, jobDocLength)) {
-                prvSendOTAJobDocument(&jobDocument);
+                if (prvHoldJobDocument(&jobDocument, jobDoc, jobDocLength)) {
+                    prvSendOTAJobDocument(&jobDocument);
+                }
             } else if (prIsCertRenewalJob(jobDoc, jobDocLength)) {
-                prvSendRenewJobDocument(&jobDocument);
+                if (prvHoldJobDocument(&jobDocument, jobDoc, jobDocLength)) {
+                    prvSendRenewJobDocument(&jobDocument);
+                }
             } else {
                 ESP_LOGE(TAG, "JobDocument failed");
             }
@@ -355,34 +373,46 @@ static void prvIncomingPublishCallback(void* pvIncomingPublishCallbackContext, M
     }
 }
 
-/* Sends an OTA job document to the OTA task via a queue. */
-static void prvSendOTAJobDocument(JobEventData_t* jobDocument)
+/*
+ * Keeps the job document for the agent it is sent to. It is referenced in the
+ * buffer of the publish when the callback runs in a deferred dispatch worker,
+ * and copied out of the network buffer otherwise.
+ */
+static bool prvHoldJobDocument(JobEventData_t* jobDocument, const char* jobDoc, size_t jobDocLength)
 {
-    OtaEventMsg_t nextEvent = {0};
-    nextEvent.eventId       = OtaEventReceivedJobDocument;
+    const uint8_t* data = (const uint8_t*)jobDoc;
 
-    memcpy(jobBuffers, jobDocument, sizeof(JobEventData_t));
+    jobDocument->buffer = SharedBuffer_Hold(&data, jobDocLength);
 
-    jobBuffers->jobDataLength = jobDocument->jobDataLength;
+    if (jobDocument->buffer == NULL) {
+        ESP_LOGE(TAG, "No buffer to keep the document of job %s", jobDocument->jobId);
+        return false;
+    }
 
-    nextEvent.jobEvent = &jobBuffers[0];
+    jobDocument->jobData       = (const char*)data;
+    jobDocument->jobDataLength = jobDocLength;
 
-    SendEvent_FreeRTOS(xOtaEventQueue, (void*)&nextEvent, TAG);
+    return true;
 }
 
-/* Sends a certificate renewal job document to the certificate renewal task via a queue. */
-static void prvSendRenewJobDocument(JobEventData_t* jobDocument)
+/* Sends an OTA job document to the OTA task via a queue. */
+static void prvSendOTAJobDocument(const JobEventData_t* jobDocument)
 {
-    CertRenewEventMsg_t nextEvent = {0};
-    nextEvent.eventId         = CertRenewEventReceivedJobDocument;
-
-    memcpy(jobBuffers, jobDocument, sizeof(JobEventData_t));
+    OtaEventMsg_t nextEvent = {0};
+    nextEvent.eventId       = OtaEventReceivedJobDocument;
+    nextEvent.jobEvent      = *jobDocument;
 
-    jobBuffers->jobDataLength = jobDocument->jobDataLength;
+    EventBus_Send(xOtaEventQueue, &nextEvent);
+}
 
-    nextEvent.jobEvent = &jobBuffers[0];
+/* Sends a certificate renewal job document to the certificate renewal task via a queue. */
+static void prvSendRenewJobDocument(const JobEventData_t* jobDocument)
+{
+    CertRenewEventMsg_t nextEvent = {0};
+    nextEvent.eventId             = CertRenewEventReceivedJobDocument;
+    nextEvent.jobEvent            = *jobDocument;
 
-    SendEvent_FreeRTOS(xCertRenewEventQueue, (void*)&nextEvent, TAG);
+    EventBus_Send(xCertRenewEventQueue, &nextEvent);
 }
 
 /* FreeRTOS OTA updates have a top level "afr_ota" job document key.
@@ -409,20 +439,13 @@ static bool prIsFreeRTOSOtaJob(const char* jobDoc, size_t jobDocLength)
 /* Updates the execution status of a job on AWS IoT Jobs. */
 void SendUpdateForJob(JobCurrentStatus_t pcJobStatus, const char* pcJobStatusMsg)
 {
-    JobsStatus_t xStatus                 = JobsSuccess;
     JobsUpdateRequest_t jobUpdateRequest = {0};
-    char pUpdateJobTopic[JOBS_API_MAX_LENGTH(strlen(GetThingName()))];
-    size_t ulTopicLength = 0U;
-
-    xStatus = Jobs_Update(pUpdateJobTopic,
-                          sizeof(pUpdateJobTopic),
-                          GetThingName(),
-                          strlen(GetThingName()),
-                          GetJobId(),
-                          strlen(GetJobId()),
-                          &ulTopicLength);
-
-    if (xStatus == JobsSuccess) {
+
+    /* Interned by SetJobId(). */
+    const char* pUpdateJobTopic = TopicRegistry_Get(TopicIdJobUpdate);
+    uint16_t ulTopicLength      = TopicRegistry_Length(TopicIdJobUpdate);
+
+    if (ulTopicLength > 0U) {
         jobUpdateRequest.status = pcJobStatus;
 
         if (pcJobStatusMsg != NULL) {
@@ -432,14 +455,21 @@ void SendUpdateForJob(JobCurrentStatus_t pcJobStatus, const char* pcJobStatusMsg
         char messageBuffer[UPDATE_REQUEST_SIZE] = {0};
         size_t messageLength                    = Jobs_UpdateMsg(jobUpdateRequest, messageBuffer, JOB_UPDATE_SIZE);
 
-        if (messageLength > 0) {
+        /* The topic and message are copied, the job goes on while the update is sent. */
+        if ((messageLength > 0) && (PublishToTopicAsync(pUpdateJobTopic,
+                                                        ulTopicLength,
+                                                        messageBuffer,
+                                                        strlen(messageBuffer),
+                                                        MQTTQoS0,
+                                                        NULL,
+                                                        TAG) == PUBLISH_HANDLE_INVALID)) {
             PublishToTopic(pUpdateJobTopic,
-                           strlen(pUpdateJobTopic),
+                           ulTopicLength,
                            messageBuffer,
                            strlen(messageBuffer),
                            MQTTQoS0,
                            TAG);
-        } else {
+        } else if (messageLength == 0) {
             ESP_LOGE(TAG, "Failed to generate job Update Request");
         }
 
@@ -595,6 +625,7 @@ char* CreateStringCopy(const char* src, size_t srcLength)
 void SetJobId(const char* jobId)
 {
     strncpy(globalJobId, jobId, JOB_ID_LENGTH);
+    TopicRegistry_SetJob(globalJobId);
 }
 
 const char* GetJobId()
@@ -1,14 +1,14 @@
 #include "mqtt_connection.h"
 
 /* Includes helpers for managing MQTT subscriptions. */
+#include "mqtt_deferred_dispatch.h"
 #include "mqtt_subscription_manager.h"
+#include "mqtt_topic_registry.h"
+#include "queue_handler.h"
 
 /*Include backoff algorithm header for retry logic.*/
 #include "backoff_algorithm.h"
 
-#define TOPIC_FORMAT      "$aws/things/%s/jobs/%s/update%s"
-#define TOPIC_FORMAT_SIZE 150
-
 /* The maximum back-off delay (in milliseconds) for retrying connection to server. */
 #define CONNECTION_RETRY_MAX_BACKOFF_DELAY_MS 5000U
 
@@ -24,6 +24,28 @@
 
 /* The length of the queue used to hold commands for the agent. */
 #define MQTT_AGENT_COMMAND_QUEUE_LENGTH 25
+
+/* The length of the queue of large publishes, which wait behind the other commands. */
+#define MQTT_AGENT_BULK_QUEUE_LENGTH 5
+
+#if defined(CONFIG_MQTT_AGENT_BULK_PUBLISH_SIZE)
+    #define MQTT_AGENT_BULK_PUBLISH_SIZE CONFIG_MQTT_AGENT_BULK_PUBLISH_SIZE
+#else
+    #define MQTT_AGENT_BULK_PUBLISH_SIZE 2048U
+#endif
+
+#if defined(CONFIG_MQTT_AGENT_CONTROL_BURST)
+    #define MQTT_AGENT_CONTROL_BURST CONFIG_MQTT_AGENT_CONTROL_BURST
+#else
+    #define MQTT_AGENT_CONTROL_BURST 8U
+#endif
+
+#if defined(CONFIG_SUBSCRIPTION_MANAGER_FAN_OUT)
+    #define SUBSCRIPTION_MANAGER_FAN_OUT true
+#else
+    #define SUBSCRIPTION_MANAGER_FAN_OUT false
+#endif
+
 #define MILLISECONDS_PER_SECOND         1000U
 #define MILLISECONDS_PER_TICK           (MILLISECONDS_PER_SECOND / configTICK_RATE_HZ)
 #define MQTT_CONNECT_TIMEOUT            50000U
@@ -34,7 +56,7 @@
  */
 static uint8_t pucNetworkBuffer[MQTT_AGENT_NETWORK_BUFFER_SIZE];
 
-/* FreeRTOS blocking queue to be used as MQTT Agent context. */
+/* FreeRTOS blocking queues, one per lane, to be used as MQTT Agent context. */
 static MQTTAgentMessageContext_t xCommandQueue;
 
 /*
@@ -43,8 +65,8 @@ static MQTTAgentMessageContext_t xCommandQueue;
  */
 static MQTTAgentMessageInterface_t xMessageInterface = {0};
 
-/* The global array of subscription elements. */
-static SubscriptionElement_t globalSubscriptionList[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
+/* The global trie of subscriptions. */
+static SubscriptionManager_t globalSubscriptionManager;
 
 /* TLS Context Semaphore. */
 static StaticSemaphore_t xTlsContextSemaphoreBuffer;
@@ -106,18 +128,30 @@ MQTTStatus_t MQTTAgentInit(TransportInterface_t* pTransport)
 {
     MQTTStatus_t xReturn;
     MQTTFixedBuffer_t xFixedBuffer = {.pBuffer = pucNetworkBuffer, .size = MQTT_AGENT_NETWORK_BUFFER_SIZE};
-    static uint8_t ucStaticQueueStorageArea[MQTT_AGENT_COMMAND_QUEUE_LENGTH * sizeof(MQTTAgentCommand_t*)];
+    static uint8_t ucStaticQueueStorageArea[MQTT_AGENT_COMMAND_QUEUE_LENGTH * sizeof(AgentLaneMessage_t)];
+    static uint8_t ucStaticBulkQueueStorageArea[MQTT_AGENT_BULK_QUEUE_LENGTH * sizeof(AgentLaneMessage_t)];
     static StaticQueue_t xStaticQueueStructure;
+    static StaticQueue_t xStaticBulkQueueStructure;
 
     ESP_LOGI(TAG, "Creating command queue.\n");
-    xCommandQueue.queue = xQueueCreateStatic(MQTT_AGENT_COMMAND_QUEUE_LENGTH,
-                                             sizeof(MQTTAgentCommand_t*),
-                                             ucStaticQueueStorageArea,
-                                             &xStaticQueueStructure);
+    Agent_MessageInitLanes(&xCommandQueue,
+                           xQueueCreateStatic(MQTT_AGENT_COMMAND_QUEUE_LENGTH,
+                                              sizeof(AgentLaneMessage_t),
+                                              ucStaticQueueStorageArea,
+                                              &xStaticQueueStructure),
+                           xQueueCreateStatic(MQTT_AGENT_BULK_QUEUE_LENGTH,
+                                              sizeof(AgentLaneMessage_t),
+                                              ucStaticBulkQueueStorageArea,
+                                              &xStaticBulkQueueStructure),
+                           MQTT_AGENT_BULK_PUBLISH_SIZE,
+                           MQTT_AGENT_CONTROL_BURST);
 
     /* Initialize the agent task pool. */
     Agent_InitializePool();
 
+    /* A new agent starts without subscriptions. */
+    SubscriptionManager_Init(&globalSubscriptionManager, SUBSCRIPTION_MANAGER_FAN_OUT);
+
     xMessageInterface.pMsgCtx        = &xCommandQueue;
     xMessageInterface.recv           = Agent_MessageReceive;
     xMessageInterface.send           = Agent_MessageSend;
@@ -131,8 +165,8 @@ MQTTStatus_t MQTTAgentInit(TransportInterface_t* pTransport)
                              pTransport,
                              prvGetTimeMs,
                              prvIncomingPublishCallback,
-                             /* Context to pass into the callback. Passing the pointer to subscription array. */
-                             (void*)globalSubscriptionList);
+                             /* Context to pass into the callback. Passing the pointer to subscription trie. */
+                             (void*)&globalSubscriptionManager);
 
     assert(&globalMqttAgentContext != NULL);
     assert(&globalMqttAgentContext.mqttContext.getTime != NULL);
@@ -258,6 +292,10 @@ void HandleMQTTDisconnect(NetworkContext_t* pNetworkContext, MQTTContext_t * pCo
     TlsTransportStatus_t xTLSStatus;
 
     ESP_LOGI(TAG, "Disconnecting from AWS");
+    LogCommandQueueStats();
+    DeferredDispatch_LogStats();
+    SharedBuffer_LogStats();
+    EventBus_LogStats();
 
     xMQTTStatus = MQTT_Disconnect(pContext);
     assert(xMQTTStatus == MQTTSuccess);
@@ -266,6 +304,36 @@ void HandleMQTTDisconnect(NetworkContext_t* pNetworkContext, MQTTContext_t * pCo
     assert(xTLSStatus == TLS_TRANSPORT_SUCCESS);    
 }
 
+/* Logs the time commands waited in each lane of the agent queue, as a histogram. */
+void LogCommandQueueStats(void)
+{
+    static const char* pLaneNames[AgentMessageLaneMax] = {"Control", "Bulk"};
+
+    for (uint32_t lane = 0; lane < AgentMessageLaneMax; lane++) {
+        AgentLaneStats_t stats;
+        char histogram[AGENT_MESSAGE_HISTOGRAM_BUCKETS * 16] = {0};
+        size_t length = 0;
+
+        Agent_MessageGetLaneStats(&xCommandQueue, (AgentMessageLane_t)lane, &stats);
+
+        for (uint32_t i = 0; i < AGENT_MESSAGE_HISTOGRAM_BUCKETS; i++) {
+            uint32_t boundMs = Agent_MessageHistogramBoundMs(i);
+
+            length += snprintf(histogram + length, sizeof(histogram) - length,
+                               (boundMs == UINT32_MAX) ? " >=%lu:%lu" : " <%lu:%lu",
+                               (boundMs == UINT32_MAX) ? Agent_MessageHistogramBoundMs(i - 1U) : boundMs,
+                               stats.histogram[i]);
+        }
+
+        ESP_LOGI(TAG, "%s lane: %lu commands, wait %lu us mean, %lu us max, ms histogram%s",
+                 pLaneNames[lane],
+                 stats.messages,
+                 (stats.messages > 0) ? (uint32_t)(stats.totalWaitUs / stats.messages) : 0U,
+                 stats.maxWaitUs,
+                 histogram);
+    }
+}
+
 bool ReconnectWithNewCertificate(NetworkContext_t* pNetworkContext)
 {
     ESP_LOGI(TAG, "Establishing MQTT session with new certificate...to %s:%d", AWSConnectSettings.endpoint, AWS_SECURE_MQTT_PORT);
@@ -341,19 +409,18 @@ static void prvIncomingPublishCallback(MQTTAgentContext_t* pxMqttAgentContext,
                                        uint16_t usPacketId,
                                        MQTTPublishInfo_t* pxPublishInfo)
 {
-    bool xPublishHandled   = false;
-    char topicRecived[150] = {0};
-
-    strncpy(topicRecived, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+    bool xPublishHandled = false;
 
     /* Fan out the incoming publishes to the callbacks registered using subscription manager. */
 
-    ESP_LOGI(TAG, "In the incoming publish callback by the topic: %s", topicRecived);
+    ESP_LOGI(TAG, "In the incoming publish callback by the topic: %.*s", pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName);
 
-    assert((SubscriptionElement_t*)pxMqttAgentContext->pIncomingCallbackContext != NULL);
+    assert((SubscriptionManager_t*)pxMqttAgentContext->pIncomingCallbackContext != NULL);
 
-    xPublishHandled = SubscriptionManager_HandleIncomingPublishes((SubscriptionElement_t*)pxMqttAgentContext->pIncomingCallbackContext,
+    DeferredDispatch_BeginPublish();
+    xPublishHandled = SubscriptionManager_HandleIncomingPublishes((SubscriptionManager_t*)pxMqttAgentContext->pIncomingCallbackContext,
                                                                   pxPublishInfo);
+    DeferredDispatch_EndPublish();
 
     /* If there are no callbacks to handle the incoming publishes, handle it as an unsolicited publish. */
     if (xPublishHandled != true) {
@@ -404,21 +471,10 @@ static void prvTestConnections(void)
 /* Checks if the given topic corresponds to an AWS IoT job update topic. */
 static bool isUpdateJobs(const char* pTopicName, size_t topicNameLength)
 {
-    char topicAccepted[TOPIC_FORMAT_SIZE] = {0};
-    char topicRejected[TOPIC_FORMAT_SIZE] = {0};
-
-    snprintf(topicAccepted, sizeof(topicAccepted), TOPIC_FORMAT, GetThingName(), GetJobId(), JOBS_API_SUCCESS);
-    snprintf(topicRejected, sizeof(topicRejected), TOPIC_FORMAT, GetThingName(), GetJobId(), JOBS_API_FAILURE);
-
-    /*
-    ESP_LOGI(TAG, "Topico accepted %s", topicAccepted);
-    ESP_LOGI(TAG, "Topico rejected %s", topicRejected);
-    */
-    if (!strncmp(pTopicName, topicAccepted, topicNameLength)) {
-        ESP_LOGI(TAG, "The topic corresponds to a job update %s\n", topicAccepted);
-        return true;
-    } else if (!strncmp(pTopicName, topicRejected, topicNameLength)) {
-        ESP_LOGI(TAG, "The topic corresponds to a job update %s\n", topicRejected);
+    TopicId_t id = TopicRegistry_Classify(pTopicName, (uint16_t)topicNameLength);
+
+    if ((id == TopicIdJobUpdateAccepted) || (id == TopicIdJobUpdateRejected)) {
+        ESP_LOGI(TAG, "The topic corresponds to a job update %s\n", TopicRegistry_Get(id));
         return true;
     }
     return false;
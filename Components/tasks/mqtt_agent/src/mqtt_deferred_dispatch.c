@@ -0,0 +1,336 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "mqtt_deferred_dispatch.h"
+#include "shared_buffer.h"
+
+#if defined(CONFIG_MQTT_DEFERRED_DISPATCH)
+    #define DEFERRED_DISPATCH_ENABLED true
+#else
+    #define DEFERRED_DISPATCH_ENABLED false
+#endif
+
+#if defined(CONFIG_MQTT_DEFERRED_WORKERS)
+    #define DEFERRED_WORKERS CONFIG_MQTT_DEFERRED_WORKERS
+#else
+    #define DEFERRED_WORKERS 1U
+#endif
+
+#if defined(CONFIG_MQTT_DEFERRED_WORKER_STACK_SIZE)
+    #define WORKER_TASK_STACK_SIZE CONFIG_MQTT_DEFERRED_WORKER_STACK_SIZE
+#else
+    #define WORKER_TASK_STACK_SIZE 4096U
+#endif
+
+#define WORKER_TASK_NAME      "mqtt_deferred"
+#define DEFERRED_QUEUE_LENGTH 8U
+
+/* Longest wait of the agent task for room in a worker queue before dropping the publish */
+#define DEFERRED_SEND_WAIT_MS 20U
+
+/* Handlers slower than this are logged as they run. */
+#define SLOW_HANDLER_US 100000U
+
+static const char* TAG = "MQTT_DEFERRED";
+
+typedef struct DeferredHandler {
+    IncomingPubCallback_t callback;
+    const char* name;
+    QueueHandle_t queue; /* Of its worker */
+    bool deferred;       /* Runs in the agent task otherwise */
+    uint32_t pending;    /* Publishes queued or running in the worker */
+    DeferredHandlerStats_t stats;
+} DeferredHandler_t;
+
+/* Posted to a worker queue, with a reference to the copy of the publish. */
+typedef struct DeferredPublish {
+    DeferredHandler_t* pHandler;
+    SharedBuffer_t* pBuffer;
+    MQTTPublishInfo_t publishInfo; /* Pointing into the buffer */
+    int64_t queuedUs;
+} DeferredPublish_t;
+
+static StaticSemaphore_t xMutexBuffer;
+static SemaphoreHandle_t xMutex = NULL;
+
+static bool enabled = false;
+static DeferredHandler_t handlers[DEFERRED_DISPATCH_MAX_HANDLERS];
+static uint32_t handlerCount = 0;
+static QueueHandle_t workerQueues[DEFERRED_WORKERS];
+
+/*
+ * Copy of the publish being dispatched, only used from the MQTT agent task.
+ * Its topic and payload are in a shared buffer, followed by the callbacks
+ * that keep part of it for their agent.
+ */
+static SharedBuffer_t* pCurrent = NULL;
+static MQTTPublishInfo_t currentInfo;
+static bool currentNotCopied = false;
+
+static uint32_t notCopied = 0;
+static uint32_t queueFull = 0;
+
+static void prvDeferredIncomingPublish(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo);
+static SharedBuffer_t* prvCopyPublish(const MQTTPublishInfo_t* pxPublishInfo);
+static void prvRun(DeferredHandler_t* pHandler, MQTTPublishInfo_t* pxPublishInfo, int64_t queuedUs, bool inlineCall);
+static uint32_t prvAddPending(DeferredHandler_t* pHandler, int32_t change);
+static void prvWorkerTask(void* pvParameters);
+
+void DeferredDispatch_Init(void)
+{
+    xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+
+    if (!DEFERRED_DISPATCH_ENABLED) {
+        ESP_LOGI(TAG, "Publishes are handled in the MQTT agent task");
+        return;
+    }
+
+    for (uint32_t i = 0; i < DEFERRED_WORKERS; i++) {
+        workerQueues[i] = xQueueCreate(DEFERRED_QUEUE_LENGTH, sizeof(DeferredPublish_t));
+
+        /* Same priority as the agent, so a handler does not wait behind the socket. */
+        if ((workerQueues[i] == NULL) ||
+            (xTaskCreate(prvWorkerTask, WORKER_TASK_NAME, WORKER_TASK_STACK_SIZE, workerQueues[i],
+                         uxTaskPriorityGet(NULL), NULL) != pdPASS)) {
+            ESP_LOGE(TAG, "Failed to start the workers, publishes are handled in the MQTT agent task");
+            return;
+        }
+    }
+
+    enabled = true;
+    ESP_LOGI(TAG, "%u workers, publishes kept in the shared buffers", DEFERRED_WORKERS);
+}
+
+void DeferredDispatch_Wrap(IncomingPubCallback_t callback,
+                           const char* name,
+                           bool deferred,
+                           IncomingPubCallback_t* pCallback,
+                           void** ppContext)
+{
+    DeferredHandler_t* pHandler = NULL;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    for (uint32_t i = 0; i < handlerCount; i++) {
+        if (handlers[i].callback == callback) {
+            pHandler = &handlers[i];
+            break;
+        }
+    }
+
+    if ((pHandler == NULL) && (handlerCount < DEFERRED_DISPATCH_MAX_HANDLERS)) {
+        pHandler = &handlers[handlerCount];
+        memset(pHandler, 0x00, sizeof(DeferredHandler_t));
+
+        pHandler->callback = callback;
+        pHandler->name     = name;
+        pHandler->deferred = deferred;
+        pHandler->queue    = workerQueues[handlerCount % DEFERRED_WORKERS];
+        handlerCount++;
+    }
+
+    xSemaphoreGive(xMutex);
+
+    if (pHandler != NULL) {
+        *pCallback = prvDeferredIncomingPublish;
+        *ppContext = pHandler;
+    } else {
+        ESP_LOGW(TAG, "Every handler is taken, %s publishes are handled in the MQTT agent task", name);
+        *pCallback = callback;
+        *ppContext = NULL;
+    }
+}
+
+void DeferredDispatch_BeginPublish(void)
+{
+    pCurrent         = NULL;
+    currentNotCopied = false;
+}
+
+void DeferredDispatch_EndPublish(void)
+{
+    /* Drops the reference of the dispatch, the workers hold theirs. */
+    SharedBuffer_Release(pCurrent);
+    pCurrent = NULL;
+}
+
+bool DeferredDispatch_GetStats(IncomingPubCallback_t callback, DeferredHandlerStats_t* pStats)
+{
+    bool found = false;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    for (uint32_t i = 0; i < handlerCount; i++) {
+        if (handlers[i].callback == callback) {
+            *pStats = handlers[i].stats;
+            found   = true;
+            break;
+        }
+    }
+
+    xSemaphoreGive(xMutex);
+
+    return found;
+}
+
+void DeferredDispatch_LogStats(void)
+{
+    ESP_LOGI(TAG, "%lu publishes not copied, too large or without a free buffer, %lu with the worker queue full",
+             notCopied, queueFull);
+
+    for (uint32_t i = 0; i < handlerCount; i++) {
+        DeferredHandlerStats_t stats;
+
+        xSemaphoreTake(xMutex, portMAX_DELAY);
+        stats = handlers[i].stats;
+        xSemaphoreGive(xMutex);
+
+        ESP_LOGI(TAG, "%s: %lu publishes (%lu in the agent task), %lu dropped, %lu us mean, %lu us max, waited %lu us max",
+                 handlers[i].name,
+                 stats.calls,
+                 stats.inlineCalls,
+                 stats.dropped,
+                 (stats.calls > 0U) ? (uint32_t)(stats.totalUs / stats.calls) : 0U,
+                 stats.maxUs,
+                 stats.maxQueuedUs);
+    }
+}
+
+/* Registered in the subscription manager, runs in the MQTT agent task. */
+static void prvDeferredIncomingPublish(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
+{
+    DeferredHandler_t* pHandler = (DeferredHandler_t*)pvIncomingPublishCallbackContext;
+    SharedBuffer_t* pBuffer     = (enabled && pHandler->deferred) ? prvCopyPublish(pxPublishInfo) : NULL;
+
+    if (pBuffer != NULL) {
+        DeferredPublish_t publish = {
+            .pHandler    = pHandler,
+            .pBuffer     = pBuffer,
+            .publishInfo = currentInfo,
+            .queuedUs    = esp_timer_get_time(),
+        };
+
+        /* The worker's, moved through its queue. */
+        SharedBuffer_Retain(pBuffer);
+        prvAddPending(pHandler, 1);
+
+        if (xQueueSend(pHandler->queue, &publish, pdMS_TO_TICKS(DEFERRED_SEND_WAIT_MS)) == pdPASS) {
+            return;
+        }
+
+        queueFull++;
+        prvAddPending(pHandler, -1);
+        SharedBuffer_Release(pBuffer);
+    }
+
+    /* Running it here while the worker runs the same callback would break the order of its publishes. */
+    if (prvAddPending(pHandler, 0) == 0U) {
+        prvRun(pHandler, pxPublishInfo, 0, true);
+        return;
+    }
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    pHandler->stats.dropped++;
+    xSemaphoreGive(xMutex);
+
+    ESP_LOGW(TAG, "%s busy, publish on %.*s dropped", pHandler->name,
+             pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName);
+}
+
+/* Copies the publish being dispatched once, for every callback it matches. */
+static SharedBuffer_t* prvCopyPublish(const MQTTPublishInfo_t* pxPublishInfo)
+{
+    SharedBuffer_t* pBuffer;
+
+    if ((pCurrent != NULL) || currentNotCopied) {
+        return pCurrent;
+    }
+
+    /* The dispatch's reference, dropped by DeferredDispatch_EndPublish(). */
+    pBuffer = SharedBuffer_Alloc((size_t)pxPublishInfo->topicNameLength + pxPublishInfo->payloadLength);
+
+    if (pBuffer == NULL) {
+        notCopied++;
+        currentNotCopied = true;
+        return NULL;
+    }
+
+    memcpy(pBuffer->data, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+    memcpy(&pBuffer->data[pxPublishInfo->topicNameLength], pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
+
+    currentInfo            = *pxPublishInfo;
+    currentInfo.pTopicName = (const char*)pBuffer->data;
+    currentInfo.pPayload   = &pBuffer->data[pxPublishInfo->topicNameLength];
+
+    pCurrent = pBuffer;
+
+    return pBuffer;
+}
+
+static void prvRun(DeferredHandler_t* pHandler, MQTTPublishInfo_t* pxPublishInfo, int64_t queuedUs, bool inlineCall)
+{
+    int64_t startUs = esp_timer_get_time();
+    uint32_t elapsedUs;
+
+    pHandler->callback(NULL, pxPublishInfo);
+
+    elapsedUs = (uint32_t)(esp_timer_get_time() - startUs);
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    pHandler->stats.calls++;
+    pHandler->stats.totalUs += elapsedUs;
+
+    if (inlineCall) {
+        pHandler->stats.inlineCalls++;
+    }
+    if (elapsedUs > pHandler->stats.maxUs) {
+        pHandler->stats.maxUs = elapsedUs;
+    }
+    if ((uint32_t)queuedUs > pHandler->stats.maxQueuedUs) {
+        pHandler->stats.maxQueuedUs = (uint32_t)queuedUs;
+    }
+
+    xSemaphoreGive(xMutex);
+
+    if (elapsedUs > SLOW_HANDLER_US) {
+        ESP_LOGW(TAG, "%s took %lu ms on %.*s", pHandler->name, elapsedUs / 1000U,
+                 pxPublishInfo->topicNameLength, pxPublishInfo->pTopicName);
+    }
+}
+
+/* Changes the publishes a handler has in its worker, returns how many are left. */
+static uint32_t prvAddPending(DeferredHandler_t* pHandler, int32_t change)
+{
+    uint32_t pending;
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+    pHandler->pending = (uint32_t)((int32_t)pHandler->pending + change);
+    pending           = pHandler->pending;
+    xSemaphoreGive(xMutex);
+
+    return pending;
+}
+
+static void prvWorkerTask(void* pvParameters)
+{
+    QueueHandle_t queue = (QueueHandle_t)pvParameters;
+    DeferredPublish_t publish;
+
+    while (true) {
+        if (xQueueReceive(queue, &publish, portMAX_DELAY) == pdPASS) {
+            prvRun(publish.pHandler, &publish.publishInfo, esp_timer_get_time() - publish.queuedUs, false);
+            SharedBuffer_Release(publish.pBuffer);
+            prvAddPending(publish.pHandler, -1);
+        }
+    }
+}
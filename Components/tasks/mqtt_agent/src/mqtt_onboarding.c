@@ -9,7 +9,6 @@
 #include "mqtt_subscription_manager.h"
 
 extern MQTTAgentContext_t globalMqttAgentContext;
-extern SubscriptionElement_t globalSubscriptionList;
 extern AWSConnectSettings_t AWSConnectSettings;
 
 CertificateOnBoarding_t CertificateOnBoarding = {0};
@@ -96,7 +95,7 @@ MQTTStatus_t SubscribeOnBoardingTopic()
         subscriptionList[i].pTopicFilter      = topic_filters[i];
         subscriptionList[i].topicFilterLength = strlen(topic_filters[i]);
 
-        bool xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext,
+        bool xSubscriptionAdded = SubscriptionManager_AddSubscription((SubscriptionManager_t*)globalMqttAgentContext.pIncomingCallbackContext,
                                                                       topic_filters[i],
                                                                       strlen(topic_filters[i]),
                                                                       &prvIncomingProvisioningPublishCallback,
@@ -150,7 +149,7 @@ void UnSubscribeOnBoardingTopic()
         unsubscribeList[i].pTopicFilter      = topic_filters[i];
         unsubscribeList[i].topicFilterLength = strlen(topic_filters[i]);
 
-        SubscriptionManager_RemoveSubscription((SubscriptionElement_t*)globalMqttAgentContext.pIncomingCallbackContext,
+        SubscriptionManager_RemoveSubscription((SubscriptionManager_t*)globalMqttAgentContext.pIncomingCallbackContext,
                                                topic_filters[i],
                                                strlen(topic_filters[i]));
 
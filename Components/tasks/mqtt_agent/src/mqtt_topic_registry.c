@@ -0,0 +1,149 @@
+/* Standard C Library Headers */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "jobs.h"
+
+#include "mqtt_topic_registry.h"
+
+#define JOBS_NOTIFY_NEXT_TOPIC "$aws/things/%s/jobs/notify-next"
+#define JOB_UPDATE_TOPIC       "$aws/things/%s/jobs/%s/update%s"
+
+#define CREATE_FROM_CSR_TOPIC "things/%s/certificate/create-from-csr/json%s"
+#define CERT_REVOKE_TOPIC     "things/%s/certificate/revoke/json%s"
+
+#define STREAM_DATA_TOPIC     "$aws/things/%s/streams/%s/data/%s"
+#define STREAM_REJECTED_TOPIC "$aws/things/%s/streams/%s/rejected/%s"
+
+/* FNV-1a, 32 bits */
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME        16777619U
+
+static const char* TAG = "MQTT_TOPICS";
+
+typedef struct InternedTopic {
+    uint16_t length;
+    uint32_t hash;
+    char topic[TOPIC_REGISTRY_TOPIC_SIZE];
+} InternedTopic_t;
+
+static StaticSemaphore_t xMutexBuffer;
+static SemaphoreHandle_t xMutex = NULL;
+
+static InternedTopic_t topics[TopicIdMax];
+static char thing[TOPIC_REGISTRY_TOPIC_SIZE];
+
+static void prvIntern(TopicId_t id, const char* format, ...);
+static uint32_t prvHash(const char* pTopic, uint16_t topicLength);
+
+void TopicRegistry_Init(const char* thingName)
+{
+    if (xMutex == NULL) {
+        xMutex = xSemaphoreCreateMutexStatic(&xMutexBuffer);
+    }
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    memset(topics, 0x00, sizeof(topics));
+    strncpy(thing, thingName, sizeof(thing) - 1U);
+
+    prvIntern(TopicIdJobsNotifyNext, JOBS_NOTIFY_NEXT_TOPIC, thing);
+    prvIntern(TopicIdCreateFromCsr, CREATE_FROM_CSR_TOPIC, thing, "");
+    prvIntern(TopicIdCreateFromCsrAccepted, CREATE_FROM_CSR_TOPIC, thing, JOBS_API_SUCCESS);
+    prvIntern(TopicIdCreateFromCsrRejected, CREATE_FROM_CSR_TOPIC, thing, JOBS_API_FAILURE);
+    prvIntern(TopicIdCertRevoke, CERT_REVOKE_TOPIC, thing, "");
+    prvIntern(TopicIdCertRevokeAccepted, CERT_REVOKE_TOPIC, thing, JOBS_API_SUCCESS);
+    prvIntern(TopicIdCertRevokeRejected, CERT_REVOKE_TOPIC, thing, JOBS_API_FAILURE);
+
+    xSemaphoreGive(xMutex);
+
+    ESP_LOGI(TAG, "Topics of %s interned", thing);
+}
+
+void TopicRegistry_SetJob(const char* jobId)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    prvIntern(TopicIdJobUpdate, JOB_UPDATE_TOPIC, thing, jobId, "");
+    prvIntern(TopicIdJobUpdateAccepted, JOB_UPDATE_TOPIC, thing, jobId, JOBS_API_SUCCESS);
+    prvIntern(TopicIdJobUpdateRejected, JOB_UPDATE_TOPIC, thing, jobId, JOBS_API_FAILURE);
+
+    xSemaphoreGive(xMutex);
+}
+
+void TopicRegistry_SetStream(const char* streamName, const char* dataType)
+{
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    prvIntern(TopicIdStreamData, STREAM_DATA_TOPIC, thing, streamName, dataType);
+    prvIntern(TopicIdStreamRejected, STREAM_REJECTED_TOPIC, thing, streamName, dataType);
+
+    xSemaphoreGive(xMutex);
+}
+
+const char* TopicRegistry_Get(TopicId_t id)
+{
+    return topics[id].topic;
+}
+
+uint16_t TopicRegistry_Length(TopicId_t id)
+{
+    return topics[id].length;
+}
+
+TopicId_t TopicRegistry_Classify(const char* pTopic, uint16_t topicLength)
+{
+    TopicId_t found = TopicIdUnknown;
+    uint32_t hash   = prvHash(pTopic, topicLength);
+
+    xSemaphoreTake(xMutex, portMAX_DELAY);
+
+    for (uint32_t id = TopicIdUnknown + 1; id < TopicIdMax; id++) {
+        if ((topics[id].hash == hash) && (topics[id].length == topicLength) && (memcmp(topics[id].topic, pTopic, topicLength) == 0)) {
+            found = (TopicId_t)id;
+            break;
+        }
+    }
+
+    xSemaphoreGive(xMutex);
+
+    return found;
+}
+
+/* Formats a topic into its slot, a topic too long for it is left empty. */
+static void prvIntern(TopicId_t id, const char* format, ...)
+{
+    InternedTopic_t* pEntry = &topics[id];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(pEntry->topic, sizeof(pEntry->topic), format, args);
+    va_end(args);
+
+    if ((length < 0) || ((size_t)length >= sizeof(pEntry->topic))) {
+        ESP_LOGE(TAG, "Topic %d does not fit in %u bytes", id, TOPIC_REGISTRY_TOPIC_SIZE);
+        memset(pEntry, 0x00, sizeof(InternedTopic_t));
+        return;
+    }
+
+    pEntry->length = (uint16_t)length;
+    pEntry->hash   = prvHash(pEntry->topic, pEntry->length);
+}
+
+static uint32_t prvHash(const char* pTopic, uint16_t topicLength)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for (uint16_t i = 0; i < topicLength; i++) {
+        hash = (hash ^ (uint8_t)pTopic[i]) * FNV_PRIME;
+    }
+    return hash;
+}
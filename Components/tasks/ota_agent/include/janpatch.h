@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef JANPATCH_DEBUG
 #define JANPATCH_DEBUG(...)  while (0) {} // printf(__VA_ARGS__)
@@ -30,7 +31,7 @@ typedef struct {
     long int         position;
 } janpatch_buffer;
 
-typedef struct {
+typedef struct janpatch_ctx {
     // fread/fwrite buffers
     janpatch_buffer source_buffer;
     janpatch_buffer patch_buffer;
@@ -45,8 +46,11 @@ typedef struct {
     // progress callback
     void   (*progress)(uint8_t);
 
-    // the combination of the size of both the source + patch files (that's the max. the target file can be)
+    // size of the patch file, progress is the share of it already read
     long   max_file_size;
+
+    // called before every operation, where the positions of the three streams are consistent (optional)
+    void   (*checkpoint)(struct janpatch_ctx*);
 } janpatch_ctx;
 
 enum {
@@ -103,11 +107,12 @@ static int jp_fseek(janpatch_buffer *buffer, long int offset, int origin) {
 
 
 /**
- * Get a character from the stream
+ * Load the page holding the current position for reading. Returns the number of bytes
+ * that can be read from that page at the current position, 0 at the end of the stream.
  */
-static int jp_getc(janpatch_ctx* ctx, janpatch_buffer* buffer) {
+static size_t jp_read_run(janpatch_ctx* ctx, janpatch_buffer* buffer, const unsigned char** data) {
     long position = buffer->position;
-    if (position < 0) return -1;
+    if (position < 0) return 0;
 
     // calculate the current page...
     uint32_t page = ((unsigned long)position) / buffer->size;
@@ -116,26 +121,27 @@ static int jp_getc(janpatch_ctx* ctx, janpatch_buffer* buffer) {
         jp_fseek(buffer, page * buffer->size, SEEK_SET);
         buffer->current_page_size = jp_fread(ctx, buffer->buffer, 1, buffer->size, buffer);
         buffer->current_page = page;
+        jp_fseek(buffer, position, SEEK_SET);
     }
 
-    int position_in_page = position % buffer->size;
+    size_t position_in_page = position % buffer->size;
 
-    if ((size_t)position_in_page >= buffer->current_page_size) {
-        return EOF;
+    if (position_in_page >= buffer->current_page_size) {
+        return 0;
     }
 
-    unsigned char b = buffer->buffer[position_in_page];
-    jp_fseek(buffer, position + 1, SEEK_SET);
-    return b;
+    *data = buffer->buffer + position_in_page;
+    return buffer->current_page_size - position_in_page;
 }
 
 /**
- * Write a character to a stream
+ * Make the page holding the current position writable, writing out the previous page.
+ * Returns the number of bytes that fit in that page from the current position.
  */
-static int jp_putc(int c, janpatch_ctx* ctx, janpatch_buffer* buffer) {
+static size_t jp_write_run(janpatch_ctx* ctx, janpatch_buffer* buffer, unsigned char** data) {
     long position = buffer->position;
     if (position < 0) {
-        return -1;
+        return 0;
     }
 
     // calculate the current page...
@@ -148,25 +154,98 @@ static int jp_putc(int c, janpatch_ctx* ctx, janpatch_buffer* buffer) {
             jp_fwrite(ctx, buffer->buffer, 1, buffer->current_page_size, buffer);
 
             if (ctx->progress) {
-                ctx->progress(position * 100 / ctx->max_file_size);
+                ctx->progress(ctx->patch_buffer.position * 100 / ctx->max_file_size);
             }
         }
 
-        // and read the next page...
-        jp_fseek(buffer, page * buffer->size, SEEK_SET);
-        //jp_fread(ctx, buffer->buffer, 1, buffer->size, buffer);
+        // the target is only written, the new page is not read
         buffer->current_page_size = buffer->size;
         buffer->current_page = page;
+        jp_fseek(buffer, position, SEEK_SET);
     }
 
-    int position_in_page = position % buffer->size;
+    size_t position_in_page = position % buffer->size;
+
+    *data = buffer->buffer + position_in_page;
+    return buffer->size - position_in_page;
+}
+
+/**
+ * Get a character from the stream
+ */
+static int jp_getc(janpatch_ctx* ctx, janpatch_buffer* buffer) {
+    const unsigned char* data;
+
+    if (jp_read_run(ctx, buffer, &data) == 0) {
+        return EOF;
+    }
+
+    jp_fseek(buffer, 1, SEEK_CUR);
+    return *data;
+}
+
+/**
+ * Write a character to a stream
+ */
+static int jp_putc(int c, janpatch_ctx* ctx, janpatch_buffer* buffer) {
+    unsigned char* data;
+
+    if (jp_write_run(ctx, buffer, &data) == 0) {
+        return -1;
+    }
 
-    buffer->buffer[position_in_page] = (unsigned char)c;
-    jp_fseek(buffer, position + 1, SEEK_SET);
+    *data = (unsigned char)c;
+    jp_fseek(buffer, 1, SEEK_CUR);
 
     return 0;
 }
 
+/**
+ * Write a span of bytes to a stream, a page at a time
+ */
+static void jp_write_bytes(janpatch_ctx* ctx, janpatch_buffer* buffer, const unsigned char* data, size_t length) {
+    while (length > 0) {
+        unsigned char* out;
+        size_t n = jp_write_run(ctx, buffer, &out);
+        if (n == 0) {
+            return;
+        }
+        if (n > length) {
+            n = length;
+        }
+
+        memcpy(out, data, n);
+        jp_fseek(buffer, n, SEEK_CUR);
+        data += n;
+        length -= n;
+    }
+}
+
+/**
+ * Copy length bytes from the source to the target stream, a page at a time
+ */
+static void jp_copy(janpatch_ctx* ctx, janpatch_buffer* source, janpatch_buffer* target, size_t length) {
+    while (length > 0) {
+        const unsigned char* in;
+        size_t n = jp_read_run(ctx, source, &in);
+
+        if (n == 0) {
+            // past the end of the source, the byte by byte copy wrote EOF (0xff) without moving the source
+            jp_putc(EOF, ctx, target);
+            length--;
+            continue;
+        }
+        if (n > length) {
+            n = length;
+        }
+
+        // the source page is not touched by writing the target
+        jp_fseek(source, n, SEEK_CUR);
+        jp_write_bytes(ctx, target, in, n);
+        length -= n;
+    }
+}
+
 static void jp_final_flush(janpatch_ctx* ctx, janpatch_buffer* buffer) {
     long position = buffer->position;
     int position_in_page = position % buffer->size;
@@ -192,12 +271,60 @@ static void jp_final_flush(janpatch_ctx* ctx, janpatch_buffer* buffer) {
     }
 }
 
+/**
+ * Write the buffered part of the target page, e.g. before checkpointing the positions.
+ * The page stays in the buffer and is written again in full once it is complete,
+ * so the target stream has to accept the same bytes being written twice.
+ */
+static void jp_flush_target(janpatch_ctx* ctx) {
+    janpatch_buffer* buffer = &ctx->target_buffer;
+    long position = buffer->position;
+
+    if (buffer->current_page == 0xFFFFFFFF || position < 0) {
+        return;
+    }
+
+    uint32_t page = ((unsigned long)position) / buffer->size;
+
+    if (page != buffer->current_page) {
+        // the last jp_putc just filled the page, write all of it
+        jp_fseek(buffer, buffer->current_page * buffer->size, SEEK_SET);
+        jp_fwrite(ctx, buffer->buffer, 1, buffer->current_page_size, buffer);
+    }
+    else {
+        jp_fseek(buffer, page * buffer->size, SEEK_SET);
+        jp_fwrite(ctx, buffer->buffer, 1, position % buffer->size, buffer);
+    }
+
+    jp_fseek(buffer, position, SEEK_SET);
+}
+
 static void process_mod(janpatch_ctx *ctx, janpatch_buffer *source, janpatch_buffer *patch, janpatch_buffer *target, bool up_source_stream) {
     // it can be that ESC character is actually in the data, but then it's prefixed with another ESC
     // so... we're looking for a lone ESC character
     size_t cnt = 0;
     while (1) {
         cnt++;
+
+#ifndef JANPATCH_BYTE_COPY
+        // copy the bytes before the next ESC in the patch page in one go
+        const unsigned char* in;
+        size_t available = jp_read_run(ctx, patch, &in);
+        if (available > 0) {
+            const unsigned char* esc = (const unsigned char*)memchr(in, JANPATCH_OPERATION_ESC, available);
+            size_t literal = (esc != NULL) ? (size_t)(esc - in) : available;
+
+            if (literal > 0) {
+                jp_fseek(patch, literal, SEEK_CUR);
+                jp_write_bytes(ctx, target, in, literal);
+                if (up_source_stream) {
+                    jp_fseek(source, literal, SEEK_CUR); // and up source
+                }
+                continue;
+            }
+        }
+#endif
+
         int m = jp_getc(ctx, patch);
         if (m == -1) {
             // End of file stream... rewind 1 character and return, this will yield back to janpatch main function, which will exit
@@ -285,33 +412,32 @@ int janpatch(janpatch_ctx ctx, JANPATCH_STREAM *source, JANPATCH_STREAM *patch,
     ctx.patch_buffer.current_page = 0xffffffff;
     ctx.target_buffer.current_page = 0xffffffff;
 
-    ctx.source_buffer.position = 0;
-    ctx.patch_buffer.position = 0;
-    ctx.target_buffer.position = 0;
+    // the positions are the ones given by the caller: 0, or those of a checkpoint to resume from
 
     ctx.source_buffer.stream = source;
     ctx.patch_buffer.stream = patch;
     ctx.target_buffer.stream = target;
     
-    // look at the size of the source file...
+    // look at the size of the patch file, the size of the target is not known before the end
     if (ctx.progress != NULL && ctx.ftell != NULL) {
-        ctx.fseek(source, 0, SEEK_END);
-        ctx.max_file_size = ctx.ftell(source);
-        JANPATCH_DEBUG("Source file size is %ld\n", ctx.max_file_size);
-        ctx.fseek(source, 0, SEEK_SET);
-
-        // and at the size of the patch file
         ctx.fseek(patch, 0, SEEK_END);
-        ctx.max_file_size += ctx.ftell(patch);
-        JANPATCH_DEBUG("Now max file size is %ld\n", ctx.max_file_size);
+        ctx.max_file_size = ctx.ftell(patch);
+        JANPATCH_DEBUG("Patch file size is %ld\n", ctx.max_file_size);
         ctx.fseek(patch, 0, SEEK_SET);
     }
-    else {
+    if (ctx.max_file_size <= 0) {
         ctx.progress = NULL;
     }
 
     int c;
-    while ((c = jp_getc(&ctx, &ctx.patch_buffer)) != EOF) {
+    while (1) {
+        if (ctx.checkpoint != NULL) {
+            ctx.checkpoint(&ctx);
+        }
+        if ((c = jp_getc(&ctx, &ctx.patch_buffer)) == EOF) {
+            break;
+        }
+
         if (c == JANPATCH_OPERATION_ESC) {
             switch ((c = jp_getc(&ctx, &ctx.patch_buffer))) {
                 case JANPATCH_OPERATION_EQL: {
@@ -324,6 +450,10 @@ int janpatch(janpatch_ctx ctx, JANPATCH_STREAM *source, JANPATCH_STREAM *patch,
 
                     JANPATCH_DEBUG("EQL: %d bytes\n", length);
 
+#ifndef JANPATCH_BYTE_COPY
+                    jp_copy(&ctx, &ctx.source_buffer, &ctx.target_buffer, length);
+#else
+                    // the byte by byte copy the runs replaced, kept as the reference of tools/host/janpatch_check.c
                     for (int ix = 0; ix < length; ix++) {
                         int r = jp_getc(&ctx, &ctx.source_buffer);
                         if (r < -1) {
@@ -334,6 +464,7 @@ int janpatch(janpatch_ctx ctx, JANPATCH_STREAM *source, JANPATCH_STREAM *patch,
 
                         jp_putc(r, &ctx, &ctx.target_buffer);
                     }
+#endif
 
                     break;
                 }
@@ -20,10 +20,16 @@
  */
 #include "queue_handler.h"
 #include "mqtt_common.h"
+#include "ota_patch_stream.h"
+#include "ota_image_verifier.h"
+#include "ota_image_file.h"
 
 #define WAIT_RESPONSE 5000
 #define CONFIG_HEADER_SIZE 2000
 
+/* Page size of the janpatch stream buffers */
+#define OTA_PATCH_PAGE_SIZE 4096U
+
 /**
  * The current state of the OTA Task (OTA Agent).
  */
@@ -45,7 +51,8 @@ typedef enum OtaState
 typedef enum OtaPartitionType
 {
     OtaUpdatePartition = 1,            /* OTA update partition */
-    OtaPatchPartition                  /* OTA patch partition */
+    OtaPatchPartition,                 /* OTA patch partition */
+    OtaStreamPatch                     /* Patch applied to the update partition while it is downloaded */
 } OtaPartitionType_t;
 
 /* 
@@ -56,10 +63,14 @@ typedef struct
 {
     const esp_partition_t *update_partition; /* Pointer to the update partition */
     const esp_partition_t *patch_partition;  /* Pointer to the patch partition */
-    esp_ota_handle_t update_handle;          /* Handle for the OTA update */
+    OtaImageFile_t update_file;              /* Update partition, written through an OTA handle or directly */
     OtaPartitionType_t OtaPartition_type;    /* Type of the OTA partition */
     uint32_t data_write_len;                 /* Length of data written */
     bool valid_image;                        /* Indicates if the image is valid */
+    uint8_t target_digest[32];               /* SHA-256 of the image to boot, from the job document */
+    bool has_target_digest;                  /* Indicates if target_digest was given */
+    const struct OtaDeltaEngine *delta_engine; /* Format of the patch, NULL for a full image */
+    void ( *patch_progress )( uint8_t percent ); /* Reports the share of the patch applied, NULL to skip it */
 } esp_ota_context_t;
 
 /* 
@@ -70,8 +81,44 @@ typedef struct
     const esp_partition_t *partition; /* Pointer to the partition */
     size_t offset;                    /* Offset within the partition */
     size_t size;                      /* Size of the partition */
+    struct OtaFlashWriter *writer;    /* Write combining for the partition, NULL to write directly */
+    struct OtaPageCache *cache;       /* Read cache of the partition, NULL to read directly */
+    struct OtaImageVerifier *verifier;/* Hashes the data written, NULL to skip it */
+    struct OtaPatchStream *stream;    /* Patch read while it is downloaded, NULL to read the partition */
+    size_t written_end;               /* Data before this offset is in flash and is not written again */
 } esp_partition_context_t;
 
+/* 
+ * Streams handed to a delta engine, the functions behave as fread, fwrite and fseek
+ */
+typedef struct
+{
+    esp_partition_context_t *source; /* Running image */
+    esp_partition_context_t *patch;  /* Downloaded patch */
+    esp_partition_context_t *target; /* Image being rebuilt */
+    size_t ( *fread )( void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx );
+    size_t ( *fwrite )( const void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx );
+    int ( *fseek )( esp_partition_context_t *pCtx, long int offset, int whence );
+    void ( *progress )( uint8_t percent ); /* Called as the target is written, with the share of the work done */
+} OtaDeltaStreams_t;
+
+/* 
+ * Patch format, selected by the extension of the file or by the job document
+ */
+typedef struct OtaDeltaEngine
+{
+    const char *name;      /* Name of the format in the job document */
+    const char *extension; /* Extension of the patch file */
+    bool readsSource;      /* False for a compressed full image, the running image is not read */
+
+    /* 
+     * Rebuilds the target from the source and the patch. pStart gives the positions to resume
+     * from, NULL to start at the beginning. With checkpoint set, the engine reports positions it
+     * can be resumed from through the patch task.
+     */
+    bool ( *apply )( const OtaDeltaStreams_t *pStreams, const OtaPatchProgress_t *pStart, bool checkpoint );
+} OtaDeltaEngine_t;
+
 /* 
  * Enum defining possible events for the OTA agent
  */
@@ -83,27 +130,44 @@ typedef enum OtaEvent
     OtaEventRequestFileBlock,    /* Request file blocks */
     OtaEventReceivedFileBlock,   /* Received a file block */
     OtaEventFinishDownload,      /* Finish downloading the file */
+    OtaEventActivateImage,       /* Boot the staged image */
     OtaEventMax                  /* Maximum number of events */
 } OtaEvent_t;
 
 /* 
- * This structure contains the buffer to store the downloaded block, its size, 
- * and a flag to indicate whether the buffer is currently in use.
+ * This structure contains the buffer to store the downloaded block and its size.
+ * The buffers are owned by the OTA data ring (see ota_data_ring.h).
  */
 typedef struct OtaDataEvent
 {
     uint8_t data[mqttFileDownloader_CONFIG_BLOCK_SIZE + CONFIG_HEADER_SIZE];
     size_t dataLength;                                                       
-    bool bufferUsed;                                                         
 } OtaDataEvent_t;
 
 typedef struct OtaEventMsg
 {
-    OtaDataEvent_t *dataEvent; /* Pointer to the data block */
-    JobEventData_t *jobEvent;  /* Pointer to the ota event */
+    JobEventData_t jobEvent;   /* Job document, released once the event is handled */
     OtaEvent_t eventId;        /* Identifier for the event */
 } OtaEventMsg_t;
 
+/* Base64 length of the largest signature */
+#define OTA_SIGNATURE_BASE64_MAX_LENGTH ( ( ( OTA_IMAGE_SIGNATURE_MAX_LENGTH + 2U ) / 3U ) * 4U )
+
+/*
+ * A file of a job besides its application image, written as it is to a data partition.
+ * The job document buffer is reused by the next job, so what is needed is copied.
+ */
+typedef struct OtaDataFile
+{
+    uint16_t fileId;
+    uint32_t fileSize;
+    const esp_partition_t *partition;
+    uint8_t digest[OTA_IMAGE_DIGEST_LENGTH];
+    bool hasDigest;
+    char signature[OTA_SIGNATURE_BASE64_MAX_LENGTH];  /* Base64, as in the job document */
+    size_t signatureLength;
+} OtaDataFile_t;
+
 /* 
  * Entry point for executing the OTA agent. 
  * This task manages the OTA update process, including state transitions, 
@@ -114,9 +178,32 @@ void otaAgentTask(void *parameters);
 /* 
  * Initializes the OTA update partition for firmware update. 
  * This function sets up the context required for writing to the OTA partition.
+ * With resume set, the partition keeps the data of an interrupted download.
+ * The patch format is taken from pDeltaFormat when it is not NULL, else from the file extension.
  */
-bool SetOTAUpdateContext( const char * pfilePath, esp_ota_context_t * ota_ctx);
+bool SetOTAUpdateContext( const char * pfilePath, const char * pDeltaFormat, esp_ota_context_t * ota_ctx, bool resume);
 
 bool ApplyPatch( esp_ota_context_t * ota_ctx);
 
+/* 
+ * Called from the patch task with a position the application can be resumed from,
+ * and the digest state of the patch bytes before pProgress->streamOffset.
+ */
+typedef void (*OtaPatchCheckpoint_t)( const OtaPatchProgress_t * pProgress, const mbedtls_sha256_context * pPatchDigest );
+
+/* 
+ * Starts applying the patch read from pStream in a separate task, writing the
+ * target to the update partition as the patch arrives. pResume is the position
+ * of an interrupted application, NULL to start from the beginning. checkpoint is
+ * called about every checkpointInterval patch bytes, NULL disables it.
+ */
+bool ApplyPatchStreamStart( esp_ota_context_t * ota_ctx, OtaPatchStream_t * pStream, const OtaPatchProgress_t * pResume,
+                            OtaPatchCheckpoint_t checkpoint, uint32_t checkpointInterval );
+
+/* Waits for the patch task to end. Returns true if the whole target was written. */
+bool ApplyPatchStreamFinish( void );
+
+/* Returns true if the patch task already stopped on an error. */
+bool ApplyPatchStreamFailed( void );
+
 #endif 
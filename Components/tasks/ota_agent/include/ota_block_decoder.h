@@ -0,0 +1,38 @@
+#ifndef OTA_BLOCK_DECODER_H
+#define OTA_BLOCK_DECODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Keys of the GetStream response message, see the AWS IoT MQTT-based file delivery docs. */
+#define OTA_BLOCK_KEY_FILE_ID    "f"
+#define OTA_BLOCK_KEY_BLOCK_ID   "i"
+#define OTA_BLOCK_KEY_BLOCK_SIZE "l"
+#define OTA_BLOCK_KEY_PAYLOAD    "p"
+
+/*
+ * A data block of a stream. The payload points into the received message,
+ * so it is only valid while the message buffer is.
+ */
+typedef struct OtaStreamBlock {
+    int32_t fileId;
+    int32_t blockId;
+    int32_t blockSize;
+    const uint8_t* payload;
+    size_t payloadLength;
+} OtaStreamBlock_t;
+
+/*
+ * Decodes a CBOR GetStream response without copying the payload:
+ * pBlock->payload points at the byte string inside pMessage.
+ */
+bool OtaBlockDecoder_DecodeCbor(const uint8_t* pMessage, size_t messageLength, OtaStreamBlock_t* pBlock);
+
+/*
+ * Decodes a JSON GetStream response in place: the base64 payload is decoded
+ * over itself, so pMessage is modified and pBlock->payload points into it.
+ */
+bool OtaBlockDecoder_DecodeJson(uint8_t* pMessage, size_t messageLength, OtaStreamBlock_t* pBlock);
+
+#endif
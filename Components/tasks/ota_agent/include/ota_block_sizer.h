@@ -0,0 +1,53 @@
+#ifndef OTA_BLOCK_SIZER_H
+#define OTA_BLOCK_SIZER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Largest number of halvings of the block size, blocks are requested in at most 16 parts. */
+#define OTA_BLOCK_SIZER_MAX_SHIFT 4U
+
+/* Blocks received without loss before the part size is doubled, and its upper bound after failed probes. */
+#define OTA_BLOCK_SIZER_PROBE_BLOCKS     8U
+#define OTA_BLOCK_SIZER_MAX_PROBE_BLOCKS 64U
+
+/*
+ * Chooses the size of the parts blocks are requested in, from the round trip
+ * time and the losses measured on the link. A lost request halves the part
+ * size, so less data is sent again. After a run of blocks without loss the
+ * size is doubled again, saving round trips. A round trip time more than twice
+ * the lowest one seen with the same size means the link is queueing, the size
+ * is not raised then. A size that lost a request right after it was raised
+ * waits twice as long before it is tried again.
+ */
+typedef struct OtaBlockSizer {
+    uint8_t shift;                                    /* Parts are the block size >> shift */
+    uint8_t maxShift;                                 /* Shift of the smallest part */
+    uint32_t cleanBlocks;                             /* Blocks received without loss at the current size */
+    uint32_t probeBlocks;                             /* Clean blocks needed to double the size */
+    bool probing;                                     /* The size was just doubled */
+    uint32_t minRttMs[OTA_BLOCK_SIZER_MAX_SHIFT + 1]; /* Lowest round trip time seen with each size */
+    uint32_t losses;
+    uint32_t changes;                                 /* Number of size changes, for the stats */
+} OtaBlockSizer_t;
+
+/* Starts with whole blocks, parts go down to the block size >> maxShift. */
+void OtaBlockSizer_Init(OtaBlockSizer_t* pSizer, uint8_t maxShift);
+
+/* Lowers or raises the shift of the smallest parts, e.g. for the next file, keeping what was learned of the link. */
+void OtaBlockSizer_SetMaxShift(OtaBlockSizer_t* pSizer, uint8_t maxShift);
+
+/* A block requested in parts of shift arrived in rttMs, 0 when it was requested more than once. */
+void OtaBlockSizer_BlockReceived(OtaBlockSizer_t* pSizer, uint8_t shift, uint32_t rttMs);
+
+/* The request of a block in parts of shift timed out. */
+void OtaBlockSizer_RequestLost(OtaBlockSizer_t* pSizer, uint8_t shift);
+
+/* Shift of the parts new blocks are requested in. */
+uint8_t OtaBlockSizer_Shift(const OtaBlockSizer_t* pSizer);
+
+/* Shift of the smallest parts. */
+uint8_t OtaBlockSizer_MaxShift(const OtaBlockSizer_t* pSizer);
+
+#endif
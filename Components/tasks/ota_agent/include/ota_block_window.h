@@ -0,0 +1,121 @@
+#ifndef OTA_BLOCK_WINDOW_H
+#define OTA_BLOCK_WINDOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Upper bound for the number of block requests that can be outstanding at once. */
+#define BLOCK_WINDOW_MAX_SIZE 16U
+
+/* Number of times a single block is re-requested before the download is given up. */
+#define BLOCK_WINDOW_MAX_RETRIES 8U
+
+/* Blocks can be requested in up to 2^BLOCK_WINDOW_MAX_PART_SHIFT parts. */
+#define BLOCK_WINDOW_MAX_PART_SHIFT 4U
+
+/* Retransmission timeout limits, in milliseconds. */
+#define BLOCK_WINDOW_INITIAL_RTO_MS 3000U
+#define BLOCK_WINDOW_MIN_RTO_MS     500U
+#define BLOCK_WINDOW_MAX_RTO_MS     20000U
+
+#define BLOCK_WINDOW_NO_TIMEOUT UINT32_MAX
+
+/*
+ * A block request that has been published and is waiting for its data.
+ * The block may be requested in smaller parts, each one arriving in its own message.
+ */
+typedef struct BlockRequest {
+    uint32_t blockId;       /* Index of the requested block */
+    uint32_t sentTimeMs;    /* Time at which the (last) request was published */
+    uint8_t retries;        /* Number of times the block was re-requested */
+    bool inFlight;          /* Slot is in use */
+    uint8_t partShift;      /* The block is requested in 2^partShift parts */
+    uint16_t partsReceived; /* One bit per part already stored */
+} BlockRequest_t;
+
+/*
+ * Sliding window used to keep several block requests outstanding.
+ * Received blocks are tracked in a bitmap so that they can arrive in any order,
+ * and blocks whose request timed out are re-requested selectively.
+ */
+typedef struct BlockWindow {
+    uint8_t* bitmap;             /* One bit per block, set once the block is stored */
+    uint32_t numOfBlocks;        /* Total number of blocks of the file */
+    uint32_t blocksReceived;     /* Number of bits set in the bitmap */
+    uint32_t firstMissingBlock;  /* Lowest block index not yet received */
+    uint32_t nextBlockToRequest; /* Lowest block index never requested */
+    uint32_t requestLimit;       /* Blocks from this index on are not requested yet */
+    uint32_t retransmissions;    /* Total number of re-requested blocks */
+    uint32_t duplicates;         /* Blocks received more than once */
+    uint32_t srttMs;             /* Smoothed round trip time */
+    uint32_t rttvarMs;           /* Round trip time variation */
+    uint32_t rtoMs;              /* Current retransmission timeout */
+    uint8_t windowSize;          /* Maximum number of requests in flight */
+    BlockRequest_t requests[BLOCK_WINDOW_MAX_SIZE];
+} BlockWindow_t;
+
+/* Allocates the bitmap and resets the window. Returns false if memory is not available. */
+bool BlockWindow_Init(BlockWindow_t* pWindow, uint32_t numOfBlocks, uint8_t windowSize);
+
+/* Releases the memory held by the window. */
+void BlockWindow_Free(BlockWindow_t* pWindow);
+
+/*
+ * Reserves free window slots for blocks never requested before, to be requested in
+ * 2^partShift parts each. The reserved blocks are always contiguous so they can be
+ * requested with a single GetStream message. Returns the number of blocks reserved,
+ * starting at *pBlockId.
+ */
+uint32_t BlockWindow_ReserveNewBlocks(BlockWindow_t* pWindow, uint32_t nowMs, uint8_t partShift, uint32_t* pBlockId);
+
+/* Returns the request of an in-flight block, NULL if it is not in flight. */
+const BlockRequest_t* BlockWindow_GetRequest(const BlockWindow_t* pWindow, uint32_t blockId);
+
+/*
+ * Records a part of an in-flight block. numOfParts is the number of parts of the
+ * block, fewer for the last block of the file. Returns true once every part arrived,
+ * the block is then marked received with BlockWindow_MarkReceived.
+ */
+bool BlockWindow_MarkPartReceived(BlockWindow_t* pWindow, uint32_t blockId, uint32_t part, uint32_t numOfParts);
+
+/*
+ * Collects into pBlockIds, with room for BLOCK_WINDOW_MAX_SIZE, every in-flight
+ * block whose request timed out, re-arms them and backs the timeout off once.
+ * Returns the number of blocks collected, 0 when no request expired. *pGiveUp
+ * is set when a block exceeded BLOCK_WINDOW_MAX_RETRIES, it is then the only
+ * one returned.
+ */
+uint32_t BlockWindow_CollectExpiredBlocks(BlockWindow_t* pWindow, uint32_t nowMs, uint32_t* pBlockIds, bool* pGiveUp);
+
+/*
+ * Marks a block as received and frees its window slot.
+ * Returns false if the block is out of range or was already received.
+ */
+bool BlockWindow_MarkReceived(BlockWindow_t* pWindow, uint32_t blockId, uint32_t nowMs);
+
+/* Returns true if the block was already received. */
+bool BlockWindow_IsReceived(const BlockWindow_t* pWindow, uint32_t blockId);
+
+/* Milliseconds until the earliest in-flight request expires, or BLOCK_WINDOW_NO_TIMEOUT. */
+uint32_t BlockWindow_NextTimeoutMs(const BlockWindow_t* pWindow, uint32_t nowMs);
+
+/* Returns true when every block of the file has been received. */
+bool BlockWindow_IsComplete(const BlockWindow_t* pWindow);
+
+/* Size in bytes of the received-block bitmap. */
+size_t BlockWindow_BitmapSize(const BlockWindow_t* pWindow);
+
+/*
+ * Replaces the received-block bitmap, e.g. with one loaded from a checkpoint,
+ * and rewinds the requester to the first missing block.
+ */
+void BlockWindow_Restore(BlockWindow_t* pWindow, const uint8_t* pBitmap);
+
+/* Holds back new requests for the blocks from limit on, e.g. until there is room to store them. */
+void BlockWindow_SetRequestLimit(BlockWindow_t* pWindow, uint32_t limit);
+
+/* Marks a block as missing again, e.g. after its flash area had to be erased. */
+void BlockWindow_ClearReceived(BlockWindow_t* pWindow, uint32_t blockId);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef OTA_CHECKPOINT_H
+#define OTA_CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "job_parser.h"
+#include "mbedtls/sha256.h"
+#include "mqtt_common.h"
+#include "ota_patch_stream.h"
+
+#define OTA_CHECKPOINT_NAMESPACE     "ota"
+#define OTA_CHECKPOINT_NVS_KEY       "checkpoint"
+#define OTA_CHECKPOINT_VERSION       2U
+#define OTA_CHECKPOINT_STREAM_LENGTH 64U
+#define OTA_CHECKPOINT_DIGEST_LENGTH 32U
+
+/*
+ * Identifies a partially downloaded image. A download is only resumed when
+ * the checkpoint stored in NVS matches the one built from the new job document.
+ */
+typedef struct OtaCheckpoint {
+    uint32_t version;                                  /* Layout version of the stored checkpoint */
+    char jobId[JOB_ID_LENGTH];                         /* Job the download belongs to */
+    char streamName[OTA_CHECKPOINT_STREAM_LENGTH];     /* Stream the file is downloaded from */
+    uint32_t fileId;                                   /* File of the stream */
+    uint32_t fileSize;                                 /* Size of the file in bytes */
+    uint32_t blockSize;                                /* Size of the blocks tracked by the bitmap */
+    uint32_t partitionAddress;                         /* Flash address of the partition being written */
+    uint8_t imageDigest[OTA_CHECKPOINT_DIGEST_LENGTH]; /* SHA-256 of the stream name and image signature */
+    OtaPatchProgress_t patchProgress;                  /* Where a streamed patch is resumed, zero otherwise */
+    mbedtls_sha256_context patchDigest;                /* Digest state of the patch before patchProgress.streamOffset */
+} OtaCheckpoint_t;
+
+/* Fills a checkpoint with the identity of the image described by the job document. */
+bool OtaCheckpoint_Create(OtaCheckpoint_t* pCheckpoint,
+                          const char* jobId,
+                          const AfrOtaJobDocumentFields_t* jobFields,
+                          uint32_t blockSize,
+                          uint32_t partitionAddress);
+
+/* Returns true if both checkpoints describe the same image written to the same partition. */
+bool OtaCheckpoint_Matches(const OtaCheckpoint_t* pCheckpoint, const OtaCheckpoint_t* pOther);
+
+/* Stores the checkpoint together with the block-completion bitmap. */
+bool OtaCheckpoint_Save(const OtaCheckpoint_t* pCheckpoint, const uint8_t* pBitmap, size_t bitmapSize);
+
+/*
+ * Loads the stored checkpoint and its bitmap. Returns false if there is none
+ * or if the stored bitmap does not have bitmapSize bytes.
+ */
+bool OtaCheckpoint_Load(OtaCheckpoint_t* pCheckpoint, uint8_t* pBitmap, size_t bitmapSize);
+
+/* Removes the stored checkpoint, if any. */
+void OtaCheckpoint_Erase(void);
+
+#endif
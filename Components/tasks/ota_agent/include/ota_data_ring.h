@@ -0,0 +1,49 @@
+#ifndef OTA_DATA_RING_H
+#define OTA_DATA_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ota_agent.h"
+
+/*
+ * Single-producer/single-consumer ring of OTA data buffers.
+ * The MQTT agent task (producer) fills the slot at the head while the OTA task
+ * (consumer) processes the slot at the tail, so neither side takes a lock.
+ * Only the slot count is shared, and it is updated atomically.
+ */
+typedef struct OtaDataRing {
+    OtaDataEvent_t* slots;       /* Storage for the ring, owned by the caller */
+    uint32_t depth;              /* Number of slots */
+    uint32_t head;               /* Next slot to fill, only written by the producer */
+    uint32_t tail;               /* Next slot to process, only written by the consumer */
+    atomic_uint_least32_t count; /* Number of filled slots */
+    uint32_t received;           /* Blocks committed by the producer */
+    uint32_t dropped;            /* Blocks dropped because the ring was full */
+    uint32_t highWater;          /* Maximum number of filled slots observed */
+} OtaDataRing_t;
+
+/* Resets the ring to use depth slots of the given storage. */
+void OtaDataRing_Init(OtaDataRing_t* pRing, OtaDataEvent_t* pSlots, uint32_t depth);
+
+/*
+ * Producer side: returns the slot to fill, or NULL if the ring is full
+ * (the block is counted as dropped). The slot is handed over with OtaDataRing_Commit.
+ */
+OtaDataEvent_t* OtaDataRing_Acquire(OtaDataRing_t* pRing);
+
+/* Producer side: publishes the slot returned by OtaDataRing_Acquire. */
+void OtaDataRing_Commit(OtaDataRing_t* pRing);
+
+/* Consumer side: returns the oldest filled slot, or NULL if the ring is empty. */
+OtaDataEvent_t* OtaDataRing_Peek(OtaDataRing_t* pRing);
+
+/* Consumer side: gives the slot returned by OtaDataRing_Peek back to the producer. */
+void OtaDataRing_Release(OtaDataRing_t* pRing);
+
+/* Number of filled slots. */
+uint32_t OtaDataRing_Occupancy(OtaDataRing_t* pRing);
+
+#endif
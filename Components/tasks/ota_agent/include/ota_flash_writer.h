@@ -0,0 +1,73 @@
+#ifndef OTA_FLASH_WRITER_H
+#define OTA_FLASH_WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define OTA_FLASH_SECTOR_SIZE 4096U
+
+/* Write the previous sector from a separate task while the next one is being filled. */
+#if defined(CONFIG_OTA_AGENT_FLASH_DOUBLE_BUFFER)
+    #define OTA_FLASH_DOUBLE_BUFFER true
+#else
+    #define OTA_FLASH_DOUBLE_BUFFER false
+#endif
+
+/* Writes length bytes at offset of the partition behind pContext. */
+typedef esp_err_t (*OtaFlashWriteFunc_t)(void* pContext, uint32_t offset, const void* pData, size_t length);
+
+/* Contiguous data gathered in a sector buffer and not yet written. */
+typedef struct OtaFlashRun {
+    uint32_t sectorOffset; /* Partition offset of the sector */
+    uint32_t start;        /* First buffered byte, relative to the sector */
+    uint32_t end;          /* One past the last buffered byte, relative to the sector */
+} OtaFlashRun_t;
+
+/*
+ * Write combining layer for the OTA and patch partitions.
+ * Data is gathered in sector-aligned buffers and written a whole sector at a
+ * time. Sector-aligned writes of a whole sector skip the buffer. With double
+ * buffering a writer task writes one sector while the caller fills the next.
+ */
+typedef struct OtaFlashWriter {
+    OtaFlashWriteFunc_t writeFunc;
+    void* pContext;
+    uint8_t* buffers[2];     /* Sector buffers, the second one only with double buffering */
+    uint8_t activeBuffer;    /* Buffer being filled */
+    bool runActive;          /* The active buffer holds data */
+    OtaFlashRun_t run;       /* Data held by the active buffer */
+    bool doubleBuffer;
+    TaskHandle_t writerTask; /* Writes the submitted sectors when double buffering */
+    QueueHandle_t jobQueue;  /* Sectors submitted to the writer task */
+    SemaphoreHandle_t idle;  /* Given when the writer task has no sector in progress */
+    esp_err_t error;         /* First write error, every later write fails with it */
+
+    /* Statistics */
+    uint32_t bytesWritten;   /* Bytes handed to writeFunc */
+    uint32_t flashWrites;    /* Calls to writeFunc */
+    uint32_t partialWrites;  /* Calls to writeFunc shorter than a sector */
+    uint32_t bytesCopied;    /* Bytes copied into the sector buffers */
+    uint64_t writeTimeUs;    /* Time spent in writeFunc */
+    uint64_t waitTimeUs;     /* Time the caller waited for the writer task */
+} OtaFlashWriter_t;
+
+/* Allocates the sector buffers and, with double buffering, starts the writer task. */
+bool OtaFlashWriter_Init(OtaFlashWriter_t* pWriter, OtaFlashWriteFunc_t writeFunc, void* pContext, bool doubleBuffer);
+
+/* Writes data at offset, through the sector buffers when it does not cover a whole sector. */
+esp_err_t OtaFlashWriter_Write(OtaFlashWriter_t* pWriter, uint32_t offset, const uint8_t* pData, size_t length);
+
+/* Writes every buffered byte and waits until it is in flash. */
+esp_err_t OtaFlashWriter_Flush(OtaFlashWriter_t* pWriter);
+
+/* Stops the writer task and releases the buffers. Buffered data not flushed is lost. */
+void OtaFlashWriter_Deinit(OtaFlashWriter_t* pWriter);
+
+#endif
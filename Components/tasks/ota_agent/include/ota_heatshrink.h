@@ -0,0 +1,64 @@
+#ifndef OTA_HEATSHRINK_H
+#define OTA_HEATSHRINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ota_agent.h"
+
+#define OTA_HEATSHRINK_MIN_WINDOW 4U
+#define OTA_HEATSHRINK_MAX_WINDOW 12U
+#define OTA_HEATSHRINK_INPUT_SIZE 256U
+
+/*
+ * Compressed full image, made by tools/hsdiff.py compress. Little endian header:
+ *
+ *   0  "HSIM"
+ *   4  uint8   version, 1
+ *   5  uint8   heatshrink window size, log2 (4..12)
+ *   6  uint8   heatshrink lookahead size, log2 (3..window - 1)
+ *   7  uint8   reserved, 0
+ *   8  uint32  size of the image
+ *
+ * followed by the heatshrink compressed image.
+ */
+#define OTA_HEATSHRINK_IMAGE_MAGIC       "HSIM"
+#define OTA_HEATSHRINK_IMAGE_VERSION     1U
+#define OTA_HEATSHRINK_IMAGE_HEADER_SIZE 12U
+#define OTA_HEATSHRINK_IMAGE_CHUNK_SIZE  512U
+
+/*
+ * Streaming heatshrink (LZSS) decoder. The compressed bits are read from the
+ * patch stream, a 1 bit is followed by a literal byte, a 0 bit by a
+ * back-reference of window bits of distance and lookahead bits of length into
+ * the bytes decoded last. Only the window is kept, whatever the output size.
+ */
+typedef struct OtaHeatshrink {
+    const OtaDeltaStreams_t* pStreams;
+    uint8_t input[OTA_HEATSHRINK_INPUT_SIZE];
+    size_t inputLength;
+    size_t inputPosition;
+    uint8_t bitBuffer; /* Byte the next bits are taken from, MSB first */
+    uint8_t bitsLeft;
+    uint8_t* window;   /* Last bytes decoded, for the back-references */
+    uint32_t windowMask;
+    uint32_t windowPosition;
+    uint8_t windowBits;
+    uint8_t lookaheadBits;
+    uint32_t backrefOffset;
+    uint32_t backrefRemaining; /* Bytes of the current back-reference still to copy */
+} OtaHeatshrink_t;
+
+/* Checks the parameters and allocates the window. The compressed data starts at the current offset of the patch. */
+bool OtaHeatshrink_Init(OtaHeatshrink_t* pDecoder, const OtaDeltaStreams_t* pStreams, uint8_t windowBits, uint8_t lookaheadBits);
+
+/* Decodes the next length bytes, false if the compressed data ends before. */
+bool OtaHeatshrink_Decode(OtaHeatshrink_t* pDecoder, uint8_t* pData, size_t length);
+
+void OtaHeatshrink_Deinit(OtaHeatshrink_t* pDecoder);
+
+/* Delta engine of compressed full images, the running image is not read. checkpoint is ignored. */
+bool OtaHeatshrink_ApplyImage(const OtaDeltaStreams_t* pStreams, const OtaPatchProgress_t* pStart, bool checkpoint);
+
+#endif
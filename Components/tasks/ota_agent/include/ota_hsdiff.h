@@ -0,0 +1,39 @@
+#ifndef OTA_HSDIFF_H
+#define OTA_HSDIFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ota_agent.h"
+
+/*
+ * hsdiff patch format, made by tools/hsdiff.py. Little endian header:
+ *
+ *   0  "HSDF"
+ *   4  uint8   version, 1
+ *   5  uint8   heatshrink window size, log2 (4..12)
+ *   6  uint8   heatshrink lookahead size, log2 (3..window - 1)
+ *   7  uint8   reserved, 0
+ *   8  uint32  size of the source image the patch was made from
+ *   12 uint32  size of the target image
+ *
+ * followed by a heatshrink compressed stream of bsdiff records, until the
+ * target is complete:
+ *
+ *   varint  diff length, then as many bytes added to the source bytes
+ *   varint  extra length, then as many bytes copied to the target
+ *   varint  source adjustment, zigzag encoded, applied after both spans
+ *
+ * Decoding needs the heatshrink window and a few small buffers, about 5 KB
+ * with the largest window, whatever the size of the images. See
+ * ota_heatshrink.h for the decoder.
+ */
+#define OTA_HSDIFF_MAGIC        "HSDF"
+#define OTA_HSDIFF_VERSION      1U
+#define OTA_HSDIFF_HEADER_SIZE  16U
+#define OTA_HSDIFF_CHUNK_SIZE   256U
+
+/* Delta engine of hsdiff patches. The format cannot be resumed, checkpoint is ignored. */
+bool OtaHsdiff_Apply(const OtaDeltaStreams_t* pStreams, const OtaPatchProgress_t* pStart, bool checkpoint);
+
+#endif
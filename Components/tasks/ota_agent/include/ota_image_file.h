@@ -0,0 +1,42 @@
+#ifndef OTA_IMAGE_FILE_H
+#define OTA_IMAGE_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+
+/*
+ * The update partition an image is downloaded to. A download started from the
+ * beginning writes it through the handle of esp_ota_begin(), which erases the
+ * whole partition. esp_ota_write_with_offset() only works after that erase, and
+ * esp_ota_end() refuses a handle nothing was written through, so a resumed
+ * download, whose partition keeps the blocks already stored, and the delta
+ * engines, which rebuild the image with esp_partition_write(), write it directly
+ * and the image is verified on its own.
+ */
+typedef struct OtaImageFile {
+    const esp_partition_t* partition;
+    esp_ota_handle_t handle;
+    bool hasHandle; /* Data goes through handle, else straight to the partition */
+} OtaImageFile_t;
+
+/* Opens partition. It is erased, unless resume is set: the data of the interrupted download is kept. */
+bool OtaImageFile_Open(OtaImageFile_t* pFile, const esp_partition_t* partition, bool resume);
+
+/* Closes the handle but keeps the partition it erased, for an image its owner writes with esp_partition_write(). */
+void OtaImageFile_WriteDirectly(OtaImageFile_t* pFile);
+
+/* Writes length bytes at offset, as the flash write function of OtaFlashWriter_t with pContext the file. */
+esp_err_t OtaImageFile_Write(void* pContext, uint32_t offset, const void* pData, size_t length);
+
+/* Closes the file and checks the image it holds. */
+bool OtaImageFile_Finish(OtaImageFile_t* pFile);
+
+/* Closes the file, the partition is left as it is. */
+void OtaImageFile_Abort(OtaImageFile_t* pFile);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef OTA_IMAGE_VERIFIER_H
+#define OTA_IMAGE_VERIFIER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mbedtls/sha256.h"
+
+#define OTA_IMAGE_DIGEST_LENGTH 32U
+
+/* Large enough for an ECDSA P-256 or RSA-4096 signature in DER */
+#define OTA_IMAGE_SIGNATURE_MAX_LENGTH 512U
+
+/*
+ * Streaming check of a downloaded file. The SHA-256 is updated as the data is
+ * stored, so no second read pass over the partition is needed. At the end the
+ * digest is compared with the expected one and the signature of the job
+ * document is verified with the code signing certificate stored in NVS.
+ */
+typedef struct OtaImageVerifier {
+    mbedtls_sha256_context shaCtx;
+    uint8_t expectedDigest[OTA_IMAGE_DIGEST_LENGTH];
+    bool hasExpectedDigest;
+    uint8_t signature[OTA_IMAGE_SIGNATURE_MAX_LENGTH];
+    size_t signatureLength; /* 0 when the job document has no signature */
+    bool checkSignature;    /* False when only the digest is checked */
+
+    /* Statistics */
+    uint32_t bytesHashed;
+    uint64_t hashTimeUs;
+} OtaImageVerifier_t;
+
+/* Starts the digest. Without checkSignature, Finish only compares the digest. */
+void OtaImageVerifier_Init(OtaImageVerifier_t* pVerifier, bool checkSignature);
+
+/* Sets the base64 signature of the file, as found in the job document. */
+bool OtaImageVerifier_SetSignature(OtaImageVerifier_t* pVerifier, const char* signature, size_t signatureLength);
+
+/* Sets the SHA-256 the file must have. */
+void OtaImageVerifier_SetDigest(OtaImageVerifier_t* pVerifier, const uint8_t* digest);
+
+/* Hashes the next bytes of the file, which must be given in order. */
+void OtaImageVerifier_Update(OtaImageVerifier_t* pVerifier, const uint8_t* pData, size_t length);
+
+/* Copies the digest state, so it can be stored and hashing resumed from it. */
+void OtaImageVerifier_Snapshot(OtaImageVerifier_t* pVerifier, mbedtls_sha256_context* pState);
+
+/* Continues hashing from a state copied with OtaImageVerifier_Snapshot() after bytesHashed bytes. */
+void OtaImageVerifier_Restore(OtaImageVerifier_t* pVerifier, const mbedtls_sha256_context* pState, uint32_t bytesHashed);
+
+/* Completes the digest and returns true if it matches and the signature is valid. */
+bool OtaImageVerifier_Finish(OtaImageVerifier_t* pVerifier);
+
+void OtaImageVerifier_Free(OtaImageVerifier_t* pVerifier);
+
+/* Parses a SHA-256 written as 64 hex characters. */
+bool OtaImageVerifier_ParseDigest(const char* hex, size_t hexLength, uint8_t* digest);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef OTA_MANIFEST_H
+#define OTA_MANIFEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_partition.h"
+
+/*
+ * Chunk manifest of a full image, made by tools/ota_manifest.py. Little endian:
+ *
+ *   0  "OTAM"
+ *   4  uint8   version, 1
+ *   5  uint8   chunk size, log2
+ *   6  uint16  reserved, 0
+ *   8  uint32  size of the image
+ *   12 uint32  number of chunks
+ *
+ * followed by one entry per chunk of the image, in order:
+ *
+ *   uint32  rolling checksum of the chunk, rsync style
+ *   uint8   first 8 bytes of the SHA-256 of the chunk
+ *
+ * The last chunk may be shorter than the others.
+ */
+#define OTA_MANIFEST_MAGIC        "OTAM"
+#define OTA_MANIFEST_VERSION      1U
+#define OTA_MANIFEST_HEADER_SIZE  16U
+#define OTA_MANIFEST_HASH_SIZE    8U
+#define OTA_MANIFEST_ENTRY_SIZE   (4U + OTA_MANIFEST_HASH_SIZE)
+#define OTA_MANIFEST_MIN_CHUNK    10U /* 1 KB */
+#define OTA_MANIFEST_MAX_CHUNK    16U /* 64 KB */
+#define OTA_MANIFEST_MAX_SIZE     (16U * 1024U)
+#define OTA_MANIFEST_READ_SIZE    1024U
+
+/* Chunk not found in the running image */
+#define OTA_MANIFEST_NOT_FOUND UINT32_MAX
+
+typedef struct OtaManifest {
+    const uint8_t* entries;
+    uint32_t chunkSize;
+    uint32_t imageSize;
+    uint32_t numOfChunks;
+} OtaManifest_t;
+
+/* Checks the header and the size of the manifest, the entries are used where they are. */
+bool OtaManifest_Parse(OtaManifest_t* pManifest, const uint8_t* pData, size_t length);
+
+/*
+ * Looks for the chunks of the image at any offset of the partition, as rsync
+ * does, so code moved by an insertion is still found. pSourceOffsets receives,
+ * for each chunk, its offset in the partition or OTA_MANIFEST_NOT_FOUND.
+ * Returns the number of chunks found.
+ */
+uint32_t OtaManifest_FindChunks(const OtaManifest_t* pManifest, const esp_partition_t* pSource, uint32_t* pSourceOffsets);
+
+/* Length of a chunk, shorter for the last one. */
+uint32_t OtaManifest_ChunkLength(const OtaManifest_t* pManifest, uint32_t chunk);
+
+#endif
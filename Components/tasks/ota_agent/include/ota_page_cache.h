@@ -0,0 +1,84 @@
+#ifndef OTA_PAGE_CACHE_H
+#define OTA_PAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define OTA_PAGE_CACHE_MAX_PAGES 16U
+
+/* Reads length bytes at offset of the partition behind pContext. */
+typedef esp_err_t (*OtaPageReadFunc_t)(void* pContext, uint32_t offset, void* pData, size_t length);
+
+typedef enum OtaCachePageState {
+    OtaCachePageEmpty = 0,
+    OtaCachePageLoading, /* Being read by the read-ahead task */
+    OtaCachePageValid
+} OtaCachePageState_t;
+
+typedef struct OtaCachePage {
+    uint8_t* data;
+    uint32_t page;    /* Index of the page held */
+    uint32_t length;  /* Bytes held, fewer for the last page */
+    uint32_t lastUse; /* Value of the access clock at the last read */
+    bool prefetched;  /* Loaded ahead and not read yet */
+    volatile OtaCachePageState_t state;
+} OtaCachePage_t;
+
+/*
+ * Read cache of whole pages of a partition with LRU replacement, used for the
+ * source image of a patch, which janpatch reads back and forth. When pages
+ * are read in sequence, a read-ahead task loads the next page while the
+ * current one is being used. Only the caller picks the pages to replace, the
+ * read-ahead task fills at most one page at a time.
+ */
+typedef struct OtaPageCache {
+    OtaPageReadFunc_t readFunc;
+    void* pContext;
+    uint32_t size;        /* Bytes that can be read */
+    uint32_t pageSize;
+    OtaCachePage_t pages[OTA_PAGE_CACHE_MAX_PAGES];
+    uint32_t numPages;    /* Pages allocated */
+    uint32_t clock;       /* Access clock for the LRU order */
+    uint32_t lastPage;    /* Page read last, to detect sequential reads */
+    bool readAhead;
+    bool prefetchPending; /* A page is being loaded by the read-ahead task */
+    uint32_t prefetchSlot;
+    TaskHandle_t readerTask;
+    QueueHandle_t prefetchQueue; /* Pages handed to the read-ahead task */
+    SemaphoreHandle_t loaded;    /* Given when the read-ahead task loaded a page */
+
+    /* Statistics */
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t prefetches;   /* Pages loaded ahead */
+    uint32_t prefetchHits; /* Pages read after being loaded ahead */
+    uint64_t readTimeUs;   /* Time spent in readFunc by the caller */
+    uint64_t waitTimeUs;   /* Time the caller waited for the read-ahead task */
+} OtaPageCache_t;
+
+/*
+ * Allocates up to numPages pages of pageSize bytes for a partition of size bytes.
+ * Fewer pages are used if the heap runs out, at least one is required.
+ */
+bool OtaPageCache_Init(OtaPageCache_t* pCache,
+                       OtaPageReadFunc_t readFunc,
+                       void* pContext,
+                       uint32_t size,
+                       uint32_t pageSize,
+                       uint32_t numPages,
+                       bool readAhead);
+
+/* Reads length bytes at offset. Returns fewer bytes at the end of the partition and 0 on a read error. */
+size_t OtaPageCache_Read(OtaPageCache_t* pCache, uint32_t offset, uint8_t* pData, size_t length);
+
+/* Stops the read-ahead task and releases the pages. */
+void OtaPageCache_Deinit(OtaPageCache_t* pCache);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef OTA_PATCH_STREAM_H
+#define OTA_PATCH_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/sha256.h"
+
+#include "ota_image_verifier.h"
+
+/*
+ * Position of a streamed patch application at an operation boundary, where it
+ * can be resumed from. The patch is downloaded again from streamOffset.
+ */
+typedef struct OtaPatchProgress {
+    uint32_t streamOffset; /* First patch byte downloaded again, a page boundary */
+    uint32_t patchOffset;  /* janpatch positions of the patch, source and target streams */
+    uint32_t sourceOffset;
+    uint32_t targetOffset;
+} OtaPatchProgress_t;
+
+/* Called by the reader whenever it made room for more data, or gave up. */
+typedef void (*OtaPatchStreamNotify_t)(void);
+
+/*
+ * Window of patch bytes between the OTA task, which stores the blocks as they
+ * arrive, and the patch task, which reads them in order while janpatch runs.
+ * Blocks may be stored out of order anywhere in the window; the reader only
+ * sees the contiguous prefix published with OtaPatchStream_SetAvailable().
+ * The reader keeps one page behind its position for the backward seeks of
+ * janpatch, everything before that is released to make room for new blocks.
+ *
+ * The reader also hashes the patch as it first reads it, keeping the digest
+ * state at the start of the last page read, so a checkpoint can store it.
+ */
+typedef struct OtaPatchStream {
+    uint8_t* buffer;
+    uint32_t capacity;       /* Bytes held by the window */
+    uint32_t history;        /* Bytes kept behind the reader */
+    uint32_t length;         /* Size of the patch */
+    uint32_t base;           /* Offset of the first byte held, only written by the reader */
+    uint32_t available;      /* Bytes readable from offset 0, only written by the writer */
+    bool aborted;
+    SemaphoreHandle_t mutex;
+    SemaphoreHandle_t dataReady;
+    OtaPatchStreamNotify_t notify;
+
+    /* Digest of the patch */
+    OtaImageVerifier_t* verifier;
+    mbedtls_sha256_context snapshot; /* Digest state at snapshotOffset */
+    uint32_t snapshotOffset;
+
+    /* Statistics */
+    uint32_t rejectedBlocks; /* Blocks that did not fit in the window */
+    uint64_t readWaitUs;     /* Time the reader waited for the download */
+} OtaPatchStream_t;
+
+/*
+ * Allocates a window of capacity bytes for a patch of length bytes, starting at
+ * startOffset. The reader keeps history bytes behind it. The verifier hashes the
+ * patch and already covers the bytes before startOffset.
+ */
+bool OtaPatchStream_Init(OtaPatchStream_t* pStream,
+                         uint32_t capacity,
+                         uint32_t history,
+                         uint32_t length,
+                         uint32_t startOffset,
+                         OtaImageVerifier_t* pVerifier,
+                         OtaPatchStreamNotify_t notify);
+
+void OtaPatchStream_Deinit(OtaPatchStream_t* pStream);
+
+/* Stores a block at its patch offset. Returns false if it does not fit in the window. */
+bool OtaPatchStream_Write(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length);
+
+/* Publishes the bytes before end, which are all stored, to the reader. */
+void OtaPatchStream_SetAvailable(OtaPatchStream_t* pStream, uint32_t end);
+
+/* End of the window, blocks past it cannot be stored yet. */
+uint32_t OtaPatchStream_WriteLimit(OtaPatchStream_t* pStream);
+
+/*
+ * Reads length bytes at offset, waiting until they have been downloaded.
+ * Returns fewer bytes at the end of the patch, and 0 once the stream is aborted.
+ */
+size_t OtaPatchStream_Read(OtaPatchStream_t* pStream, uint32_t offset, uint8_t* pData, size_t length);
+
+/* Copies the digest state of the patch before offset, if it is the one kept. */
+bool OtaPatchStream_GetSnapshot(OtaPatchStream_t* pStream, uint32_t offset, mbedtls_sha256_context* pSnapshot);
+
+/* Wakes the reader up and makes every further read fail. */
+void OtaPatchStream_Abort(OtaPatchStream_t* pStream);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef OTA_STAGING_H
+#define OTA_STAGING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mqtt_common.h"
+
+#define OTA_STAGING_NAMESPACE "ota"
+#define OTA_STAGING_NVS_KEY   "staged"
+#define OTA_STAGING_VERSION   1U
+
+/*
+ * Image downloaded and verified into the update partition but not activated yet.
+ * It is activated by an activation job, or once its maintenance window ends.
+ */
+typedef struct OtaStagedImage {
+    uint32_t version;          /* Layout version of the stored record */
+    char jobId[JOB_ID_LENGTH]; /* Job that staged the image */
+    uint32_t partitionAddress; /* Flash address of the partition holding the image */
+    uint32_t activateAfterS;   /* Seconds from staging, or from boot, to the activation, 0 to wait for a job */
+} OtaStagedImage_t;
+
+/* Stores the staged image, replacing the previous one. */
+bool OtaStaging_Save(const OtaStagedImage_t* pStaged);
+
+/* Loads the staged image. Returns false if there is none or if it has another layout. */
+bool OtaStaging_Load(OtaStagedImage_t* pStaged);
+
+/* Forgets the staged image, if any. */
+void OtaStaging_Erase(void);
+
+#endif
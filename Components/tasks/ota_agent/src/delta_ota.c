@@ -1,90 +1,414 @@
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_partition.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
 
 #include "ota_agent.h"
+#include "ota_flash_writer.h"
+#include "ota_image_verifier.h"
+#include "ota_heatshrink.h"
+#include "ota_hsdiff.h"
+#include "ota_page_cache.h"
 #include <freertos/FreeRTOS.h>
-
-#define PATCH_FILE_EXTENSION ".patch"
-#define PATCH_BUFFER_SIZE    4096
-#define PATCH_PARTITION_NAME "ota_patch"
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define PATCH_BUFFER_SIZE     OTA_PATCH_PAGE_SIZE
+#define PATCH_PARTITION_NAME  "ota_patch"
+#define PATCH_TASK_NAME       "ota_patch"
+#define PATCH_TASK_STACK_SIZE 6144
+
+/* Pages of the running image cached while a patch is applied, and heap left to the rest of the system. */
+#if defined( CONFIG_OTA_AGENT_PATCH_SOURCE_CACHE_PAGES )
+    #define PATCH_SOURCE_CACHE_PAGES CONFIG_OTA_AGENT_PATCH_SOURCE_CACHE_PAGES
+#else
+    #define PATCH_SOURCE_CACHE_PAGES 4
+#endif
+#define PATCH_HEAP_RESERVE ( 32 * 1024 )
+
+/* Load the next source page from a separate task when the source is read in sequence. */
+#if defined( CONFIG_OTA_AGENT_PATCH_READ_AHEAD )
+    #define PATCH_READ_AHEAD true
+#else
+    #define PATCH_READ_AHEAD false
+#endif
+
+/* Target bytes written between two yields of the task applying a patch. */
+#if defined( CONFIG_OTA_AGENT_PATCH_SLICE_SIZE )
+    #define PATCH_SLICE_SIZE CONFIG_OTA_AGENT_PATCH_SLICE_SIZE
+#else
+    #define PATCH_SLICE_SIZE ( 16 * 1024 )
+#endif
+
+/* Share of the patch applied between two progress updates of the job, in percent. */
+#define PATCH_PROGRESS_STEP 10
+
+/* Apply patches while they are downloaded instead of storing them in the patch partition. */
+#if defined( CONFIG_OTA_AGENT_STREAM_PATCH )
+    #define OTA_STREAM_PATCH true
+#else
+    #define OTA_STREAM_PATCH false
+#endif
 
 static const char * TAG = "OTA_AGENT";
 
 #define JANPATCH_STREAM esp_partition_context_t
 #include "janpatch.h"
 
-
-static bool prvIsPatchFile( const char *pFilePath );
-static bool prvCreateOtaFile(esp_ota_context_t * ota_ctx);
-static bool prvCreatePatchFile( esp_ota_context_t * ota_ctx );
+/* State shared between the OTA task and the task applying a streamed patch. */
+typedef struct
+{
+    esp_ota_context_t * ota_ctx;
+    OtaPatchStream_t * stream;
+    OtaPatchProgress_t start;          /* Positions to resume from */
+    bool resume;                       /* The target partition was not erased */
+    OtaPatchCheckpoint_t checkpoint;
+    uint32_t checkpointInterval;       /* Patch bytes between two checkpoints */
+    uint32_t lastCheckpoint;
+    SemaphoreHandle_t done;
+    volatile bool finished;
+    bool result;
+} PatchApplier_t;
+
+static PatchApplier_t patchApplier;
+
+/*
+ * Time slices of the patch being applied. The delta engines run to the end of the patch
+ * in a single call, so the task applying it yields every PATCH_SLICE_SIZE bytes of target
+ * to let the MQTT agent, of the same priority, serve its keep-alives and commands.
+ */
+typedef struct
+{
+    int64_t sliceStartUs;
+    size_t sliceWritten;               /* Target bytes written since the last yield */
+    uint32_t slices;
+    int64_t maxSliceUs;                /* Longest time between two yields */
+    uint8_t reportedPercent;
+    void ( *report )( uint8_t percent );
+} PatchSlicer_t;
+
+static PatchSlicer_t patchSlicer;
+
+static const OtaDeltaEngine_t * prvFindDeltaEngine( const char *pFilePath, const char *pDeltaFormat );
+static bool prvCreateOtaFile(esp_ota_context_t * ota_ctx, bool resume);
+static bool prvCreatePatchFile( esp_ota_context_t * ota_ctx, bool resume );
 static int prvfseek( esp_partition_context_t *fileCtx, long int offset, int whence );
 static size_t prvfread( void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx );
 static size_t prvfwrite( const void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx );
 static long int prvftell( esp_partition_context_t *pCtx );
+static esp_err_t prvWritePartition( void *pContext, uint32_t offset, const void *pData, size_t length );
+static esp_err_t prvReadPartition( void *pContext, uint32_t offset, void *pData, size_t length );
+static uint32_t prvSourceCachePages( void );
+static bool prvRunDeltaEngine( esp_ota_context_t * ota_ctx, esp_partition_context_t * pPatchCtx, const OtaPatchProgress_t * pStart,
+                               bool checkpoint );
+static bool prvApplyJanpatch( const OtaDeltaStreams_t * pStreams, const OtaPatchProgress_t * pStart, bool checkpoint );
+static bool prvPrepareResumedTarget( esp_ota_context_t * ota_ctx, uint32_t targetOffset, OtaImageVerifier_t * pVerifier );
+static void prvPatchTask( void *parameters );
+static void prvCheckpointPatch( janpatch_ctx *ctx );
+static void prvEndSliceIfDue( size_t written );
+static void prvPatchProgress( uint8_t percent );
+
+/* Patch and compressed image formats, by name in the job document and by file extension. */
+static const OtaDeltaEngine_t deltaEngines[] =
+{
+    { "janpatch",   ".patch",  true,  prvApplyJanpatch         },
+    { "hsdiff",     ".hsdiff", true,  OtaHsdiff_Apply          },
+    { "heatshrink", ".hs",     false, OtaHeatshrink_ApplyImage },
+};
 
 bool ApplyPatch( esp_ota_context_t * ota_ctx)
 {
-    bool xReturn = 0;
+    esp_partition_context_t patchCtx = { 0 };
 
-    esp_partition_context_t sourceCtx = { 0 }, patchCtx = { 0 }, targetCtx = { 0} ;
-    unsigned char *source_buffer = NULL, *patch_buffer = NULL, *target_buffer = NULL;
+    /* Set patch partition context. */
+    patchCtx.partition = ota_ctx->patch_partition;
+    patchCtx.size = ota_ctx->data_write_len;
+
+    return prvRunDeltaEngine( ota_ctx, &patchCtx, NULL, false );
+}
+
+bool ApplyPatchStreamStart( esp_ota_context_t * ota_ctx, OtaPatchStream_t * pStream, const OtaPatchProgress_t * pResume,
+                            OtaPatchCheckpoint_t checkpoint, uint32_t checkpointInterval )
+{
+    memset( &patchApplier, 0x00, sizeof( PatchApplier_t ) );
+
+    patchApplier.ota_ctx = ota_ctx;
+    patchApplier.stream = pStream;
+    patchApplier.checkpoint = checkpoint;
+    patchApplier.checkpointInterval = checkpointInterval;
+
+    if ( pResume != NULL )
+    {
+        patchApplier.start = *pResume;
+        patchApplier.resume = true;
+        patchApplier.lastCheckpoint = pResume->patchOffset;
+    }
+
+    patchApplier.done = xSemaphoreCreateBinary();
+    if ( patchApplier.done == NULL )
+    {
+        ESP_LOGE(TAG, "Failed to create the patch task semaphore." );
+        return false;
+    }
+
+    /* Same priority as the OTA task, which stores the blocks janpatch is waiting for. */
+    if ( xTaskCreate( prvPatchTask, PATCH_TASK_NAME, PATCH_TASK_STACK_SIZE, NULL, uxTaskPriorityGet( NULL ), NULL ) != pdPASS )
+    {
+        ESP_LOGE(TAG, "Failed to create the patch task." );
+        vSemaphoreDelete( patchApplier.done );
+        patchApplier.done = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+bool ApplyPatchStreamFinish( void )
+{
+    if ( patchApplier.done == NULL )
+    {
+        return false;
+    }
+
+    xSemaphoreTake( patchApplier.done, portMAX_DELAY );
+    vSemaphoreDelete( patchApplier.done );
+    patchApplier.done = NULL;
+
+    return patchApplier.result;
+}
+
+bool ApplyPatchStreamFailed( void )
+{
+    return patchApplier.finished && !patchApplier.result;
+}
+
+/* Runs janpatch over the patch stream, the patch is read as the OTA task stores it. */
+static void prvPatchTask( void *parameters )
+{
+    esp_partition_context_t patchCtx = { 0 };
+    bool result;
+
+    ( void ) parameters;
+
+    patchCtx.stream = patchApplier.stream;
+    patchCtx.size = patchApplier.stream->length;
+
+    result = prvRunDeltaEngine( patchApplier.ota_ctx, &patchCtx, patchApplier.resume ? &patchApplier.start : NULL,
+                                patchApplier.checkpoint != NULL );
+
+    /* An aborted stream looks like the end of the patch to janpatch. */
+    patchApplier.result = result && !patchApplier.stream->aborted;
+    patchApplier.finished = true;
+
+    ESP_LOGI(TAG, "Patch task done: %s, waited %lu ms for the download",
+             patchApplier.result ? "target written" : "failed", (uint32_t)( patchApplier.stream->readWaitUs / 1000U ) );
+
+    /* Let the OTA task stop requesting blocks for a patch that cannot be applied. */
+    if ( !patchApplier.result && ( patchApplier.stream->notify != NULL ) )
+    {
+        patchApplier.stream->notify();
+    }
+
+    xSemaphoreGive( patchApplier.done );
+    vTaskDelete( NULL );
+}
+
+/*
+ * janpatch checkpoint hook, called between two operations. About every checkpointInterval
+ * patch bytes, the target is flushed and the positions are reported, provided the patch
+ * digest is known at the start of the page being read, where the download would resume.
+ */
+static void prvCheckpointPatch( janpatch_ctx *ctx )
+{
+    uint32_t patchOffset = ( uint32_t ) ctx->patch_buffer.position;
+    OtaPatchProgress_t progress = { 0 };
+    mbedtls_sha256_context patchDigest;
+
+    if ( ( patchApplier.checkpoint == NULL ) || ( ( patchOffset - patchApplier.lastCheckpoint ) < patchApplier.checkpointInterval ) )
+    {
+        return;
+    }
+
+    progress.streamOffset = patchOffset - ( patchOffset % PATCH_BUFFER_SIZE );
+
+    if ( !OtaPatchStream_GetSnapshot( patchApplier.stream, progress.streamOffset, &patchDigest ) )
+    {
+        return;
+    }
+
+    jp_flush_target( ctx );
+
+    if ( OtaFlashWriter_Flush( ctx->target_buffer.stream->writer ) == ESP_OK )
+    {
+        progress.patchOffset = patchOffset;
+        progress.sourceOffset = ( uint32_t ) ctx->source_buffer.position;
+        progress.targetOffset = ( uint32_t ) ctx->target_buffer.position;
+
+        patchApplier.checkpoint( &progress, &patchDigest );
+        patchApplier.lastCheckpoint = patchOffset;
+    }
+
+    mbedtls_sha256_free( &patchDigest );
+}
+
+/*
+ * Rebuilds the target image from the running image and the patch read through patchCtx,
+ * with the delta engine of the job. pStart gives the positions to resume from, NULL to
+ * start at the beginning.
+ */
+static bool prvRunDeltaEngine( esp_ota_context_t * ota_ctx, esp_partition_context_t * pPatchCtx, const OtaPatchProgress_t * pStart,
+                               bool checkpoint )
+{
+    bool xReturn = true;
+
+    esp_partition_context_t sourceCtx = { 0 }, targetCtx = { 0} ;
+    OtaFlashWriter_t targetWriter;
+    OtaImageVerifier_t *targetVerifier = NULL;
+    OtaPageCache_t sourceCache;
+    OtaDeltaStreams_t streams = { &sourceCtx, pPatchCtx, &targetCtx, &prvfread, &prvfwrite, &prvfseek, &prvPatchProgress };
 
     /* Set source partition context.*/
     sourceCtx.partition = esp_ota_get_running_partition();
     sourceCtx.size = sourceCtx.partition->size;
-    source_buffer = (unsigned char *) pvPortMalloc( PATCH_BUFFER_SIZE );
 
-    if ( source_buffer == NULL )
+    /* Set target partition context. */
+    targetCtx.partition = ota_ctx->update_partition;
+    targetCtx.size = ota_ctx->update_partition->size;
+
+    if ( !OtaFlashWriter_Init( &targetWriter, prvWritePartition, (void *)targetCtx.partition, OTA_FLASH_DOUBLE_BUFFER ) )
     {
-        ESP_LOGE(TAG, "pvPortMalloc failed allocating %d bytes for source_buffer.", PATCH_BUFFER_SIZE );
-        return 0;
+        return false;
     }
+    targetCtx.writer = &targetWriter;
 
-    /* Set desitination partition context. */
-    patchCtx.partition = ota_ctx->patch_partition;
-    patchCtx.size = ota_ctx->data_write_len;
-    patch_buffer = (unsigned char *)pvPortMalloc( PATCH_BUFFER_SIZE );
-    if ( patch_buffer == NULL )
+    /* The rebuilt image is hashed as it is written, it is not read back. */
+    if ( ota_ctx->has_target_digest )
     {
-        ESP_LOGE(TAG, "pvPortMalloc failed allocating %d bytes for patch_buffer.", PATCH_BUFFER_SIZE );
-        free( source_buffer );
-        return 0;
+        targetVerifier = (OtaImageVerifier_t *)pvPortMalloc( sizeof( OtaImageVerifier_t ) );
+        if ( targetVerifier == NULL )
+        {
+            ESP_LOGE(TAG, "pvPortMalloc failed allocating the target verifier." );
+            OtaFlashWriter_Deinit( &targetWriter );
+            return false;
+        }
+        OtaImageVerifier_Init( targetVerifier, false );
+        OtaImageVerifier_SetDigest( targetVerifier, ota_ctx->target_digest );
+        targetCtx.verifier = targetVerifier;
     }
 
-    /* Set target partition context. */
-    targetCtx.partition = ota_ctx->update_partition;
-    target_buffer = (unsigned char *)pvPortMalloc( PATCH_BUFFER_SIZE );
-    if ( target_buffer == NULL )
+    /* Without a cache the source is read from flash a page at a time. */
+    if ( ota_ctx->delta_engine->readsSource &&
+         OtaPageCache_Init( &sourceCache, prvReadPartition, (void *)sourceCtx.partition, sourceCtx.size,
+                            PATCH_BUFFER_SIZE, prvSourceCachePages(), PATCH_READ_AHEAD ) )
     {
-        ESP_LOGE(TAG, "pvPortMalloc failed allocating %d bytes for target_buffer.", PATCH_BUFFER_SIZE );
-        free( source_buffer );
-        free( patch_buffer );
-        return 0;
+        sourceCtx.cache = &sourceCache;
     }
 
-     /* Set janpatch context.*/
-    janpatch_ctx jCtx =
+    /* Resume at the positions of the checkpoint, the target before them is already in flash. */
+    if ( pStart != NULL )
     {
-        { source_buffer, PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0},
-        { patch_buffer,  PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0} ,
-        { target_buffer, PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0},
-        &prvfread,
-        &prvfwrite,
-        &prvfseek,
-        &prvftell,
-        //&prvPatchProgress,
-        NULL,
-        0
-    };
+        xReturn = prvPrepareResumedTarget( ota_ctx, pStart->targetOffset, targetVerifier );
+
+        ESP_LOGI(TAG, "Resuming the patch at offset %lu, target offset %lu", pStart->patchOffset, pStart->targetOffset );
+        targetCtx.written_end = pStart->targetOffset;
+    }
 
     /* Patch the base version. */
-    xReturn = janpatch( jCtx, &sourceCtx, &patchCtx, &targetCtx );
-    if( xReturn == 0 )
+    int64_t applyStartUs = esp_timer_get_time();
+
+    memset( &patchSlicer, 0x00, sizeof( PatchSlicer_t ) );
+    patchSlicer.sliceStartUs = applyStartUs;
+    patchSlicer.report = ota_ctx->patch_progress;
+
+    if ( xReturn )
+    {
+        xReturn = ota_ctx->delta_engine->apply( &streams, pStart, checkpoint );
+    }
+
+    /* The last sectors of the target may still be buffered. */
+    if ( OtaFlashWriter_Flush( &targetWriter ) != ESP_OK )
+    {
+        xReturn = false;
+    }
+    uint32_t applyMs = (uint32_t)( ( esp_timer_get_time() - applyStartUs ) / 1000 );
+
+    ESP_LOGI(TAG, "%s patch applied in %lu ms (%lu KB/s of target), %lu bytes in %lu flash writes, %lu ms writing",
+             ota_ctx->delta_engine->name, applyMs, ( applyMs > 0 ) ? (uint32_t)( targetCtx.offset / applyMs ) : 0U,
+             targetWriter.bytesWritten, targetWriter.flashWrites, (uint32_t)( targetWriter.writeTimeUs / 1000U ) );
+    ESP_LOGI(TAG, "Yielded %lu times, every %d KB of target, at most %lu ms between two yields",
+             patchSlicer.slices, PATCH_SLICE_SIZE / 1024, (uint32_t)( patchSlicer.maxSliceUs / 1000 ) );
+    OtaFlashWriter_Deinit( &targetWriter );
+
+    if ( targetVerifier != NULL )
+    {
+        if ( xReturn && !OtaImageVerifier_Finish( targetVerifier ) )
+        {
+            ESP_LOGE(TAG, "The patched image does not match the expected digest" );
+            xReturn = false;
+        }
+        OtaImageVerifier_Free( targetVerifier );
+        free( targetVerifier );
+    }
+
+    if( xReturn )
     {
         ota_ctx->data_write_len = targetCtx.offset;
     }
 
+    if ( sourceCtx.cache != NULL )
+    {
+        ESP_LOGI(TAG, "Source cache: %lu pages%s, %lu hits (%lu loaded ahead), %lu misses, %lu ms reading, %lu ms waiting",
+                 sourceCache.numPages, sourceCache.readAhead ? " with read-ahead" : "", sourceCache.hits,
+                 sourceCache.prefetchHits, sourceCache.misses, (uint32_t)( sourceCache.readTimeUs / 1000U ),
+                 (uint32_t)( sourceCache.waitTimeUs / 1000U ) );
+        OtaPageCache_Deinit( &sourceCache );
+    }
+
+    return xReturn;
+}
+
+/* Delta engine of JojoDiff patches, applied by janpatch. */
+static bool prvApplyJanpatch( const OtaDeltaStreams_t * pStreams, const OtaPatchProgress_t * pStart, bool checkpoint )
+{
+    int xReturn = 1;
+    unsigned char *source_buffer = NULL, *patch_buffer = NULL, *target_buffer = NULL;
+
+    source_buffer = (unsigned char *) pvPortMalloc( PATCH_BUFFER_SIZE );
+    patch_buffer = (unsigned char *)pvPortMalloc( PATCH_BUFFER_SIZE );
+    target_buffer = (unsigned char *)pvPortMalloc( PATCH_BUFFER_SIZE );
+
+    if ( ( source_buffer == NULL ) || ( patch_buffer == NULL ) || ( target_buffer == NULL ) )
+    {
+        ESP_LOGE(TAG, "pvPortMalloc failed allocating the %d byte janpatch buffers.", PATCH_BUFFER_SIZE );
+    }
+    else
+    {
+        /* Set janpatch context.*/
+        janpatch_ctx jCtx =
+        {
+            { source_buffer, PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0},
+            { patch_buffer,  PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0} ,
+            { target_buffer, PATCH_BUFFER_SIZE, 0xffffffff, 0, NULL, 0},
+            pStreams->fread,
+            pStreams->fwrite,
+            pStreams->fseek,
+            &prvftell,
+            pStreams->progress,
+            0,
+            checkpoint ? prvCheckpointPatch : NULL
+        };
+
+        if ( pStart != NULL )
+        {
+            jCtx.source_buffer.position = pStart->sourceOffset;
+            jCtx.patch_buffer.position = pStart->patchOffset;
+            jCtx.target_buffer.position = pStart->targetOffset;
+        }
+
+        xReturn = janpatch( jCtx, pStreams->source, pStreams->patch, pStreams->target );
+    }
+
     /* Release the buffers. */
     free( source_buffer );
     free( patch_buffer );
@@ -92,59 +416,136 @@ bool ApplyPatch( esp_ota_context_t * ota_ctx)
 
     return ( xReturn == 0 );
 }
-/* Returns true if the file recieved is delta, false otherwise. */
-static bool prvIsPatchFile( const char *pFilePath )
+
+/*
+ * The target partition is not erased when resuming. Erases it from the sector holding
+ * targetOffset, keeping what was written before, and hashes the kept part.
+ */
+static bool prvPrepareResumedTarget( esp_ota_context_t * ota_ctx, uint32_t targetOffset, OtaImageVerifier_t * pVerifier )
+{
+    const esp_partition_t *partition = ota_ctx->update_partition;
+    uint32_t sectorOffset = targetOffset - ( targetOffset % OTA_FLASH_SECTOR_SIZE );
+    uint8_t *sector = NULL;
+    esp_err_t err = ESP_OK;
+
+    sector = (uint8_t *)pvPortMalloc( OTA_FLASH_SECTOR_SIZE );
+    if ( sector == NULL )
+    {
+        ESP_LOGE(TAG, "pvPortMalloc failed allocating %d bytes for the resumed sector.", OTA_FLASH_SECTOR_SIZE );
+        return false;
+    }
+
+    /* Hash the sectors kept as they are. */
+    for ( uint32_t offset = 0; ( offset < sectorOffset ) && ( err == ESP_OK ); offset += OTA_FLASH_SECTOR_SIZE )
+    {
+        err = esp_partition_read( partition, offset, sector, OTA_FLASH_SECTOR_SIZE );
+
+        if ( ( err == ESP_OK ) && ( pVerifier != NULL ) )
+        {
+            OtaImageVerifier_Update( pVerifier, sector, OTA_FLASH_SECTOR_SIZE );
+        }
+    }
+
+    /* The partially written sector is erased with the rest and its start written back. */
+    if ( err == ESP_OK )
+    {
+        err = esp_partition_read( partition, sectorOffset, sector, targetOffset - sectorOffset );
+    }
+    if ( err == ESP_OK )
+    {
+        err = esp_partition_erase_range( partition, sectorOffset, partition->size - sectorOffset );
+    }
+    if ( ( err == ESP_OK ) && ( targetOffset > sectorOffset ) )
+    {
+        err = esp_partition_write( partition, sectorOffset, sector, targetOffset - sectorOffset );
+
+        if ( ( err == ESP_OK ) && ( pVerifier != NULL ) )
+        {
+            OtaImageVerifier_Update( pVerifier, sector, targetOffset - sectorOffset );
+        }
+    }
+
+    free( sector );
+
+    if ( err != ESP_OK )
+    {
+        ESP_LOGE(TAG, "Failed to prepare the target partition for resuming: %d", err );
+        return false;
+    }
+
+    return true;
+}
+
+/* Returns the delta engine of the received file, NULL if it is a full image. */
+static const OtaDeltaEngine_t * prvFindDeltaEngine( const char *pFilePath, const char *pDeltaFormat )
 {
     
     const char * patchFileExt = strrchr( pFilePath, '.' );
-    bool xReturn = false;
+    const OtaDeltaEngine_t * pEngine = NULL;
 
-    if ( patchFileExt != NULL )
-    { 
-        /* Check if the file is a patch file. */
-        if ( !strncmp( patchFileExt, PATCH_FILE_EXTENSION , sizeof( PATCH_FILE_EXTENSION ) ) )
+    for ( size_t i = 0; i < sizeof( deltaEngines ) / sizeof( deltaEngines[ 0 ] ); i++ )
+    {
+        /* The format given by the job document takes precedence over the extension. */
+        if ( pDeltaFormat != NULL )
         {
-            xReturn = true;
-            ESP_LOGI(TAG,"Received file is a patch." );
+            if ( !strcmp( pDeltaFormat, deltaEngines[ i ].name ) )
+            {
+                pEngine = &deltaEngines[ i ];
+            }
         }
+        else if ( ( patchFileExt != NULL ) && !strcmp( patchFileExt, deltaEngines[ i ].extension ) )
+        {
+            pEngine = &deltaEngines[ i ];
+        }
+    }
 
+    if ( pEngine != NULL )
+    {
+        ESP_LOGI(TAG,"Received file is in %s format.", pEngine->name );
     }
-    else
+    else if ( pDeltaFormat != NULL )
+    {
+        ESP_LOGE(TAG,"Unknown delta format %s. OTA full file", pDeltaFormat );
+    }
+    else if ( patchFileExt == NULL )
     {
         ESP_LOGE(TAG,"No extension in the received filename. OTA full file" );
     }
 
-    return xReturn;
+    return pEngine;
 }
 
-bool SetOTAUpdateContext( const char * filePath, esp_ota_context_t * ota_ctx)
+bool SetOTAUpdateContext( const char * filePath, const char * pDeltaFormat, esp_ota_context_t * ota_ctx, bool resume)
 {
     bool xReturn = false;
-    memset(ota_ctx, '0', sizeof(esp_ota_context_t));
+    const OtaDeltaEngine_t * pEngine = NULL;
+    memset(ota_ctx, 0x00, sizeof(esp_ota_context_t));
 
     /* Check if the file is a patch. */
     ESP_LOGE(TAG, "FILE PATH %s", filePath);
 
-    if ( prvIsPatchFile( filePath ) )
+    pEngine = prvFindDeltaEngine( filePath, pDeltaFormat );
+
+    if ( pEngine != NULL )
     {
         /* Create a patch file. */                
-        xReturn = prvCreatePatchFile( ota_ctx );
+        xReturn = prvCreatePatchFile( ota_ctx, resume );
+        ota_ctx->delta_engine = pEngine;
     }
     else
     {
         /* Create an ota file. */
-        xReturn = prvCreateOtaFile( ota_ctx );
+        xReturn = prvCreateOtaFile( ota_ctx, resume );
     }
 
     return xReturn;
 }
 
-/* Create file for storing the full ota image. */
-static bool prvCreateOtaFile(esp_ota_context_t * ota_ctx)
+/* Create file for storing the full ota image.
+ * When resuming, the partition is not erased so the blocks already written are kept.
+ */
+static bool prvCreateOtaFile(esp_ota_context_t * ota_ctx, bool resume)
 {
-    esp_ota_handle_t update_handle;
-    esp_err_t err;
-
     const esp_partition_t * update_partition = esp_ota_get_next_update_partition( NULL );
 
     if( update_partition == NULL )
@@ -156,45 +557,64 @@ static bool prvCreateOtaFile(esp_ota_context_t * ota_ctx)
     ESP_LOGI( TAG, "Writing to partition subtype %d at offset 0x%"PRIx32"",
                update_partition->subtype, update_partition->address );
 
-    
-    err = esp_ota_begin( update_partition, OTA_SIZE_UNKNOWN, &update_handle );
-
-    if( err != ESP_OK )
+    if( !OtaImageFile_Open( &ota_ctx->update_file, update_partition, resume ) )
     {
-        ESP_LOGE( TAG, "esp_ota_begin failed (%d)", err  );
         return false;
     }
 
     ota_ctx->update_partition = update_partition;
-    ota_ctx->update_handle = update_handle;
     ota_ctx->OtaPartition_type = OtaUpdatePartition;
     ota_ctx->valid_image = false;   
 
-    ESP_LOGI( TAG, "esp_ota_begin succeeded" );
+    ESP_LOGI( TAG, "Update partition opened" );
     return true;
 }
 /* Create file for storing patch data. */
-static bool prvCreatePatchFile( esp_ota_context_t * ota_ctx )
+static bool prvCreatePatchFile( esp_ota_context_t * ota_ctx, bool resume )
 {
     bool xReturn = false;
 
     const esp_partition_t *patch_partition = NULL;
 
+    /* The patch is applied as it arrives, the target is written to the update partition. */
+    if ( OTA_STREAM_PATCH )
+    {
+        if( !prvCreateOtaFile( ota_ctx, resume ))
+        {
+            ESP_LOGE( TAG, "Failed to set update partition. \n" );
+            return false;
+        }
+
+        ota_ctx->OtaPartition_type = OtaStreamPatch;
+
+        /* The patch task writes the target with esp_partition_write(). */
+        OtaImageFile_WriteDirectly( &ota_ctx->update_file );
+
+        return true;
+    }
+
     /* Find the OTA patch partiton. */
     patch_partition = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, PATCH_PARTITION_NAME );
 
-    if( !prvCreateOtaFile( ota_ctx ))
+    /* The target image is rebuilt from scratch, only the patch is resumed. */
+    if( !prvCreateOtaFile( ota_ctx, false ))
     {
         ESP_LOGE( TAG, "Failed to set update partition. \n" );
         return false;
     }
 
+    /* ApplyPatch() writes the target with esp_partition_write(). */
+    OtaImageFile_WriteDirectly( &ota_ctx->update_file );
+
     if ( patch_partition != NULL) 
     {
         ESP_LOGI( TAG, "Found %s partition.", PATCH_PARTITION_NAME );
 
         /* Erase the partiton. */
-        esp_partition_erase_range( patch_partition, 0, patch_partition->size );        
+        if ( !resume )
+        {
+            esp_partition_erase_range( patch_partition, 0, patch_partition->size );
+        }
 
         /* Set ota context. */
         ota_ctx->patch_partition   = patch_partition;
@@ -254,6 +674,24 @@ static int prvfseek( esp_partition_context_t *fileCtx, long int offset, int when
 static size_t prvfread( void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx )
 {
     esp_err_t esp_ret = ESP_FAIL;
+
+    /* The source image is read through the page cache. */
+    if ( pCtx->cache != NULL )
+    {
+        size_t read = OtaPageCache_Read( pCtx->cache, pCtx->offset, buffer, size * count );
+
+        pCtx->offset += read;
+        return read;
+    }
+
+    /* A streamed patch is read from the download window, waiting for the blocks. */
+    if ( pCtx->stream != NULL )
+    {
+        size_t read = OtaPatchStream_Read( pCtx->stream, pCtx->offset, buffer, size * count );
+
+        pCtx->offset += read;
+        return read;
+    }
     
     esp_ret = esp_partition_read( pCtx->partition, pCtx->offset, buffer, size * count );
 
@@ -280,27 +718,123 @@ static size_t prvfread( void *buffer, size_t size, size_t count, esp_partition_c
 /* Write block of data to partition. */
 static size_t prvfwrite( const void *buffer, size_t size, size_t count, esp_partition_context_t *pCtx )
 {
-    esp_err_t esp_ret = ESP_FAIL;
+    esp_err_t esp_ret = ESP_OK;
+    const uint8_t *data = (const uint8_t *)buffer;
+    size_t length = size * count;
+    size_t skip = 0;
 
-    ESP_LOGE(TAG, "Tipo: 0x%x\n", pCtx->partition->type);
-    ESP_LOGE(TAG, "Subtipo: 0x%x\n", pCtx->partition->subtype);
-    ESP_LOGE(TAG, "Dirección de comienzo: 0x%lx\n", pCtx->partition->address);
-
-    esp_ret = esp_partition_write( pCtx->partition, pCtx->offset, buffer, size * count );
+    /* Pages flushed at a checkpoint are written again, only the part after written_end is new. */
+    if ( pCtx->written_end > pCtx->offset )
+    {
+        skip = pCtx->written_end - pCtx->offset;
+        if ( skip > length )
+        {
+            skip = length;
+        }
+    }
 
-    //esp_ret = esp_ota_write_with_offset( ota_ctx.update_handle, data, dataLength, totalBytesReceived );
+    if ( skip < length )
+    {
+        if ( pCtx->writer != NULL )
+        {
+            esp_ret = OtaFlashWriter_Write( pCtx->writer, pCtx->offset + skip, data + skip, length - skip );
+        }
+        else
+        {
+            esp_ret = esp_partition_write( pCtx->partition, pCtx->offset + skip, data + skip, length - skip );
+        }
+    }
 
     if ( esp_ret != ESP_OK )
     {
-        ESP_ERROR_CHECK(esp_ret);
         ESP_LOGE(TAG, "esp_partition_write error: %d\n", esp_ret);
         return 0;
     }
 
+    /* janpatch writes the target sequentially, so the data is hashed in order. */
+    if ( ( pCtx->verifier != NULL ) && ( skip < length ) )
+    {
+        OtaImageVerifier_Update( pCtx->verifier, data + skip, length - skip );
+    }
+
     /* Udpate offset. */
-    pCtx->offset += ( size * count );
+    pCtx->offset += length;
 
-    return ( size * count );
+    if ( pCtx->offset > pCtx->written_end )
+    {
+        pCtx->written_end = pCtx->offset;
+    }
+
+    prvEndSliceIfDue( length );
+
+    return length;
+}
+
+/*
+ * Yields once PATCH_SLICE_SIZE target bytes were written since the last yield. The time
+ * between two yields bounds how long the MQTT agent waits for the CPU while a patch is applied.
+ */
+static void prvEndSliceIfDue( size_t written )
+{
+    int64_t sliceUs;
+
+    patchSlicer.sliceWritten += written;
+
+    if ( patchSlicer.sliceWritten < PATCH_SLICE_SIZE )
+    {
+        return;
+    }
+
+    sliceUs = esp_timer_get_time() - patchSlicer.sliceStartUs;
+    if ( sliceUs > patchSlicer.maxSliceUs )
+    {
+        patchSlicer.maxSliceUs = sliceUs;
+    }
+    patchSlicer.slices++;
+    patchSlicer.sliceWritten = 0;
+
+    /* A delay rather than taskYIELD(), the idle task runs as well as the tasks of the same priority. */
+    vTaskDelay( 1 );
+
+    patchSlicer.sliceStartUs = esp_timer_get_time();
+}
+
+/* Progress hook of the delta engines, the job is updated every PATCH_PROGRESS_STEP percent. */
+static void prvPatchProgress( uint8_t percent )
+{
+    if ( ( patchSlicer.report == NULL ) || ( percent < patchSlicer.reportedPercent + PATCH_PROGRESS_STEP ) )
+    {
+        return;
+    }
+
+    patchSlicer.reportedPercent = percent - ( percent % PATCH_PROGRESS_STEP );
+    patchSlicer.report( patchSlicer.reportedPercent );
+}
+
+/* Flash write function of the target writer, pContext is the partition. */
+static esp_err_t prvWritePartition( void *pContext, uint32_t offset, const void *pData, size_t length )
+{
+    return esp_partition_write( (const esp_partition_t *)pContext, offset, pData, length );
+}
+
+/* Flash read function of the source cache, pContext is the partition. */
+static esp_err_t prvReadPartition( void *pContext, uint32_t offset, void *pData, size_t length )
+{
+    return esp_partition_read( (const esp_partition_t *)pContext, offset, pData, length );
+}
+
+/* As many source pages as configured, as long as PATCH_HEAP_RESERVE bytes stay free. */
+static uint32_t prvSourceCachePages( void )
+{
+    size_t freeHeap = heap_caps_get_free_size( MALLOC_CAP_8BIT );
+    uint32_t pages = ( freeHeap > PATCH_HEAP_RESERVE ) ? ( freeHeap - PATCH_HEAP_RESERVE ) / PATCH_BUFFER_SIZE : 0;
+
+    if ( pages > PATCH_SOURCE_CACHE_PAGES )
+    {
+        pages = PATCH_SOURCE_CACHE_PAGES;
+    }
+
+    return ( pages > 0 ) ? pages : 1;
 }
 
 /* Get current offset in partition. */
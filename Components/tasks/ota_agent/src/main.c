@@ -1,14 +1,16 @@
 /* Standard C Library Headers */
+#include <stdlib.h>
 #include <string.h>
 
 /* esp-idf Headers*/
+#include "esp_app_format.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
-#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 /* AWS IoT SDK Headers */
@@ -25,59 +27,174 @@
  * Application-specific headers for OTA and MQTT operations
  */
 #include "mqtt_agent.h"
+#include "mqtt_async_publish.h"
+#include "mqtt_deferred_dispatch.h"
+#include "mqtt_bandwidth.h"
 #include "mqtt_common.h"
+#include "mqtt_topic_registry.h"
 #include "ota_agent.h"
+#include "ota_block_decoder.h"
+#include "ota_block_sizer.h"
+#include "ota_block_window.h"
+#include "ota_checkpoint.h"
+#include "ota_data_ring.h"
+#include "ota_flash_writer.h"
+#include "ota_image_verifier.h"
+#include "ota_manifest.h"
+#include "ota_patch_stream.h"
+#include "ota_staging.h"
 
 /*
  * Macro Definitions
  * Defines constants, sizes, and other parameters for the application
  */
 
-#define MAX_MESSAGES 5
+/* Number of block requests kept outstanding during the download. */
+#if defined(CONFIG_OTA_AGENT_BLOCK_WINDOW_SIZE)
+    #define OTA_BLOCK_WINDOW_SIZE CONFIG_OTA_AGENT_BLOCK_WINDOW_SIZE
+#else
+    #define OTA_BLOCK_WINDOW_SIZE 4U
+#endif
+
+/* Number of data block buffers shared between the MQTT agent task and the OTA task. */
+#if defined(CONFIG_OTA_AGENT_DATA_RING_SIZE)
+    #define OTA_DATA_RING_SIZE CONFIG_OTA_AGENT_DATA_RING_SIZE
+#else
+    #define OTA_DATA_RING_SIZE 4U
+#endif
+
+/* Number of newly stored blocks between two download checkpoints, 0 disables resuming downloads. */
+#if defined(CONFIG_OTA_AGENT_CHECKPOINT_INTERVAL)
+    #define OTA_CHECKPOINT_INTERVAL CONFIG_OTA_AGENT_CHECKPOINT_INTERVAL
+#else
+    #define OTA_CHECKPOINT_INTERVAL 16U
+#endif
+
+/* Encoding of the stream data blocks, unless the job document asks for another one. */
+#if defined(CONFIG_OTA_AGENT_STREAM_DATA_JSON)
+    #define OTA_STREAM_DATA_TYPE DATA_TYPE_JSON
+#else
+    #define OTA_STREAM_DATA_TYPE DATA_TYPE_CBOR
+#endif
+
+/* Bytes of a streamed patch held between the download and the patch task. */
+#if defined(CONFIG_OTA_AGENT_PATCH_STREAM_SIZE)
+    #define OTA_PATCH_STREAM_SIZE CONFIG_OTA_AGENT_PATCH_STREAM_SIZE
+#else
+    #define OTA_PATCH_STREAM_SIZE 16384U
+#endif
+
+/* Chunks of a full image found in the running image are copied instead of downloaded. */
+#if defined(CONFIG_OTA_AGENT_CHUNK_DEDUP)
+    #define OTA_CHUNK_DEDUP true
+#else
+    #define OTA_CHUNK_DEDUP false
+#endif
+
+/* Block requests kept outstanding while a staged image is downloaded in the background. */
+#if defined(CONFIG_OTA_AGENT_STAGED_BLOCK_WINDOW_SIZE)
+    #define OTA_STAGED_BLOCK_WINDOW_SIZE CONFIG_OTA_AGENT_STAGED_BLOCK_WINDOW_SIZE
+#else
+    #define OTA_STAGED_BLOCK_WINDOW_SIZE 1U
+#endif
+
+/* Smallest part blocks are requested in on a lossy link, the block size disables the adaptive size. */
+#if defined(CONFIG_OTA_AGENT_MIN_BLOCK_SIZE)
+    #define OTA_MIN_BLOCK_SIZE CONFIG_OTA_AGENT_MIN_BLOCK_SIZE
+#else
+    #define OTA_MIN_BLOCK_SIZE 1024U
+#endif
+
+/* Files a job may carry besides its application image. */
+#if defined(CONFIG_OTA_AGENT_MAX_DATA_FILES)
+    #define OTA_MAX_DATA_FILES CONFIG_OTA_AGENT_MAX_DATA_FILES
+#else
+    #define OTA_MAX_DATA_FILES 3U
+#endif
+
+/* Comma separated labels of the partitions data files may be written to, they are rewritten in place. */
+#if defined(CONFIG_OTA_AGENT_DATA_PARTITIONS)
+    #define OTA_DATA_PARTITIONS CONFIG_OTA_AGENT_DATA_PARTITIONS
+#else
+    #define OTA_DATA_PARTITIONS ""
+#endif
+
+/*
+ * Block notifications and requests are coalesced, the queue holds one of each besides the control events.
+ * The reserved slots keep room for the transitions the OTA task sends itself, such as OtaEventFinishDownload.
+ */
+#define MAX_MESSAGES      7U
+#define RESERVED_MESSAGES 2U
 #define MAX_MSG_SIZE sizeof(OtaEventMsg_t)
 
 /* Maximum size of the file which can be downloaded */
-#define CONFIG_MAX_FILE_SIZE    1843200U
-#define NUM_OF_BLOCKS_REQUESTED 1U
+#define CONFIG_MAX_FILE_SIZE 1843200U
 
-#define MAX_NUM_OF_OTA_DATA_BUFFERS 1U
-#define UPDATE_JOB_MSG_LENGTH       48U
+#define UPDATE_JOB_MSG_LENGTH 48U
 
-#define NUMBER_OF_SUBSCRIPTIONS    2
-#define STREAM_DATA_ACCEPTED_TOPIC "$aws/things/%s/streams/%s/data/json"
-#define STREAM_DATA_REJECTED_TOPIC "$aws/things/%s/streams/%s/rejected/json"
+#define FLASH_SECTOR_SIZE      4096U
+#define ERASED_CHECK_READ_SIZE 256U
 
-#define SUCCESS_OTA_STATUS_DETAILS "{\"Code\": \"200\", \"Message\": \"Successful ota update\"}"
-#define FAILED_OTA_STATUS_DETAILS  "{\"Code\": \"400\", \"Error\": \"Failed to ota update\"}"
+#define NUMBER_OF_SUBSCRIPTIONS 2
+
+/* Optional job document field selecting the stream data encoding, "json" or "cbor". */
+#define STREAM_DATA_TYPE_JOB_KEY "afr_ota.streamDataType"
+
+/* Optional job document field with the SHA-256 of the image to boot, as 64 hex characters. */
+#define IMAGE_DIGEST_JOB_KEY "afr_ota.files[0].sha256"
+
+/* Optional job document field naming the format of the file, "janpatch", "hsdiff" or "heatshrink". */
+#define DELTA_FORMAT_JOB_KEY    "afr_ota.files[0].deltaFormat"
+#define DELTA_FORMAT_MAX_LENGTH 16U
+
+/* Optional job document fields with the stream file holding the chunk manifest of a full image. */
+#define MANIFEST_FILE_ID_JOB_KEY   "afr_ota.files[0].manifest.fileid"
+#define MANIFEST_FILE_SIZE_JOB_KEY "afr_ota.files[0].manifest.filesize"
 
 /*
- * Used as a mutex to synchronize access to the data buffer
+ * The application image is the first file of a job. Every other file names the data
+ * partition it is written to, and may give its SHA-256 like the image does; its
+ * signature is the "sig" of the file. They are downloaded after the image, which is
+ * booted once all of them are stored.
  */
-static SemaphoreHandle_t bufferSemaphore;
+#define DATA_FILE_PARTITION_JOB_KEY "afr_ota.files[%u].partition"
+#define DATA_FILE_DIGEST_JOB_KEY    "afr_ota.files[%u].sha256"
+#define DATA_FILE_JOB_KEY_LENGTH    32U
+
+/*
+ * Optional job document fields of staged updates. With "activation": "staged" the image is
+ * downloaded and verified but only booted by a job with "activate": true, or "activateAfter"
+ * seconds after it was staged.
+ */
+#define ACTIVATION_JOB_KEY     "afr_ota.activation"
+#define ACTIVATE_AFTER_JOB_KEY "afr_ota.activateAfter"
+#define ACTIVATE_JOB_KEY       "afr_ota.activate"
+
+/* Delay before the activation timer tries again to queue its event */
+#define ACTIVATION_RETRY_MS 100U
+
+#define SUCCESS_OTA_STATUS_DETAILS "{\"Code\": \"200\", \"Message\": \"Successful ota update\"}"
+#define FAILED_OTA_STATUS_DETAILS  "{\"Code\": \"400\", \"Error\": \"Failed to ota update\"}"
+#define STAGED_OTA_STATUS_DETAILS  "{\"Code\": \"202\", \"Message\": \"Image staged\"}"
+#define PATCH_PROGRESS_STATUS_DETAILS "{\"Code\": \"102\", \"Progress\": \"%u%%\"}"
+#define PATCH_PROGRESS_DETAILS_SIZE   48U
 
 static esp_ota_context_t ota_ctx;
 
-/* Data buffers for OTA events */
-static OtaDataEvent_t dataBuffers[MAX_NUM_OF_OTA_DATA_BUFFERS] = {0};
+/* Data buffers for OTA events, handed from the MQTT agent task to the OTA task through dataRing */
+static OtaDataEvent_t dataBuffers[OTA_DATA_RING_SIZE] = {0};
+static OtaDataRing_t dataRing;
+
+EventQueue_t* xOtaEventQueue;
+static EventQueue_t otaEventQueue;
 
-QueueHandle_t xOtaEventQueue;
 /*
- * Array containing pointer to the OTA event structures used
- * to send events to the OTA task.
+ * Storage of the OTA event queue, the events are copied into it.
 */
-static OtaEventMsg_t xqueueData[MAX_MESSAGES * MAX_MSG_SIZE];
-
-/* The variable used to hold the queue's data structure. */
-static StaticQueue_t xStaticQueue;
+static uint8_t xqueueData[EVENT_BUS_STORAGE_SIZE(MAX_MESSAGES, MAX_MSG_SIZE)];
 
 static char jobId[JOB_ID_LENGTH] = {0};
 
-/*
- * Topic Filters
- * Buffer used for subscription topics related to OTA api responses
- */
-static char* topic_filters[2] = {NULL, NULL};
-
 /*
  * MQTT File Downloader Context
  * Structure used to interact with the AWS IoT Streams API
@@ -102,18 +219,76 @@ const char* pOtaEventStrings[OtaEventMax + 1] = {
     "ReceivedJobDocument",
     "RequestFileBlock",
     "ReceivedFileBlock",
-    "FinishDownload"
+    "FinishDownload",
+    "ActivateImage"
+};
+
+/*
+ * What is done with an event sent to the full queue, block otherwise. Handling
+ * one request or block notification serves those sent after it, they are
+ * merged into the one queued.
+ */
+static const EventPolicy_t otaEventPolicies[OtaEventMax] = {
+    [OtaEventRequestFileBlock]  = EventPolicyCoalesce,
+    [OtaEventReceivedFileBlock] = EventPolicyCoalesce,
+    [OtaEventActivateImage]     = EventPolicyCoalesce,
 };
 
 static OtaState_t otaAgentState = OtaStateInit;
 
 /* OTA state tracking variables */
 
-static uint32_t totalBytesReceived   = 0;
-static uint32_t numOfBlocksRemaining = 0;
-static uint32_t currentBlockOffset   = 0;
-static uint32_t lastBlock            = 0;
-static uint16_t currentFileId        = 0;
+static uint32_t totalBytesReceived = 0;
+static uint16_t currentFileId      = 0;
+static uint32_t currentFileSize    = 0;
+static uint32_t downloadStartMs    = 0;
+
+/* Cost of decoding the stream data blocks, to compare the JSON and CBOR encodings */
+static uint32_t wireBytesReceived = 0;
+static uint32_t blocksDecoded     = 0;
+static uint64_t decodeTimeUs      = 0;
+
+/* Bytes copied on the way from the MQTT payload to flash */
+static uint32_t bytesCopied = 0;
+
+/* Outstanding block requests and received-block bitmap of the current download */
+static BlockWindow_t blockWindow = {0};
+
+/* Size of the parts blocks are requested in, from the losses and round trip times of the link */
+static OtaBlockSizer_t blockSizer = {0};
+
+/* Combines the received blocks into whole flash sectors */
+static OtaFlashWriter_t flashWriter = {0};
+
+/* Digest and signature check of the file, hashed in block order as the blocks are stored */
+static OtaImageVerifier_t imageVerifier = {0};
+static uint32_t blocksHashed            = 0;
+
+/* Patch handed to the patch task as it is downloaded, when it is applied on the fly */
+static OtaPatchStream_t patchStream = {0};
+static uint32_t blocksPublished     = 0;
+
+/* Manifest downloaded before a full image, while the window of the image waits in imageBlockWindow */
+static uint8_t* manifestData          = NULL;
+static BlockWindow_t imageBlockWindow = {0};
+static uint16_t imageFileId           = 0;
+static uint32_t imageFileSize         = 0;
+static uint32_t bytesDeduplicated     = 0;
+
+/* Data files of the current job, downloaded one after the other once the image is complete */
+static OtaDataFile_t dataFiles[OTA_MAX_DATA_FILES] = {0};
+static uint32_t numOfDataFiles                     = 0;
+static OtaDataFile_t* currentDataFile              = NULL;
+
+/* The image of the current job is staged instead of activated, see ACTIVATION_JOB_KEY */
+static bool stagedUpdate                  = false;
+static uint32_t activateAfterS            = 0;
+static esp_timer_handle_t activationTimer = NULL;
+
+/* Identity of the current download, stored in NVS so it can be resumed after a reboot */
+static OtaCheckpoint_t checkpoint     = {0};
+static bool checkpointEnabled         = false;
+static uint32_t blocksSinceCheckpoint = 0;
 
 /* Only Debug to detect stack size*/
 #if defined(CONFIG_ENABLE_STACK_WATERMARK)
@@ -124,20 +299,79 @@ static uint16_t currentFileId        = 0;
 static const char* TAG = "OTA_AGENT";
 
 static void prvProcessOTAEvents(void);
-static bool prvJobDocumentParser(char* message, size_t messageLength, AfrOtaJobDocumentFields_t* jobFields);
+static bool prvJobDocumentParser(const char* message, size_t messageLength, AfrOtaJobDocumentFields_t* jobFields);
 static void prvRequestDataBlock(void);
-static bool prvInitMqttDownloader(AfrOtaJobDocumentFields_t* jobFields);
-static void prvProcessReceivedDataBlock(OtaEventMsg_t recvEvent);
-static void prvHandleMqttStreamsBlockArrived(int32_t blockId, uint8_t* data, size_t dataLength);
+static void prvPublishBlockRequest(uint32_t partOffset, uint32_t numOfParts, uint8_t partShift);
+static void prvRequestMissingParts(uint32_t blockId, const BlockRequest_t* pRequest);
+static uint32_t prvGetNumOfParts(uint32_t blockId, uint8_t partShift);
+static uint8_t prvGetMaxPartShift(uint32_t fileSize);
+static bool prvLocateBlockPart(const OtaStreamBlock_t* block, uint32_t* pOffset);
+static void prvCompleteBlockPart(const OtaStreamBlock_t* block, uint32_t offset);
+static void prvHandleBlockTimeouts(void);
+static void prvAbortDownload(void);
+static void prvReleaseDownload(void);
+static bool prvIsDownloading(void);
+static void prvLogDownloadStats(void);
+static uint32_t prvGetTimeMs(void);
+static bool prvInitMqttDownloader(AfrOtaJobDocumentFields_t* jobFields, DataType_t dataType);
+static DataType_t prvGetStreamDataType(const char* jobDoc, size_t jobDocLength);
+static const char* prvGetDeltaFormat(const char* jobDoc, size_t jobDocLength, char* format);
+static bool prvDecodeDataBlock(OtaDataEvent_t* dataEvent, OtaStreamBlock_t* block);
+static bool prvLoadCheckpoint(const AfrOtaJobDocumentFields_t* jobFields);
+static void prvStartCheckpointing(bool resume);
+static void prvUpdateCheckpoint(void);
+static void prvStopCheckpointing(void);
+static void prvValidatePartialImage(void);
+static bool prvStartFlashWriter(void);
+static bool prvStartImageVerification(const AfrOtaJobDocumentFields_t* jobFields, const char* jobDoc, size_t jobDocLength);
+static void prvAdvanceImageDigest(const OtaStreamBlock_t* block);
+static bool prvHashStoredBlock(uint32_t blockId);
+static bool prvFinishImageVerification(void);
+static bool prvIsImageHeaderValid(uint32_t offset, const OtaStreamBlock_t* block);
+static const esp_partition_t* prvGetDownloadPartition(void);
+static esp_err_t prvStopFlashWriter(void);
+static bool prvStartPatchStream(bool resume);
+static bool prvStopPatchStream(bool abort);
+static void prvPublishPatchData(void);
+static void prvSavePatchCheckpoint(const OtaPatchProgress_t* progress, const mbedtls_sha256_context* patchDigest);
+static void prvNotifyPatchStream(void);
+static bool prvIsPatchStreamed(void);
+static void prvStartManifestDownload(const char* jobDoc, size_t jobDocLength, bool resume);
+static void prvFinishManifestDownload(void);
+static void prvStopManifestDownload(void);
+static void prvCopyLocalChunks(const OtaManifest_t* pManifest);
+static bool prvIsManifestDownloading(void);
+static esp_err_t prvWriteDownloadedData(void* pContext, uint32_t offset, const void* pData, size_t length);
+static bool prvIsFlashErased(const esp_partition_t* partition, uint32_t offset, uint32_t length);
+static uint32_t prvProcessReceivedDataBlocks(void);
+static void prvDiscardReceivedDataBlocks(void);
+static void prvProcessReceivedDataBlock(OtaDataEvent_t* dataEvent);
+static bool prvHandleMqttStreamsBlockArrived(uint32_t offset, const uint8_t* data, size_t dataLength);
 static void prvStreamDataIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo);
+static bool prvActivateNewImage(void);
 static bool prvFinishFirmwareUpdate(void);
+static bool prvFinishDownloadedFile(void);
+static bool prvAddDataFile(const char* jobDoc, size_t jobDocLength, uint8_t fileIndex, const AfrOtaJobDocumentFields_t* fields);
+static bool prvIsDataPartitionAllowed(const char* label);
+static bool prvStartNextDataFile(void);
+static esp_err_t prvWriteDataFile(void* pContext, uint32_t offset, const void* pData, size_t length);
+static void prvResetDownloadStats(void);
 static bool prvSubscribeStreamDataTopics(const char* streamName);
-static bool isRejectedTopic(char* receivedTopic);
 static void prvSendJobSuccessUpdate(void);
 static void prvSendJobFailedUpdate(void);
-static OtaDataEvent_t* prvGetOtaDataEventBuffer(void);
-static void prvFreeOtaDataEventBuffer(OtaDataEvent_t* const pxBuffer);
+static void prvReportPatchProgress(uint8_t percent);
+static void prvGetActivation(const char* jobDoc, size_t jobDocLength);
+static bool prvIsActivationJob(const char* jobDoc, size_t jobDocLength);
+static uint32_t prvGetBlockWindowSize(void);
+static bool prvStageNewImage(void);
+static void prvRestoreStagedImage(void);
+static void prvCancelStagedImage(void);
+static bool prvActivateStagedImage(void);
+static void prvStartActivationTimer(uint32_t seconds);
+static void prvActivationTimerCallback(void* pArg);
 static void prvPrint_partitions(void);
+static uint32_t prvEventType(const void* event);
+static void prvReleaseEvent(const void* event);
 
 void otaAgentTask(void* parameters)
 {
@@ -147,15 +381,26 @@ void otaAgentTask(void* parameters)
     uxHighWaterMark = uxTaskGetStackHighWaterMark(NULL);
 #endif
 
-    bufferSemaphore = xSemaphoreCreateMutex();
-
-    if (bufferSemaphore != NULL) {
-        memset(dataBuffers, 0x00, sizeof(dataBuffers));
-    }
-    xOtaEventQueue = InitEvent_FreeRTOS(MAX_MESSAGES, MAX_MSG_SIZE, (uint8_t*)xqueueData, &xStaticQueue, TAG);
+    OtaDataRing_Init(&dataRing, dataBuffers, OTA_DATA_RING_SIZE);
+
+    EventQueueConfig_t queueConfig = {
+        .name      = "OTA",
+        .eventSize = MAX_MSG_SIZE,
+        .depth     = MAX_MESSAGES,
+        .reserved  = RESERVED_MESSAGES,
+        .typeCount = OtaEventMax,
+        .typeOf    = prvEventType,
+        .policies  = otaEventPolicies,
+        .typeNames = pOtaEventStrings,
+        .release   = prvReleaseEvent,
+        .deadline  = pdMS_TO_TICKS(EVENT_BUS_SEND_DEADLINE_MS),
+    };
+    xOtaEventQueue = EventBus_InitQueue(&otaEventQueue, &queueConfig, xqueueData);
 
     nextEvent.eventId = OtaEventReady;
-    SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+    EventBus_Send(xOtaEventQueue, &nextEvent);
+
+    prvRestoreStagedImage();
 
     while (true) {
         prvProcessOTAEvents();
@@ -172,8 +417,36 @@ static void prvProcessOTAEvents(void)
     OtaEventMsg_t recvEvent = {0};
     OtaEvent_t recvEventId  = 0;
     OtaEventMsg_t nextEvent = {0};
+    TickType_t xTicksToWait = portMAX_DELAY;
+
+    /* While downloading, wake up in time to re-request blocks whose request timed out. */
+    if (prvIsDownloading()) {
+        uint32_t timeoutMs = BlockWindow_NextTimeoutMs(&blockWindow, prvGetTimeMs());
+
+        /* New blocks deferred by the bandwidth governor are requested once the OTA share allows it. */
+        uint32_t bandwidthMs = BandwidthGovernor_WaitTimeMs(BandwidthClassOta);
+
+        if ((bandwidthMs > 0U) && (bandwidthMs < timeoutMs)) {
+            timeoutMs = bandwidthMs;
+        }
+
+        if (timeoutMs != BLOCK_WINDOW_NO_TIMEOUT) {
+            xTicksToWait = pdMS_TO_TICKS(timeoutMs) + 1;
+        }
+    }
 
-    ReceiveEvent_FreeRTOS(xOtaEventQueue, (void*)&recvEvent, portMAX_DELAY, TAG);
+    if (!EventBus_Receive(xOtaEventQueue, &recvEvent, xTicksToWait)) {
+        if (prvIsDownloading()) {
+            /* A block whose event could not be queued may still be waiting in the ring. */
+            if ((prvProcessReceivedDataBlocks() > 0) && BlockWindow_IsComplete(&blockWindow)) {
+                nextEvent.eventId = OtaEventFinishDownload;
+                EventBus_Send(xOtaEventQueue, &nextEvent);
+            } else {
+                prvHandleBlockTimeouts();
+            }
+        }
+        return;
+    }
     recvEventId = recvEvent.eventId;
     ESP_LOGI(TAG, "Current State: %s | Received Event: %s \n", pOtaAgentStateStrings[otaAgentState], pOtaEventStrings[recvEventId]);
 
@@ -185,81 +458,171 @@ static void prvProcessOTAEvents(void)
             ESP_LOGI(TAG, "Job Document event Received ");
             ESP_LOGI(TAG, "-------------------------------------");
 
+            /* The job is notified again after a reconnection, keep the download going. */
+            if (prvIsDownloading() && (strncmp(jobId, recvEvent.jobEvent.jobId, JOB_ID_LENGTH) == 0)) {
+                ESP_LOGI(TAG, "Job %s is already being downloaded", jobId);
+                break;
+            }
+
+            /* Boots the image staged by a previous job. */
+            if (!prvIsDownloading() && prvIsActivationJob(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength)) {
+                strncpy(jobId, recvEvent.jobEvent.jobId, JOB_ID_LENGTH);
+                SetJobId(jobId);
+
+                if (prvActivateStagedImage()) {
+                    prvSendJobSuccessUpdate();
+                    vTaskDelay(pdMS_TO_TICKS(WAIT_RESPONSE));
+                    esp_restart();
+                }
+                prvSendJobFailedUpdate();
+                break;
+            }
+
             otaAgentState = OtaStateProcessingJob;
 
-            strncpy(jobId, recvEvent.jobEvent->jobId, JOB_ID_LENGTH);
+            strncpy(jobId, recvEvent.jobEvent.jobId, JOB_ID_LENGTH);
             ESP_LOGI(TAG, "Job Id %s", jobId);
-            ESP_LOGI(TAG, "Job document %s", recvEvent.jobEvent->jobData);
+            ESP_LOGI(TAG, "Job document %.*s", recvEvent.jobEvent.jobDataLength, recvEvent.jobEvent.jobData);
 
             AfrOtaJobDocumentFields_t jobFields = {0};
 
-            if (prvJobDocumentParser(recvEvent.jobEvent->jobData, recvEvent.jobEvent->jobDataLength, &jobFields)) {
+            if (prvJobDocumentParser(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength, &jobFields)) {
                 char* filePath = (char*)calloc(jobFields.filepathLen + 1, sizeof(char));
-                strncpy(filePath, jobFields.filepath, jobFields.filepathLen);
+                bool started   = false;
 
-                if (prvInitMqttDownloader(&jobFields)) {
+                DataType_t dataType = prvGetStreamDataType(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength);
+
+                char deltaFormatBuffer[DELTA_FORMAT_MAX_LENGTH + 1U] = {0};
+                const char* deltaFormat = prvGetDeltaFormat(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength, deltaFormatBuffer);
+
+                prvGetActivation(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength);
+
+                if (filePath == NULL) {
+                    ESP_LOGE(TAG, "Failed to allocate the file path");
+                } else if (stagedUpdate && (numOfDataFiles > 0U)) {
+                    /* Data files would be in use before the staged image they go with is booted. */
+                    ESP_LOGE(TAG, "A staged image cannot come with data files");
+                } else if (prvInitMqttDownloader(&jobFields, dataType)) {
                     ESP_LOGI(TAG, "Received OTA Job.");
 
-                    if (SetOTAUpdateContext(filePath, &ota_ctx)) {
+                    strncpy(filePath, jobFields.filepath, jobFields.filepathLen);
+
+                    bool resume     = prvLoadCheckpoint(&jobFields);
+                    bool contextSet = SetOTAUpdateContext(filePath, deltaFormat, &ota_ctx, resume);
+
+                    /* The new image replaces the staged one, the update partition is being written. */
+                    if (contextSet) {
+                        prvCancelStagedImage();
+                    }
+
+                    if (contextSet &&
+                        prvStartImageVerification(&jobFields, recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength) &&
+                        prvStartFlashWriter()) {
                         SetJobId(jobId);
                         SendUpdateForJob(InProgress, NULL);
+                        ota_ctx.patch_progress = prvReportPatchProgress;
+                        prvStartCheckpointing(resume);
+                        prvAdvanceImageDigest(NULL);
 
                         char* streamName = (char*)calloc(jobFields.imageRefLen + 1, sizeof(char));
 
-                        if (streamName != NULL) {
+                        /* The patch task starts once the checkpoint it updates is stored. */
+                        if ((streamName != NULL) && prvStartPatchStream(resume)) {
+                            prvStartManifestDownload(recvEvent.jobEvent.jobData, recvEvent.jobEvent.jobDataLength, resume);
+
                             strncpy(streamName, jobFields.imageRef, jobFields.imageRefLen);
+                            BandwidthGovernor_SetOtaActive(true);
                             prvSubscribeStreamDataTopics(streamName);
-                            free(streamName);
-                            free(filePath);
-
-                            nextEvent.eventId = OtaEventRequestFileBlock;
-                            SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
-                            return;
+                            started = true;
                         }
                         free(streamName);
                     }
-                    free(filePath);
+
+                    /* The OTA handle may be open and the flash writer task running, the next job would reuse them. */
+                    if (!started) {
+                        prvReleaseDownload();
+                    }
+                }
+                free(filePath);
+
+                if (started) {
+                    nextEvent.eventId = OtaEventRequestFileBlock;
+                    EventBus_Send(xOtaEventQueue, &nextEvent);
+                    break;
                 }
                 SendUpdateForJob(Rejected, NULL);
                 nextEvent.eventId = OtaEventReady;
-                SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+                EventBus_Send(xOtaEventQueue, &nextEvent);
 
             } else {
                 ESP_LOGE(TAG, "This is not an OTA Document Job");
 
                 SendUpdateForJob(Rejected, NULL);
                 nextEvent.eventId = OtaEventReady;
-                SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+                EventBus_Send(xOtaEventQueue, &nextEvent);
             }
             break;
 
         case OtaEventRequestFileBlock:
+            /* The patch task asks for blocks whenever it frees some room, even after the download ended. */
+            if (!prvIsDownloading() && (otaAgentState != OtaStateProcessingJob)) {
+                break;
+            }
             ESP_LOGI(TAG, "Request File Block event Received");
             ESP_LOGI(TAG, "-----------------------------------");
 
-            if (currentBlockOffset == 0) {
+            if (prvIsPatchStreamed() && ApplyPatchStreamFailed()) {
+                ESP_LOGE(TAG, "The patch could not be applied, aborting the download");
+                prvAbortDownload();
+                break;
+            }
+
+            if (blockWindow.nextBlockToRequest == 0) {
                 ESP_LOGI(TAG, "Starting The Download.");
             }
             otaAgentState = OtaStateRequestingFileBlock;
+
+            /* A resumed download may already have every block. */
+            if (BlockWindow_IsComplete(&blockWindow)) {
+                nextEvent.eventId = OtaEventFinishDownload;
+                EventBus_Send(xOtaEventQueue, &nextEvent);
+                break;
+            }
             prvRequestDataBlock();
 
             break;
         case OtaEventReceivedFileBlock:
+            /* Late or duplicated blocks can still arrive after the download ended. */
+            if (!prvIsDownloading()) {
+                ESP_LOGW(TAG, "Block received outside of a download, ignoring it");
+                prvDiscardReceivedDataBlocks();
+                break;
+            }
             otaAgentState = OtaStateProcessingFileBlock;
             ESP_LOGI(TAG, "Received File Block event Received");
             ESP_LOGI(TAG, "---------------------------------------");
 
-            prvProcessReceivedDataBlock(recvEvent);
+            /* The blocks of this event may have been processed with a previous one. */
+            if (prvProcessReceivedDataBlocks() == 0) {
+                break;
+            }
 
-            if (numOfBlocksRemaining == 0) {
+            if (BlockWindow_IsComplete(&blockWindow)) {
                 nextEvent.eventId = OtaEventFinishDownload;
-                SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+                EventBus_Send(xOtaEventQueue, &nextEvent);
             } else {
                 nextEvent.eventId = OtaEventRequestFileBlock;
-                SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+                EventBus_Send(xOtaEventQueue, &nextEvent);
             }
             break;
         case OtaEventFinishDownload:
+            /* The manifest came first, the image is downloaded now. */
+            if (prvIsManifestDownloading()) {
+                prvFinishManifestDownload();
+                nextEvent.eventId = OtaEventRequestFileBlock;
+                EventBus_Send(xOtaEventQueue, &nextEvent);
+                break;
+            }
             otaAgentState = OtaStateDownloadFinalized;
             ESP_LOGI(TAG, "Finishing download");
             ESP_LOGI(TAG, "-----------------------");
@@ -267,21 +630,57 @@ static void prvProcessOTAEvents(void)
             uxHighWaterMark = uxTaskGetStackHighWaterMark(NULL);
             ESP_LOGI(TAG, "HIGH WATER MARK | ota_agent %d", uxHighWaterMark);
 #endif
+            prvLogDownloadStats();
+            BlockWindow_Free(&blockWindow);
+
+            /* Power loss while applying a patch keeps the checkpoint, so the patch is applied again. */
+            bool updated = prvFinishDownloadedFile();
+            prvStopCheckpointing();
+
+            /* The image is only booted once the data files of the job are stored as well. */
+            if (updated && (numOfDataFiles > 0U) && (currentDataFile != &dataFiles[numOfDataFiles - 1U])) {
+                if (prvStartNextDataFile()) {
+                    otaAgentState     = OtaStateProcessingJob;
+                    nextEvent.eventId = OtaEventRequestFileBlock;
+                    EventBus_Send(xOtaEventQueue, &nextEvent);
+                    break;
+                }
+                updated = false;
+            }
+            currentDataFile = NULL;
+            BandwidthGovernor_SetOtaActive(false);
+
+            if (updated) {
+                updated = stagedUpdate ? prvStageNewImage() : prvActivateNewImage();
+            }
 
-            if (prvFinishFirmwareUpdate()) {
+            if (updated && stagedUpdate) {
+                SendUpdateForJob(Succeeded, STAGED_OTA_STATUS_DETAILS);
+                nextEvent.eventId = OtaEventReady;
+                EventBus_Send(xOtaEventQueue, &nextEvent);
+            } else if (updated) {
                 prvSendJobSuccessUpdate();
                 vTaskDelay(pdMS_TO_TICKS(WAIT_RESPONSE));
                 esp_restart();
             } else {
                 prvSendJobFailedUpdate();
                 nextEvent.eventId = OtaEventReady;
-                SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
+                EventBus_Send(xOtaEventQueue, &nextEvent);
             }
 
+            break;
+        case OtaEventActivateImage:
+            /* The maintenance window of the staged image ended. */
+            if (!prvIsDownloading() && prvActivateStagedImage()) {
+                esp_restart();
+            }
             break;
         default:
             break;
     }
+
+    /* What is kept of a job document has been copied out of its buffer. */
+    SharedBuffer_Release(recvEvent.jobEvent.buffer);
 }
 
 static bool prvActivateNewImage()
@@ -321,283 +720,1645 @@ static void prvSendJobFailedUpdate()
     free((void*)statusDetails);
 }
 
-static bool prvFinishFirmwareUpdate()
+/*
+ * Called by the task applying a patch every few percent. The update is queued to the MQTT
+ * agent like any other command, so the time it takes is the latency of the agent while
+ * the patch is applied.
+ */
+static void prvReportPatchProgress(uint8_t percent)
 {
-    esp_err_t xError;
+    char statusDetails[PATCH_PROGRESS_DETAILS_SIZE];
+    int64_t startUs = esp_timer_get_time();
 
-    if (ota_ctx.OtaPartition_type == OtaPatchPartition) {
-        if (ApplyPatch(&ota_ctx)) {
-            xError = esp_ota_end(ota_ctx.update_handle);
-            if (xError != ESP_OK) {
-                ESP_LOGE(TAG, "Ota end Failed %d\n", xError);
-                return false;
-            }
-            return prvActivateNewImage();
-        }
-    } else {
-        xError = esp_ota_end(ota_ctx.update_handle);
-        if (xError != ESP_OK) {
-            ESP_LOGE(TAG, "Ota end Failed %d\n", xError);
-            return false;
-        }
-        return prvActivateNewImage();
-    }
-    return false;
+    snprintf(statusDetails, sizeof(statusDetails), PATCH_PROGRESS_STATUS_DETAILS, percent);
+    SendUpdateForJob(InProgress, statusDetails);
+
+    ESP_LOGI(TAG, "Patch %u%% applied, job updated in %lu ms", percent,
+             (uint32_t)((esp_timer_get_time() - startUs) / 1000));
 }
 
-static void prvProcessReceivedDataBlock(OtaEventMsg_t recvEvent)
+/*
+ * Verifies the new image and closes the update partition, it is booted or staged by the caller.
+ * A full image downloaded from the beginning is checked by esp_ota_end(), one written directly,
+ * resumed or rebuilt from a patch, by esp_image_verify().
+ */
+static bool prvFinishFirmwareUpdate(void)
 {
-    MQTTFileDownloaderStatus_t xStatus = 0;
-    uint8_t decodedData[mqttFileDownloader_CONFIG_BLOCK_SIZE];
-    size_t decodedDataLength = 0;
-    int32_t fileId = 0, blockId = 0, blockSize = 0;
+    bool finished = (prvStopFlashWriter() == ESP_OK);
 
-    /*
-     * MQTT streams Library:
-     * Extracting and decoding the received data block from the incoming MQTT message.
-     */
-    xStatus = mqttDownloader_processReceivedDataBlock(&mqttFileDownloaderContext,
-                                                      recvEvent.dataEvent->data,
-                                                      recvEvent.dataEvent->dataLength,
-                                                      &fileId,
-                                                      &blockId,
-                                                      &blockSize,
-                                                      decodedData,
-                                                      &decodedDataLength);
+    /* The patch task still applies the end of the patch, the image is complete once it is done. */
+    if (prvIsPatchStreamed()) {
+        finished = prvStopPatchStream(!finished) && finished;
+    }
 
-    if (xStatus != MQTTFileDownloaderSuccess) {
-        ESP_LOGE(TAG, "Process Received Data Block failed %d\n", xStatus);
-        return;
+    if (!finished) {
+        OtaImageVerifier_Free(&imageVerifier);
+    } else {
+        finished = prvFinishImageVerification();
+    }
+
+    /* A staged patch is applied now as well, the update partition is not the one running. */
+    if (finished && (ota_ctx.OtaPartition_type == OtaPatchPartition)) {
+        finished = ApplyPatch(&ota_ctx);
+    }
+
+    if (!finished) {
+        OtaImageFile_Abort(&ota_ctx.update_file);
+        return false;
     }
-    prvHandleMqttStreamsBlockArrived(blockId, decodedData, decodedDataLength);
-    prvFreeOtaDataEventBuffer(recvEvent.dataEvent);
-    numOfBlocksRemaining--;
-    currentBlockOffset++;
+    return OtaImageFile_Finish(&ota_ctx.update_file);
 }
 
-static bool prvJobDocumentParser(char* message, size_t messageLength, AfrOtaJobDocumentFields_t* jobFields)
+/* Completes the file just downloaded: the image is verified and closed, a data file verified. */
+static bool prvFinishDownloadedFile(void)
 {
-    int8_t fileIndex = 0;
+    esp_err_t xError;
 
-    do {
-        fileIndex = otaParser_parseJobDocFile(message,
-                                              messageLength,
-                                              fileIndex,
-                                              jobFields);
-    } while (fileIndex > 0);
+    if (currentDataFile == NULL) {
+        return prvFinishFirmwareUpdate();
+    }
 
-    ESP_LOGI(TAG, "fileIndex =%d", fileIndex);
-    // File index will be -1 if an error occured, and 0 if all files were
-    // processed
-    return fileIndex == 0;
+    xError = prvStopFlashWriter();
+
+    return prvFinishImageVerification() && (xError == ESP_OK);
 }
 
-/* Creates and publishes a request for the next data block in the OTA update. */
-static void prvRequestDataBlock(void)
+/*
+ * Processes every block waiting in the ring. A single event may find several
+ * blocks, or none if they were already processed with a previous event.
+ * A download aborted by one of the blocks reports none.
+ */
+static uint32_t prvProcessReceivedDataBlocks(void)
 {
-    char getStreamRequest[GET_STREAM_REQUEST_BUFFER_SIZE];
-    /*
-     * MQTT streams Library:
-     * Creating the Get data block request. MQTT streams library only
-     * creates the get block request. To publish the request, MQTT libraries
-     * like coreMQTT are required.
-     */
-    size_t getStreamRequestLength = mqttDownloader_createGetDataBlockRequest(mqttFileDownloaderContext.dataType,
-                                                                             currentFileId,
-                                                                             mqttFileDownloader_CONFIG_BLOCK_SIZE,
-                                                                             currentBlockOffset,
-                                                                             NUM_OF_BLOCKS_REQUESTED,
-                                                                             getStreamRequest,
-                                                                             GET_STREAM_REQUEST_BUFFER_SIZE);
+    OtaDataEvent_t* dataEvent;
+    uint32_t processed = 0;
 
-    if (getStreamRequestLength > 0) {
-        PublishToTopic(mqttFileDownloaderContext.topicGetStream,
-                       mqttFileDownloaderContext.topicGetStreamLength,
-                       getStreamRequest,
-                       getStreamRequestLength,
-                       MQTTQoS0,
-                       TAG);
-    } else {
-        ESP_LOGE(TAG, "Failed creating the Get data block request");
+    while (prvIsDownloading() && ((dataEvent = OtaDataRing_Peek(&dataRing)) != NULL)) {
+        prvProcessReceivedDataBlock(dataEvent);
+        processed++;
     }
+    return prvIsDownloading() ? processed : 0U;
 }
 
-/* Initializes the MQTT downloader with the information from the job document. */
-static bool prvInitMqttDownloader(AfrOtaJobDocumentFields_t* jobFields)
+static void prvDiscardReceivedDataBlocks(void)
 {
-    MQTTFileDownloaderStatus_t xStatus;
-
-    numOfBlocksRemaining = jobFields->fileSize / mqttFileDownloader_CONFIG_BLOCK_SIZE;
-    numOfBlocksRemaining += (jobFields->fileSize % mqttFileDownloader_CONFIG_BLOCK_SIZE > 0) ? 1 : 0;
-
-    ESP_LOGI(TAG, "Number of blocks to receive %ld", numOfBlocksRemaining);
-
-    currentFileId      = jobFields->fileId;
-    currentBlockOffset = 0;
-    totalBytesReceived = 0;
-    lastBlock          = numOfBlocksRemaining;
-
-    /*
-     * MQTT streams Library:
-     * Initializing the MQTT streams downloader. Passing the
-     * parameters extracted from the AWS IoT OTA jobs document
-     * using OTA jobs parser.
-     */
-    xStatus = mqttDownloader_init(&mqttFileDownloaderContext,
-                                  jobFields->imageRef,
-                                  jobFields->imageRefLen,
-                                  GetThingName(),
-                                  strlen(GetThingName()),
-                                  DATA_TYPE_JSON);
-
-    if (xStatus != MQTTFileDownloaderSuccess) {
-        ESP_LOGE(TAG, "MQTTFileDownloader initialization failed. Parsing of the job document failed");
-        return false;
+    while (OtaDataRing_Peek(&dataRing) != NULL) {
+        OtaDataRing_Release(&dataRing);
     }
-    return true;
 }
 
-/* Subscribes to MQTT topics for receiving data blocks in the OTA stream. */
-static bool prvSubscribeStreamDataTopics(const char* streamName)
+/*
+ * Decodes a block inside its ring buffer and writes it to flash from there.
+ * The only copy of the data is the one made by the MQTT callback into the ring.
+ */
+static void prvProcessReceivedDataBlock(OtaDataEvent_t* dataEvent)
 {
-    MQTTAgentSubscribeArgs_t xSubscribeArgs                       = {0};
-    MQTTSubscribeInfo_t subscriptionList[NUMBER_OF_SUBSCRIPTIONS] = {0};
-
-    topic_filters[0] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-    topic_filters[1] = (char*)calloc(TOPIC_FILTER_LENGTH, sizeof(char));
-
-    if (topic_filters[0] == NULL && topic_filters[1] == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for subscription topics");
-        assert(topic_filters[0] != NULL);
-        assert(topic_filters[1] != NULL);
+    OtaStreamBlock_t block = {0};
+    uint32_t offset        = 0;
+
+    if (!prvDecodeDataBlock(dataEvent, &block)) {
+        ESP_LOGE(TAG, "Process Received Data Block failed\n");
+    } else if (block.fileId != currentFileId) {
+        ESP_LOGW(TAG, "Block of file %ld ignored, downloading file %u", block.fileId, currentFileId);
+    } else if (!prvLocateBlockPart(&block, &offset)) {
+        /* A block that is re-requested after a timeout may still arrive twice. */
+        ESP_LOGW(TAG, "Duplicate block %ld ignored", block.blockId);
+        blockWindow.duplicates++;
+    } else if (!prvIsImageHeaderValid(offset, &block)) {
+        /* Not a firmware image, there is no point in downloading the rest of it. */
+        ESP_LOGE(TAG, "The file is not an ESP application image, aborting the download");
+        OtaDataRing_Release(&dataRing);
+        prvAbortDownload();
+        return;
+    } else if (prvHandleMqttStreamsBlockArrived(offset, block.payload, block.payloadLength)) {
+        prvCompleteBlockPart(&block, offset);
     }
 
-    snprintf(topic_filters[0], TOPIC_FILTER_LENGTH, STREAM_DATA_ACCEPTED_TOPIC, GetThingName(), streamName);
-    snprintf(topic_filters[1], TOPIC_FILTER_LENGTH, STREAM_DATA_REJECTED_TOPIC, GetThingName(), streamName);
+    /* The block is stored, give the buffer back to the MQTT agent task. */
+    OtaDataRing_Release(&dataRing);
+}
 
-    for (int i = 0; i < NUMBER_OF_SUBSCRIPTIONS; i++) {
-        ESP_LOGI(TAG, "Topic: %s", topic_filters[i]);
-        subscriptionList[i].qos               = MQTTQoS0;
-        subscriptionList[i].pTopicFilter      = topic_filters[i];
-        subscriptionList[i].topicFilterLength = strlen(topic_filters[i]);
+/*
+ * Finds the offset of a received message in the file. Block ids count parts of
+ * the size the message was requested in, which is the one of the request of its
+ * block; only the last part of the file is shorter. Parts already stored, or of
+ * blocks not in flight, are duplicates.
+ */
+static bool prvLocateBlockPart(const OtaStreamBlock_t* block, uint32_t* pOffset)
+{
+    if (block->blockId < 0) {
+        return false;
     }
-    xSubscribeArgs.numSubscriptions = NUMBER_OF_SUBSCRIPTIONS;
-    xSubscribeArgs.pSubscribeInfo   = subscriptionList;
 
-    return (SubscribeToTopic(&xSubscribeArgs, &prvStreamDataIncomingPublishCallback, TAG) == MQTTSuccess);
-}
+    for (uint8_t shift = 0; shift <= OtaBlockSizer_MaxShift(&blockSizer); shift++) {
+        uint32_t partSize = mqttFileDownloader_CONFIG_BLOCK_SIZE >> shift;
+        uint64_t offset   = (uint64_t)block->blockId * partSize;
+        const BlockRequest_t* pRequest;
+        uint32_t part;
 
-/* Stores the received data blocks in the flash partition reserved for OTA */
-static void prvHandleMqttStreamsBlockArrived(int32_t blockId, uint8_t* data, size_t dataLength)
-{
-    esp_err_t xError;
+        if (offset >= currentFileSize) {
+            continue;
+        }
 
-    ESP_LOGI(TAG, "Total bytes received: %lu", (totalBytesReceived + dataLength));
+        pRequest = BlockWindow_GetRequest(&blockWindow, (uint32_t)(offset / mqttFileDownloader_CONFIG_BLOCK_SIZE));
 
-    assert((totalBytesReceived + dataLength) < CONFIG_MAX_FILE_SIZE);
+        if ((pRequest == NULL) || (pRequest->partShift != shift) ||
+            (block->payloadLength != (((currentFileSize - offset) > partSize) ? partSize : (currentFileSize - offset)))) {
+            continue;
+        }
 
-    ESP_LOGI(TAG, "Downloaded block %lu of %lu", blockId, numOfBlocksRemaining);
+        part = (uint32_t)(offset % mqttFileDownloader_CONFIG_BLOCK_SIZE) / partSize;
 
-    if (ota_ctx.OtaPartition_type == OtaPatchPartition) {
-        xError = esp_partition_write(ota_ctx.patch_partition, totalBytesReceived, data, dataLength);
-    } else {
-        xError = esp_ota_write_with_offset(ota_ctx.update_handle, data, dataLength, totalBytesReceived);
-    }
-    if (xError != ESP_OK) {
-        ESP_LOGE(TAG, "Couldn't flash at the offset %" PRIu32 "", totalBytesReceived);
-        return;
+        if ((pRequest->partsReceived & (1U << part)) != 0U) {
+            return false;
+        }
+        *pOffset = (uint32_t)offset;
+        return true;
     }
-
-    totalBytesReceived += dataLength;
+    return false;
 }
 
-static void prvFreeOtaDataEventBuffer(OtaDataEvent_t* const pxBuffer)
+/* Records a stored part, and its block once the last part of it is in. */
+static void prvCompleteBlockPart(const OtaStreamBlock_t* block, uint32_t offset)
 {
-    if (xSemaphoreTake(bufferSemaphore, portMAX_DELAY) == pdTRUE) {
-        pxBuffer->bufferUsed = false;
-        (void)xSemaphoreGive(bufferSemaphore);
-    } else {
-        ESP_LOGE(TAG, "Failed to get buffer semaphore.\n");
+    uint32_t blockId                = offset / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    const BlockRequest_t* pRequest  = BlockWindow_GetRequest(&blockWindow, blockId);
+    uint8_t shift                   = pRequest->partShift;
+    uint32_t partSize               = mqttFileDownloader_CONFIG_BLOCK_SIZE >> shift;
+    uint32_t nowMs                  = prvGetTimeMs();
+
+    if (!BlockWindow_MarkPartReceived(&blockWindow, blockId, (offset % mqttFileDownloader_CONFIG_BLOCK_SIZE) / partSize,
+                                      prvGetNumOfParts(blockId, shift))) {
+        return;
     }
+
+    /* The round trip time of a block requested again is ambiguous. */
+    OtaBlockSizer_BlockReceived(&blockSizer, shift, (pRequest->retries == 0U) ? (nowMs - pRequest->sentTimeMs) : 0U);
+    BlockWindow_MarkReceived(&blockWindow, blockId, nowMs);
+
+    /* A block received in parts is read back from flash to be hashed. */
+    prvAdvanceImageDigest((shift == 0U) ? block : NULL);
+    prvPublishPatchData();
+    prvUpdateCheckpoint();
 }
 
-static OtaDataEvent_t* prvGetOtaDataEventBuffer(void)
+/*
+ * Decodes a data block without copying it. CBOR payloads are used where they are,
+ * JSON payloads are base64 decoded over themselves. Either way the payload points
+ * into the ring buffer.
+ */
+static bool prvDecodeDataBlock(OtaDataEvent_t* dataEvent, OtaStreamBlock_t* block)
 {
-    OtaDataEvent_t* freeBuffer = NULL;
-
-    if (xSemaphoreTake(bufferSemaphore, portMAX_DELAY) == pdTRUE) {
-        for (uint32_t ulIndex = 0; ulIndex < MAX_NUM_OF_OTA_DATA_BUFFERS; ulIndex++) {
-            if (dataBuffers[ulIndex].bufferUsed == false) {
-                dataBuffers[ulIndex].bufferUsed = true;
-                freeBuffer                      = &dataBuffers[ulIndex];
-                break;
-            }
-        }
+    int64_t startUs = esp_timer_get_time();
+    bool decoded;
 
-        (void)xSemaphoreGive(bufferSemaphore);
+    if (mqttFileDownloaderContext.dataType == DATA_TYPE_CBOR) {
+        decoded = OtaBlockDecoder_DecodeCbor(dataEvent->data, dataEvent->dataLength, block);
     } else {
-        ESP_LOGE(TAG, "Failed to get buffer semaphore. \n");
+        decoded = OtaBlockDecoder_DecodeJson(dataEvent->data, dataEvent->dataLength, block);
     }
 
-    return freeBuffer;
+    decodeTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+    wireBytesReceived += dataEvent->dataLength;
+    blocksDecoded++;
+
+    /* The MQTT callback, run in the agent task, copied the message from the MQTT buffer into the ring. */
+    bytesCopied += dataEvent->dataLength;
+
+    return decoded;
 }
 
 /*
- * Callback function for handling incoming MQTT messages for OTA streams.
-*/
-static void prvStreamDataIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
+ * Parses the application image, the first file of the job, into jobFields and
+ * keeps the other files as data files.
+ */
+static bool prvJobDocumentParser(const char* message, size_t messageLength, AfrOtaJobDocumentFields_t* jobFields)
 {
-    OtaEventMsg_t nextEvent = {0};
+    int8_t fileIndex = otaParser_parseJobDocFile(message, messageLength, 0, jobFields);
 
-    char topic_filter[TOPIC_FILTER_LENGTH] = {0};
+    numOfDataFiles  = 0;
+    currentDataFile = NULL;
 
-    size_t copyLength = (pxPublishInfo->topicNameLength < TOPIC_FILTER_LENGTH - 1)
-                        ? pxPublishInfo->topicNameLength
-                        : TOPIC_FILTER_LENGTH - 1;
+    while (fileIndex > 0) {
+        AfrOtaJobDocumentFields_t fileFields = {0};
+        uint8_t index                        = (uint8_t)fileIndex;
 
-    memcpy(topic_filter, pxPublishInfo->pTopicName, copyLength);
-    topic_filter[copyLength] = '\0';
+        fileIndex = otaParser_parseJobDocFile(message, messageLength, index, &fileFields);
 
-    ESP_LOGI("MQTT_AGENT", "Handling Stream data Incoming publish\n");
+        if ((fileIndex >= 0) && !prvAddDataFile(message, messageLength, index, &fileFields)) {
+            return false;
+        }
+    }
 
-    (void)pvIncomingPublishCallbackContext;
+    ESP_LOGI(TAG, "fileIndex =%d", fileIndex);
+    // File index will be -1 if an error occured, and 0 if all files were
+    // processed
+    return fileIndex == 0;
+}
+
+/* Copies a data file of the job, it must name a data partition it fits in. */
+static bool prvAddDataFile(const char* jobDoc, size_t jobDocLength, uint8_t fileIndex, const AfrOtaJobDocumentFields_t* fields)
+{
+    char key[DATA_FILE_JOB_KEY_LENGTH];
+    char label[sizeof(((esp_partition_t*)0)->label)] = {0};
+    const char* value                                = NULL;
+    size_t valueLength                               = 0;
+    OtaDataFile_t* pFile                             = &dataFiles[numOfDataFiles];
+
+    if (numOfDataFiles >= OTA_MAX_DATA_FILES) {
+        ESP_LOGE(TAG, "A job carries at most %u data files", OTA_MAX_DATA_FILES);
+        return false;
+    }
+
+    memset(pFile, 0x00, sizeof(OtaDataFile_t));
+    snprintf(key, sizeof(key), DATA_FILE_PARTITION_JOB_KEY, fileIndex);
+
+    if ((JSON_SearchConst(jobDoc, jobDocLength, key, strlen(key), &value, &valueLength, NULL) != JSONSuccess) ||
+        (valueLength >= sizeof(label))) {
+        ESP_LOGE(TAG, "File %u names no data partition", fileIndex);
+        return false;
+    }
+    memcpy(label, value, valueLength);
+
+    pFile->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+
+    /*
+     * The OTA data and the NVS partitions, the patch one included, hold the state of the agent,
+     * the PHY one the calibration of the radio. The others may be in use by the running image.
+     */
+    if ((pFile->partition == NULL) || (pFile->partition->subtype == ESP_PARTITION_SUBTYPE_DATA_OTA) ||
+        (pFile->partition->subtype == ESP_PARTITION_SUBTYPE_DATA_NVS) ||
+        (pFile->partition->subtype == ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS) ||
+        (pFile->partition->subtype == ESP_PARTITION_SUBTYPE_DATA_PHY) || !prvIsDataPartitionAllowed(label)) {
+        ESP_LOGE(TAG, "File %u cannot be written to the partition %s", fileIndex, label);
+        return false;
+    }
+
+    if ((fields->fileSize > pFile->partition->size) || (fields->fileId > UINT16_MAX)) {
+        ESP_LOGE(TAG, "File %u of %lu bytes does not fit the partition %s", fileIndex, fields->fileSize, label);
+        return false;
+    }
+
+    /* Blocks are requested by a 16 bit offset. */
+    if (((fields->fileSize + mqttFileDownloader_CONFIG_BLOCK_SIZE - 1U) / mqttFileDownloader_CONFIG_BLOCK_SIZE) > (UINT16_MAX + 1U)) {
+        ESP_LOGE(TAG, "File %u of %lu bytes has too many blocks to be requested", fileIndex, fields->fileSize);
+        return false;
+    }
+
+    snprintf(key, sizeof(key), DATA_FILE_DIGEST_JOB_KEY, fileIndex);
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, key, strlen(key), &value, &valueLength, NULL) == JSONSuccess) {
+        if (!OtaImageVerifier_ParseDigest(value, valueLength, pFile->digest)) {
+            ESP_LOGE(TAG, "Invalid digest of file %u in the job document", fileIndex);
+            return false;
+        }
+        pFile->hasDigest = true;
+    }
+
+    if ((fields->signature != NULL) && (fields->signatureLen > 0U)) {
+        if (fields->signatureLen > sizeof(pFile->signature)) {
+            ESP_LOGE(TAG, "Signature of file %u too long", fileIndex);
+            return false;
+        }
+        memcpy(pFile->signature, fields->signature, fields->signatureLen);
+        pFile->signatureLength = fields->signatureLen;
+    }
+
+    /* Nothing like the image header tells a data file is the right one. */
+    if (!pFile->hasDigest && (pFile->signatureLength == 0U)) {
+        ESP_LOGE(TAG, "File %u has neither a digest nor a signature", fileIndex);
+        return false;
+    }
+
+    pFile->fileId   = (uint16_t)fields->fileId;
+    pFile->fileSize = fields->fileSize;
+    numOfDataFiles++;
+
+    ESP_LOGI(TAG, "File %u of %lu bytes goes to the partition %s", fileIndex, pFile->fileSize, label);
+
+    return true;
+}
+
+/*
+ * Data partitions are erased and rewritten in place with no way back, only the
+ * ones listed in OTA_DATA_PARTITIONS, which the running image does not use, are.
+ */
+static bool prvIsDataPartitionAllowed(const char* label)
+{
+    const char* entry  = OTA_DATA_PARTITIONS;
+    size_t labelLength = strlen(label);
+
+    while (*entry != '\0') {
+        const char* end = strchr(entry, ',');
+        size_t length   = (end != NULL) ? (size_t)(end - entry) : strlen(entry);
+
+        if ((length == labelLength) && (strncmp(entry, label, length) == 0)) {
+            return true;
+        }
+        entry += (end != NULL) ? length + 1U : length;
+    }
+
+    return false;
+}
+
+/*
+ * Moves the download to the next data file. The request window goes on with it,
+ * the block sizer keeps what it learned of the link. The partition is erased
+ * first, data files are not resumed after a reboot.
+ */
+static bool prvStartNextDataFile(void)
+{
+    OtaDataFile_t* pFile = (currentDataFile == NULL) ? &dataFiles[0] : currentDataFile + 1;
+    uint32_t numOfBlocks = (pFile->fileSize + mqttFileDownloader_CONFIG_BLOCK_SIZE - 1U) / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    uint32_t eraseSize   = (pFile->fileSize + FLASH_SECTOR_SIZE - 1U) & ~(FLASH_SECTOR_SIZE - 1U);
+
+    currentDataFile = pFile;
+
+    ESP_LOGI(TAG, "Downloading data file %u of %lu, file %u to the partition %s", (unsigned)(pFile - dataFiles) + 1U,
+             numOfDataFiles, pFile->fileId, pFile->partition->label);
+
+    if (!BlockWindow_Init(&blockWindow, numOfBlocks, prvGetBlockWindowSize())) {
+        ESP_LOGE(TAG, "Failed to allocate the block bitmap");
+        return false;
+    }
+
+    if ((eraseSize > 0U) && (esp_partition_erase_range(pFile->partition, 0, eraseSize) != ESP_OK)) {
+        ESP_LOGE(TAG, "Failed to erase the partition %s", pFile->partition->label);
+        BlockWindow_Free(&blockWindow);
+        return false;
+    }
+
+    if (!OtaFlashWriter_Init(&flashWriter, prvWriteDataFile, (void*)pFile->partition, OTA_FLASH_DOUBLE_BUFFER)) {
+        ESP_LOGE(TAG, "Failed to start the flash writer");
+        BlockWindow_Free(&blockWindow);
+        return false;
+    }
+
+    OtaImageVerifier_Init(&imageVerifier, pFile->signatureLength > 0U);
+    blocksHashed = 0;
+
+    if (pFile->hasDigest) {
+        OtaImageVerifier_SetDigest(&imageVerifier, pFile->digest);
+    }
+
+    if ((pFile->signatureLength > 0U) && !OtaImageVerifier_SetSignature(&imageVerifier, pFile->signature, pFile->signatureLength)) {
+        prvStopFlashWriter();
+        OtaImageVerifier_Free(&imageVerifier);
+        BlockWindow_Free(&blockWindow);
+        return false;
+    }
+
+    currentFileId   = pFile->fileId;
+    currentFileSize = pFile->fileSize;
+    OtaBlockSizer_SetMaxShift(&blockSizer, prvGetMaxPartShift(pFile->fileSize));
+    prvResetDownloadStats();
+
+    return true;
+}
+
+/*
+ * Fills the free slots of the request window with the next blocks of the file.
+ * The new blocks are contiguous, so they are requested with a single message,
+ * in parts of the size chosen for the link.
+ *
+ * Messages only carry the index of a part, not its size. The short last part
+ * of the file could be taken for a whole part of another size in flight, so
+ * the last block is always requested in the smallest parts, which no other
+ * part is shorter than.
+ *
+ * New blocks wait for the OTA share of the bandwidth governor, re-requests of
+ * lost ones do not.
+ */
+static void prvRequestDataBlock(void)
+{
+    uint8_t partShift    = OtaBlockSizer_Shift(&blockSizer);
+    uint32_t limit       = blockWindow.numOfBlocks;
+    uint32_t blockOffset = 0;
+    uint32_t numOfBlocks;
+
+    if (BandwidthGovernor_WaitTimeMs(BandwidthClassOta) > 0U) {
+        return;
+    }
+
+    /* A streamed patch is only requested as far as the patch task has room for it. */
+    if (prvIsPatchStreamed()) {
+        limit = OtaPatchStream_WriteLimit(&patchStream) / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    }
+
+    BlockWindow_SetRequestLimit(&blockWindow, (partShift != OtaBlockSizer_MaxShift(&blockSizer)) && (limit >= blockWindow.numOfBlocks)
+                                                  ? blockWindow.numOfBlocks - 1U
+                                                  : limit);
+    numOfBlocks = BlockWindow_ReserveNewBlocks(&blockWindow, prvGetTimeMs(), partShift, &blockOffset);
+
+    if ((numOfBlocks == 0) && (blockWindow.requestLimit < limit)) {
+        partShift = OtaBlockSizer_MaxShift(&blockSizer);
+        BlockWindow_SetRequestLimit(&blockWindow, limit);
+        numOfBlocks = BlockWindow_ReserveNewBlocks(&blockWindow, prvGetTimeMs(), partShift, &blockOffset);
+    }
+
+    if (numOfBlocks > 0) {
+        prvPublishBlockRequest(blockOffset << partShift, numOfBlocks << partShift, partShift);
+    }
+}
+
+/* Re-requests, one by one, the blocks whose request has timed out. Only their missing parts are sent again. */
+static void prvHandleBlockTimeouts(void)
+{
+    uint32_t blockIds[BLOCK_WINDOW_MAX_SIZE];
+    bool giveUp      = false;
+    uint32_t expired = BlockWindow_CollectExpiredBlocks(&blockWindow, prvGetTimeMs(), blockIds, &giveUp);
+
+    if (giveUp) {
+        ESP_LOGE(TAG, "Block %lu could not be downloaded after %u retries", blockIds[0], BLOCK_WINDOW_MAX_RETRIES);
+        prvAbortDownload();
+        return;
+    }
+
+    for (uint32_t i = 0; i < expired; i++) {
+        const BlockRequest_t* pRequest = BlockWindow_GetRequest(&blockWindow, blockIds[i]);
+
+        ESP_LOGW(TAG, "Block %lu timed out, requesting it again (timeout %lu ms)", blockIds[i], blockWindow.rtoMs);
+        OtaBlockSizer_RequestLost(&blockSizer, pRequest->partShift);
+        prvRequestMissingParts(blockIds[i], pRequest);
+    }
+
+    /* Nothing expired: the window may have drained, refill it. */
+    prvRequestDataBlock();
+}
+
+/* Requests the parts of a block from the first to the last one missing, in the size of its first request. */
+static void prvRequestMissingParts(uint32_t blockId, const BlockRequest_t* pRequest)
+{
+    uint32_t numOfParts = prvGetNumOfParts(blockId, pRequest->partShift);
+    uint32_t first      = 0;
+    uint32_t last       = numOfParts;
+
+    while ((first < last) && ((pRequest->partsReceived & (1U << first)) != 0U)) {
+        first++;
+    }
+    while ((last > first) && ((pRequest->partsReceived & (1U << (last - 1U))) != 0U)) {
+        last--;
+    }
+
+    prvPublishBlockRequest((blockId << pRequest->partShift) + first, last - first, pRequest->partShift);
+}
+
+/* Number of parts of shift a block is requested in, fewer for the last block of the file. */
+static uint32_t prvGetNumOfParts(uint32_t blockId, uint8_t partShift)
+{
+    uint32_t partSize    = mqttFileDownloader_CONFIG_BLOCK_SIZE >> partShift;
+    uint32_t blockLength = currentFileSize - (blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE);
+
+    if (blockLength > mqttFileDownloader_CONFIG_BLOCK_SIZE) {
+        blockLength = mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    }
+    return (blockLength + partSize - 1U) / partSize;
+}
+
+/* Halvings of the block size down to the smallest part, within what the request bookkeeping tracks. */
+static uint8_t prvGetMaxPartShift(uint32_t fileSize)
+{
+    uint32_t lastByte = (fileSize > 0U) ? fileSize - 1U : 0U;
+    uint8_t shift     = 0;
+
+    /* The offset of a part in a request is 16 bits, the last part of the file must fit in it. */
+    while ((shift < OTA_BLOCK_SIZER_MAX_SHIFT) && ((mqttFileDownloader_CONFIG_BLOCK_SIZE >> (shift + 1U)) >= OTA_MIN_BLOCK_SIZE) &&
+           ((lastByte / (mqttFileDownloader_CONFIG_BLOCK_SIZE >> (shift + 1U))) <= UINT16_MAX)) {
+        shift++;
+    }
+    return shift;
+}
+
+static void prvAbortDownload(void)
+{
+    OtaEventMsg_t nextEvent = {0};
+
+    /* The patch task stops before the state it uses is released. */
+    if (prvIsPatchStreamed()) {
+        prvStopPatchStream(true);
+    }
+
+    prvLogDownloadStats();
+    prvReleaseDownload();
+    prvSendJobFailedUpdate();
+
+    otaAgentState     = OtaStateReady;
+    nextEvent.eventId = OtaEventReady;
+    EventBus_Send(xOtaEventQueue, &nextEvent);
+}
+
+/*
+ * Releases what a job set up for its download, whatever stage it reached: the flash
+ * writer and its task, the image digest, the checkpoint and the OTA handle. The patch
+ * task, if any, is stopped by the caller first.
+ */
+static void prvReleaseDownload(void)
+{
+    prvStopManifestDownload();
+    BlockWindow_Free(&blockWindow);
+    prvStopCheckpointing();
+    prvStopFlashWriter();
+    OtaImageVerifier_Free(&imageVerifier);
+    OtaImageFile_Abort(&ota_ctx.update_file);
+
+    currentDataFile = NULL;
+    BandwidthGovernor_SetOtaActive(false);
+}
+
+static bool prvIsDownloading(void)
+{
+    return (otaAgentState == OtaStateRequestingFileBlock) || (otaAgentState == OtaStateProcessingFileBlock);
+}
+
+/* Logs the throughput of the download so window sizes can be compared on the field. */
+static void prvLogDownloadStats(void)
+{
+    uint32_t elapsedMs = prvGetTimeMs() - downloadStartMs;
+
+    ESP_LOGI(TAG, "Download: %lu/%lu blocks, %lu bytes in %lu ms (%lu B/s), window %u, "
+             "retransmissions %lu, duplicates %lu, srtt %lu ms",
+             blockWindow.blocksReceived,
+             blockWindow.numOfBlocks,
+             totalBytesReceived,
+             elapsedMs,
+             (elapsedMs > 0) ? (uint32_t)(((uint64_t)totalBytesReceived * 1000U) / elapsedMs) : 0U,
+             blockWindow.windowSize,
+             blockWindow.retransmissions,
+             blockWindow.duplicates,
+             blockWindow.srttMs);
+    ESP_LOGI(TAG, "Decoding: %s, %lu bytes on the wire, %lu us per block, %lu bytes copied per block",
+             (mqttFileDownloaderContext.dataType == DATA_TYPE_CBOR) ? "CBOR" : "JSON",
+             wireBytesReceived,
+             (blocksDecoded > 0) ? (uint32_t)(decodeTimeUs / blocksDecoded) : 0U,
+             (blocksDecoded > 0) ? bytesCopied / blocksDecoded : 0U);
+    ESP_LOGI(TAG, "Block size: parts of %lu bytes at the end, %lu size changes, %lu lost requests",
+             (uint32_t)(mqttFileDownloader_CONFIG_BLOCK_SIZE >> OtaBlockSizer_Shift(&blockSizer)),
+             blockSizer.changes,
+             blockSizer.losses);
+    ESP_LOGI(TAG, "Receive ring: %lu slots, %lu blocks received, %lu dropped, max occupancy %lu",
+             dataRing.depth,
+             dataRing.received,
+             dataRing.dropped,
+             dataRing.highWater);
+
+    if (bytesDeduplicated > 0) {
+        ESP_LOGI(TAG, "Deduplication: %lu of %lu bytes copied from the running image", bytesDeduplicated, currentFileSize);
+    }
+    BandwidthGovernor_LogStats();
+    LogCommandQueueStats();
+    DeferredDispatch_LogStats();
+    SharedBuffer_LogStats();
+    EventBus_LogStats();
+}
+
+static uint32_t prvGetTimeMs(void)
+{
+    return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+/*
+ * Creates and publishes a request for numOfParts consecutive parts of the block
+ * size >> partShift, partOffset counting parts of that size. The stream ends with
+ * the file, so parts past its end are not asked for.
+ */
+static void prvPublishBlockRequest(uint32_t partOffset, uint32_t numOfParts, uint8_t partShift)
+{
+    char getStreamRequest[GET_STREAM_REQUEST_BUFFER_SIZE];
+    uint32_t partSize    = mqttFileDownloader_CONFIG_BLOCK_SIZE >> partShift;
+    uint32_t fileParts   = (currentFileSize + partSize - 1U) / partSize;
+
+    if ((partOffset + numOfParts) > fileParts) {
+        numOfParts = fileParts - partOffset;
+    }
+
+    /* The part shift of the file is capped so its parts fit the offset of the request. */
+    if (partOffset > UINT16_MAX) {
+        ESP_LOGE(TAG, "Part %lu of %lu bytes is out of the range of a request", partOffset, partSize);
+        return;
+    }
+
+    /* The stream data is what shares the link with uploads, the request itself is small. */
+    BandwidthGovernor_Consume(BandwidthClassOta, numOfParts * partSize);
+    /*
+     * MQTT streams Library:
+     * Creating the Get data block request. MQTT streams library only
+     * creates the get block request. To publish the request, MQTT libraries
+     * like coreMQTT are required.
+     */
+    size_t getStreamRequestLength = mqttDownloader_createGetDataBlockRequest(mqttFileDownloaderContext.dataType,
+                                                                             currentFileId,
+                                                                             partSize,
+                                                                             (uint16_t)partOffset,
+                                                                             numOfParts,
+                                                                             getStreamRequest,
+                                                                             GET_STREAM_REQUEST_BUFFER_SIZE);
+
+    /* The request is copied, blocks keep being processed while it is sent. A lost one times out. */
+    if ((getStreamRequestLength > 0) && (PublishToTopicAsync(mqttFileDownloaderContext.topicGetStream,
+                                                             mqttFileDownloaderContext.topicGetStreamLength,
+                                                             getStreamRequest,
+                                                             getStreamRequestLength,
+                                                             MQTTQoS0,
+                                                             NULL,
+                                                             TAG) == PUBLISH_HANDLE_INVALID)) {
+        PublishToTopic(mqttFileDownloaderContext.topicGetStream,
+                       mqttFileDownloaderContext.topicGetStreamLength,
+                       getStreamRequest,
+                       getStreamRequestLength,
+                       MQTTQoS0,
+                       TAG);
+    } else if (getStreamRequestLength == 0) {
+        ESP_LOGE(TAG, "Failed creating the Get data block request");
+    }
+}
+
+/* Initializes the MQTT downloader with the information from the job document. */
+static bool prvInitMqttDownloader(AfrOtaJobDocumentFields_t* jobFields, DataType_t dataType)
+{
+    MQTTFileDownloaderStatus_t xStatus;
+    uint32_t numOfBlocks;
+
+    if (jobFields->fileSize > CONFIG_MAX_FILE_SIZE) {
+        ESP_LOGE(TAG, "File size %lu exceeds the maximum of %u bytes", jobFields->fileSize, CONFIG_MAX_FILE_SIZE);
+        return false;
+    }
+
+    numOfBlocks = jobFields->fileSize / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    numOfBlocks += (jobFields->fileSize % mqttFileDownloader_CONFIG_BLOCK_SIZE > 0) ? 1 : 0;
+
+    ESP_LOGI(TAG, "Number of blocks to receive %ld", numOfBlocks);
+
+    BlockWindow_Free(&blockWindow);
+
+    if (!BlockWindow_Init(&blockWindow, numOfBlocks, prvGetBlockWindowSize())) {
+        ESP_LOGE(TAG, "Failed to allocate the block bitmap");
+        return false;
+    }
+
+    OtaBlockSizer_Init(&blockSizer, prvGetMaxPartShift(jobFields->fileSize));
+
+    currentFileId   = jobFields->fileId;
+    currentFileSize = jobFields->fileSize;
+    prvResetDownloadStats();
+
+    /*
+     * MQTT streams Library:
+     * Initializing the MQTT streams downloader. Passing the
+     * parameters extracted from the AWS IoT OTA jobs document
+     * using OTA jobs parser.
+     */
+    xStatus = mqttDownloader_init(&mqttFileDownloaderContext,
+                                  jobFields->imageRef,
+                                  jobFields->imageRefLen,
+                                  GetThingName(),
+                                  strlen(GetThingName()),
+                                  dataType);
+
+    if (xStatus != MQTTFileDownloaderSuccess) {
+        ESP_LOGE(TAG, "MQTTFileDownloader initialization failed. Parsing of the job document failed");
+        return false;
+    }
+    return true;
+}
+
+static void prvResetDownloadStats(void)
+{
+    totalBytesReceived = 0;
+    downloadStartMs    = prvGetTimeMs();
+    wireBytesReceived  = 0;
+    blocksDecoded      = 0;
+    decodeTimeUs       = 0;
+    bytesCopied        = 0;
+    bytesDeduplicated  = 0;
+}
+
+/* Returns the stream data encoding requested by the job document, or the configured one. */
+static DataType_t prvGetStreamDataType(const char* jobDoc, size_t jobDocLength)
+{
+    const char* value  = NULL;
+    size_t valueLength = 0;
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, STREAM_DATA_TYPE_JOB_KEY, strlen(STREAM_DATA_TYPE_JOB_KEY),
+                         &value, &valueLength, NULL) == JSONSuccess) {
+        if ((valueLength == 4U) && (strncmp(value, "cbor", 4U) == 0)) {
+            return DATA_TYPE_CBOR;
+        }
+        if ((valueLength == 4U) && (strncmp(value, "json", 4U) == 0)) {
+            return DATA_TYPE_JSON;
+        }
+        ESP_LOGW(TAG, "Unknown stream data type %.*s, using the default one", (int)valueLength, value);
+    }
+    return OTA_STREAM_DATA_TYPE;
+}
+
+/* Copies the delta format given by the job document into format, NULL if there is none. */
+static const char* prvGetDeltaFormat(const char* jobDoc, size_t jobDocLength, char* format)
+{
+    const char* value  = NULL;
+    size_t valueLength = 0;
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, DELTA_FORMAT_JOB_KEY, strlen(DELTA_FORMAT_JOB_KEY),
+                         &value, &valueLength, NULL) != JSONSuccess) {
+        return NULL;
+    }
+    if (valueLength > DELTA_FORMAT_MAX_LENGTH) {
+        ESP_LOGW(TAG, "Delta format %.*s too long, using the file extension", (int)valueLength, value);
+        return NULL;
+    }
+
+    memcpy(format, value, valueLength);
+    format[valueLength] = '\0';
+
+    return format;
+}
+
+/*
+ * Builds the checkpoint of the new job and compares it with the one stored in NVS.
+ * If both describe the same image, the received-block bitmap is restored and true
+ * is returned so the partition is not erased.
+ */
+static bool prvLoadCheckpoint(const AfrOtaJobDocumentFields_t* jobFields)
+{
+    OtaCheckpoint_t storedCheckpoint = {0};
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    size_t bitmapSize                = BlockWindow_BitmapSize(&blockWindow);
+    uint8_t* bitmap                  = NULL;
+    bool resume                      = false;
+
+    checkpointEnabled = (OTA_CHECKPOINT_INTERVAL > 0) && (partition != NULL) &&
+                        OtaCheckpoint_Create(&checkpoint, jobId, jobFields, mqttFileDownloader_CONFIG_BLOCK_SIZE, partition->address);
+
+    if (!checkpointEnabled) {
+        return false;
+    }
+
+    bitmap = (uint8_t*)calloc(bitmapSize, sizeof(uint8_t));
+
+    if ((bitmap != NULL) && OtaCheckpoint_Load(&storedCheckpoint, bitmap, bitmapSize)) {
+        if (OtaCheckpoint_Matches(&storedCheckpoint, &checkpoint)) {
+            BlockWindow_Restore(&blockWindow, bitmap);
+            checkpoint.patchProgress = storedCheckpoint.patchProgress;
+            memcpy(&checkpoint.patchDigest, &storedCheckpoint.patchDigest, sizeof(mbedtls_sha256_context));
+            resume = true;
+        } else {
+            ESP_LOGI(TAG, "Discarding the checkpoint of job %s", storedCheckpoint.jobId);
+        }
+    }
+    free(bitmap);
+
+    return resume;
+}
+
+/* Validates the partially written image when resuming, then stores the first checkpoint. */
+static void prvStartCheckpointing(bool resume)
+{
+    blocksSinceCheckpoint = 0;
+
+    if (!checkpointEnabled) {
+        return;
+    }
+
+    if (resume) {
+        /* Nothing of a streamed patch is in flash, it is downloaded again from its checkpoint. */
+        if (!prvIsPatchStreamed()) {
+            prvValidatePartialImage();
+        }
+        ESP_LOGI(TAG, "Resuming download of job %s: %lu of %lu blocks already stored",
+                 jobId, blockWindow.blocksReceived, blockWindow.numOfBlocks);
+    } else {
+        OtaCheckpoint_Erase();
+    }
+
+    /* The patch engine reads up to the furthest block stored so far. */
+    for (uint32_t blockId = blockWindow.numOfBlocks; blockId > 0; blockId--) {
+        if (BlockWindow_IsReceived(&blockWindow, blockId - 1)) {
+            uint32_t end           = blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+            ota_ctx.data_write_len = (end > checkpoint.fileSize) ? checkpoint.fileSize : end;
+            break;
+        }
+    }
+
+    OtaCheckpoint_Save(&checkpoint, blockWindow.bitmap, BlockWindow_BitmapSize(&blockWindow));
+}
+
+/* Stores the bitmap every OTA_CHECKPOINT_INTERVAL blocks to bound flash wear and latency. */
+static void prvUpdateCheckpoint(void)
+{
+    /* A streamed patch is checkpointed by the patch task, where it can be resumed from. */
+    if (!checkpointEnabled || prvIsPatchStreamed() || prvIsManifestDownloading()) {
+        return;
+    }
+
+    if ((++blocksSinceCheckpoint >= OTA_CHECKPOINT_INTERVAL) || BlockWindow_IsComplete(&blockWindow)) {
+        /* Only blocks already in flash can be recorded as stored. */
+        if (OtaFlashWriter_Flush(&flashWriter) == ESP_OK) {
+            OtaCheckpoint_Save(&checkpoint, blockWindow.bitmap, BlockWindow_BitmapSize(&blockWindow));
+        }
+        blocksSinceCheckpoint = 0;
+    }
+}
+
+static void prvStopCheckpointing(void)
+{
+    if (checkpointEnabled) {
+        OtaCheckpoint_Erase();
+        checkpointEnabled = false;
+    }
+}
+
+/*
+ * Blocks are written without erasing when resuming, so the area of every missing
+ * block must still be erased. A block written after the last checkpoint, or cut
+ * by a power loss, is erased again together with the blocks sharing its sectors.
+ */
+static void prvValidatePartialImage(void)
+{
+    const esp_partition_t* partition = prvGetDownloadPartition();
+    uint32_t erasedSectors           = 0;
+
+    for (uint32_t blockId = 0; blockId < blockWindow.numOfBlocks; blockId++) {
+        uint32_t offset = blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        uint32_t length = checkpoint.fileSize - offset;
+
+        if (length > mqttFileDownloader_CONFIG_BLOCK_SIZE) {
+            length = mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        }
+
+        if (BlockWindow_IsReceived(&blockWindow, blockId) || prvIsFlashErased(partition, offset, length)) {
+            continue;
+        }
+
+        uint32_t sectorStart = offset & ~(FLASH_SECTOR_SIZE - 1U);
+        uint32_t sectorEnd   = (offset + length + FLASH_SECTOR_SIZE - 1U) & ~(FLASH_SECTOR_SIZE - 1U);
+
+        if (esp_partition_erase_range(partition, sectorStart, sectorEnd - sectorStart) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase the area of block %lu", blockId);
+            continue;
+        }
+        erasedSectors += (sectorEnd - sectorStart) / FLASH_SECTOR_SIZE;
+
+        for (uint32_t id = sectorStart / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+             (id * mqttFileDownloader_CONFIG_BLOCK_SIZE < sectorEnd) && (id < blockWindow.numOfBlocks);
+             id++) {
+            BlockWindow_ClearReceived(&blockWindow, id);
+        }
+    }
+
+    if (erasedSectors > 0) {
+        ESP_LOGW(TAG, "Erased %lu sectors holding data not covered by the checkpoint", erasedSectors);
+    }
+}
+
+static bool prvIsFlashErased(const esp_partition_t* partition, uint32_t offset, uint32_t length)
+{
+    uint32_t buffer[ERASED_CHECK_READ_SIZE / sizeof(uint32_t)];
+
+    while (length > 0) {
+        uint32_t readLength = (length > ERASED_CHECK_READ_SIZE) ? ERASED_CHECK_READ_SIZE : length;
+
+        memset(buffer, 0xFF, sizeof(buffer));
+
+        if (esp_partition_read(partition, offset, buffer, readLength) != ESP_OK) {
+            return false;
+        }
+        for (uint32_t i = 0; i < sizeof(buffer) / sizeof(uint32_t); i++) {
+            if (buffer[i] != UINT32_MAX) {
+                return false;
+            }
+        }
+        offset += readLength;
+        length -= readLength;
+    }
+    return true;
+}
+
+/*
+ * Prepares the digest of the downloaded file and its expected values. A full image
+ * is checked against the digest and the signature. A patch is checked against the
+ * signature, the digest is the one of the image rebuilt by ApplyPatch.
+ */
+static bool prvStartImageVerification(const AfrOtaJobDocumentFields_t* jobFields, const char* jobDoc, size_t jobDocLength)
+{
+    const char* value  = NULL;
+    size_t valueLength = 0;
+
+    OtaImageVerifier_Init(&imageVerifier, true);
+    blocksHashed = 0;
+
+    if ((jobFields->signature != NULL) && (jobFields->signatureLen > 0U) &&
+        !OtaImageVerifier_SetSignature(&imageVerifier, jobFields->signature, jobFields->signatureLen)) {
+        return false;
+    }
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, IMAGE_DIGEST_JOB_KEY, strlen(IMAGE_DIGEST_JOB_KEY),
+                         &value, &valueLength, NULL) == JSONSuccess) {
+        if (!OtaImageVerifier_ParseDigest(value, valueLength, ota_ctx.target_digest)) {
+            ESP_LOGE(TAG, "Invalid image digest in the job document");
+            return false;
+        }
+        ota_ctx.has_target_digest = true;
+
+        if (ota_ctx.OtaPartition_type == OtaUpdatePartition) {
+            OtaImageVerifier_SetDigest(&imageVerifier, ota_ctx.target_digest);
+        }
+    }
+    return true;
+}
+
+/*
+ * Hashes the stored blocks that follow the ones already hashed. Blocks arrive out
+ * of order, so the digest only advances over the received prefix of the file: the
+ * block just stored is hashed from the ring, blocks that arrived before it are
+ * read back from flash. A resumed download hashes what it already stored.
+ */
+static void prvAdvanceImageDigest(const OtaStreamBlock_t* block)
+{
+    bool flushed = false;
+
+    /* A streamed patch is hashed by the patch task as it reads it. */
+    if (prvIsPatchStreamed() || prvIsManifestDownloading()) {
+        return;
+    }
+
+    while (BlockWindow_IsReceived(&blockWindow, blocksHashed)) {
+        if ((block != NULL) && ((uint32_t)block->blockId == blocksHashed)) {
+            OtaImageVerifier_Update(&imageVerifier, block->payload, block->payloadLength);
+        } else {
+            if (!flushed) {
+                OtaFlashWriter_Flush(&flashWriter);
+                flushed = true;
+            }
+            if (!prvHashStoredBlock(blocksHashed)) {
+                return;
+            }
+        }
+        blocksHashed++;
+    }
+}
+
+static bool prvHashStoredBlock(uint32_t blockId)
+{
+    const esp_partition_t* partition = prvGetDownloadPartition();
+    uint8_t buffer[ERASED_CHECK_READ_SIZE];
+    uint32_t offset = blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    uint32_t length = currentFileSize - offset;
+
+    if (length > mqttFileDownloader_CONFIG_BLOCK_SIZE) {
+        length = mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    }
+
+    while (length > 0) {
+        uint32_t readLength = (length > sizeof(buffer)) ? sizeof(buffer) : length;
+
+        if (esp_partition_read(partition, offset, buffer, readLength) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read block %lu back for the image digest", blockId);
+            return false;
+        }
+        OtaImageVerifier_Update(&imageVerifier, buffer, readLength);
+
+        offset += readLength;
+        length -= readLength;
+    }
+    return true;
+}
+
+/* Checks the digest of the whole file before it is applied or marked bootable. */
+static bool prvFinishImageVerification(void)
+{
+    bool verified = false;
+
+    if (imageVerifier.bytesHashed != currentFileSize) {
+        ESP_LOGE(TAG, "Only %lu of %lu bytes were hashed", imageVerifier.bytesHashed, currentFileSize);
+    } else {
+        verified = OtaImageVerifier_Finish(&imageVerifier);
+    }
+    OtaImageVerifier_Free(&imageVerifier);
+
+    return verified;
+}
+
+/* The first block of a full image must start with the ESP application image header. */
+static bool prvIsImageHeaderValid(uint32_t offset, const OtaStreamBlock_t* block)
+{
+    if ((ota_ctx.OtaPartition_type != OtaUpdatePartition) || (offset != 0U) || prvIsManifestDownloading() ||
+        (currentDataFile != NULL)) {
+        return true;
+    }
+    return (block->payloadLength > 0U) && (block->payload[0] == ESP_IMAGE_HEADER_MAGIC);
+}
+
+static const esp_partition_t* prvGetDownloadPartition(void)
+{
+    if (currentDataFile != NULL) {
+        return currentDataFile->partition;
+    }
+    return (ota_ctx.OtaPartition_type == OtaPatchPartition) ? ota_ctx.patch_partition : ota_ctx.update_partition;
+}
+
+/* Subscribes to MQTT topics for receiving data blocks in the OTA stream. */
+static bool prvSubscribeStreamDataTopics(const char* streamName)
+{
+    MQTTAgentSubscribeArgs_t xSubscribeArgs                       = {0};
+    MQTTSubscribeInfo_t subscriptionList[NUMBER_OF_SUBSCRIPTIONS] = {0};
+    const TopicId_t topicIds[NUMBER_OF_SUBSCRIPTIONS]            = {TopicIdStreamData, TopicIdStreamRejected};
+
+    /* The interned topics of the previous stream are replaced, the subscriptions keep pointing to them. */
+    TopicRegistry_SetStream(streamName, (mqttFileDownloaderContext.dataType == DATA_TYPE_CBOR) ? "cbor" : "json");
+
+    for (int i = 0; i < NUMBER_OF_SUBSCRIPTIONS; i++) {
+        ESP_LOGI(TAG, "Topic: %s", TopicRegistry_Get(topicIds[i]));
+        subscriptionList[i].qos               = MQTTQoS0;
+        subscriptionList[i].pTopicFilter      = TopicRegistry_Get(topicIds[i]);
+        subscriptionList[i].topicFilterLength = TopicRegistry_Length(topicIds[i]);
+    }
+    xSubscribeArgs.numSubscriptions = NUMBER_OF_SUBSCRIPTIONS;
+    xSubscribeArgs.pSubscribeInfo   = subscriptionList;
+
+    /* The callback copies the block into dataRing itself, deferring it would copy each block twice. */
+    return (SubscribeToTopicInAgentTask(&xSubscribeArgs, &prvStreamDataIncomingPublishCallback, TAG) == MQTTSuccess);
+}
+
+static bool prvStartFlashWriter(void)
+{
+    /* A streamed patch is not stored, the patch task writes the image it rebuilds. */
+    if (prvIsPatchStreamed()) {
+        return true;
+    }
+
+    if (!OtaFlashWriter_Init(&flashWriter, prvWriteDownloadedData, &ota_ctx, OTA_FLASH_DOUBLE_BUFFER)) {
+        ESP_LOGE(TAG, "Failed to start the flash writer");
+        return false;
+    }
+    return true;
+}
+
+/* Writes the data still buffered, logs the flash throughput and releases the writer. */
+static esp_err_t prvStopFlashWriter(void)
+{
+    esp_err_t xError = OtaFlashWriter_Flush(&flashWriter);
+    uint32_t writeTimeMs = (uint32_t)(flashWriter.writeTimeUs / 1000U);
+
+    ESP_LOGI(TAG, "Flash: %lu bytes in %lu writes (%lu partial) in %lu ms (%lu KB/s), %lu bytes copied, waited %lu ms",
+             flashWriter.bytesWritten,
+             flashWriter.flashWrites,
+             flashWriter.partialWrites,
+             writeTimeMs,
+             (flashWriter.writeTimeUs > 0) ? (uint32_t)(((uint64_t)flashWriter.bytesWritten * 1000U) / flashWriter.writeTimeUs) : 0U,
+             flashWriter.bytesCopied,
+             (uint32_t)(flashWriter.waitTimeUs / 1000U));
+
+    OtaFlashWriter_Deinit(&flashWriter);
+
+    return xError;
+}
+
+/* Only the image is streamed to the patch task, the data files of the job are stored. */
+static bool prvIsPatchStreamed(void)
+{
+    return (ota_ctx.OtaPartition_type == OtaStreamPatch) && (currentDataFile == NULL);
+}
+
+/*
+ * Starts the patch task on a window of OTA_PATCH_STREAM_SIZE bytes. A resumed patch
+ * is downloaded again from the page of its checkpoint, with the digest it had there.
+ */
+static bool prvStartPatchStream(bool resume)
+{
+    const OtaPatchProgress_t* pResume = NULL;
+    uint32_t startOffset              = 0;
+
+    if (!prvIsPatchStreamed()) {
+        return true;
+    }
+
+    blocksPublished = 0;
+
+    if (resume) {
+        pResume     = &checkpoint.patchProgress;
+        startOffset = checkpoint.patchProgress.streamOffset;
+
+        if (startOffset > 0) {
+            OtaImageVerifier_Restore(&imageVerifier, &checkpoint.patchDigest, startOffset);
+        }
+        ESP_LOGI(TAG, "Resuming the patch at offset %lu", checkpoint.patchProgress.patchOffset);
+    }
+
+    if (!OtaPatchStream_Init(&patchStream, OTA_PATCH_STREAM_SIZE, OTA_PATCH_PAGE_SIZE, currentFileSize, startOffset,
+                             &imageVerifier, prvNotifyPatchStream)) {
+        return false;
+    }
+
+    if (!ApplyPatchStreamStart(&ota_ctx, &patchStream, pResume, checkpointEnabled ? prvSavePatchCheckpoint : NULL,
+                               OTA_CHECKPOINT_INTERVAL * mqttFileDownloader_CONFIG_BLOCK_SIZE)) {
+        OtaPatchStream_Deinit(&patchStream);
+        return false;
+    }
+    return true;
+}
+
+/* Waits for the patch task, after making it give up if abort is set, and releases the window. */
+static bool prvStopPatchStream(bool abort)
+{
+    bool applied;
+
+    if (abort) {
+        OtaPatchStream_Abort(&patchStream);
+    }
+    applied = ApplyPatchStreamFinish();
+
+    ESP_LOGI(TAG, "Patch stream: %lu blocks outside of the window, patch task waited %lu ms for data",
+             patchStream.rejectedBlocks,
+             (uint32_t)(patchStream.readWaitUs / 1000U));
+
+    OtaPatchStream_Deinit(&patchStream);
+
+    return applied;
+}
+
+/* Hands the received prefix of the patch to the patch task. */
+static void prvPublishPatchData(void)
+{
+    uint32_t end;
+
+    if (!prvIsPatchStreamed()) {
+        return;
+    }
+
+    while (BlockWindow_IsReceived(&blockWindow, blocksPublished)) {
+        blocksPublished++;
+    }
+
+    end = blocksPublished * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    OtaPatchStream_SetAvailable(&patchStream, (end > currentFileSize) ? currentFileSize : end);
+}
+
+/*
+ * Called by the patch task at a checkpoint. The blocks before the page it resumes
+ * from are recorded as received, the ones after it are downloaded again.
+ */
+static void prvSavePatchCheckpoint(const OtaPatchProgress_t* progress, const mbedtls_sha256_context* patchDigest)
+{
+    uint32_t numOfBlocks = (currentFileSize + mqttFileDownloader_CONFIG_BLOCK_SIZE - 1U) / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    uint32_t blocksKept  = progress->streamOffset / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+    size_t bitmapSize    = (numOfBlocks + 7U) / 8U;
+    uint8_t* bitmap;
+
+    /* The download can only restart at a block boundary. */
+    if (!checkpointEnabled || ((progress->streamOffset % mqttFileDownloader_CONFIG_BLOCK_SIZE) != 0U)) {
+        return;
+    }
+
+    bitmap = (uint8_t*)calloc(bitmapSize, sizeof(uint8_t));
+    if (bitmap == NULL) {
+        return;
+    }
+
+    for (uint32_t blockId = 0; blockId < blocksKept; blockId++) {
+        bitmap[blockId / 8U] |= (uint8_t)(1U << (blockId % 8U));
+    }
+
+    checkpoint.patchProgress = *progress;
+    memcpy(&checkpoint.patchDigest, patchDigest, sizeof(mbedtls_sha256_context));
+
+    OtaCheckpoint_Save(&checkpoint, bitmap, bitmapSize);
+    free(bitmap);
+}
+
+/*
+ * Downloads the chunk manifest named by the job document before a full image,
+ * swapping the block window of the image for one of the manifest. A resumed
+ * download keeps the blocks it stored and fetches the rest.
+ */
+static void prvStartManifestDownload(const char* jobDoc, size_t jobDocLength, bool resume)
+{
+    const char* value    = NULL;
+    size_t valueLength   = 0;
+    uint32_t fileId      = 0;
+    uint32_t fileSize    = 0;
+    uint32_t numOfBlocks = 0;
+
+    if (!OTA_CHUNK_DEDUP || resume || (ota_ctx.OtaPartition_type != OtaUpdatePartition)) {
+        return;
+    }
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, MANIFEST_FILE_ID_JOB_KEY, strlen(MANIFEST_FILE_ID_JOB_KEY),
+                         &value, &valueLength, NULL) != JSONSuccess) {
+        return;
+    }
+    fileId = strtoul(value, NULL, 10);
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, MANIFEST_FILE_SIZE_JOB_KEY, strlen(MANIFEST_FILE_SIZE_JOB_KEY),
+                         &value, &valueLength, NULL) != JSONSuccess) {
+        return;
+    }
+    fileSize = strtoul(value, NULL, 10);
+
+    if ((fileSize == 0U) || (fileSize > OTA_MANIFEST_MAX_SIZE) || (fileId > UINT16_MAX)) {
+        ESP_LOGW(TAG, "Manifest of %lu bytes not supported, downloading the whole image", fileSize);
+        return;
+    }
+
+    manifestData = (uint8_t*)malloc(fileSize);
+    numOfBlocks  = (fileSize + mqttFileDownloader_CONFIG_BLOCK_SIZE - 1U) / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+
+    if (manifestData == NULL) {
+        ESP_LOGW(TAG, "No memory for the manifest, downloading the whole image");
+        return;
+    }
+
+    imageBlockWindow = blockWindow;
+    memset(&blockWindow, 0x00, sizeof(BlockWindow_t));
+
+    if (!BlockWindow_Init(&blockWindow, numOfBlocks, prvGetBlockWindowSize())) {
+        ESP_LOGW(TAG, "No memory for the manifest, downloading the whole image");
+        blockWindow = imageBlockWindow;
+        memset(&imageBlockWindow, 0x00, sizeof(BlockWindow_t));
+        free(manifestData);
+        manifestData = NULL;
+        return;
+    }
+
+    imageFileId     = currentFileId;
+    imageFileSize   = currentFileSize;
+    currentFileId   = (uint16_t)fileId;
+    currentFileSize = fileSize;
+
+    ESP_LOGI(TAG, "Downloading the manifest of %lu bytes, file %lu", fileSize, fileId);
+}
+
+/* Goes back to the image and copies the chunks of it found in the running image. */
+static void prvFinishManifestDownload(void)
+{
+    OtaManifest_t manifest;
+    uint8_t* data = manifestData;
+    uint32_t size = currentFileSize;
+
+    BlockWindow_Free(&blockWindow);
+    blockWindow = imageBlockWindow;
+    memset(&imageBlockWindow, 0x00, sizeof(BlockWindow_t));
+
+    manifestData    = NULL;
+    currentFileId   = imageFileId;
+    currentFileSize = imageFileSize;
+
+    if (!OtaManifest_Parse(&manifest, data, size) || (manifest.imageSize != currentFileSize) ||
+        ((manifest.chunkSize % mqttFileDownloader_CONFIG_BLOCK_SIZE) != 0U)) {
+        ESP_LOGW(TAG, "The manifest does not describe the image, downloading all of it");
+    } else {
+        prvCopyLocalChunks(&manifest);
+    }
+    free(data);
+}
+
+static void prvStopManifestDownload(void)
+{
+    if (prvIsManifestDownloading()) {
+        BlockWindow_Free(&imageBlockWindow);
+        free(manifestData);
+        manifestData = NULL;
+    }
+}
+
+/*
+ * Copies the chunks found in the running image to the update partition and
+ * marks their blocks as received, so only the other blocks are requested.
+ */
+static void prvCopyLocalChunks(const OtaManifest_t* pManifest)
+{
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    uint32_t* sourceOffsets        = (uint32_t*)malloc(pManifest->numOfChunks * sizeof(uint32_t));
+    uint8_t* buffer                = (uint8_t*)malloc(mqttFileDownloader_CONFIG_BLOCK_SIZE);
+    uint32_t blocksPerChunk        = pManifest->chunkSize / mqttFileDownloader_CONFIG_BLOCK_SIZE;
+
+    if ((sourceOffsets == NULL) || (buffer == NULL) || (OtaManifest_FindChunks(pManifest, running, sourceOffsets) == 0U)) {
+        free(sourceOffsets);
+        free(buffer);
+        return;
+    }
+
+    for (uint32_t chunk = 0; chunk < pManifest->numOfChunks; chunk++) {
+        if (sourceOffsets[chunk] == OTA_MANIFEST_NOT_FOUND) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < blocksPerChunk; i++) {
+            uint32_t blockId = (chunk * blocksPerChunk) + i;
+            uint32_t offset  = blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+
+            if ((esp_partition_read(running, sourceOffsets[chunk] + (i * mqttFileDownloader_CONFIG_BLOCK_SIZE), buffer,
+                                    mqttFileDownloader_CONFIG_BLOCK_SIZE) != ESP_OK) ||
+                (OtaFlashWriter_Write(&flashWriter, offset, buffer, mqttFileDownloader_CONFIG_BLOCK_SIZE) != ESP_OK)) {
+                ESP_LOGW(TAG, "Failed to copy block %lu, downloading it", blockId);
+                break;
+            }
+            BlockWindow_MarkReceived(&blockWindow, blockId, prvGetTimeMs());
+            bytesDeduplicated += mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        }
+    }
+
+    free(sourceOffsets);
+    free(buffer);
+
+    prvAdvanceImageDigest(NULL);
+
+    ESP_LOGI(TAG, "Copied %lu of %lu bytes from the running image, %lu blocks left to download",
+             bytesDeduplicated, currentFileSize, blockWindow.numOfBlocks - blockWindow.blocksReceived);
+}
+
+static bool prvIsManifestDownloading(void)
+{
+    return manifestData != NULL;
+}
+
+/* Reads whether the job stages its image, and when a staged image is activated. */
+static void prvGetActivation(const char* jobDoc, size_t jobDocLength)
+{
+    const char* value  = NULL;
+    size_t valueLength = 0;
+
+    stagedUpdate   = false;
+    activateAfterS = 0;
+
+    if ((JSON_SearchConst(jobDoc, jobDocLength, ACTIVATION_JOB_KEY, strlen(ACTIVATION_JOB_KEY), &value, &valueLength,
+                          NULL) != JSONSuccess) ||
+        (valueLength != 6U) || (strncmp(value, "staged", 6U) != 0)) {
+        return;
+    }
+    stagedUpdate = true;
+
+    if (JSON_SearchConst(jobDoc, jobDocLength, ACTIVATE_AFTER_JOB_KEY, strlen(ACTIVATE_AFTER_JOB_KEY), &value,
+                         &valueLength, NULL) == JSONSuccess) {
+        activateAfterS = strtoul(value, NULL, 10);
+    }
+
+    if (activateAfterS > 0U) {
+        ESP_LOGI(TAG, "Staged update, activated %lu s after the download", activateAfterS);
+    } else {
+        ESP_LOGI(TAG, "Staged update, activated by an activation job");
+    }
+}
+
+static bool prvIsActivationJob(const char* jobDoc, size_t jobDocLength)
+{
+    const char* value  = NULL;
+    size_t valueLength = 0;
+
+    return (JSON_SearchConst(jobDoc, jobDocLength, ACTIVATE_JOB_KEY, strlen(ACTIVATE_JOB_KEY), &value, &valueLength,
+                             NULL) == JSONSuccess) &&
+           (valueLength == 4U) && (strncmp(value, "true", 4U) == 0);
+}
+
+/* A staged image is downloaded in the background, with fewer requests in flight. */
+static uint32_t prvGetBlockWindowSize(void)
+{
+    return stagedUpdate ? OTA_STAGED_BLOCK_WINDOW_SIZE : OTA_BLOCK_WINDOW_SIZE;
+}
+
+/*
+ * Records the verified image of the update partition, so it is booted later even
+ * if the device restarts in between, and starts its maintenance window.
+ */
+static bool prvStageNewImage(void)
+{
+    OtaStagedImage_t staged = {0};
+
+    staged.version          = OTA_STAGING_VERSION;
+    staged.partitionAddress = ota_ctx.update_partition->address;
+    staged.activateAfterS   = activateAfterS;
+    strncpy(staged.jobId, jobId, JOB_ID_LENGTH - 1);
+
+    if (!OtaStaging_Save(&staged)) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Image staged in partition %s", ota_ctx.update_partition->label);
+
+    if (activateAfterS > 0U) {
+        prvStartActivationTimer(activateAfterS);
+    }
+    return true;
+}
+
+/*
+ * Called at start up. There is no wall clock, so the maintenance window of an image
+ * staged before a restart starts again from the boot.
+ */
+static void prvRestoreStagedImage(void)
+{
+    OtaStagedImage_t staged;
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+
+    if (!OtaStaging_Load(&staged)) {
+        return;
+    }
+
+    /* The staged image was booted, or the partitions changed since. */
+    if ((partition == NULL) || (partition->address != staged.partitionAddress)) {
+        OtaStaging_Erase();
+        return;
+    }
+
+    ESP_LOGI(TAG, "Image of job %s staged in partition %s", staged.jobId, partition->label);
+
+    if (staged.activateAfterS > 0U) {
+        prvStartActivationTimer(staged.activateAfterS);
+    }
+}
+
+static void prvCancelStagedImage(void)
+{
+    if (activationTimer != NULL) {
+        esp_timer_stop(activationTimer);
+    }
+    OtaStaging_Erase();
+}
+
+/* Sets the staged image as the boot partition. The caller restarts the device. */
+static bool prvActivateStagedImage(void)
+{
+    OtaStagedImage_t staged;
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    esp_err_t xError;
+
+    if (!OtaStaging_Load(&staged) || (partition == NULL) || (partition->address != staged.partitionAddress)) {
+        ESP_LOGE(TAG, "No staged image to activate");
+        return false;
+    }
+
+    /* The image is checked again, it may have been in flash for a while. */
+    xError = esp_ota_set_boot_partition(partition);
+
+    if (xError != ESP_OK) {
+        ESP_LOGE(TAG, "Set boot partition Failed %d", xError);
+        OtaStaging_Erase();
+        return false;
+    }
+
+    OtaStaging_Erase();
+    ESP_LOGI(TAG, "Staged image of job %s activated", staged.jobId);
+    return true;
+}
+
+static void prvStartActivationTimer(uint32_t seconds)
+{
+    const esp_timer_create_args_t timerArgs = {
+        .callback = prvActivationTimerCallback,
+        .name     = "ota_activation",
+    };
+
+    if ((activationTimer == NULL) && (esp_timer_create(&timerArgs, &activationTimer) != ESP_OK)) {
+        ESP_LOGE(TAG, "Failed to create the activation timer");
+        return;
+    }
+
+    esp_timer_stop(activationTimer);
+    esp_timer_start_once(activationTimer, (uint64_t)seconds * 1000000U);
+}
+
+/* Runs in the esp_timer task, which must not block: a busy queue is tried again a bit later. */
+static void prvActivationTimerCallback(void* pArg)
+{
+    OtaEventMsg_t nextEvent = {0};
+
+    (void)pArg;
+
+    nextEvent.eventId = OtaEventActivateImage;
+
+    if (!EventBus_TrySend(xOtaEventQueue, &nextEvent)) {
+        esp_timer_start_once(activationTimer, ACTIVATION_RETRY_MS * 1000U);
+    }
+}
+
+/* Called from the patch task when it released part of the window, or failed. */
+static void prvNotifyPatchStream(void)
+{
+    OtaEventMsg_t nextEvent = {0};
+
+    nextEvent.eventId = OtaEventRequestFileBlock;
+    EventBus_Send(xOtaEventQueue, &nextEvent);
+}
+
+static uint32_t prvEventType(const void* event)
+{
+    return ((const OtaEventMsg_t*)event)->eventId;
+}
+
+/* Called by the event bus on an event it dropped or replaced. */
+static void prvReleaseEvent(const void* event)
+{
+    SharedBuffer_Release(((const OtaEventMsg_t*)event)->jobEvent.buffer);
+}
+
+/* Flash write function of the writer, the data goes to the partition of the current download. */
+static esp_err_t prvWriteDownloadedData(void* pContext, uint32_t offset, const void* pData, size_t length)
+{
+    esp_ota_context_t* pOtaCtx = (esp_ota_context_t*)pContext;
+
+    if (pOtaCtx->OtaPartition_type == OtaPatchPartition) {
+        return esp_partition_write(pOtaCtx->patch_partition, offset, pData, length);
+    }
+    return OtaImageFile_Write(&pOtaCtx->update_file, offset, pData, length);
+}
+
+/* Flash write function of the writer for data files, their partition is erased when their download starts. */
+static esp_err_t prvWriteDataFile(void* pContext, uint32_t offset, const void* pData, size_t length)
+{
+    return esp_partition_write((const esp_partition_t*)pContext, offset, pData, length);
+}
+
+/*
+ * Stores the received data blocks in the flash partition reserved for OTA.
+ * Blocks may arrive in any order, so each one is written at its own offset.
+ */
+static bool prvHandleMqttStreamsBlockArrived(uint32_t offset, const uint8_t* data, size_t dataLength)
+{
+    esp_err_t xError;
+
+    if ((offset + dataLength) > CONFIG_MAX_FILE_SIZE) {
+        ESP_LOGE(TAG, "Data at the offset %lu is out of the file bounds", offset);
+        return false;
+    }
+
+    if (prvIsManifestDownloading()) {
+        if ((offset + dataLength) > currentFileSize) {
+            ESP_LOGE(TAG, "Data at the offset %lu is out of the manifest bounds", offset);
+            return false;
+        }
+        memcpy(manifestData + offset, data, dataLength);
+        totalBytesReceived += dataLength;
+        return true;
+    }
+
+    if (prvIsPatchStreamed()) {
+        if (!OtaPatchStream_Write(&patchStream, offset, data, dataLength)) {
+            ESP_LOGW(TAG, "Data at the offset %lu is outside of the patch window, dropping it", offset);
+            return false;
+        }
+        xError = ESP_OK;
+    } else {
+        xError = OtaFlashWriter_Write(&flashWriter, offset, data, dataLength);
+    }
+
+    if (xError != ESP_OK) {
+        ESP_LOGE(TAG, "Couldn't flash at the offset %" PRIu32 "", offset);
+        return false;
+    }
+
+    totalBytesReceived += dataLength;
+
+    /* The file size is given by the end of the furthest block, the patch engine reads up to it. */
+    if ((offset + dataLength) > ota_ctx.data_write_len) {
+        ota_ctx.data_write_len = offset + dataLength;
+    }
+
+    ESP_LOGI(TAG, "Downloaded %u bytes at the offset %lu (%lu of %lu blocks), total bytes received: %lu",
+             (unsigned)dataLength, offset, blockWindow.blocksReceived, blockWindow.numOfBlocks, totalBytesReceived);
+
+    return true;
+}
+
+/*
+ * Callback function for handling incoming MQTT messages for OTA streams.
+*/
+static void prvStreamDataIncomingPublishCallback(void* pvIncomingPublishCallbackContext, MQTTPublishInfo_t* pxPublishInfo)
+{
+    OtaEventMsg_t nextEvent = {0};
+
+    ESP_LOGD("MQTT_AGENT", "Handling Stream data Incoming publish\n");
+
+    (void)pvIncomingPublishCallbackContext;
 
     /* Check if the topic is not rejected */
-    if (!isRejectedTopic(topic_filter)) {
-        ESP_LOGI("MQTT_AGENT", "Accepted topic, processing data block.\n");
+    if (TopicRegistry_Classify(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength) != TopicIdStreamRejected) {
+        ESP_LOGD("MQTT_AGENT", "Accepted topic, processing data block.\n");
 
         nextEvent.eventId = OtaEventReceivedFileBlock;
 
-        /* Get a buffer for the event data. */
-        OtaDataEvent_t* dataBuf = prvGetOtaDataEventBuffer();
+        if (pxPublishInfo->payloadLength > sizeof(dataBuffers[0].data)) {
+            ESP_LOGE("MQTT_AGENT", "Data block of %u bytes does not fit in the buffer.", pxPublishInfo->payloadLength);
+            return;
+        }
+
+        /* Get a buffer for the event data, the block is requested again if none is free. */
+        OtaDataEvent_t* dataBuf = OtaDataRing_Acquire(&dataRing);
         if (dataBuf == NULL) {
-            ESP_LOGE("MQTT_AGENT", "No available buffers for the event.");
+            ESP_LOGW("MQTT_AGENT", "No available buffers for the event (%lu dropped).", dataRing.dropped);
             return;
         }
 
         memcpy(dataBuf->data, pxPublishInfo->pPayload, pxPublishInfo->payloadLength);
         dataBuf->dataLength = pxPublishInfo->payloadLength;
 
-        nextEvent.dataEvent = dataBuf;
+        OtaDataRing_Commit(&dataRing);
 
-        ESP_LOGI("MQTT_AGENT", "Stream Data Block Incoming: %.*s\n",
+        ESP_LOGD("MQTT_AGENT", "Stream Data Block Incoming: %.*s\n",
                  (int)pxPublishInfo->payloadLength, (char*)pxPublishInfo->pPayload);
     } else {
         ESP_LOGW("MQTT_AGENT", "Rejected topic, ignoring message.\n");
         return;
     }
 
-    SendEvent_FreeRTOS(xOtaEventQueue, &nextEvent, TAG);
-}
-
-/* Checks if a given topic corresponds to a rejected topic. */
-static bool isRejectedTopic(char* receivedTopic)
-{
-    if (strstr(receivedTopic, JOBS_API_FAILURE) != NULL) {
-        return true;
-    }
-
-    return false;
+    EventBus_Send(xOtaEventQueue, &nextEvent);
 }
 
 void prvPrint_partitions()
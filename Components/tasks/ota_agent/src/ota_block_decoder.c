@@ -0,0 +1,307 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* AWS IoT SDK Headers */
+#include "core_json.h"
+
+#include "ota_block_decoder.h"
+
+/* CBOR major types (RFC 8949) used by the GetStream response. */
+#define CBOR_MAJOR_UNSIGNED 0U
+#define CBOR_MAJOR_NEGATIVE 1U
+#define CBOR_MAJOR_BYTES    2U
+#define CBOR_MAJOR_TEXT     3U
+#define CBOR_MAJOR_MAP      5U
+
+/*
+ * Minimal reader for the flat map of the GetStream response. tinycbor can only
+ * copy byte strings out of the message, while the block payload is written to
+ * flash straight from the receive buffer.
+ */
+typedef struct CborReader {
+    const uint8_t* pos;
+    const uint8_t* end;
+} CborReader_t;
+
+static bool prvReadHeader(CborReader_t* pReader, uint8_t* pMajorType, uint64_t* pValue);
+static bool prvReadString(CborReader_t* pReader, uint8_t majorType, const uint8_t** ppData, size_t* pLength);
+static bool prvReadInt(CborReader_t* pReader, int32_t* pValue);
+static bool prvSkipValue(CborReader_t* pReader);
+static bool prvJsonGetInt(const char* pJson, size_t jsonLength, const char* key, int32_t* pValue);
+static int8_t prvBase64Value(uint8_t c);
+static bool prvBase64DecodeInPlace(uint8_t* pData, size_t length, size_t* pDecodedLength);
+
+bool OtaBlockDecoder_DecodeCbor(const uint8_t* pMessage, size_t messageLength, OtaStreamBlock_t* pBlock)
+{
+    CborReader_t reader = {pMessage, pMessage + messageLength};
+    uint8_t majorType;
+    uint64_t numOfPairs;
+    bool hasFileId = false, hasBlockId = false, hasPayload = false;
+
+    memset(pBlock, 0x00, sizeof(OtaStreamBlock_t));
+    pBlock->blockSize = -1;
+
+    if (!prvReadHeader(&reader, &majorType, &numOfPairs) || (majorType != CBOR_MAJOR_MAP)) {
+        return false;
+    }
+
+    for (uint64_t pair = 0; pair < numOfPairs; pair++) {
+        const uint8_t* key;
+        size_t keyLength;
+        bool decoded;
+
+        if (!prvReadString(&reader, CBOR_MAJOR_TEXT, &key, &keyLength)) {
+            return false;
+        }
+
+        if ((keyLength == 1U) && (key[0] == OTA_BLOCK_KEY_FILE_ID[0])) {
+            decoded = hasFileId = prvReadInt(&reader, &pBlock->fileId);
+        } else if ((keyLength == 1U) && (key[0] == OTA_BLOCK_KEY_BLOCK_ID[0])) {
+            decoded = hasBlockId = prvReadInt(&reader, &pBlock->blockId);
+        } else if ((keyLength == 1U) && (key[0] == OTA_BLOCK_KEY_BLOCK_SIZE[0])) {
+            decoded = prvReadInt(&reader, &pBlock->blockSize);
+        } else if ((keyLength == 1U) && (key[0] == OTA_BLOCK_KEY_PAYLOAD[0])) {
+            decoded = hasPayload = prvReadString(&reader, CBOR_MAJOR_BYTES, &pBlock->payload, &pBlock->payloadLength);
+        } else {
+            decoded = prvSkipValue(&reader);
+        }
+
+        if (!decoded) {
+            return false;
+        }
+    }
+
+    /* The block size is optional, it matches the payload unless told otherwise. */
+    if (pBlock->blockSize < 0) {
+        pBlock->blockSize = (int32_t)pBlock->payloadLength;
+    }
+
+    return hasFileId && hasBlockId && hasPayload && (pBlock->blockId >= 0) &&
+           ((size_t)pBlock->blockSize == pBlock->payloadLength);
+}
+
+bool OtaBlockDecoder_DecodeJson(uint8_t* pMessage, size_t messageLength, OtaStreamBlock_t* pBlock)
+{
+    const char* pJson = (const char*)pMessage;
+    const char* payload;
+    size_t payloadLength;
+
+    memset(pBlock, 0x00, sizeof(OtaStreamBlock_t));
+
+    if (!prvJsonGetInt(pJson, messageLength, OTA_BLOCK_KEY_FILE_ID, &pBlock->fileId) ||
+        !prvJsonGetInt(pJson, messageLength, OTA_BLOCK_KEY_BLOCK_ID, &pBlock->blockId) ||
+        (pBlock->blockId < 0)) {
+        return false;
+    }
+
+    if (JSON_SearchConst(pJson, messageLength, OTA_BLOCK_KEY_PAYLOAD, strlen(OTA_BLOCK_KEY_PAYLOAD),
+                         &payload, &payloadLength, NULL) != JSONSuccess) {
+        return false;
+    }
+
+    /* Every 4 base64 characters become 3 bytes, so decoding never overtakes the input. */
+    pBlock->payload = (const uint8_t*)payload;
+
+    if (!prvBase64DecodeInPlace((uint8_t*)payload, payloadLength, &pBlock->payloadLength)) {
+        return false;
+    }
+
+    if (!prvJsonGetInt(pJson, messageLength, OTA_BLOCK_KEY_BLOCK_SIZE, &pBlock->blockSize)) {
+        pBlock->blockSize = (int32_t)pBlock->payloadLength;
+    }
+
+    return (size_t)pBlock->blockSize == pBlock->payloadLength;
+}
+
+/* Reads the initial byte and argument of a data item. Indefinite lengths and floats are not accepted. */
+static bool prvReadHeader(CborReader_t* pReader, uint8_t* pMajorType, uint64_t* pValue)
+{
+    uint8_t additionalInfo;
+    size_t argumentLength;
+
+    if (pReader->pos >= pReader->end) {
+        return false;
+    }
+
+    *pMajorType    = *pReader->pos >> 5;
+    additionalInfo = *pReader->pos & 0x1FU;
+    pReader->pos++;
+
+    if (additionalInfo < 24U) {
+        *pValue = additionalInfo;
+        return true;
+    }
+    if (additionalInfo > 27U) {
+        return false;
+    }
+
+    argumentLength = (size_t)1U << (additionalInfo - 24U);
+
+    if ((size_t)(pReader->end - pReader->pos) < argumentLength) {
+        return false;
+    }
+
+    *pValue = 0;
+    for (size_t i = 0; i < argumentLength; i++) {
+        *pValue = (*pValue << 8) | *pReader->pos++;
+    }
+    return true;
+}
+
+static bool prvReadString(CborReader_t* pReader, uint8_t majorType, const uint8_t** ppData, size_t* pLength)
+{
+    uint8_t readMajorType;
+    uint64_t length;
+
+    if (!prvReadHeader(pReader, &readMajorType, &length) || (readMajorType != majorType) ||
+        (length > (uint64_t)(pReader->end - pReader->pos))) {
+        return false;
+    }
+
+    *ppData  = pReader->pos;
+    *pLength = (size_t)length;
+    pReader->pos += length;
+
+    return true;
+}
+
+static bool prvReadInt(CborReader_t* pReader, int32_t* pValue)
+{
+    uint8_t majorType;
+    uint64_t value;
+
+    if (!prvReadHeader(pReader, &majorType, &value) || (value > INT32_MAX)) {
+        return false;
+    }
+
+    if (majorType == CBOR_MAJOR_UNSIGNED) {
+        *pValue = (int32_t)value;
+    } else if (majorType == CBOR_MAJOR_NEGATIVE) {
+        *pValue = -1 - (int32_t)value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Only scalar and string values are expected in the response. */
+static bool prvSkipValue(CborReader_t* pReader)
+{
+    uint8_t majorType;
+    uint64_t value;
+
+    if (!prvReadHeader(pReader, &majorType, &value)) {
+        return false;
+    }
+
+    switch (majorType) {
+        case CBOR_MAJOR_UNSIGNED:
+        case CBOR_MAJOR_NEGATIVE:
+            return true;
+        case CBOR_MAJOR_BYTES:
+        case CBOR_MAJOR_TEXT:
+            if (value > (uint64_t)(pReader->end - pReader->pos)) {
+                return false;
+            }
+            pReader->pos += value;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool prvJsonGetInt(const char* pJson, size_t jsonLength, const char* key, int32_t* pValue)
+{
+    const char* value;
+    size_t valueLength;
+    JSONTypes_t valueType;
+    int32_t result = 0;
+    bool negative  = false;
+    size_t i       = 0;
+
+    if ((JSON_SearchConst(pJson, jsonLength, key, strlen(key), &value, &valueLength, &valueType) != JSONSuccess) ||
+        (valueType != JSONNumber)) {
+        return false;
+    }
+
+    if ((valueLength > 0U) && (value[0] == '-')) {
+        negative = true;
+        i++;
+    }
+
+    for (; i < valueLength; i++) {
+        if ((value[i] < '0') || (value[i] > '9') || (result > (INT32_MAX - 9) / 10)) {
+            return false;
+        }
+        result = result * 10 + (value[i] - '0');
+    }
+
+    *pValue = negative ? -result : result;
+    return true;
+}
+
+static int8_t prvBase64Value(uint8_t c)
+{
+    if ((c >= 'A') && (c <= 'Z')) {
+        return (int8_t)(c - 'A');
+    }
+    if ((c >= 'a') && (c <= 'z')) {
+        return (int8_t)(c - 'a' + 26);
+    }
+    if ((c >= '0') && (c <= '9')) {
+        return (int8_t)(c - '0' + 52);
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/*
+ * Decodes base64 over its own buffer. A byte is only written once at least
+ * two characters were read, so the output always stays behind the input.
+ */
+static bool prvBase64DecodeInPlace(uint8_t* pData, size_t length, size_t* pDecodedLength)
+{
+    uint32_t accumulator = 0;
+    uint32_t bits        = 0;
+    size_t padding       = 0;
+    size_t out           = 0;
+
+    for (size_t in = 0; in < length; in++) {
+        int8_t value;
+
+        /* JSON encoders may escape '/' as "\/". */
+        if (pData[in] == '\\') {
+            continue;
+        }
+        if (pData[in] == '=') {
+            padding++;
+            continue;
+        }
+
+        value = prvBase64Value(pData[in]);
+
+        if ((value < 0) || (padding > 0U)) {
+            return false;
+        }
+
+        accumulator = (accumulator << 6) | (uint32_t)value;
+        bits += 6U;
+
+        if (bits >= 8U) {
+            bits -= 8U;
+            pData[out++] = (uint8_t)(accumulator >> bits);
+        }
+    }
+
+    if (padding > 2U) {
+        return false;
+    }
+
+    *pDecodedLength = out;
+    return true;
+}
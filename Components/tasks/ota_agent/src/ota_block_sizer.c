@@ -0,0 +1,101 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "ota_block_sizer.h"
+
+static const char* TAG = "OTA_BLOCK_SIZER";
+
+static void prvSetShift(OtaBlockSizer_t* pSizer, uint8_t shift);
+
+void OtaBlockSizer_Init(OtaBlockSizer_t* pSizer, uint8_t maxShift)
+{
+    memset(pSizer, 0x00, sizeof(OtaBlockSizer_t));
+
+    pSizer->maxShift    = (maxShift > OTA_BLOCK_SIZER_MAX_SHIFT) ? OTA_BLOCK_SIZER_MAX_SHIFT : maxShift;
+    pSizer->probeBlocks = OTA_BLOCK_SIZER_PROBE_BLOCKS;
+}
+
+void OtaBlockSizer_SetMaxShift(OtaBlockSizer_t* pSizer, uint8_t maxShift)
+{
+    pSizer->maxShift = (maxShift > OTA_BLOCK_SIZER_MAX_SHIFT) ? OTA_BLOCK_SIZER_MAX_SHIFT : maxShift;
+
+    if (pSizer->shift > pSizer->maxShift) {
+        prvSetShift(pSizer, pSizer->maxShift);
+    }
+}
+
+void OtaBlockSizer_BlockReceived(OtaBlockSizer_t* pSizer, uint8_t shift, uint32_t rttMs)
+{
+    /* Blocks requested before the last change tell nothing about the current size. */
+    if (shift != pSizer->shift) {
+        return;
+    }
+
+    if (rttMs > 0U) {
+        if ((pSizer->minRttMs[shift] == 0U) || (rttMs < pSizer->minRttMs[shift])) {
+            pSizer->minRttMs[shift] = rttMs;
+        }
+
+        /* The link is queueing, larger parts would only wait longer. */
+        if (rttMs > 2U * pSizer->minRttMs[shift]) {
+            pSizer->cleanBlocks = 0;
+            return;
+        }
+    }
+
+    pSizer->cleanBlocks++;
+
+    if (pSizer->probing && (pSizer->cleanBlocks >= OTA_BLOCK_SIZER_PROBE_BLOCKS)) {
+        /* The larger size held, the next one is tried as soon. */
+        pSizer->probing     = false;
+        pSizer->probeBlocks = OTA_BLOCK_SIZER_PROBE_BLOCKS;
+    }
+
+    if ((pSizer->shift > 0U) && (pSizer->cleanBlocks >= pSizer->probeBlocks)) {
+        prvSetShift(pSizer, pSizer->shift - 1U);
+        pSizer->probing = true;
+    }
+}
+
+void OtaBlockSizer_RequestLost(OtaBlockSizer_t* pSizer, uint8_t shift)
+{
+    pSizer->losses++;
+
+    if (shift != pSizer->shift) {
+        return;
+    }
+
+    if (pSizer->probing) {
+        pSizer->probeBlocks = (pSizer->probeBlocks * 2U > OTA_BLOCK_SIZER_MAX_PROBE_BLOCKS) ? OTA_BLOCK_SIZER_MAX_PROBE_BLOCKS
+                                                                                          : pSizer->probeBlocks * 2U;
+        pSizer->probing     = false;
+    }
+
+    if (pSizer->shift < pSizer->maxShift) {
+        prvSetShift(pSizer, pSizer->shift + 1U);
+    } else {
+        pSizer->cleanBlocks = 0;
+    }
+}
+
+uint8_t OtaBlockSizer_Shift(const OtaBlockSizer_t* pSizer)
+{
+    return pSizer->shift;
+}
+
+uint8_t OtaBlockSizer_MaxShift(const OtaBlockSizer_t* pSizer)
+{
+    return pSizer->maxShift;
+}
+
+static void prvSetShift(OtaBlockSizer_t* pSizer, uint8_t shift)
+{
+    ESP_LOGI(TAG, "Blocks requested in %u parts from now on", 1U << shift);
+
+    pSizer->shift       = shift;
+    pSizer->cleanBlocks = 0;
+    pSizer->changes++;
+}
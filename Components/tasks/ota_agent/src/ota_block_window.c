@@ -0,0 +1,314 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ota_block_window.h"
+
+#define BITMAP_SIZE(n) (((n) + 7U) / 8U)
+
+static void prvSetReceived(BlockWindow_t* pWindow, uint32_t blockId);
+static void prvUpdateRto(BlockWindow_t* pWindow, uint32_t rttMs);
+static BlockRequest_t* prvFindRequest(BlockWindow_t* pWindow, uint32_t blockId);
+static uint32_t prvInFlightCount(const BlockWindow_t* pWindow);
+
+bool BlockWindow_Init(BlockWindow_t* pWindow, uint32_t numOfBlocks, uint8_t windowSize)
+{
+    memset(pWindow, 0x00, sizeof(BlockWindow_t));
+
+    pWindow->bitmap = (uint8_t*)calloc(BITMAP_SIZE(numOfBlocks) + 1U, sizeof(uint8_t));
+
+    if (pWindow->bitmap == NULL) {
+        return false;
+    }
+
+    if (windowSize == 0U) {
+        windowSize = 1U;
+    } else if (windowSize > BLOCK_WINDOW_MAX_SIZE) {
+        windowSize = BLOCK_WINDOW_MAX_SIZE;
+    }
+
+    pWindow->numOfBlocks  = numOfBlocks;
+    pWindow->requestLimit = numOfBlocks;
+    pWindow->windowSize   = windowSize;
+    pWindow->rtoMs        = BLOCK_WINDOW_INITIAL_RTO_MS;
+
+    return true;
+}
+
+void BlockWindow_Free(BlockWindow_t* pWindow)
+{
+    free(pWindow->bitmap);
+    memset(pWindow, 0x00, sizeof(BlockWindow_t));
+}
+
+bool BlockWindow_IsReceived(const BlockWindow_t* pWindow, uint32_t blockId)
+{
+    if (blockId >= pWindow->numOfBlocks) {
+        return false;
+    }
+    return (pWindow->bitmap[blockId / 8U] & (1U << (blockId % 8U))) != 0U;
+}
+
+bool BlockWindow_IsComplete(const BlockWindow_t* pWindow)
+{
+    return pWindow->blocksReceived == pWindow->numOfBlocks;
+}
+
+size_t BlockWindow_BitmapSize(const BlockWindow_t* pWindow)
+{
+    return BITMAP_SIZE(pWindow->numOfBlocks);
+}
+
+void BlockWindow_Restore(BlockWindow_t* pWindow, const uint8_t* pBitmap)
+{
+    memcpy(pWindow->bitmap, pBitmap, BITMAP_SIZE(pWindow->numOfBlocks));
+
+    /* Bits past the last block are not meaningful. */
+    if ((pWindow->numOfBlocks % 8U) != 0U) {
+        pWindow->bitmap[pWindow->numOfBlocks / 8U] &= (uint8_t)((1U << (pWindow->numOfBlocks % 8U)) - 1U);
+    }
+
+    pWindow->blocksReceived    = 0;
+    pWindow->firstMissingBlock = pWindow->numOfBlocks;
+
+    for (uint32_t blockId = 0; blockId < pWindow->numOfBlocks; blockId++) {
+        if (BlockWindow_IsReceived(pWindow, blockId)) {
+            pWindow->blocksReceived++;
+        } else if (blockId < pWindow->firstMissingBlock) {
+            pWindow->firstMissingBlock = blockId;
+        }
+    }
+
+    pWindow->nextBlockToRequest = pWindow->firstMissingBlock;
+    memset(pWindow->requests, 0x00, sizeof(pWindow->requests));
+}
+
+void BlockWindow_ClearReceived(BlockWindow_t* pWindow, uint32_t blockId)
+{
+    if (!BlockWindow_IsReceived(pWindow, blockId)) {
+        return;
+    }
+
+    pWindow->bitmap[blockId / 8U] &= (uint8_t)~(1U << (blockId % 8U));
+    pWindow->blocksReceived--;
+
+    if (blockId < pWindow->firstMissingBlock) {
+        pWindow->firstMissingBlock = blockId;
+    }
+    if (blockId < pWindow->nextBlockToRequest) {
+        pWindow->nextBlockToRequest = blockId;
+    }
+}
+
+void BlockWindow_SetRequestLimit(BlockWindow_t* pWindow, uint32_t limit)
+{
+    pWindow->requestLimit = (limit > pWindow->numOfBlocks) ? pWindow->numOfBlocks : limit;
+}
+
+uint32_t BlockWindow_ReserveNewBlocks(BlockWindow_t* pWindow, uint32_t nowMs, uint8_t partShift, uint32_t* pBlockId)
+{
+    uint32_t reserved = 0;
+
+    /* Every block was requested but some never arrived and nothing is pending: rescan the gaps. */
+    if ((pWindow->nextBlockToRequest >= pWindow->numOfBlocks) && !BlockWindow_IsComplete(pWindow) &&
+        (prvInFlightCount(pWindow) == 0U)) {
+        pWindow->nextBlockToRequest = pWindow->firstMissingBlock;
+    }
+
+    *pBlockId = pWindow->nextBlockToRequest;
+
+    for (uint32_t i = 0; i < pWindow->windowSize; i++) {
+        BlockRequest_t* pRequest = &pWindow->requests[i];
+
+        if (pRequest->inFlight) {
+            continue;
+        }
+
+        /* Skip blocks that were already received, e.g. after a resumed download. */
+        while ((pWindow->nextBlockToRequest < pWindow->numOfBlocks) &&
+               BlockWindow_IsReceived(pWindow, pWindow->nextBlockToRequest)) {
+            if (reserved > 0U) {
+                /* Keep the reserved run contiguous. */
+                return reserved;
+            }
+            pWindow->nextBlockToRequest++;
+            *pBlockId = pWindow->nextBlockToRequest;
+        }
+
+        if (pWindow->nextBlockToRequest >= pWindow->requestLimit) {
+            break;
+        }
+
+        pRequest->blockId       = pWindow->nextBlockToRequest++;
+        pRequest->sentTimeMs    = nowMs;
+        pRequest->retries       = 0;
+        pRequest->inFlight      = true;
+        pRequest->partShift     = (partShift > BLOCK_WINDOW_MAX_PART_SHIFT) ? BLOCK_WINDOW_MAX_PART_SHIFT : partShift;
+        pRequest->partsReceived = 0;
+        reserved++;
+    }
+
+    return reserved;
+}
+
+uint32_t BlockWindow_CollectExpiredBlocks(BlockWindow_t* pWindow, uint32_t nowMs, uint32_t* pBlockIds, bool* pGiveUp)
+{
+    uint32_t expired = 0;
+
+    *pGiveUp = false;
+
+    /* Every request is tested against the timeout they were sent with, before it backs off. */
+    for (uint32_t i = 0; i < pWindow->windowSize; i++) {
+        BlockRequest_t* pRequest = &pWindow->requests[i];
+
+        if (!pRequest->inFlight || ((nowMs - pRequest->sentTimeMs) < pWindow->rtoMs)) {
+            continue;
+        }
+
+        if (pRequest->retries >= BLOCK_WINDOW_MAX_RETRIES) {
+            *pGiveUp     = true;
+            pBlockIds[0] = pRequest->blockId;
+            return 1U;
+        }
+
+        pRequest->retries++;
+        pRequest->sentTimeMs = nowMs;
+        pWindow->retransmissions++;
+
+        pBlockIds[expired++] = pRequest->blockId;
+    }
+
+    /* Exponential back-off, once per expiry as in RFC 6298: a lost block usually means the link got slower. */
+    if (expired > 0U) {
+        pWindow->rtoMs = (pWindow->rtoMs * 2U > BLOCK_WINDOW_MAX_RTO_MS) ? BLOCK_WINDOW_MAX_RTO_MS : pWindow->rtoMs * 2U;
+    }
+
+    return expired;
+}
+
+bool BlockWindow_MarkReceived(BlockWindow_t* pWindow, uint32_t blockId, uint32_t nowMs)
+{
+    BlockRequest_t* pRequest;
+
+    if (blockId >= pWindow->numOfBlocks) {
+        return false;
+    }
+
+    if (BlockWindow_IsReceived(pWindow, blockId)) {
+        pWindow->duplicates++;
+        return false;
+    }
+
+    pRequest = prvFindRequest(pWindow, blockId);
+
+    if (pRequest != NULL) {
+        /* Karn's rule: only blocks that were requested once give an unambiguous RTT sample. */
+        if (pRequest->retries == 0U) {
+            prvUpdateRto(pWindow, nowMs - pRequest->sentTimeMs);
+        }
+        pRequest->inFlight = false;
+    }
+
+    prvSetReceived(pWindow, blockId);
+
+    while ((pWindow->firstMissingBlock < pWindow->numOfBlocks) &&
+           BlockWindow_IsReceived(pWindow, pWindow->firstMissingBlock)) {
+        pWindow->firstMissingBlock++;
+    }
+
+    return true;
+}
+
+const BlockRequest_t* BlockWindow_GetRequest(const BlockWindow_t* pWindow, uint32_t blockId)
+{
+    for (uint32_t i = 0; i < pWindow->windowSize; i++) {
+        if (pWindow->requests[i].inFlight && (pWindow->requests[i].blockId == blockId)) {
+            return &pWindow->requests[i];
+        }
+    }
+    return NULL;
+}
+
+bool BlockWindow_MarkPartReceived(BlockWindow_t* pWindow, uint32_t blockId, uint32_t part, uint32_t numOfParts)
+{
+    BlockRequest_t* pRequest = prvFindRequest(pWindow, blockId);
+    uint32_t allParts        = (numOfParts >= 16U) ? 0xFFFFU : ((1U << numOfParts) - 1U);
+
+    if ((pRequest == NULL) || (part >= numOfParts)) {
+        return false;
+    }
+
+    pRequest->partsReceived |= (uint16_t)(1U << part);
+
+    return (pRequest->partsReceived & allParts) == allParts;
+}
+
+uint32_t BlockWindow_NextTimeoutMs(const BlockWindow_t* pWindow, uint32_t nowMs)
+{
+    uint32_t timeoutMs = BLOCK_WINDOW_NO_TIMEOUT;
+
+    for (uint32_t i = 0; i < pWindow->windowSize; i++) {
+        const BlockRequest_t* pRequest = &pWindow->requests[i];
+
+        if (pRequest->inFlight) {
+            uint32_t elapsedMs   = nowMs - pRequest->sentTimeMs;
+            uint32_t remainingMs = (elapsedMs >= pWindow->rtoMs) ? 0U : pWindow->rtoMs - elapsedMs;
+
+            if (remainingMs < timeoutMs) {
+                timeoutMs = remainingMs;
+            }
+        }
+    }
+
+    /* With nothing in flight but blocks missing, poll so the requester is re-armed. */
+    if ((timeoutMs == BLOCK_WINDOW_NO_TIMEOUT) && !BlockWindow_IsComplete(pWindow) && (prvInFlightCount(pWindow) == 0U)) {
+        timeoutMs = pWindow->rtoMs;
+    }
+
+    return timeoutMs;
+}
+
+static void prvSetReceived(BlockWindow_t* pWindow, uint32_t blockId)
+{
+    pWindow->bitmap[blockId / 8U] |= (uint8_t)(1U << (blockId % 8U));
+    pWindow->blocksReceived++;
+}
+
+/* Jacobson/Karels estimator, as used by TCP (RFC 6298). */
+static void prvUpdateRto(BlockWindow_t* pWindow, uint32_t rttMs)
+{
+    if (pWindow->srttMs == 0U) {
+        pWindow->srttMs   = rttMs;
+        pWindow->rttvarMs = rttMs / 2U;
+    } else {
+        uint32_t delta = (rttMs > pWindow->srttMs) ? rttMs - pWindow->srttMs : pWindow->srttMs - rttMs;
+
+        pWindow->rttvarMs = (3U * pWindow->rttvarMs + delta) / 4U;
+        pWindow->srttMs   = (7U * pWindow->srttMs + rttMs) / 8U;
+    }
+
+    pWindow->rtoMs = pWindow->srttMs + 4U * pWindow->rttvarMs;
+
+    if (pWindow->rtoMs < BLOCK_WINDOW_MIN_RTO_MS) {
+        pWindow->rtoMs = BLOCK_WINDOW_MIN_RTO_MS;
+    } else if (pWindow->rtoMs > BLOCK_WINDOW_MAX_RTO_MS) {
+        pWindow->rtoMs = BLOCK_WINDOW_MAX_RTO_MS;
+    }
+}
+
+static BlockRequest_t* prvFindRequest(BlockWindow_t* pWindow, uint32_t blockId)
+{
+    return (BlockRequest_t*)BlockWindow_GetRequest(pWindow, blockId);
+}
+
+static uint32_t prvInFlightCount(const BlockWindow_t* pWindow)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < pWindow->windowSize; i++) {
+        if (pWindow->requests[i].inFlight) {
+            count++;
+        }
+    }
+    return count;
+}
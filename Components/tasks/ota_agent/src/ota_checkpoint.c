@@ -0,0 +1,139 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "nvs.h"
+
+#include "ota_checkpoint.h"
+
+static const char* TAG = "OTA_CHECKPOINT";
+
+bool OtaCheckpoint_Create(OtaCheckpoint_t* pCheckpoint,
+                          const char* jobId,
+                          const AfrOtaJobDocumentFields_t* jobFields,
+                          uint32_t blockSize,
+                          uint32_t partitionAddress)
+{
+    mbedtls_sha256_context shaCtx;
+
+    memset(pCheckpoint, 0x00, sizeof(OtaCheckpoint_t));
+
+    if (jobFields->imageRefLen >= OTA_CHECKPOINT_STREAM_LENGTH) {
+        ESP_LOGW(TAG, "Stream name too long to be checkpointed");
+        return false;
+    }
+
+    pCheckpoint->version = OTA_CHECKPOINT_VERSION;
+    strncpy(pCheckpoint->jobId, jobId, JOB_ID_LENGTH - 1);
+    memcpy(pCheckpoint->streamName, jobFields->imageRef, jobFields->imageRefLen);
+    pCheckpoint->fileId           = jobFields->fileId;
+    pCheckpoint->fileSize         = jobFields->fileSize;
+    pCheckpoint->blockSize        = blockSize;
+    pCheckpoint->partitionAddress = partitionAddress;
+
+    /* The signature changes with every image, even if the job and stream are reused. */
+    mbedtls_sha256_init(&shaCtx);
+    mbedtls_sha256_starts(&shaCtx, 0);
+    mbedtls_sha256_update(&shaCtx, (const unsigned char*)jobFields->imageRef, jobFields->imageRefLen);
+    if (jobFields->signature != NULL) {
+        mbedtls_sha256_update(&shaCtx, (const unsigned char*)jobFields->signature, jobFields->signatureLen);
+    }
+    mbedtls_sha256_finish(&shaCtx, pCheckpoint->imageDigest);
+    mbedtls_sha256_free(&shaCtx);
+
+    return true;
+}
+
+bool OtaCheckpoint_Matches(const OtaCheckpoint_t* pCheckpoint, const OtaCheckpoint_t* pOther)
+{
+    return (pCheckpoint->version == pOther->version) &&
+           (strncmp(pCheckpoint->jobId, pOther->jobId, JOB_ID_LENGTH) == 0) &&
+           (strncmp(pCheckpoint->streamName, pOther->streamName, OTA_CHECKPOINT_STREAM_LENGTH) == 0) &&
+           (pCheckpoint->fileId == pOther->fileId) &&
+           (pCheckpoint->fileSize == pOther->fileSize) &&
+           (pCheckpoint->blockSize == pOther->blockSize) &&
+           (pCheckpoint->partitionAddress == pOther->partitionAddress) &&
+           (memcmp(pCheckpoint->imageDigest, pOther->imageDigest, OTA_CHECKPOINT_DIGEST_LENGTH) == 0);
+}
+
+bool OtaCheckpoint_Save(const OtaCheckpoint_t* pCheckpoint, const uint8_t* pBitmap, size_t bitmapSize)
+{
+    nvs_handle_t xHandle;
+    esp_err_t err;
+    size_t blobSize = sizeof(OtaCheckpoint_t) + bitmapSize;
+
+    /* A single blob keeps the identity and the bitmap consistent if power fails mid write. */
+    uint8_t* blob = (uint8_t*)malloc(blobSize);
+
+    if (blob == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the checkpoint", blobSize);
+        return false;
+    }
+    memcpy(blob, pCheckpoint, sizeof(OtaCheckpoint_t));
+    memcpy(blob + sizeof(OtaCheckpoint_t), pBitmap, bitmapSize);
+
+    err = nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READWRITE, &xHandle);
+
+    if (err == ESP_OK) {
+        err = nvs_set_blob(xHandle, OTA_CHECKPOINT_NVS_KEY, blob, blobSize);
+
+        if (err == ESP_OK) {
+            err = nvs_commit(xHandle);
+        }
+        nvs_close(xHandle);
+    }
+    free(blob);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store the checkpoint: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+bool OtaCheckpoint_Load(OtaCheckpoint_t* pCheckpoint, uint8_t* pBitmap, size_t bitmapSize)
+{
+    nvs_handle_t xHandle;
+    esp_err_t err;
+    size_t blobSize = 0;
+    uint8_t* blob   = NULL;
+
+    if (nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READONLY, &xHandle) != ESP_OK) {
+        return false;
+    }
+
+    err = nvs_get_blob(xHandle, OTA_CHECKPOINT_NVS_KEY, NULL, &blobSize);
+
+    if ((err == ESP_OK) && (blobSize == sizeof(OtaCheckpoint_t) + bitmapSize)) {
+        blob = (uint8_t*)malloc(blobSize);
+
+        if ((blob != NULL) && (nvs_get_blob(xHandle, OTA_CHECKPOINT_NVS_KEY, blob, &blobSize) == ESP_OK)) {
+            memcpy(pCheckpoint, blob, sizeof(OtaCheckpoint_t));
+            memcpy(pBitmap, blob + sizeof(OtaCheckpoint_t), bitmapSize);
+        } else {
+            err = ESP_FAIL;
+        }
+        free(blob);
+    } else if (err == ESP_OK) {
+        ESP_LOGW(TAG, "Stored checkpoint does not match the file size, ignoring it");
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    nvs_close(xHandle);
+
+    return err == ESP_OK;
+}
+
+void OtaCheckpoint_Erase(void)
+{
+    nvs_handle_t xHandle;
+
+    if (nvs_open(OTA_CHECKPOINT_NAMESPACE, NVS_READWRITE, &xHandle) == ESP_OK) {
+        if (nvs_erase_key(xHandle, OTA_CHECKPOINT_NVS_KEY) == ESP_OK) {
+            nvs_commit(xHandle);
+        }
+        nvs_close(xHandle);
+    }
+}
@@ -0,0 +1,57 @@
+#include "ota_data_ring.h"
+
+void OtaDataRing_Init(OtaDataRing_t* pRing, OtaDataEvent_t* pSlots, uint32_t depth)
+{
+    pRing->slots     = pSlots;
+    pRing->depth     = depth;
+    pRing->head      = 0;
+    pRing->tail      = 0;
+    pRing->received  = 0;
+    pRing->dropped   = 0;
+    pRing->highWater = 0;
+    atomic_init(&pRing->count, 0);
+}
+
+OtaDataEvent_t* OtaDataRing_Acquire(OtaDataRing_t* pRing)
+{
+    /* Acquire pairs with the release in OtaDataRing_Release: the consumer is done with the slot. */
+    if (atomic_load_explicit(&pRing->count, memory_order_acquire) >= pRing->depth) {
+        pRing->dropped++;
+        return NULL;
+    }
+    return &pRing->slots[pRing->head];
+}
+
+void OtaDataRing_Commit(OtaDataRing_t* pRing)
+{
+    uint32_t count;
+
+    pRing->head = (pRing->head + 1U) % pRing->depth;
+    pRing->received++;
+
+    /* Release makes the slot contents visible before the consumer sees the new count. */
+    count = atomic_fetch_add_explicit(&pRing->count, 1U, memory_order_release) + 1U;
+
+    if (count > pRing->highWater) {
+        pRing->highWater = count;
+    }
+}
+
+OtaDataEvent_t* OtaDataRing_Peek(OtaDataRing_t* pRing)
+{
+    if (atomic_load_explicit(&pRing->count, memory_order_acquire) == 0U) {
+        return NULL;
+    }
+    return &pRing->slots[pRing->tail];
+}
+
+void OtaDataRing_Release(OtaDataRing_t* pRing)
+{
+    pRing->tail = (pRing->tail + 1U) % pRing->depth;
+    atomic_fetch_sub_explicit(&pRing->count, 1U, memory_order_release);
+}
+
+uint32_t OtaDataRing_Occupancy(OtaDataRing_t* pRing)
+{
+    return atomic_load_explicit(&pRing->count, memory_order_relaxed);
+}
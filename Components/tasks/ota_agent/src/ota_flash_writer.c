@@ -0,0 +1,206 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ota_flash_writer.h"
+
+#define WRITER_TASK_NAME       "ota_flash_writer"
+#define WRITER_TASK_STACK_SIZE 2048U
+
+/* A sector handed to the writer task. */
+typedef struct OtaFlashJob {
+    const uint8_t* pData;
+    uint32_t offset;
+    uint32_t length;
+} OtaFlashJob_t;
+
+static const char* TAG = "OTA_FLASH_WRITER";
+
+static esp_err_t prvWriteToFlash(OtaFlashWriter_t* pWriter, uint32_t offset, const uint8_t* pData, size_t length);
+static esp_err_t prvSubmitRun(OtaFlashWriter_t* pWriter);
+static void prvWaitForWriter(OtaFlashWriter_t* pWriter);
+static void prvWriterTask(void* parameters);
+
+bool OtaFlashWriter_Init(OtaFlashWriter_t* pWriter, OtaFlashWriteFunc_t writeFunc, void* pContext, bool doubleBuffer)
+{
+    memset(pWriter, 0x00, sizeof(OtaFlashWriter_t));
+
+    pWriter->writeFunc    = writeFunc;
+    pWriter->pContext     = pContext;
+    pWriter->doubleBuffer = doubleBuffer;
+    pWriter->error        = ESP_OK;
+    pWriter->buffers[0]   = (uint8_t*)malloc(OTA_FLASH_SECTOR_SIZE);
+
+    if (pWriter->buffers[0] == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate the sector buffer");
+        return false;
+    }
+
+    if (!doubleBuffer) {
+        return true;
+    }
+
+    pWriter->buffers[1] = (uint8_t*)malloc(OTA_FLASH_SECTOR_SIZE);
+    pWriter->jobQueue   = xQueueCreate(1, sizeof(OtaFlashJob_t));
+    pWriter->idle       = xSemaphoreCreateBinary();
+
+    if ((pWriter->buffers[1] != NULL) && (pWriter->jobQueue != NULL) && (pWriter->idle != NULL)) {
+        xSemaphoreGive(pWriter->idle);
+
+        /* Same priority as the caller, so filling and writing take turns. */
+        if (xTaskCreate(prvWriterTask, WRITER_TASK_NAME, WRITER_TASK_STACK_SIZE, pWriter,
+                        uxTaskPriorityGet(NULL), &pWriter->writerTask) == pdPASS) {
+            return true;
+        }
+    }
+
+    ESP_LOGW(TAG, "Double buffering not available, writing sectors synchronously");
+    OtaFlashWriter_Deinit(pWriter);
+
+    return OtaFlashWriter_Init(pWriter, writeFunc, pContext, false);
+}
+
+esp_err_t OtaFlashWriter_Write(OtaFlashWriter_t* pWriter, uint32_t offset, const uint8_t* pData, size_t length)
+{
+    while ((length > 0) && (pWriter->error == ESP_OK)) {
+        uint32_t sectorOffset = offset & ~(OTA_FLASH_SECTOR_SIZE - 1U);
+        uint32_t inSector     = offset - sectorOffset;
+        uint32_t chunk        = OTA_FLASH_SECTOR_SIZE - inSector;
+
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        /* A buffered run that this data does not extend is written first. */
+        if (pWriter->runActive && ((pWriter->run.sectorOffset != sectorOffset) || (pWriter->run.end != inSector))) {
+            prvSubmitRun(pWriter);
+        }
+
+        if ((chunk == OTA_FLASH_SECTOR_SIZE) && !pWriter->doubleBuffer) {
+            /* Whole aligned sector: nothing to combine, write it straight from the caller. */
+            prvWriteToFlash(pWriter, offset, pData, chunk);
+        } else {
+            if (!pWriter->runActive) {
+                pWriter->runActive        = true;
+                pWriter->run.sectorOffset = sectorOffset;
+                pWriter->run.start        = inSector;
+                pWriter->run.end          = inSector;
+            }
+
+            memcpy(pWriter->buffers[pWriter->activeBuffer] + inSector, pData, chunk);
+            pWriter->run.end += chunk;
+            pWriter->bytesCopied += chunk;
+
+            if (pWriter->run.end == OTA_FLASH_SECTOR_SIZE) {
+                prvSubmitRun(pWriter);
+            }
+        }
+
+        offset += chunk;
+        pData += chunk;
+        length -= chunk;
+    }
+
+    return pWriter->error;
+}
+
+esp_err_t OtaFlashWriter_Flush(OtaFlashWriter_t* pWriter)
+{
+    if (pWriter->runActive) {
+        prvSubmitRun(pWriter);
+    }
+
+    if (pWriter->doubleBuffer) {
+        prvWaitForWriter(pWriter);
+        xSemaphoreGive(pWriter->idle);
+    }
+
+    return pWriter->error;
+}
+
+void OtaFlashWriter_Deinit(OtaFlashWriter_t* pWriter)
+{
+    if (pWriter->writerTask != NULL) {
+        /* Once idle, the writer task is blocked on the empty queue and can be deleted. */
+        prvWaitForWriter(pWriter);
+        vTaskDelete(pWriter->writerTask);
+    }
+    if (pWriter->jobQueue != NULL) {
+        vQueueDelete(pWriter->jobQueue);
+    }
+    if (pWriter->idle != NULL) {
+        vSemaphoreDelete(pWriter->idle);
+    }
+    free(pWriter->buffers[0]);
+    free(pWriter->buffers[1]);
+
+    memset(pWriter, 0x00, sizeof(OtaFlashWriter_t));
+}
+
+static esp_err_t prvWriteToFlash(OtaFlashWriter_t* pWriter, uint32_t offset, const uint8_t* pData, size_t length)
+{
+    int64_t startUs = esp_timer_get_time();
+    esp_err_t err   = pWriter->writeFunc(pWriter->pContext, offset, pData, length);
+
+    pWriter->writeTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+    pWriter->bytesWritten += length;
+    pWriter->flashWrites++;
+
+    if (length < OTA_FLASH_SECTOR_SIZE) {
+        pWriter->partialWrites++;
+    }
+
+    if ((err != ESP_OK) && (pWriter->error == ESP_OK)) {
+        ESP_LOGE(TAG, "Flash write of %u bytes at 0x%lx failed: %s", length, offset, esp_err_to_name(err));
+        pWriter->error = err;
+    }
+    return err;
+}
+
+/* Writes the run held by the active buffer, or hands it to the writer task and switches buffers. */
+static esp_err_t prvSubmitRun(OtaFlashWriter_t* pWriter)
+{
+    OtaFlashJob_t job = {
+        .pData  = pWriter->buffers[pWriter->activeBuffer] + pWriter->run.start,
+        .offset = pWriter->run.sectorOffset + pWriter->run.start,
+        .length = pWriter->run.end - pWriter->run.start
+    };
+
+    pWriter->runActive = false;
+
+    if (!pWriter->doubleBuffer) {
+        return prvWriteToFlash(pWriter, job.offset, job.pData, job.length);
+    }
+
+    /* The other buffer is free again once the writer task finished the previous sector. */
+    prvWaitForWriter(pWriter);
+    xQueueSendToBack(pWriter->jobQueue, &job, portMAX_DELAY);
+    pWriter->activeBuffer ^= 1U;
+
+    return pWriter->error;
+}
+
+static void prvWaitForWriter(OtaFlashWriter_t* pWriter)
+{
+    int64_t startUs = esp_timer_get_time();
+
+    xSemaphoreTake(pWriter->idle, portMAX_DELAY);
+    pWriter->waitTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+}
+
+static void prvWriterTask(void* parameters)
+{
+    OtaFlashWriter_t* pWriter = (OtaFlashWriter_t*)parameters;
+    OtaFlashJob_t job;
+
+    while (true) {
+        if (xQueueReceive(pWriter->jobQueue, &job, portMAX_DELAY) == pdTRUE) {
+            prvWriteToFlash(pWriter, job.offset, job.pData, job.length);
+            xSemaphoreGive(pWriter->idle);
+        }
+    }
+}
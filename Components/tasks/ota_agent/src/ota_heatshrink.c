@@ -0,0 +1,179 @@
+/* Standard C Library Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "ota_heatshrink.h"
+
+static const char* TAG = "OTA_HEATSHRINK";
+
+static int32_t prvGetBits(OtaHeatshrink_t* pDecoder, uint8_t count);
+
+bool OtaHeatshrink_Init(OtaHeatshrink_t* pDecoder, const OtaDeltaStreams_t* pStreams, uint8_t windowBits, uint8_t lookaheadBits)
+{
+    memset(pDecoder, 0x00, sizeof(OtaHeatshrink_t));
+
+    if ((windowBits < OTA_HEATSHRINK_MIN_WINDOW) || (windowBits > OTA_HEATSHRINK_MAX_WINDOW) || (lookaheadBits < 3U) ||
+        (lookaheadBits >= windowBits)) {
+        ESP_LOGE(TAG, "Unsupported window of 2^%u bytes with a lookahead of 2^%u bytes", windowBits, lookaheadBits);
+        return false;
+    }
+
+    pDecoder->window = (uint8_t*)calloc(1U << windowBits, sizeof(uint8_t));
+
+    if (pDecoder->window == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate a window of %u bytes", 1U << windowBits);
+        return false;
+    }
+
+    pDecoder->pStreams      = pStreams;
+    pDecoder->windowBits    = windowBits;
+    pDecoder->lookaheadBits = lookaheadBits;
+    pDecoder->windowMask    = (1U << windowBits) - 1U;
+
+    return true;
+}
+
+bool OtaHeatshrink_Decode(OtaHeatshrink_t* pDecoder, uint8_t* pData, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        uint8_t byte;
+
+        if (pDecoder->backrefRemaining == 0U) {
+            int32_t tag = prvGetBits(pDecoder, 1);
+
+            if (tag == 1) {
+                int32_t literal = prvGetBits(pDecoder, 8);
+
+                if (literal < 0) {
+                    ESP_LOGE(TAG, "Compressed stream ended early");
+                    return false;
+                }
+                pDecoder->window[pDecoder->windowPosition++ & pDecoder->windowMask] = (uint8_t)literal;
+                pData[i] = (uint8_t)literal;
+                continue;
+            }
+
+            int32_t index = (tag == 0) ? prvGetBits(pDecoder, pDecoder->windowBits) : -1;
+            int32_t count = (index >= 0) ? prvGetBits(pDecoder, pDecoder->lookaheadBits) : -1;
+
+            if (count < 0) {
+                ESP_LOGE(TAG, "Compressed stream ended early");
+                return false;
+            }
+            pDecoder->backrefOffset    = (uint32_t)index + 1U;
+            pDecoder->backrefRemaining = (uint32_t)count + 1U;
+        }
+
+        byte = pDecoder->window[(pDecoder->windowPosition - pDecoder->backrefOffset) & pDecoder->windowMask];
+        pDecoder->window[pDecoder->windowPosition++ & pDecoder->windowMask] = byte;
+        pDecoder->backrefRemaining--;
+        pData[i] = byte;
+    }
+    return true;
+}
+
+void OtaHeatshrink_Deinit(OtaHeatshrink_t* pDecoder)
+{
+    free(pDecoder->window);
+    pDecoder->window = NULL;
+}
+
+bool OtaHeatshrink_ApplyImage(const OtaDeltaStreams_t* pStreams, const OtaPatchProgress_t* pStart, bool checkpoint)
+{
+    uint8_t header[OTA_HEATSHRINK_IMAGE_HEADER_SIZE];
+    OtaHeatshrink_t* pDecoder = NULL;
+    uint8_t* data             = NULL;
+    uint32_t imageSize        = 0;
+    uint32_t written          = 0;
+    bool applied              = false;
+
+    (void)checkpoint;
+
+    /* No checkpoint is ever reported, so a resumed image starts over. */
+    if ((pStart != NULL) && (pStart->targetOffset > 0U)) {
+        ESP_LOGE(TAG, "Compressed images cannot be resumed");
+        return false;
+    }
+
+    pStreams->fseek(pStreams->patch, 0, SEEK_SET);
+
+    if ((pStreams->fread(header, 1, sizeof(header), pStreams->patch) != sizeof(header)) ||
+        (memcmp(header, OTA_HEATSHRINK_IMAGE_MAGIC, 4) != 0) || (header[4] != OTA_HEATSHRINK_IMAGE_VERSION)) {
+        ESP_LOGE(TAG, "Not a compressed image");
+        return false;
+    }
+
+    imageSize = (uint32_t)header[8] | ((uint32_t)header[9] << 8) | ((uint32_t)header[10] << 16) | ((uint32_t)header[11] << 24);
+
+    if (imageSize > pStreams->target->size) {
+        ESP_LOGE(TAG, "Image of %lu bytes does not fit the partition", imageSize);
+        return false;
+    }
+
+    pDecoder = (OtaHeatshrink_t*)malloc(sizeof(OtaHeatshrink_t));
+    data     = (uint8_t*)malloc(OTA_HEATSHRINK_IMAGE_CHUNK_SIZE);
+
+    if ((pDecoder == NULL) || (data == NULL) || !OtaHeatshrink_Init(pDecoder, pStreams, header[5], header[6])) {
+        ESP_LOGE(TAG, "Failed to set up the decoder");
+        free(pDecoder);
+        free(data);
+        return false;
+    }
+
+    while (written < imageSize) {
+        uint32_t n = imageSize - written;
+
+        if (n > OTA_HEATSHRINK_IMAGE_CHUNK_SIZE) {
+            n = OTA_HEATSHRINK_IMAGE_CHUNK_SIZE;
+        }
+        if (!OtaHeatshrink_Decode(pDecoder, data, n) || (pStreams->fwrite(data, 1, n, pStreams->target) != n)) {
+            break;
+        }
+        written += n;
+        pStreams->progress((uint8_t)(((uint64_t)written * 100U) / imageSize));
+    }
+
+    applied = (written == imageSize);
+
+    if (applied) {
+        ESP_LOGI(TAG, "Decompressed %lu bytes, window of %u bytes", written, 1U << pDecoder->windowBits);
+    } else {
+        ESP_LOGE(TAG, "Decompression failed after %lu of %lu bytes", written, imageSize);
+    }
+
+    OtaHeatshrink_Deinit(pDecoder);
+    free(pDecoder);
+    free(data);
+
+    return applied;
+}
+
+/* Returns the next count bits of the compressed stream, -1 at its end. */
+static int32_t prvGetBits(OtaHeatshrink_t* pDecoder, uint8_t count)
+{
+    int32_t value = 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (pDecoder->bitsLeft == 0U) {
+            if (pDecoder->inputPosition == pDecoder->inputLength) {
+                pDecoder->inputLength   = pDecoder->pStreams->fread(pDecoder->input, 1, sizeof(pDecoder->input),
+                                                                    pDecoder->pStreams->patch);
+                pDecoder->inputPosition = 0;
+
+                if (pDecoder->inputLength == 0U) {
+                    return -1;
+                }
+            }
+            pDecoder->bitBuffer = pDecoder->input[pDecoder->inputPosition++];
+            pDecoder->bitsLeft  = 8U;
+        }
+
+        pDecoder->bitsLeft--;
+        value = (value << 1) | ((pDecoder->bitBuffer >> pDecoder->bitsLeft) & 1U);
+    }
+    return value;
+}
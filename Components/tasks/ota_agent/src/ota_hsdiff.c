@@ -0,0 +1,190 @@
+/* Standard C Library Headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+
+#include "ota_heatshrink.h"
+#include "ota_hsdiff.h"
+
+static const char* TAG = "OTA_HSDIFF";
+
+static bool prvReadVarint(OtaHeatshrink_t* pDecoder, uint32_t* pValue);
+static uint32_t prvReadLe32(const uint8_t* pData);
+
+bool OtaHsdiff_Apply(const OtaDeltaStreams_t* pStreams, const OtaPatchProgress_t* pStart, bool checkpoint)
+{
+    uint8_t header[OTA_HSDIFF_HEADER_SIZE];
+    uint8_t* data             = NULL;
+    uint8_t* source           = NULL;
+    OtaHeatshrink_t* pDecoder = NULL;
+    uint32_t sourceSize       = 0;
+    uint32_t targetSize       = 0;
+    uint32_t sourcePos        = 0;
+    uint32_t written          = 0;
+    bool applied              = false;
+
+    (void)checkpoint;
+
+    /* No checkpoint is ever reported, so a resumed patch starts over. */
+    if ((pStart != NULL) && (pStart->targetOffset > 0U)) {
+        ESP_LOGE(TAG, "hsdiff patches cannot be resumed");
+        return false;
+    }
+
+    pStreams->fseek(pStreams->patch, 0, SEEK_SET);
+
+    if (pStreams->fread(header, 1, sizeof(header), pStreams->patch) != sizeof(header)) {
+        ESP_LOGE(TAG, "Patch too short");
+        return false;
+    }
+
+    if ((memcmp(header, OTA_HSDIFF_MAGIC, 4) != 0) || (header[4] != OTA_HSDIFF_VERSION)) {
+        ESP_LOGE(TAG, "Not an hsdiff patch");
+        return false;
+    }
+
+    sourceSize = prvReadLe32(&header[8]);
+    targetSize = prvReadLe32(&header[12]);
+
+    if ((sourceSize > pStreams->source->size) || (targetSize > pStreams->target->size)) {
+        ESP_LOGE(TAG, "Patch for a %lu byte source and a %lu byte target does not fit the partitions", sourceSize, targetSize);
+        return false;
+    }
+
+    pDecoder = (OtaHeatshrink_t*)malloc(sizeof(OtaHeatshrink_t));
+    data     = (uint8_t*)malloc(OTA_HSDIFF_CHUNK_SIZE);
+    source   = (uint8_t*)malloc(OTA_HSDIFF_CHUNK_SIZE);
+
+    if ((pDecoder == NULL) || (data == NULL) || (source == NULL)) {
+        ESP_LOGE(TAG, "Failed to allocate the decoder");
+        free(pDecoder);
+        free(data);
+        free(source);
+        return false;
+    }
+
+    if (!OtaHeatshrink_Init(pDecoder, pStreams, header[5], header[6])) {
+        goto cleanup;
+    }
+
+    while (written < targetSize) {
+        uint32_t diffLength;
+        uint32_t extraLength;
+        uint32_t adjustment;
+
+        if (!prvReadVarint(pDecoder, &diffLength)) {
+            goto cleanup;
+        }
+        if ((diffLength > (targetSize - written)) || (diffLength > (sourceSize - sourcePos))) {
+            ESP_LOGE(TAG, "Diff of %lu bytes out of bounds", diffLength);
+            goto cleanup;
+        }
+
+        /* Diff span: patch bytes added to the source bytes. */
+        while (diffLength > 0U) {
+            uint32_t n = (diffLength > OTA_HSDIFF_CHUNK_SIZE) ? OTA_HSDIFF_CHUNK_SIZE : diffLength;
+
+            pStreams->fseek(pStreams->source, (long int)sourcePos, SEEK_SET);
+
+            if (!OtaHeatshrink_Decode(pDecoder, data, n) || (pStreams->fread(source, 1, n, pStreams->source) != n)) {
+                goto cleanup;
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                data[i] = (uint8_t)(data[i] + source[i]);
+            }
+            if (pStreams->fwrite(data, 1, n, pStreams->target) != n) {
+                goto cleanup;
+            }
+
+            sourcePos += n;
+            written += n;
+            diffLength -= n;
+        }
+
+        if (!prvReadVarint(pDecoder, &extraLength)) {
+            goto cleanup;
+        }
+        if (extraLength > (targetSize - written)) {
+            ESP_LOGE(TAG, "Extra of %lu bytes out of bounds", extraLength);
+            goto cleanup;
+        }
+
+        /* Extra span: patch bytes copied as they are. */
+        while (extraLength > 0U) {
+            uint32_t n = (extraLength > OTA_HSDIFF_CHUNK_SIZE) ? OTA_HSDIFF_CHUNK_SIZE : extraLength;
+
+            if (!OtaHeatshrink_Decode(pDecoder, data, n) || (pStreams->fwrite(data, 1, n, pStreams->target) != n)) {
+                goto cleanup;
+            }
+
+            written += n;
+            extraLength -= n;
+        }
+
+        pStreams->progress((uint8_t)(((uint64_t)written * 100U) / targetSize));
+
+        if (written == targetSize) {
+            break;
+        }
+
+        if (!prvReadVarint(pDecoder, &adjustment)) {
+            goto cleanup;
+        }
+
+        /* Zigzag: even values move forward, odd values move back. */
+        if ((adjustment & 1U) == 0U) {
+            sourcePos += adjustment >> 1;
+        } else {
+            sourcePos -= (adjustment >> 1) + 1U;
+        }
+        if (sourcePos > sourceSize) {
+            ESP_LOGE(TAG, "Source position %lu out of bounds", sourcePos);
+            goto cleanup;
+        }
+    }
+
+    applied = true;
+
+    ESP_LOGI(TAG, "Rebuilt %lu bytes, window of %u bytes", written, 1U << pDecoder->windowBits);
+
+cleanup:
+    if (!applied) {
+        ESP_LOGE(TAG, "Patch failed after %lu of %lu bytes", written, targetSize);
+    }
+    OtaHeatshrink_Deinit(pDecoder);
+    free(pDecoder);
+    free(data);
+    free(source);
+
+    return applied;
+}
+
+/* Unsigned LEB128, at most 32 bits. */
+static bool prvReadVarint(OtaHeatshrink_t* pDecoder, uint32_t* pValue)
+{
+    uint8_t byte;
+
+    *pValue = 0;
+
+    for (uint8_t shift = 0; shift < 35U; shift += 7U) {
+        if (!OtaHeatshrink_Decode(pDecoder, &byte, 1)) {
+            return false;
+        }
+        *pValue |= (uint32_t)(byte & 0x7FU) << shift;
+
+        if ((byte & 0x80U) == 0U) {
+            return true;
+        }
+    }
+
+    ESP_LOGE(TAG, "Invalid varint");
+    return false;
+}
+
+static uint32_t prvReadLe32(const uint8_t* pData)
+{
+    return (uint32_t)pData[0] | ((uint32_t)pData[1] << 8) | ((uint32_t)pData[2] << 16) | ((uint32_t)pData[3] << 24);
+}
@@ -0,0 +1,77 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_image_format.h"
+#include "esp_log.h"
+
+#include "ota_image_file.h"
+
+static const char* TAG = "OTA_IMAGE_FILE";
+
+bool OtaImageFile_Open(OtaImageFile_t* pFile, const esp_partition_t* partition, bool resume)
+{
+    esp_err_t err;
+
+    memset(pFile, 0x00, sizeof(OtaImageFile_t));
+    pFile->partition = partition;
+
+    if (resume) {
+        ESP_LOGI(TAG, "Keeping the data written to partition %s", partition->label);
+        return true;
+    }
+
+    err = esp_ota_begin(partition, OTA_SIZE_UNKNOWN, &pFile->handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%d)", err);
+        return false;
+    }
+    pFile->hasHandle = true;
+
+    return true;
+}
+
+void OtaImageFile_WriteDirectly(OtaImageFile_t* pFile)
+{
+    OtaImageFile_Abort(pFile);
+}
+
+esp_err_t OtaImageFile_Write(void* pContext, uint32_t offset, const void* pData, size_t length)
+{
+    OtaImageFile_t* pFile = (OtaImageFile_t*)pContext;
+
+    if (pFile->hasHandle) {
+        return esp_ota_write_with_offset(pFile->handle, pData, length, offset);
+    }
+    return esp_partition_write(pFile->partition, offset, pData, length);
+}
+
+bool OtaImageFile_Finish(OtaImageFile_t* pFile)
+{
+    esp_partition_pos_t position = {.offset = pFile->partition->address, .size = pFile->partition->size};
+    esp_image_metadata_t metadata;
+    esp_err_t err;
+
+    if (pFile->hasHandle) {
+        pFile->hasHandle = false;
+        err              = esp_ota_end(pFile->handle);
+    } else {
+        /* What esp_ota_end() checks. */
+        err = esp_image_verify(ESP_IMAGE_VERIFY, &position, &metadata);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "The image in partition %s is not valid (%d)", pFile->partition->label, err);
+        return false;
+    }
+    return true;
+}
+
+void OtaImageFile_Abort(OtaImageFile_t* pFile)
+{
+    if (pFile->hasHandle) {
+        esp_ota_abort(pFile->handle);
+        pFile->hasHandle = false;
+    }
+}
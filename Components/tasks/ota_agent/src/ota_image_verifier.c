@@ -0,0 +1,189 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/x509_crt.h"
+#include "nvs.h"
+
+#include "key_value_store.h"
+#include "ota_image_verifier.h"
+
+/* Reject images that cannot be checked against a signature. */
+#if defined(CONFIG_OTA_AGENT_REQUIRE_SIGNATURE)
+    #define OTA_REQUIRE_SIGNATURE true
+#else
+    #define OTA_REQUIRE_SIGNATURE false
+#endif
+
+static const char* TAG = "OTA_VERIFIER";
+
+static bool prvVerifySignature(OtaImageVerifier_t* pVerifier, const uint8_t* digest);
+static int8_t prvHexValue(char c);
+
+void OtaImageVerifier_Init(OtaImageVerifier_t* pVerifier, bool checkSignature)
+{
+    memset(pVerifier, 0x00, sizeof(OtaImageVerifier_t));
+    pVerifier->checkSignature = checkSignature;
+
+    mbedtls_sha256_init(&pVerifier->shaCtx);
+    mbedtls_sha256_starts(&pVerifier->shaCtx, 0);
+}
+
+bool OtaImageVerifier_SetSignature(OtaImageVerifier_t* pVerifier, const char* signature, size_t signatureLength)
+{
+    if (mbedtls_base64_decode(pVerifier->signature, sizeof(pVerifier->signature), &pVerifier->signatureLength,
+                              (const unsigned char*)signature, signatureLength) != 0) {
+        ESP_LOGE(TAG, "Invalid signature in the job document");
+        pVerifier->signatureLength = 0;
+        return false;
+    }
+    return true;
+}
+
+void OtaImageVerifier_SetDigest(OtaImageVerifier_t* pVerifier, const uint8_t* digest)
+{
+    memcpy(pVerifier->expectedDigest, digest, OTA_IMAGE_DIGEST_LENGTH);
+    pVerifier->hasExpectedDigest = true;
+}
+
+void OtaImageVerifier_Update(OtaImageVerifier_t* pVerifier, const uint8_t* pData, size_t length)
+{
+    int64_t startUs = esp_timer_get_time();
+
+    mbedtls_sha256_update(&pVerifier->shaCtx, pData, length);
+
+    pVerifier->hashTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+    pVerifier->bytesHashed += length;
+}
+
+void OtaImageVerifier_Snapshot(OtaImageVerifier_t* pVerifier, mbedtls_sha256_context* pState)
+{
+    /* Cloning reads the state out of the SHA peripheral when it is in use, the copy is plain memory. */
+    mbedtls_sha256_init(pState);
+    mbedtls_sha256_clone(pState, &pVerifier->shaCtx);
+}
+
+void OtaImageVerifier_Restore(OtaImageVerifier_t* pVerifier, const mbedtls_sha256_context* pState, uint32_t bytesHashed)
+{
+    mbedtls_sha256_free(&pVerifier->shaCtx);
+    mbedtls_sha256_init(&pVerifier->shaCtx);
+    mbedtls_sha256_clone(&pVerifier->shaCtx, pState);
+    pVerifier->bytesHashed = bytesHashed;
+}
+
+bool OtaImageVerifier_Finish(OtaImageVerifier_t* pVerifier)
+{
+    uint8_t digest[OTA_IMAGE_DIGEST_LENGTH];
+
+    mbedtls_sha256_finish(&pVerifier->shaCtx, digest);
+
+    ESP_LOGI(TAG, "Hashed %lu bytes in %lu ms", pVerifier->bytesHashed, (uint32_t)(pVerifier->hashTimeUs / 1000U));
+
+    if (pVerifier->hasExpectedDigest && (memcmp(digest, pVerifier->expectedDigest, OTA_IMAGE_DIGEST_LENGTH) != 0)) {
+        ESP_LOGE(TAG, "Image digest does not match the job document");
+        return false;
+    }
+
+    if (!pVerifier->checkSignature) {
+        return true;
+    }
+
+    if (pVerifier->signatureLength == 0U) {
+        if (OTA_REQUIRE_SIGNATURE) {
+            ESP_LOGE(TAG, "The job document has no signature");
+            return false;
+        }
+        return true;
+    }
+
+    return prvVerifySignature(pVerifier, digest);
+}
+
+void OtaImageVerifier_Free(OtaImageVerifier_t* pVerifier)
+{
+    mbedtls_sha256_free(&pVerifier->shaCtx);
+}
+
+bool OtaImageVerifier_ParseDigest(const char* hex, size_t hexLength, uint8_t* digest)
+{
+    if (hexLength != OTA_IMAGE_DIGEST_LENGTH * 2U) {
+        return false;
+    }
+
+    for (size_t i = 0; i < OTA_IMAGE_DIGEST_LENGTH; i++) {
+        int8_t high = prvHexValue(hex[2U * i]);
+        int8_t low  = prvHexValue(hex[2U * i + 1U]);
+
+        if ((high < 0) || (low < 0)) {
+            return false;
+        }
+        digest[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
+
+/* Verifies the signature over the image digest with the code signing certificate stored in NVS. */
+static bool prvVerifySignature(OtaImageVerifier_t* pVerifier, const uint8_t* digest)
+{
+    mbedtls_x509_crt certificate;
+    nvs_handle xHandle;
+    size_t certificateLength = 0;
+    char* pem                = NULL;
+    bool valid               = false;
+    int ret;
+
+    if (nvs_open(AWS_NAMESPACE, NVS_READONLY, &xHandle) == ESP_OK) {
+        pem = LoadValueFromNVS(xHandle, OTA_SIGNER_CERTIFICATE_NVS_KEY, &certificateLength);
+        nvs_close(xHandle);
+    }
+
+    if (pem == NULL) {
+        if (OTA_REQUIRE_SIGNATURE) {
+            ESP_LOGE(TAG, "No code signing certificate to verify the image");
+            return false;
+        }
+        ESP_LOGW(TAG, "No code signing certificate, the image signature is not verified");
+        return true;
+    }
+
+    mbedtls_x509_crt_init(&certificate);
+
+    /* The length given by NVS includes the terminating null, as mbedtls expects for PEM. */
+    ret = mbedtls_x509_crt_parse(&certificate, (const unsigned char*)pem, certificateLength);
+
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to parse the code signing certificate: -0x%x", -ret);
+    } else {
+        ret = mbedtls_pk_verify(&certificate.pk, MBEDTLS_MD_SHA256, digest, OTA_IMAGE_DIGEST_LENGTH,
+                                pVerifier->signature, pVerifier->signatureLength);
+        valid = (ret == 0);
+
+        if (!valid) {
+            ESP_LOGE(TAG, "Image signature verification failed: -0x%x", -ret);
+        }
+    }
+
+    mbedtls_x509_crt_free(&certificate);
+    free(pem);
+
+    return valid;
+}
+
+static int8_t prvHexValue(char c)
+{
+    if ((c >= '0') && (c <= '9')) {
+        return (int8_t)(c - '0');
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return (int8_t)(c - 'a' + 10);
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return (int8_t)(c - 'A' + 10);
+    }
+    return -1;
+}
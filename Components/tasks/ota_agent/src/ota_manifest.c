@@ -0,0 +1,244 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include "ota_manifest.h"
+
+static const char* TAG = "OTA_MANIFEST";
+
+/* Bits of the filter of the checksums, most positions of the partition are not looked up further. */
+#define CHECKSUM_FILTER_BITS 4096U
+
+typedef struct ChunkScan {
+    const OtaManifest_t* pManifest;
+    uint32_t* pSourceOffsets;
+    uint16_t* sorted;    /* Indexes of the full chunks, by checksum */
+    uint32_t numSorted;
+    uint8_t filter[CHECKSUM_FILTER_BITS / 8U];
+    uint8_t* window;     /* Last chunkSize bytes of the partition, circular */
+    uint32_t found;
+    uint32_t hashed;     /* Chunks hashed after a checksum match */
+} ChunkScan_t;
+
+static const ChunkScan_t* sortScan;
+
+static uint32_t prvEntryChecksum(const OtaManifest_t* pManifest, uint32_t chunk);
+static uint32_t prvFilterBit(uint32_t checksum);
+static int prvCompareChunks(const void* a, const void* b);
+static void prvCheckPosition(ChunkScan_t* pScan, uint32_t checksum, uint32_t windowStart, uint32_t offset);
+
+bool OtaManifest_Parse(OtaManifest_t* pManifest, const uint8_t* pData, size_t length)
+{
+    uint32_t chunkBits;
+
+    memset(pManifest, 0x00, sizeof(OtaManifest_t));
+
+    if ((length < OTA_MANIFEST_HEADER_SIZE) || (memcmp(pData, OTA_MANIFEST_MAGIC, 4) != 0) ||
+        (pData[4] != OTA_MANIFEST_VERSION)) {
+        ESP_LOGE(TAG, "Not a chunk manifest");
+        return false;
+    }
+
+    chunkBits = pData[5];
+
+    if ((chunkBits < OTA_MANIFEST_MIN_CHUNK) || (chunkBits > OTA_MANIFEST_MAX_CHUNK)) {
+        ESP_LOGE(TAG, "Unsupported chunk size of 2^%lu bytes", chunkBits);
+        return false;
+    }
+
+    pManifest->chunkSize   = 1U << chunkBits;
+    pManifest->imageSize   = (uint32_t)pData[8] | ((uint32_t)pData[9] << 8) | ((uint32_t)pData[10] << 16) | ((uint32_t)pData[11] << 24);
+    pManifest->numOfChunks = (uint32_t)pData[12] | ((uint32_t)pData[13] << 8) | ((uint32_t)pData[14] << 16) | ((uint32_t)pData[15] << 24);
+    pManifest->entries     = pData + OTA_MANIFEST_HEADER_SIZE;
+
+    if ((pManifest->numOfChunks != (pManifest->imageSize + pManifest->chunkSize - 1U) / pManifest->chunkSize) ||
+        (pManifest->numOfChunks > UINT16_MAX) ||
+        ((length - OTA_MANIFEST_HEADER_SIZE) != (pManifest->numOfChunks * OTA_MANIFEST_ENTRY_SIZE))) {
+        ESP_LOGE(TAG, "%lu chunks do not match an image of %lu bytes in %u bytes", pManifest->numOfChunks,
+                 pManifest->imageSize, (unsigned)length);
+        return false;
+    }
+    return true;
+}
+
+uint32_t OtaManifest_ChunkLength(const OtaManifest_t* pManifest, uint32_t chunk)
+{
+    uint32_t offset = chunk * pManifest->chunkSize;
+
+    return ((pManifest->imageSize - offset) > pManifest->chunkSize) ? pManifest->chunkSize : (pManifest->imageSize - offset);
+}
+
+uint32_t OtaManifest_FindChunks(const OtaManifest_t* pManifest, const esp_partition_t* pSource, uint32_t* pSourceOffsets)
+{
+    int64_t startUs    = esp_timer_get_time();
+    uint32_t chunkSize = pManifest->chunkSize;
+    ChunkScan_t* pScan = (ChunkScan_t*)calloc(1, sizeof(ChunkScan_t));
+    uint8_t* input     = (uint8_t*)malloc(OTA_MANIFEST_READ_SIZE);
+    uint32_t a         = 0;
+    uint32_t b         = 0;
+    uint32_t found     = 0;
+
+    for (uint32_t chunk = 0; chunk < pManifest->numOfChunks; chunk++) {
+        pSourceOffsets[chunk] = OTA_MANIFEST_NOT_FOUND;
+    }
+
+    if (pScan != NULL) {
+        pScan->sorted = (uint16_t*)malloc(pManifest->numOfChunks * sizeof(uint16_t));
+        pScan->window = (uint8_t*)malloc(chunkSize);
+    }
+
+    if ((pScan == NULL) || (input == NULL) || (pScan->sorted == NULL) || (pScan->window == NULL) ||
+        (pSource->size < chunkSize)) {
+        ESP_LOGE(TAG, "Failed to allocate the scan of the running image");
+        goto cleanup;
+    }
+
+    pScan->pManifest      = pManifest;
+    pScan->pSourceOffsets = pSourceOffsets;
+
+    /* Only full chunks are looked for, a short last chunk is always downloaded. */
+    for (uint32_t chunk = 0; chunk < pManifest->numOfChunks; chunk++) {
+        if (OtaManifest_ChunkLength(pManifest, chunk) == chunkSize) {
+            uint32_t bit = prvFilterBit(prvEntryChecksum(pManifest, chunk));
+
+            pScan->filter[bit / 8U] |= (uint8_t)(1U << (bit % 8U));
+            pScan->sorted[pScan->numSorted++] = (uint16_t)chunk;
+        }
+    }
+
+    sortScan = pScan;
+    qsort(pScan->sorted, pScan->numSorted, sizeof(uint16_t), prvCompareChunks);
+
+    /* a is the sum of the window bytes, b the sum of the a values, both modulo 2^16 as in rsync. */
+    for (uint32_t offset = 0; offset < pSource->size; offset += OTA_MANIFEST_READ_SIZE) {
+        uint32_t length = pSource->size - offset;
+
+        if (length > OTA_MANIFEST_READ_SIZE) {
+            length = OTA_MANIFEST_READ_SIZE;
+        }
+        if (esp_partition_read(pSource, offset, input, length) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read the running image at %lu", offset);
+            break;
+        }
+
+        for (uint32_t i = 0; i < length; i++) {
+            uint32_t position = offset + i;
+            uint32_t slot     = position % chunkSize;
+            uint8_t in        = input[i];
+
+            if (position < chunkSize) {
+                a += in;
+                b += a;
+            } else {
+                uint8_t out = pScan->window[slot];
+
+                a += (uint32_t)in - out;
+                b += a - (chunkSize * out);
+            }
+            pScan->window[slot] = in;
+
+            if (position + 1U >= chunkSize) {
+                uint32_t checksum = (a & 0xFFFFU) | ((b & 0xFFFFU) << 16);
+
+                prvCheckPosition(pScan, checksum, (slot + 1U) % chunkSize, position + 1U - chunkSize);
+            }
+        }
+
+        if (pScan->found == pScan->numSorted) {
+            break;
+        }
+    }
+
+    found = pScan->found;
+
+    ESP_LOGI(TAG, "Found %lu of %lu chunks in the running image in %lu ms, %lu chunks hashed", found,
+             pManifest->numOfChunks, (uint32_t)((esp_timer_get_time() - startUs) / 1000), pScan->hashed);
+
+cleanup:
+    if (pScan != NULL) {
+        free(pScan->sorted);
+        free(pScan->window);
+    }
+    free(pScan);
+    free(input);
+
+    return found;
+}
+
+static uint32_t prvEntryChecksum(const OtaManifest_t* pManifest, uint32_t chunk)
+{
+    const uint8_t* pEntry = pManifest->entries + (chunk * OTA_MANIFEST_ENTRY_SIZE);
+
+    return (uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8) | ((uint32_t)pEntry[2] << 16) | ((uint32_t)pEntry[3] << 24);
+}
+
+static uint32_t prvFilterBit(uint32_t checksum)
+{
+    return (checksum ^ (checksum >> 12) ^ (checksum >> 24)) % CHECKSUM_FILTER_BITS;
+}
+
+static int prvCompareChunks(const void* a, const void* b)
+{
+    uint32_t checksumA = prvEntryChecksum(sortScan->pManifest, *(const uint16_t*)a);
+    uint32_t checksumB = prvEntryChecksum(sortScan->pManifest, *(const uint16_t*)b);
+
+    return (checksumA > checksumB) - (checksumA < checksumB);
+}
+
+/* Hashes the window when its checksum is the one of chunks not found yet, and records the matches. */
+static void prvCheckPosition(ChunkScan_t* pScan, uint32_t checksum, uint32_t windowStart, uint32_t offset)
+{
+    const OtaManifest_t* pManifest = pScan->pManifest;
+    uint32_t bit                   = prvFilterBit(checksum);
+    uint32_t low                   = 0;
+    uint32_t high                  = pScan->numSorted;
+    uint8_t digest[32];
+    bool hashed = false;
+
+    if ((pScan->filter[bit / 8U] & (1U << (bit % 8U))) == 0U) {
+        return;
+    }
+
+    while (low < high) {
+        uint32_t middle = (low + high) / 2U;
+
+        if (prvEntryChecksum(pManifest, pScan->sorted[middle]) < checksum) {
+            low = middle + 1U;
+        } else {
+            high = middle;
+        }
+    }
+
+    /* Several chunks may have the same checksum, e.g. blocks of padding. */
+    for (; (low < pScan->numSorted) && (prvEntryChecksum(pManifest, pScan->sorted[low]) == checksum); low++) {
+        uint32_t chunk = pScan->sorted[low];
+
+        if (pScan->pSourceOffsets[chunk] != OTA_MANIFEST_NOT_FOUND) {
+            continue;
+        }
+
+        if (!hashed) {
+            mbedtls_sha256_context shaCtx;
+
+            mbedtls_sha256_init(&shaCtx);
+            mbedtls_sha256_starts(&shaCtx, 0);
+            mbedtls_sha256_update(&shaCtx, pScan->window + windowStart, pManifest->chunkSize - windowStart);
+            mbedtls_sha256_update(&shaCtx, pScan->window, windowStart);
+            mbedtls_sha256_finish(&shaCtx, digest);
+            mbedtls_sha256_free(&shaCtx);
+
+            hashed = true;
+            pScan->hashed++;
+        }
+
+        if (memcmp(digest, pManifest->entries + (chunk * OTA_MANIFEST_ENTRY_SIZE) + 4U, OTA_MANIFEST_HASH_SIZE) == 0) {
+            pScan->pSourceOffsets[chunk] = offset;
+            pScan->found++;
+        }
+    }
+}
@@ -0,0 +1,300 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ota_page_cache.h"
+
+#define READER_TASK_NAME       "ota_read_ahead"
+#define READER_TASK_STACK_SIZE 2048U
+
+static const char* TAG = "OTA_PAGE_CACHE";
+
+static OtaCachePage_t* prvGetPage(OtaPageCache_t* pCache, uint32_t page);
+static OtaCachePage_t* prvFindPage(OtaPageCache_t* pCache, uint32_t page);
+static OtaCachePage_t* prvLeastRecentlyUsed(OtaPageCache_t* pCache);
+static bool prvLoadPage(OtaPageCache_t* pCache, OtaCachePage_t* pPage, uint32_t page);
+static void prvPrefetch(OtaPageCache_t* pCache, uint32_t page);
+static void prvCompletePrefetch(OtaPageCache_t* pCache, bool wait);
+static void prvReaderTask(void* parameters);
+
+bool OtaPageCache_Init(OtaPageCache_t* pCache,
+                       OtaPageReadFunc_t readFunc,
+                       void* pContext,
+                       uint32_t size,
+                       uint32_t pageSize,
+                       uint32_t numPages,
+                       bool readAhead)
+{
+    memset(pCache, 0x00, sizeof(OtaPageCache_t));
+
+    pCache->readFunc = readFunc;
+    pCache->pContext = pContext;
+    pCache->size     = size;
+    pCache->pageSize = pageSize;
+
+    /* Page 0 counts as sequential, the source is usually read from the start. */
+    pCache->lastPage = UINT32_MAX;
+
+    if (numPages > OTA_PAGE_CACHE_MAX_PAGES) {
+        numPages = OTA_PAGE_CACHE_MAX_PAGES;
+    }
+
+    while (pCache->numPages < numPages) {
+        pCache->pages[pCache->numPages].data = (uint8_t*)malloc(pageSize);
+
+        if (pCache->pages[pCache->numPages].data == NULL) {
+            break;
+        }
+        pCache->numPages++;
+    }
+
+    if (pCache->numPages == 0U) {
+        ESP_LOGE(TAG, "Failed to allocate a cache page");
+        return false;
+    }
+
+    if (pCache->numPages < numPages) {
+        ESP_LOGW(TAG, "Only %lu of %lu cache pages could be allocated", pCache->numPages, numPages);
+    }
+
+    /* Loading ahead needs a page besides the one being read. */
+    if (!readAhead || (pCache->numPages < 2U)) {
+        return true;
+    }
+
+    pCache->prefetchQueue = xQueueCreate(1, sizeof(uint32_t));
+    pCache->loaded        = xSemaphoreCreateBinary();
+
+    if ((pCache->prefetchQueue != NULL) && (pCache->loaded != NULL) &&
+        (xTaskCreate(prvReaderTask, READER_TASK_NAME, READER_TASK_STACK_SIZE, pCache,
+                     uxTaskPriorityGet(NULL), &pCache->readerTask) == pdPASS)) {
+        pCache->readAhead = true;
+        return true;
+    }
+
+    ESP_LOGW(TAG, "Read-ahead not available, pages are read on demand");
+
+    if (pCache->prefetchQueue != NULL) {
+        vQueueDelete(pCache->prefetchQueue);
+        pCache->prefetchQueue = NULL;
+    }
+    if (pCache->loaded != NULL) {
+        vSemaphoreDelete(pCache->loaded);
+        pCache->loaded = NULL;
+    }
+    return true;
+}
+
+size_t OtaPageCache_Read(OtaPageCache_t* pCache, uint32_t offset, uint8_t* pData, size_t length)
+{
+    size_t done = 0;
+
+    if (offset >= pCache->size) {
+        return 0;
+    }
+    if (length > (pCache->size - offset)) {
+        length = pCache->size - offset;
+    }
+
+    while (done < length) {
+        uint32_t position     = offset + done;
+        uint32_t inPage       = position % pCache->pageSize;
+        OtaCachePage_t* pPage = prvGetPage(pCache, position / pCache->pageSize);
+        size_t chunk;
+
+        if (pPage == NULL) {
+            return 0;
+        }
+
+        chunk = pPage->length - inPage;
+        if (chunk > (length - done)) {
+            chunk = length - done;
+        }
+
+        memcpy(pData + done, pPage->data + inPage, chunk);
+        done += chunk;
+    }
+    return done;
+}
+
+void OtaPageCache_Deinit(OtaPageCache_t* pCache)
+{
+    if (pCache->readerTask != NULL) {
+        /* Once the pending page is loaded, the task is blocked on the empty queue and can be deleted. */
+        prvCompletePrefetch(pCache, true);
+        vTaskDelete(pCache->readerTask);
+    }
+    if (pCache->prefetchQueue != NULL) {
+        vQueueDelete(pCache->prefetchQueue);
+    }
+    if (pCache->loaded != NULL) {
+        vSemaphoreDelete(pCache->loaded);
+    }
+    for (uint32_t i = 0; i < pCache->numPages; i++) {
+        free(pCache->pages[i].data);
+    }
+
+    memset(pCache, 0x00, sizeof(OtaPageCache_t));
+}
+
+static OtaCachePage_t* prvGetPage(OtaPageCache_t* pCache, uint32_t page)
+{
+    OtaCachePage_t* pPage;
+
+    prvCompletePrefetch(pCache, false);
+
+    /* The page is on its way, waiting is cheaper than reading it a second time. */
+    if (pCache->prefetchPending && (pCache->pages[pCache->prefetchSlot].page == page)) {
+        prvCompletePrefetch(pCache, true);
+    }
+
+    pPage = prvFindPage(pCache, page);
+
+    if (pPage != NULL) {
+        pCache->hits++;
+
+        if (pPage->prefetched) {
+            pPage->prefetched = false;
+            pCache->prefetchHits++;
+        }
+    } else {
+        pCache->misses++;
+        pPage = prvLeastRecentlyUsed(pCache);
+
+        if (!prvLoadPage(pCache, pPage, page)) {
+            return NULL;
+        }
+    }
+
+    pPage->lastUse = ++pCache->clock;
+
+    if (pCache->readAhead && (page == (pCache->lastPage + 1U))) {
+        prvPrefetch(pCache, page + 1U);
+    }
+    pCache->lastPage = page;
+
+    return pPage;
+}
+
+static OtaCachePage_t* prvFindPage(OtaPageCache_t* pCache, uint32_t page)
+{
+    for (uint32_t i = 0; i < pCache->numPages; i++) {
+        if ((pCache->pages[i].state == OtaCachePageValid) && (pCache->pages[i].page == page)) {
+            return &pCache->pages[i];
+        }
+    }
+    return NULL;
+}
+
+/* Empty pages first, then the valid page read longest ago. A page being loaded is never replaced. */
+static OtaCachePage_t* prvLeastRecentlyUsed(OtaPageCache_t* pCache)
+{
+    OtaCachePage_t* pVictim = NULL;
+
+    for (uint32_t i = 0; i < pCache->numPages; i++) {
+        OtaCachePage_t* pPage = &pCache->pages[i];
+
+        if (pPage->state == OtaCachePageEmpty) {
+            return pPage;
+        }
+        if ((pPage->state == OtaCachePageValid) && ((pVictim == NULL) || (pPage->lastUse < pVictim->lastUse))) {
+            pVictim = pPage;
+        }
+    }
+    return pVictim;
+}
+
+static bool prvLoadPage(OtaPageCache_t* pCache, OtaCachePage_t* pPage, uint32_t page)
+{
+    uint32_t offset = page * pCache->pageSize;
+    uint32_t length = pCache->size - offset;
+    int64_t startUs = esp_timer_get_time();
+    esp_err_t err;
+
+    if (length > pCache->pageSize) {
+        length = pCache->pageSize;
+    }
+
+    err = pCache->readFunc(pCache->pContext, offset, pPage->data, length);
+    pCache->readTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read %lu bytes at 0x%lx: %s", length, offset, esp_err_to_name(err));
+        pPage->state = OtaCachePageEmpty;
+        return false;
+    }
+
+    pPage->page       = page;
+    pPage->length     = length;
+    pPage->prefetched = false;
+    pPage->state      = OtaCachePageValid;
+
+    return true;
+}
+
+/* Hands the page to the read-ahead task, unless it is cached or another page is still loading. */
+static void prvPrefetch(OtaPageCache_t* pCache, uint32_t page)
+{
+    OtaCachePage_t* pPage;
+    uint32_t offset = page * pCache->pageSize;
+    uint32_t slot;
+
+    if ((offset >= pCache->size) || pCache->prefetchPending || (prvFindPage(pCache, page) != NULL)) {
+        return;
+    }
+
+    pPage = prvLeastRecentlyUsed(pCache);
+    slot  = (uint32_t)(pPage - pCache->pages);
+
+    pPage->page   = page;
+    pPage->length = ((pCache->size - offset) > pCache->pageSize) ? pCache->pageSize : (pCache->size - offset);
+    pPage->state  = OtaCachePageLoading;
+
+    pCache->prefetchSlot    = slot;
+    pCache->prefetchPending = true;
+
+    xQueueSendToBack(pCache->prefetchQueue, &slot, portMAX_DELAY);
+}
+
+static void prvCompletePrefetch(OtaPageCache_t* pCache, bool wait)
+{
+    int64_t startUs = esp_timer_get_time();
+
+    if (!pCache->prefetchPending) {
+        return;
+    }
+
+    if (xSemaphoreTake(pCache->loaded, wait ? portMAX_DELAY : 0) == pdTRUE) {
+        pCache->prefetchPending = false;
+        pCache->prefetches++;
+    }
+
+    if (wait) {
+        pCache->waitTimeUs += (uint64_t)(esp_timer_get_time() - startUs);
+    }
+}
+
+static void prvReaderTask(void* parameters)
+{
+    OtaPageCache_t* pCache = (OtaPageCache_t*)parameters;
+    uint32_t slot;
+
+    while (true) {
+        if (xQueueReceive(pCache->prefetchQueue, &slot, portMAX_DELAY) == pdTRUE) {
+            OtaCachePage_t* pPage = &pCache->pages[slot];
+
+            if (pCache->readFunc(pCache->pContext, pPage->page * pCache->pageSize, pPage->data, pPage->length) == ESP_OK) {
+                pPage->prefetched = true;
+                pPage->state      = OtaCachePageValid;
+            } else {
+                /* The caller reads the page itself when it needs it. */
+                pPage->state = OtaCachePageEmpty;
+            }
+            xSemaphoreGive(pCache->loaded);
+        }
+    }
+}
@@ -0,0 +1,226 @@
+/* Standard C Library Headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "ota_patch_stream.h"
+
+static const char* TAG = "OTA_PATCH_STREAM";
+
+static void prvCopyIn(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length);
+static void prvCopyOut(OtaPatchStream_t* pStream, uint32_t offset, uint8_t* pData, size_t length);
+static void prvHash(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length);
+
+bool OtaPatchStream_Init(OtaPatchStream_t* pStream,
+                         uint32_t capacity,
+                         uint32_t history,
+                         uint32_t length,
+                         uint32_t startOffset,
+                         OtaImageVerifier_t* pVerifier,
+                         OtaPatchStreamNotify_t notify)
+{
+    memset(pStream, 0x00, sizeof(OtaPatchStream_t));
+
+    if (capacity <= history) {
+        ESP_LOGE(TAG, "A window of %lu bytes cannot keep %lu bytes of history", capacity, history);
+        return false;
+    }
+
+    pStream->buffer         = (uint8_t*)malloc(capacity);
+    pStream->mutex          = xSemaphoreCreateMutex();
+    pStream->dataReady      = xSemaphoreCreateBinary();
+    pStream->capacity       = capacity;
+    pStream->history        = history;
+    pStream->length         = length;
+    pStream->base           = startOffset;
+    pStream->available      = startOffset;
+    pStream->notify         = notify;
+    pStream->verifier       = pVerifier;
+    pStream->snapshotOffset = startOffset;
+
+    if ((pStream->buffer == NULL) || (pStream->mutex == NULL) || (pStream->dataReady == NULL)) {
+        ESP_LOGE(TAG, "Failed to allocate a patch window of %lu bytes", capacity);
+        OtaPatchStream_Deinit(pStream);
+        return false;
+    }
+
+    OtaImageVerifier_Snapshot(pVerifier, &pStream->snapshot);
+
+    return true;
+}
+
+void OtaPatchStream_Deinit(OtaPatchStream_t* pStream)
+{
+    if (pStream->mutex != NULL) {
+        vSemaphoreDelete(pStream->mutex);
+    }
+    if (pStream->dataReady != NULL) {
+        vSemaphoreDelete(pStream->dataReady);
+    }
+    if (pStream->verifier != NULL) {
+        mbedtls_sha256_free(&pStream->snapshot);
+    }
+    free(pStream->buffer);
+
+    memset(pStream, 0x00, sizeof(OtaPatchStream_t));
+}
+
+bool OtaPatchStream_Write(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length)
+{
+    uint32_t base;
+
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    base = pStream->base;
+    xSemaphoreGive(pStream->mutex);
+
+    if ((offset < base) || ((offset + length) > (base + pStream->capacity))) {
+        pStream->rejectedBlocks++;
+        return false;
+    }
+
+    /* The reader never looks past the available bytes, so this area is not shared yet. */
+    prvCopyIn(pStream, offset, pData, length);
+
+    return true;
+}
+
+void OtaPatchStream_SetAvailable(OtaPatchStream_t* pStream, uint32_t end)
+{
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    if (end > pStream->available) {
+        pStream->available = end;
+    }
+    xSemaphoreGive(pStream->mutex);
+
+    xSemaphoreGive(pStream->dataReady);
+}
+
+uint32_t OtaPatchStream_WriteLimit(OtaPatchStream_t* pStream)
+{
+    uint32_t limit;
+
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    limit = pStream->base + pStream->capacity;
+    xSemaphoreGive(pStream->mutex);
+
+    return limit;
+}
+
+size_t OtaPatchStream_Read(OtaPatchStream_t* pStream, uint32_t offset, uint8_t* pData, size_t length)
+{
+    int64_t startUs = esp_timer_get_time();
+    bool released   = false;
+    bool readable;
+
+    if (offset >= pStream->length) {
+        return 0;
+    }
+    if (length > (pStream->length - offset)) {
+        length = pStream->length - offset;
+    }
+
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+
+    if (offset < pStream->base) {
+        xSemaphoreGive(pStream->mutex);
+        ESP_LOGE(TAG, "Patch offset %lu was already released", offset);
+        return 0;
+    }
+
+    /* Nothing before the history is read again, make room for the next blocks first. */
+    if ((offset - pStream->base) > pStream->history) {
+        pStream->base = offset - pStream->history;
+        released      = true;
+    }
+    xSemaphoreGive(pStream->mutex);
+
+    if (released && (pStream->notify != NULL)) {
+        pStream->notify();
+    }
+
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    while (!pStream->aborted && (pStream->available < (offset + length))) {
+        xSemaphoreGive(pStream->mutex);
+        xSemaphoreTake(pStream->dataReady, portMAX_DELAY);
+        xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    }
+    readable = !pStream->aborted;
+    xSemaphoreGive(pStream->mutex);
+
+    pStream->readWaitUs += (uint64_t)(esp_timer_get_time() - startUs);
+
+    if (!readable) {
+        return 0;
+    }
+
+    prvCopyOut(pStream, offset, pData, length);
+    prvHash(pStream, offset, pData, length);
+
+    return length;
+}
+
+bool OtaPatchStream_GetSnapshot(OtaPatchStream_t* pStream, uint32_t offset, mbedtls_sha256_context* pSnapshot)
+{
+    if (pStream->snapshotOffset != offset) {
+        return false;
+    }
+
+    mbedtls_sha256_init(pSnapshot);
+    mbedtls_sha256_clone(pSnapshot, &pStream->snapshot);
+
+    return true;
+}
+
+void OtaPatchStream_Abort(OtaPatchStream_t* pStream)
+{
+    xSemaphoreTake(pStream->mutex, portMAX_DELAY);
+    pStream->aborted = true;
+    xSemaphoreGive(pStream->mutex);
+
+    xSemaphoreGive(pStream->dataReady);
+}
+
+static void prvCopyIn(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length)
+{
+    uint32_t index = offset % pStream->capacity;
+    size_t first   = pStream->capacity - index;
+
+    if (first > length) {
+        first = length;
+    }
+    memcpy(pStream->buffer + index, pData, first);
+    memcpy(pStream->buffer, pData + first, length - first);
+}
+
+static void prvCopyOut(OtaPatchStream_t* pStream, uint32_t offset, uint8_t* pData, size_t length)
+{
+    uint32_t index = offset % pStream->capacity;
+    size_t first   = pStream->capacity - index;
+
+    if (first > length) {
+        first = length;
+    }
+    memcpy(pData, pStream->buffer + index, first);
+    memcpy(pData + first, pStream->buffer, length - first);
+}
+
+/* Hashes the bytes read for the first time. janpatch reads whole pages, so a new read starts where the digest ends. */
+static void prvHash(OtaPatchStream_t* pStream, uint32_t offset, const uint8_t* pData, size_t length)
+{
+    uint32_t hashed = pStream->verifier->bytesHashed;
+
+    if ((offset > hashed) || ((offset + length) <= hashed)) {
+        return;
+    }
+
+    if (offset == hashed) {
+        mbedtls_sha256_free(&pStream->snapshot);
+        OtaImageVerifier_Snapshot(pStream->verifier, &pStream->snapshot);
+        pStream->snapshotOffset = offset;
+    }
+
+    OtaImageVerifier_Update(pStream->verifier, pData + (hashed - offset), length - (hashed - offset));
+}
@@ -0,0 +1,66 @@
+/* Standard C Library Headers */
+#include <string.h>
+
+/* esp-idf Headers*/
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "ota_staging.h"
+
+static const char* TAG = "OTA_STAGING";
+
+bool OtaStaging_Save(const OtaStagedImage_t* pStaged)
+{
+    nvs_handle_t xHandle;
+    esp_err_t err = nvs_open(OTA_STAGING_NAMESPACE, NVS_READWRITE, &xHandle);
+
+    if (err == ESP_OK) {
+        err = nvs_set_blob(xHandle, OTA_STAGING_NVS_KEY, pStaged, sizeof(OtaStagedImage_t));
+
+        if (err == ESP_OK) {
+            err = nvs_commit(xHandle);
+        }
+        nvs_close(xHandle);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store the staged image: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+bool OtaStaging_Load(OtaStagedImage_t* pStaged)
+{
+    nvs_handle_t xHandle;
+    esp_err_t err;
+    size_t blobSize = sizeof(OtaStagedImage_t);
+
+    memset(pStaged, 0x00, sizeof(OtaStagedImage_t));
+
+    if (nvs_open(OTA_STAGING_NAMESPACE, NVS_READONLY, &xHandle) != ESP_OK) {
+        return false;
+    }
+
+    err = nvs_get_blob(xHandle, OTA_STAGING_NVS_KEY, pStaged, &blobSize);
+    nvs_close(xHandle);
+
+    if ((err == ESP_OK) && ((blobSize != sizeof(OtaStagedImage_t)) || (pStaged->version != OTA_STAGING_VERSION))) {
+        ESP_LOGW(TAG, "Stored staged image has another layout, ignoring it");
+        err = ESP_ERR_INVALID_VERSION;
+    }
+
+    return err == ESP_OK;
+}
+
+void OtaStaging_Erase(void)
+{
+    nvs_handle_t xHandle;
+
+    if (nvs_open(OTA_STAGING_NAMESPACE, NVS_READWRITE, &xHandle) == ESP_OK) {
+        if (nvs_erase_key(xHandle, OTA_STAGING_NVS_KEY) == ESP_OK) {
+            nvs_commit(xHandle);
+        }
+        nvs_close(xHandle);
+    }
+}
@@ -0,0 +1,282 @@
+/*
+ * Decodes GetStream responses with ota_block_decoder.c, in CBOR and in JSON.
+ * Checks the CBOR reader on valid, reordered, truncated and inconsistent
+ * messages, and that the payload is left in place. For each block size it
+ * prints the bytes on the wire and the decode time of both encodings.
+ *
+ * The JSON decoder runs over coreJSON, built from CORE_JSON in the Makefile
+ * (Libs/coreJSON once the firmware is configured). Without it the JSON
+ * decode is skipped, its bytes on the wire are still printed.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ota_block_decoder.h"
+
+#define MAX_BLOCK_SIZE 4096U
+#define MAX_MESSAGE    (MAX_BLOCK_SIZE * 2U)
+#define DECODES        20000U
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);         \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+typedef struct Message {
+    uint8_t data[MAX_MESSAGE];
+    size_t length;
+} Message_t;
+
+static void prvPutCborHeader(Message_t* pMessage, uint8_t majorType, uint64_t value)
+{
+    uint8_t* out = pMessage->data + pMessage->length;
+
+    if (value < 24U) {
+        *out = (uint8_t)((majorType << 5) | value);
+        pMessage->length += 1U;
+    } else if (value <= 0xFFU) {
+        out[0] = (uint8_t)((majorType << 5) | 24U);
+        out[1] = (uint8_t)value;
+        pMessage->length += 2U;
+    } else if (value <= 0xFFFFU) {
+        out[0] = (uint8_t)((majorType << 5) | 25U);
+        out[1] = (uint8_t)(value >> 8);
+        out[2] = (uint8_t)value;
+        pMessage->length += 3U;
+    } else {
+        out[0] = (uint8_t)((majorType << 5) | 26U);
+        for (int i = 0; i < 4; i++) {
+            out[1 + i] = (uint8_t)(value >> (24 - 8 * i));
+        }
+        pMessage->length += 5U;
+    }
+}
+
+static void prvPutCborText(Message_t* pMessage, const char* text)
+{
+    prvPutCborHeader(pMessage, 3U, strlen(text));
+    memcpy(pMessage->data + pMessage->length, text, strlen(text));
+    pMessage->length += strlen(text);
+}
+
+static void prvPutCborInt(Message_t* pMessage, int64_t value)
+{
+    if (value < 0) {
+        prvPutCborHeader(pMessage, 1U, (uint64_t)(-1 - value));
+    } else {
+        prvPutCborHeader(pMessage, 0U, (uint64_t)value);
+    }
+}
+
+static void prvPutCborBytes(Message_t* pMessage, const uint8_t* pData, size_t length)
+{
+    prvPutCborHeader(pMessage, 2U, length);
+    memcpy(pMessage->data + pMessage->length, pData, length);
+    pMessage->length += length;
+}
+
+/* The response of the stream service: {"f": fileId, "i": blockId, "l": length, "p": payload}. */
+static void prvMakeCbor(Message_t* pMessage, int32_t fileId, int32_t blockId, const uint8_t* pData, size_t length)
+{
+    pMessage->length = 0;
+    prvPutCborHeader(pMessage, 5U, 4U);
+    prvPutCborText(pMessage, OTA_BLOCK_KEY_FILE_ID);
+    prvPutCborInt(pMessage, fileId);
+    prvPutCborText(pMessage, OTA_BLOCK_KEY_BLOCK_ID);
+    prvPutCborInt(pMessage, blockId);
+    prvPutCborText(pMessage, OTA_BLOCK_KEY_BLOCK_SIZE);
+    prvPutCborInt(pMessage, (int64_t)length);
+    prvPutCborText(pMessage, OTA_BLOCK_KEY_PAYLOAD);
+    prvPutCborBytes(pMessage, pData, length);
+}
+
+static void prvMakeJson(Message_t* pMessage, int32_t fileId, int32_t blockId, const uint8_t* pData, size_t length)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char* out = (char*)pMessage->data;
+
+    out += sprintf(out, "{\"%s\":%ld,\"%s\":%ld,\"%s\":%lu,\"%s\":\"", OTA_BLOCK_KEY_FILE_ID, (long)fileId,
+                   OTA_BLOCK_KEY_BLOCK_ID, (long)blockId, OTA_BLOCK_KEY_BLOCK_SIZE, (unsigned long)length,
+                   OTA_BLOCK_KEY_PAYLOAD);
+
+    for (size_t i = 0; i < length; i += 3U) {
+        uint32_t triple = (uint32_t)pData[i] << 16;
+
+        triple |= (i + 1U < length) ? (uint32_t)pData[i + 1U] << 8 : 0U;
+        triple |= (i + 2U < length) ? (uint32_t)pData[i + 2U] : 0U;
+        *out++ = alphabet[(triple >> 18) & 0x3FU];
+        *out++ = alphabet[(triple >> 12) & 0x3FU];
+        *out++ = (i + 1U < length) ? alphabet[(triple >> 6) & 0x3FU] : '=';
+        *out++ = (i + 2U < length) ? alphabet[triple & 0x3FU] : '=';
+    }
+    out += sprintf(out, "\"}");
+
+    pMessage->length = (size_t)(out - (char*)pMessage->data);
+}
+
+static void prvCheckCbor(const uint8_t* pData)
+{
+    Message_t message;
+    OtaStreamBlock_t block;
+
+    prvMakeCbor(&message, 7, 300, pData, 1000U);
+    CHECK(OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+    CHECK((block.fileId == 7) && (block.blockId == 300) && (block.blockSize == 1000));
+    CHECK(block.payloadLength == 1000U);
+    CHECK(memcmp(block.payload, pData, 1000U) == 0);
+
+    /* Not copied: the payload is the tail of the message. */
+    CHECK(block.payload == message.data + message.length - 1000U);
+
+    /* Any order, unknown keys are skipped and the block size is optional. */
+    message.length = 0;
+    prvPutCborHeader(&message, 5U, 4U);
+    prvPutCborText(&message, OTA_BLOCK_KEY_PAYLOAD);
+    prvPutCborBytes(&message, pData, 300U);
+    prvPutCborText(&message, "x");
+    prvPutCborText(&message, "ignored");
+    prvPutCborText(&message, OTA_BLOCK_KEY_BLOCK_ID);
+    prvPutCborInt(&message, 70000);
+    prvPutCborText(&message, OTA_BLOCK_KEY_FILE_ID);
+    prvPutCborInt(&message, 0);
+    CHECK(OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+    CHECK((block.fileId == 0) && (block.blockId == 70000) && (block.blockSize == 300) && (block.payloadLength == 300U));
+
+    /* Every truncation is refused. */
+    prvMakeCbor(&message, 1, 2, pData, 64U);
+    for (size_t length = 0; length < message.length; length++) {
+        CHECK(!OtaBlockDecoder_DecodeCbor(message.data, length, &block));
+    }
+
+    /* A block size other than the payload's, a negative block id, a missing key. */
+    message.length = 0;
+    prvPutCborHeader(&message, 5U, 4U);
+    prvPutCborText(&message, OTA_BLOCK_KEY_FILE_ID);
+    prvPutCborInt(&message, 1);
+    prvPutCborText(&message, OTA_BLOCK_KEY_BLOCK_ID);
+    prvPutCborInt(&message, 2);
+    prvPutCborText(&message, OTA_BLOCK_KEY_BLOCK_SIZE);
+    prvPutCborInt(&message, 65);
+    prvPutCborText(&message, OTA_BLOCK_KEY_PAYLOAD);
+    prvPutCborBytes(&message, pData, 64U);
+    CHECK(!OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+
+    prvMakeCbor(&message, 1, -2, pData, 64U);
+    CHECK(!OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+
+    message.length = 0;
+    prvPutCborHeader(&message, 5U, 2U);
+    prvPutCborText(&message, OTA_BLOCK_KEY_FILE_ID);
+    prvPutCborInt(&message, 1);
+    prvPutCborText(&message, OTA_BLOCK_KEY_PAYLOAD);
+    prvPutCborBytes(&message, pData, 64U);
+    CHECK(!OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+
+    /* A JSON message is not CBOR. */
+    prvMakeJson(&message, 1, 2, pData, 64U);
+    CHECK(!OtaBlockDecoder_DecodeCbor(message.data, message.length, &block));
+}
+
+static bool prvCheckJson(const uint8_t* pData)
+{
+    Message_t message;
+    OtaStreamBlock_t block;
+
+    prvMakeJson(&message, 7, 300, pData, 1000U);
+    if (!OtaBlockDecoder_DecodeJson(message.data, message.length, &block)) {
+#if defined(HAVE_CORE_JSON)
+        CHECK(false);
+#endif
+        return false;
+    }
+
+    CHECK((block.fileId == 7) && (block.blockId == 300) && (block.blockSize == 1000));
+    CHECK(block.payloadLength == 1000U);
+    CHECK(memcmp(block.payload, pData, 1000U) == 0);
+
+    for (size_t length = 1; length <= 4U; length++) {
+        prvMakeJson(&message, 1, 2, pData, length);
+        CHECK(OtaBlockDecoder_DecodeJson(message.data, message.length, &block));
+        CHECK((block.payloadLength == length) && (memcmp(block.payload, pData, length) == 0));
+    }
+
+    prvMakeJson(&message, 1, -2, pData, 64U);
+    CHECK(!OtaBlockDecoder_DecodeJson(message.data, message.length, &block));
+
+    return true;
+}
+
+static double prvNowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/* Mean time of a decode in ns. The JSON decoder works in place, so each decode gets a fresh copy, timed apart. */
+static double prvTimeDecode(const Message_t* pMessage, bool json)
+{
+    static Message_t copy;
+    OtaStreamBlock_t block;
+    double copyNs;
+    double startNs = prvNowNs();
+
+    for (uint32_t i = 0; i < DECODES; i++) {
+        memcpy(copy.data, pMessage->data, pMessage->length);
+        __asm__ volatile("" : : "r"(copy.data) : "memory");
+    }
+    copyNs  = prvNowNs() - startNs;
+    startNs = prvNowNs();
+
+    for (uint32_t i = 0; i < DECODES; i++) {
+        memcpy(copy.data, pMessage->data, pMessage->length);
+        CHECK(json ? OtaBlockDecoder_DecodeJson(copy.data, pMessage->length, &block)
+                   : OtaBlockDecoder_DecodeCbor(copy.data, pMessage->length, &block));
+    }
+
+    return (prvNowNs() - startNs - copyNs) / DECODES;
+}
+
+int main(void)
+{
+    static uint8_t data[MAX_BLOCK_SIZE];
+    static Message_t cbor;
+    static Message_t json;
+    bool haveJson;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 131U + (i >> 7));
+    }
+
+    prvCheckCbor(data);
+    haveJson = prvCheckJson(data);
+
+    printf("%-6s %10s %10s %10s %12s %12s\n", "block", "cbor B", "json B", "json/cbor", "cbor ns", "json ns");
+
+    for (uint32_t blockSize = 256U; blockSize <= MAX_BLOCK_SIZE; blockSize *= 2U) {
+        prvMakeCbor(&cbor, 0, 1000, data, blockSize);
+        prvMakeJson(&json, 0, 1000, data, blockSize);
+
+        printf("%-6lu %10zu %10zu %9.2fx %12.0f", (unsigned long)blockSize, cbor.length, json.length,
+               (double)json.length / cbor.length, prvTimeDecode(&cbor, false));
+        if (haveJson) {
+            printf(" %12.0f\n", prvTimeDecode(&json, true));
+        } else {
+            printf(" %12s\n", "-");
+        }
+    }
+
+    if (!haveJson) {
+        printf("JSON decode skipped, coreJSON was not found (make CORE_JSON=<coreJSON source dir>)\n");
+    }
+
+    return 0;
+}
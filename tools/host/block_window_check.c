@@ -0,0 +1,236 @@
+/*
+ * Drives ota_block_window.c as the OTA agent does for a download in whole
+ * blocks, over the simulated link of link_sim.c. Checks the window on its own
+ * first: out of order arrival, the timeout backing off once per expiry and
+ * the give up. Then every download has to store each block exactly once,
+ * and its throughput is printed for each window size and loss rate.
+ *
+ *     block_window_check [RTT_MS [BYTES_PER_S]]
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "link_sim.h"
+#include "ota_block_window.h"
+
+#define BLOCK_SIZE 4096U            /* mqttFileDownloader_CONFIG_BLOCK_SIZE */
+#define FILE_SIZE  (1800U * 1024U)  /* A firmware image */
+#define RUNS       5U
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);         \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+static void prvCheckOutOfOrder(void)
+{
+    BlockWindow_t window;
+    uint32_t first;
+
+    CHECK(BlockWindow_Init(&window, 10U, 4U));
+    CHECK(BlockWindow_ReserveNewBlocks(&window, 0U, 0U, &first) == 4U);
+    CHECK(first == 0U);
+
+    CHECK(BlockWindow_MarkReceived(&window, 3U, 100U));
+    CHECK(BlockWindow_MarkReceived(&window, 1U, 110U));
+    CHECK(window.firstMissingBlock == 0U);
+    CHECK(!BlockWindow_MarkReceived(&window, 3U, 120U));
+    CHECK(window.duplicates == 1U);
+
+    /* Two slots are free, the next blocks follow the ones already requested. */
+    CHECK(BlockWindow_ReserveNewBlocks(&window, 130U, 0U, &first) == 2U);
+    CHECK(first == 4U);
+
+    CHECK(BlockWindow_MarkReceived(&window, 0U, 140U));
+    CHECK(window.firstMissingBlock == 2U);
+    CHECK(BlockWindow_MarkReceived(&window, 2U, 150U));
+    CHECK(window.firstMissingBlock == 4U);
+
+    BlockWindow_Free(&window);
+}
+
+static void prvCheckTimeouts(void)
+{
+    BlockWindow_t window;
+    uint32_t blockIds[BLOCK_WINDOW_MAX_SIZE];
+    uint32_t first;
+    uint32_t nowMs = 0;
+    bool giveUp;
+
+    CHECK(BlockWindow_Init(&window, 100U, 8U));
+    CHECK(BlockWindow_ReserveNewBlocks(&window, nowMs, 0U, &first) == 8U);
+    CHECK(BlockWindow_NextTimeoutMs(&window, nowMs) == BLOCK_WINDOW_INITIAL_RTO_MS);
+    CHECK(BlockWindow_CollectExpiredBlocks(&window, BLOCK_WINDOW_INITIAL_RTO_MS - 1U, blockIds, &giveUp) == 0U);
+
+    /* The whole window expires at once, the timeout doubles once. */
+    nowMs = BLOCK_WINDOW_INITIAL_RTO_MS;
+    CHECK(BlockWindow_CollectExpiredBlocks(&window, nowMs, blockIds, &giveUp) == 8U);
+    CHECK(!giveUp);
+    CHECK(window.rtoMs == 2U * BLOCK_WINDOW_INITIAL_RTO_MS);
+    CHECK(window.retransmissions == 8U);
+    for (uint32_t i = 0; i < 8U; i++) {
+        CHECK(blockIds[i] == i);
+    }
+
+    /* A block requested again gives no round trip time sample (Karn). */
+    CHECK(BlockWindow_MarkReceived(&window, 0U, nowMs + 10U));
+    CHECK(window.srttMs == 0U);
+    CHECK(window.rtoMs == 2U * BLOCK_WINDOW_INITIAL_RTO_MS);
+
+    /* The timeout stops at its maximum, and a block is given up after its retries. */
+    for (uint32_t retry = 1; retry < BLOCK_WINDOW_MAX_RETRIES; retry++) {
+        nowMs += window.rtoMs;
+        CHECK(BlockWindow_CollectExpiredBlocks(&window, nowMs, blockIds, &giveUp) == 7U);
+        CHECK(!giveUp);
+        CHECK(window.rtoMs <= BLOCK_WINDOW_MAX_RTO_MS);
+    }
+    CHECK(window.rtoMs == BLOCK_WINDOW_MAX_RTO_MS);
+
+    nowMs += window.rtoMs;
+    CHECK(BlockWindow_CollectExpiredBlocks(&window, nowMs, blockIds, &giveUp) == 1U);
+    CHECK(giveUp);
+    CHECK(blockIds[0] == 1U);
+
+    BlockWindow_Free(&window);
+}
+
+static void prvRequest(LinkSim_t* pLink, double nowMs, uint32_t blockId, uint32_t numOfBlocks)
+{
+    if (!LinkSim_SendRequest(pLink)) {
+        return;
+    }
+    for (uint32_t i = 0; i < numOfBlocks; i++) {
+        uint32_t offset = (blockId + i) * BLOCK_SIZE;
+        uint32_t length = ((FILE_SIZE - offset) > BLOCK_SIZE) ? BLOCK_SIZE : (FILE_SIZE - offset);
+
+        LinkSim_SendMessage(pLink, nowMs, blockId + i, offset, length);
+    }
+}
+
+/* Downloads the file as the OTA agent does, returns the time it took in ms, a negative time when given up. */
+static double prvDownload(uint8_t windowSize, LinkSim_t* pLink, uint32_t* pRetransmissions)
+{
+    uint32_t numOfBlocks = (FILE_SIZE + BLOCK_SIZE - 1U) / BLOCK_SIZE;
+    uint8_t* stored      = calloc(numOfBlocks, 1U);
+    double nowMs         = 0.0;
+    BlockWindow_t window;
+
+    CHECK((stored != NULL) && BlockWindow_Init(&window, numOfBlocks, windowSize));
+
+    while (!BlockWindow_IsComplete(&window)) {
+        uint32_t blockIds[BLOCK_WINDOW_MAX_SIZE];
+        uint32_t first;
+        uint32_t reserved = BlockWindow_ReserveNewBlocks(&window, (uint32_t)nowMs, 0U, &first);
+        double expiryMs   = nowMs + BlockWindow_NextTimeoutMs(&window, (uint32_t)nowMs);
+        double arrivalMs;
+        uint32_t expired;
+        bool giveUp;
+
+        if (reserved > 0U) {
+            prvRequest(pLink, nowMs, first, reserved);
+            continue;
+        }
+
+        if (LinkSim_NextArrival(pLink, &arrivalMs) && (arrivalMs <= expiryMs)) {
+            LinkMessage_t message;
+            uint32_t blockId;
+
+            LinkSim_Receive(pLink, &message);
+            nowMs   = message.atMs;
+            blockId = message.blockId;
+
+            /* Answers to requests that timed out arrive for blocks already stored. */
+            if ((BlockWindow_GetRequest(&window, blockId) == NULL) ||
+                !BlockWindow_MarkPartReceived(&window, blockId, 0U, 1U)) {
+                continue;
+            }
+            CHECK(BlockWindow_MarkReceived(&window, blockId, (uint32_t)nowMs));
+            stored[blockId]++;
+            continue;
+        }
+
+        nowMs   = expiryMs;
+        expired = BlockWindow_CollectExpiredBlocks(&window, (uint32_t)nowMs, blockIds, &giveUp);
+        if (giveUp) {
+            nowMs = -1.0;
+            break;
+        }
+        for (uint32_t i = 0; i < expired; i++) {
+            prvRequest(pLink, nowMs, blockIds[i], 1U);
+        }
+    }
+
+    for (uint32_t blockId = 0; (nowMs >= 0.0) && (blockId < numOfBlocks); blockId++) {
+        CHECK(stored[blockId] == 1U);
+    }
+
+    *pRetransmissions = window.retransmissions;
+    BlockWindow_Free(&window);
+    free(stored);
+
+    return nowMs;
+}
+
+int main(int argc, char** argv)
+{
+    const uint8_t windowSizes[] = { 1U, 2U, 4U, 8U, 16U };
+    const double losses[]       = { 0.0, 0.005, 0.02, 0.05 };
+    double rttMs                = (argc > 1) ? atof(argv[1]) : 150.0;
+    double bytesPerS            = (argc > 2) ? atof(argv[2]) : 128.0 * 1024.0;
+    double lossless[sizeof(windowSizes)];
+
+    prvCheckOutOfOrder();
+    prvCheckTimeouts();
+
+    printf("%u KB file in %u byte blocks, %.0f ms round trip, %.0f KB/s down: KB/s (re-requests)\n",
+           FILE_SIZE / 1024U, BLOCK_SIZE, rttMs, bytesPerS / 1024.0);
+    printf("%-7s", "loss");
+    for (size_t w = 0; w < sizeof(windowSizes); w++) {
+        char label[16];
+
+        snprintf(label, sizeof(label), "window %u", windowSizes[w]);
+        printf("%14s", label);
+    }
+    printf("\n");
+
+    for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+        printf("%5.1f%% ", losses[l] * 100.0);
+
+        for (size_t w = 0; w < sizeof(windowSizes); w++) {
+            double totalMs           = 0.0;
+            uint32_t retransmissions = 0;
+
+            for (uint32_t run = 0; run < RUNS; run++) {
+                LinkSim_t link;
+                uint32_t runRetransmissions;
+                double timeMs;
+
+                LinkSim_Init(&link, run + 1U, rttMs, bytesPerS, losses[l]);
+                timeMs = prvDownload(windowSizes[w], &link, &runRetransmissions);
+                LinkSim_Free(&link);
+
+                CHECK(timeMs > 0.0);
+                CHECK((losses[l] > 0.0) || (runRetransmissions == 0U));
+                totalMs += timeMs;
+                retransmissions += runRetransmissions;
+            }
+
+            if (losses[l] == 0.0) {
+                lossless[w] = totalMs;
+            }
+            printf("%7.1f (%4u)", FILE_SIZE / 1024.0 / (totalMs / RUNS / 1000.0), retransmissions / RUNS);
+        }
+        printf("\n");
+    }
+
+    /* Without loss the window hides the round trips until the downlink is full. */
+    CHECK(lossless[0] > 2.0 * lossless[3]);
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+#include "core_json.h"
+
+JSONStatus_t JSON_SearchConst(const char* buf, size_t max, const char* query, size_t queryLength, const char** outValue,
+                              size_t* outValueLength, JSONTypes_t* outType)
+{
+    (void)buf;
+    (void)max;
+    (void)query;
+    (void)queryLength;
+    (void)outValue;
+    (void)outValueLength;
+    (void)outType;
+
+    return JSONNotFound;
+}
@@ -0,0 +1,298 @@
+/*
+ * The partition, OTA and image calls of include/ for host builds. Partitions
+ * live in RAM with the rules of NOR flash: erasing sets a sector to 0xFF,
+ * writing can only clear bits, so data written over data that was not erased
+ * is counted and comes out corrupted. The OTA handle follows app_update of
+ * ESP-IDF 5.1.2, including its assert on writes to a partition it did not erase.
+ */
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+
+#define SECTOR_SIZE    4096U
+#define MAX_PARTITIONS 4U
+#define MAX_HANDLES    4U
+
+struct HostFlash {
+    uint8_t* data;
+    uint32_t badWrites;
+};
+
+typedef struct HostOtaHandle {
+    esp_ota_handle_t handle; /* 0 when the slot is free */
+    const esp_partition_t* partition;
+    uint32_t erasedSize;
+    uint32_t wroteSize;
+} HostOtaHandle_t;
+
+static esp_partition_t* prvPartitions[MAX_PARTITIONS];
+static HostOtaHandle_t prvHandles[MAX_HANDLES];
+static esp_ota_handle_t prvLastHandle;
+static uint32_t prvNextAddress = 0x10000U;
+
+static uint32_t prvHash(const uint8_t* pData, uint32_t length)
+{
+    uint32_t hash = 2166136261U;
+
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ pData[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static HostOtaHandle_t* prvFindHandle(esp_ota_handle_t handle)
+{
+    for (uint32_t i = 0; i < MAX_HANDLES; i++) {
+        if ((handle != 0U) && (prvHandles[i].handle == handle)) {
+            return &prvHandles[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size)
+{
+    if ((offset > partition->size) || (size > partition->size - offset)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, partition->flash->data + offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size)
+{
+    const uint8_t* pSrc = (const uint8_t*)src;
+    uint8_t* pFlash     = partition->flash->data + offset;
+
+    if ((offset > partition->size) || (size > partition->size - offset)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        partition->flash->badWrites += ((pFlash[i] & pSrc[i]) != pSrc[i]) ? 1U : 0U;
+        pFlash[i] &= pSrc[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+    if (((offset % SECTOR_SIZE) != 0U) || ((size % SECTOR_SIZE) != 0U) || (offset > partition->size) ||
+        (size > partition->size - offset)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(partition->flash->data + offset, 0xFF, size);
+    return ESP_OK;
+}
+
+const esp_partition_t* HostPartition_Create(const char* label, uint32_t size)
+{
+    esp_partition_t* partition = calloc(1U, sizeof(esp_partition_t));
+    struct HostFlash* flash    = calloc(1U, sizeof(struct HostFlash));
+
+    assert((partition != NULL) && (flash != NULL) && ((size % SECTOR_SIZE) == 0U));
+
+    flash->data = malloc(size);
+    assert(flash->data != NULL);
+
+    for (uint32_t i = 0; i < size; i++) {
+        flash->data[i] = (uint8_t)(i * 7U + 3U);
+    }
+
+    partition->address = prvNextAddress;
+    partition->size    = size;
+    partition->flash   = flash;
+    strncpy(partition->label, label, sizeof(partition->label) - 1U);
+    prvNextAddress += size;
+
+    for (uint32_t i = 0; i < MAX_PARTITIONS; i++) {
+        if (prvPartitions[i] == NULL) {
+            prvPartitions[i] = partition;
+            return partition;
+        }
+    }
+    assert(false);
+    return NULL;
+}
+
+void HostPartition_Free(const esp_partition_t* partition)
+{
+    for (uint32_t i = 0; i < MAX_PARTITIONS; i++) {
+        if (prvPartitions[i] == partition) {
+            prvPartitions[i] = NULL;
+        }
+    }
+    free(partition->flash->data);
+    free(partition->flash);
+    free((void*)partition);
+}
+
+const uint8_t* HostPartition_Data(const esp_partition_t* partition)
+{
+    return partition->flash->data;
+}
+
+uint32_t HostPartition_BadWrites(const esp_partition_t* partition)
+{
+    return partition->flash->badWrites;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out_handle)
+{
+    HostOtaHandle_t* pEntry = NULL;
+    esp_err_t err           = ESP_OK;
+
+    for (uint32_t i = 0; (i < MAX_HANDLES) && (pEntry == NULL); i++) {
+        pEntry = (prvHandles[i].handle == 0U) ? &prvHandles[i] : NULL;
+    }
+    if ((partition == NULL) || (out_handle == NULL) || (pEntry == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(pEntry, 0x00, sizeof(HostOtaHandle_t));
+
+    if (image_size != OTA_WITH_SEQUENTIAL_WRITES) {
+        if ((image_size == 0U) || (image_size == OTA_SIZE_UNKNOWN)) {
+            pEntry->erasedSize = partition->size;
+        } else {
+            pEntry->erasedSize = ((uint32_t)image_size + SECTOR_SIZE - 1U) & ~(SECTOR_SIZE - 1U);
+        }
+        err = esp_partition_erase_range(partition, 0U, pEntry->erasedSize);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    pEntry->partition = partition;
+    pEntry->handle    = ++prvLastHandle;
+    *out_handle       = pEntry->handle;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void* data, size_t size, uint32_t offset)
+{
+    HostOtaHandle_t* pEntry = prvFindHandle(handle);
+
+    if (pEntry == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    /* As app_update: the partition must have been erased by esp_ota_begin(). */
+    assert(pEntry->erasedSize > 0U);
+
+    pEntry->wroteSize += (uint32_t)size;
+    return esp_partition_write(pEntry->partition, offset, data, size);
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    HostOtaHandle_t* pEntry = prvFindHandle(handle);
+    esp_partition_pos_t position;
+    esp_image_metadata_t metadata;
+    esp_err_t err = ESP_OK;
+
+    if (pEntry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (pEntry->wroteSize == 0U) {
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        position.offset = pEntry->partition->address;
+        position.size   = pEntry->partition->size;
+
+        if (esp_image_verify(ESP_IMAGE_VERIFY, &position, &metadata) != ESP_OK) {
+            err = ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+    }
+
+    memset(pEntry, 0x00, sizeof(HostOtaHandle_t));
+    return err;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    HostOtaHandle_t* pEntry = prvFindHandle(handle);
+
+    if (pEntry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memset(pEntry, 0x00, sizeof(HostOtaHandle_t));
+    return ESP_OK;
+}
+
+uint32_t HostOta_OpenHandles(void)
+{
+    uint32_t open = 0;
+
+    for (uint32_t i = 0; i < MAX_HANDLES; i++) {
+        open += (prvHandles[i].handle != 0U) ? 1U : 0U;
+    }
+    return open;
+}
+
+void HostOta_Restart(void)
+{
+    memset(prvHandles, 0x00, sizeof(prvHandles));
+}
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t* part, esp_image_metadata_t* data)
+{
+    const esp_partition_t* partition = NULL;
+    const uint8_t* pImage;
+    uint32_t length;
+    uint32_t hash;
+
+    (void)mode;
+
+    for (uint32_t i = 0; i < MAX_PARTITIONS; i++) {
+        if ((prvPartitions[i] != NULL) && (prvPartitions[i]->address == part->offset)) {
+            partition = prvPartitions[i];
+        }
+    }
+    if (partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pImage = partition->flash->data;
+    memcpy(&length, pImage + 1, sizeof(length));
+
+    if ((pImage[0] != ESP_IMAGE_HEADER_MAGIC) || (length < 5U + sizeof(hash)) || (length > part->size)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memcpy(&hash, pImage + length - sizeof(hash), sizeof(hash));
+    if (hash != prvHash(pImage, length - sizeof(hash))) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    data->start_addr = part->offset;
+    data->image_len  = length;
+
+    return ESP_OK;
+}
+
+void HostImage_Build(uint8_t* pImage, uint32_t size, uint32_t seed)
+{
+    uint32_t state = seed | 1U;
+    uint32_t hash;
+
+    pImage[0] = ESP_IMAGE_HEADER_MAGIC;
+    memcpy(pImage + 1, &size, sizeof(size));
+
+    for (uint32_t i = 5U; i < size - sizeof(hash); i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        pImage[i] = (uint8_t)state;
+    }
+
+    hash = prvHash(pImage, size - sizeof(hash));
+    memcpy(pImage + size - sizeof(hash), &hash, sizeof(hash));
+}
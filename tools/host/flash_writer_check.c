@@ -0,0 +1,277 @@
+/*
+ * Writes OTA blocks through ota_flash_writer.c into a simulated flash, with
+ * and without double buffering, the writer task running over the POSIX
+ * FreeRTOS of freertos_posix.c. Checks the flash content, that every byte is
+ * programmed once, the number of writes and the sticky error. Then prints
+ * the MB/s for block sizes from 256 B to 4 KB, writing each block straight to
+ * flash as before the writer, through the writer, and double buffered.
+ *
+ * A flash write takes FLASH_CALL_US plus FLASH_NS_PER_BYTE per byte, the
+ * caller spends CALLER_NS_PER_BYTE on each block received (the stream and the
+ * image digest). Both are in the order of the ESP32's, and both sleep, so the
+ * writer task overlaps the caller even on a single core host.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "ota_flash_writer.h"
+
+#define FLASH_SIZE         (512U * 1024U)
+#define BENCH_SIZE         (256U * 1024U)
+#define BENCH_RUNS         3
+#define FLASH_CALL_US      20U
+#define FLASH_NS_PER_BYTE  250U
+#define CALLER_NS_PER_BYTE 200U
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);         \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+typedef struct Flash {
+    uint8_t image[FLASH_SIZE];
+    uint8_t programmed[FLASH_SIZE];
+    uint32_t calls;
+    uint32_t failAtCall;   /* Call that fails, 0 for none */
+    bool timed;            /* Writes take the time of the flash */
+    bool twice;            /* A byte was programmed twice */
+    struct timespec busyUntil;
+} Flash_t;
+
+static uint8_t prvData[FLASH_SIZE];
+
+/* Sleeps, so the caller runs meanwhile even on a single core, until the write would be done. */
+static void prvWaitForFlash(Flash_t* pFlash, size_t length)
+{
+    uint64_t ns = FLASH_CALL_US * 1000ULL + length * FLASH_NS_PER_BYTE;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((pFlash->busyUntil.tv_sec < now.tv_sec) ||
+        ((pFlash->busyUntil.tv_sec == now.tv_sec) && (pFlash->busyUntil.tv_nsec < now.tv_nsec))) {
+        pFlash->busyUntil = now;
+    }
+
+    pFlash->busyUntil.tv_nsec += (long)ns;
+    pFlash->busyUntil.tv_sec += pFlash->busyUntil.tv_nsec / 1000000000L;
+    pFlash->busyUntil.tv_nsec %= 1000000000L;
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pFlash->busyUntil, NULL);
+}
+
+static esp_err_t prvFlashWrite(void* pContext, uint32_t offset, const void* pData, size_t length)
+{
+    Flash_t* pFlash = (Flash_t*)pContext;
+
+    if (++pFlash->calls == pFlash->failAtCall) {
+        return ESP_FAIL;
+    }
+    CHECK(offset + length <= FLASH_SIZE);
+
+    /* The data is taken at the end of the write, so a buffer reused too early shows. */
+    if (pFlash->timed) {
+        prvWaitForFlash(pFlash, length);
+    }
+
+    memcpy(pFlash->image + offset, pData, length);
+    for (size_t i = 0; i < length; i++) {
+        pFlash->twice |= (pFlash->programmed[offset + i]++ != 0U);
+    }
+    return ESP_OK;
+}
+
+/* Time the OTA agent spends on a block besides writing it, mostly waiting for it to arrive. */
+static void prvReceive(size_t length)
+{
+    struct timespec wait = { 0, (long)(length * CALLER_NS_PER_BYTE) };
+
+    nanosleep(&wait, NULL);
+}
+
+static Flash_t* prvNewFlash(bool timed)
+{
+    Flash_t* pFlash = calloc(1U, sizeof(Flash_t));
+
+    CHECK(pFlash != NULL);
+    pFlash->timed = timed;
+    return pFlash;
+}
+
+static void prvCheckImage(const Flash_t* pFlash, size_t size)
+{
+    CHECK(memcmp(pFlash->image, prvData, size) == 0);
+    CHECK(!pFlash->twice);
+    for (size_t i = 0; i < size; i++) {
+        CHECK(pFlash->programmed[i] == 1U);
+    }
+}
+
+static void prvCheckSequential(bool doubleBuffer)
+{
+    const size_t blockSizes[] = { 256U, 1000U, 4096U, 6000U };
+
+    for (size_t b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); b++) {
+        Flash_t* pFlash = prvNewFlash(false);
+        OtaFlashWriter_t writer;
+
+        CHECK(OtaFlashWriter_Init(&writer, prvFlashWrite, pFlash, doubleBuffer));
+        CHECK(writer.doubleBuffer == doubleBuffer);
+
+        for (size_t offset = 0; offset < FLASH_SIZE; offset += blockSizes[b]) {
+            size_t length = (FLASH_SIZE - offset < blockSizes[b]) ? FLASH_SIZE - offset : blockSizes[b];
+
+            CHECK(OtaFlashWriter_Write(&writer, (uint32_t)offset, prvData + offset, length) == ESP_OK);
+        }
+        CHECK(OtaFlashWriter_Flush(&writer) == ESP_OK);
+
+        /* Only whole sectors reach the flash. */
+        prvCheckImage(pFlash, FLASH_SIZE);
+        CHECK(writer.flashWrites == FLASH_SIZE / OTA_FLASH_SECTOR_SIZE);
+        CHECK(writer.partialWrites == 0U);
+        CHECK(writer.bytesWritten == FLASH_SIZE);
+
+        /* Whole aligned sectors skip the buffer, unless it is needed to hand them to the writer task. */
+        if (blockSizes[b] < OTA_FLASH_SECTOR_SIZE) {
+            CHECK(writer.bytesCopied == FLASH_SIZE);
+        } else if (blockSizes[b] == OTA_FLASH_SECTOR_SIZE) {
+            CHECK(writer.bytesCopied == (doubleBuffer ? FLASH_SIZE : 0U));
+        }
+
+        OtaFlashWriter_Deinit(&writer);
+        free(pFlash);
+    }
+}
+
+/* Blocks of a window arrive in any order, each byte is still programmed once. */
+static void prvCheckOutOfOrder(bool doubleBuffer)
+{
+    const size_t blockSize = 1024U;
+    Flash_t* pFlash        = prvNewFlash(false);
+    OtaFlashWriter_t writer;
+
+    CHECK(OtaFlashWriter_Init(&writer, prvFlashWrite, pFlash, doubleBuffer));
+
+    for (size_t window = 0; window < FLASH_SIZE; window += 4U * blockSize) {
+        const size_t order[] = { 2U, 0U, 3U, 1U };
+
+        for (size_t i = 0; i < 4U; i++) {
+            size_t offset = window + order[i] * blockSize;
+
+            CHECK(OtaFlashWriter_Write(&writer, (uint32_t)offset, prvData + offset, blockSize) == ESP_OK);
+        }
+    }
+    CHECK(OtaFlashWriter_Flush(&writer) == ESP_OK);
+
+    prvCheckImage(pFlash, FLASH_SIZE);
+    CHECK(writer.partialWrites > 0U);
+
+    OtaFlashWriter_Deinit(&writer);
+    free(pFlash);
+}
+
+/* The first failed write fails every later one and the flush. */
+static void prvCheckError(bool doubleBuffer)
+{
+    Flash_t* pFlash = prvNewFlash(false);
+    OtaFlashWriter_t writer;
+    esp_err_t err = ESP_OK;
+
+    pFlash->failAtCall = 3U;
+    CHECK(OtaFlashWriter_Init(&writer, prvFlashWrite, pFlash, doubleBuffer));
+
+    for (size_t offset = 0; (offset < 8U * OTA_FLASH_SECTOR_SIZE) && (err == ESP_OK); offset += 512U) {
+        err = OtaFlashWriter_Write(&writer, (uint32_t)offset, prvData + offset, 512U);
+    }
+
+    CHECK(OtaFlashWriter_Flush(&writer) == ESP_FAIL);
+    CHECK(OtaFlashWriter_Write(&writer, 0U, prvData, 512U) == ESP_FAIL);
+
+    OtaFlashWriter_Deinit(&writer);
+    free(pFlash);
+}
+
+/* MB/s of writing BENCH_SIZE in blocks, through the writer or straight to flash. */
+static double prvBenchOnce(size_t blockSize, bool useWriter, bool doubleBuffer)
+{
+    Flash_t* pFlash = prvNewFlash(true);
+    OtaFlashWriter_t writer;
+    int64_t startUs;
+    double seconds;
+
+    CHECK(!useWriter || OtaFlashWriter_Init(&writer, prvFlashWrite, pFlash, doubleBuffer));
+    startUs = esp_timer_get_time();
+
+    for (size_t offset = 0; offset < BENCH_SIZE; offset += blockSize) {
+        prvReceive(blockSize);
+        if (useWriter) {
+            CHECK(OtaFlashWriter_Write(&writer, (uint32_t)offset, prvData + offset, blockSize) == ESP_OK);
+        } else {
+            CHECK(prvFlashWrite(pFlash, (uint32_t)offset, prvData + offset, blockSize) == ESP_OK);
+        }
+    }
+    if (useWriter) {
+        CHECK(OtaFlashWriter_Flush(&writer) == ESP_OK);
+    }
+
+    seconds = (esp_timer_get_time() - startUs) / 1e6;
+    prvCheckImage(pFlash, BENCH_SIZE);
+
+    if (useWriter) {
+        OtaFlashWriter_Deinit(&writer);
+    }
+    free(pFlash);
+
+    return BENCH_SIZE / (1024.0 * 1024.0) / seconds;
+}
+
+/* Best of BENCH_RUNS, the sleeps of the model only ever run late. */
+static double prvBench(size_t blockSize, bool useWriter, bool doubleBuffer)
+{
+    double best = 0.0;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double mbPerS = prvBenchOnce(blockSize, useWriter, doubleBuffer);
+
+        best = (mbPerS > best) ? mbPerS : best;
+    }
+    return best;
+}
+
+int main(void)
+{
+    /* Sleeps end on time, the flash model relies on them. */
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    for (size_t i = 0; i < FLASH_SIZE; i++) {
+        prvData[i] = (uint8_t)(i * 2654435761U >> 24);
+    }
+
+    for (int doubleBuffer = 0; doubleBuffer <= 1; doubleBuffer++) {
+        prvCheckSequential(doubleBuffer != 0);
+        prvCheckOutOfOrder(doubleBuffer != 0);
+        prvCheckError(doubleBuffer != 0);
+    }
+
+    printf("%u KB in blocks, flash %u us + %u ns/B, caller %u ns/B: MB/s\n", BENCH_SIZE / 1024U, FLASH_CALL_US,
+           FLASH_NS_PER_BYTE, CALLER_NS_PER_BYTE);
+    printf("%-6s %10s %10s %10s\n", "block", "direct", "combined", "double");
+
+    for (size_t blockSize = 256U; blockSize <= OTA_FLASH_SECTOR_SIZE; blockSize *= 2U) {
+        double direct   = prvBench(blockSize, false, false);
+        double combined = prvBench(blockSize, true, false);
+        double doubled  = prvBench(blockSize, true, true);
+
+        printf("%-6zu %10.2f %10.2f %10.2f\n", blockSize, direct, combined, doubled);
+    }
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * The FreeRTOS calls of include/freertos over POSIX threads. Tasks are
+ * threads, a queue is a ring under a mutex. Priorities are not modelled,
+ * tasks run in parallel as on both cores of the ESP32.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+struct HostTask {
+    pthread_t thread;
+    TaskFunction_t function;
+    void* parameters;
+};
+
+struct HostQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    uint8_t* items;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+static void* prvRunTask(void* parameters)
+{
+    struct HostTask* pTask = (struct HostTask*)parameters;
+
+    pTask->function(pTask->parameters);
+    return NULL;
+}
+
+static void prvUnlock(void* mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+/* Waits for the queue to change until the deadline, false once it passed. */
+static bool prvWait(struct HostQueue* pQueue, TickType_t ticksToWait, const struct timespec* pDeadline)
+{
+    if (ticksToWait == 0U) {
+        return false;
+    }
+    if (ticksToWait == portMAX_DELAY) {
+        pthread_cond_wait(&pQueue->changed, &pQueue->mutex);
+        return true;
+    }
+    return pthread_cond_timedwait(&pQueue->changed, &pQueue->mutex, pDeadline) != ETIMEDOUT;
+}
+
+static struct timespec prvDeadline(TickType_t ticksToWait)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticksToWait / 1000U;
+    deadline.tv_nsec += (long)(ticksToWait % 1000U) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* parameters,
+                       UBaseType_t priority, TaskHandle_t* pHandle)
+{
+    struct HostTask* pTask = malloc(sizeof(struct HostTask));
+
+    (void)name;
+    (void)stackDepth;
+    (void)priority;
+
+    if (pTask == NULL) {
+        return pdFAIL;
+    }
+
+    pTask->function   = function;
+    pTask->parameters = parameters;
+
+    if (pthread_create(&pTask->thread, NULL, prvRunTask, pTask) != 0) {
+        free(pTask);
+        return pdFAIL;
+    }
+
+    if (pHandle != NULL) {
+        *pHandle = pTask;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    /* Waiting on a queue is a cancellation point, the queue mutex is released on the way out. */
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    free(task);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    (void)task;
+    return 5U;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec delay = { ticks / 1000U, (long)(ticks % 1000U) * 1000000L };
+
+    nanosleep(&delay, NULL);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+    struct HostQueue* pQueue = calloc(1U, sizeof(struct HostQueue));
+
+    if (pQueue == NULL) {
+        return NULL;
+    }
+
+    pQueue->items    = malloc((size_t)length * itemSize + 1U);
+    pQueue->length   = length;
+    pQueue->itemSize = itemSize;
+
+    if (pQueue->items == NULL) {
+        free(pQueue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pQueue->mutex, NULL);
+    pthread_cond_init(&pQueue->changed, NULL);
+
+    return pQueue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* pItem, TickType_t ticksToWait)
+{
+    struct timespec deadline = prvDeadline(ticksToWait);
+    BaseType_t sent          = pdFALSE;
+
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cleanup_push(prvUnlock, &queue->mutex);
+
+    while ((queue->count == queue->length) && prvWait(queue, ticksToWait, &deadline)) {
+    }
+
+    if (queue->count < queue->length) {
+        if (queue->itemSize > 0U) {
+            memcpy(queue->items + ((queue->head + queue->count) % queue->length) * queue->itemSize, pItem, queue->itemSize);
+        }
+        queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+        sent = pdTRUE;
+    }
+
+    pthread_cleanup_pop(1);
+    return sent;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* pItem, TickType_t ticksToWait)
+{
+    struct timespec deadline = prvDeadline(ticksToWait);
+    BaseType_t received      = pdFALSE;
+
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cleanup_push(prvUnlock, &queue->mutex);
+
+    while ((queue->count == 0U) && prvWait(queue, ticksToWait, &deadline)) {
+    }
+
+    if (queue->count > 0U) {
+        if (queue->itemSize > 0U) {
+            memcpy(pItem, queue->items + queue->head * queue->itemSize, queue->itemSize);
+        }
+        queue->head = (queue->head + 1U) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+        received = pdTRUE;
+    }
+
+    pthread_cleanup_pop(1);
+    return received;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    UBaseType_t count;
+
+    pthread_mutex_lock(&queue->mutex);
+    count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return count;
+}
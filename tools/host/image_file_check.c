@@ -0,0 +1,190 @@
+/*
+ * Downloads an image through ota_flash_writer.c and ota_image_file.c, the
+ * write path of the OTA agent, into a partition of esp_ota_sim.c, whose OTA
+ * handle behaves as the one of ESP-IDF 5.1.2. Blocks arrive out of order
+ * within a window, as from the block window.
+ *
+ * A download started from the beginning goes through the OTA handle. A download
+ * cut by a restart right after a checkpoint is resumed in the same partition,
+ * without erasing it, then finished: the image must be intact, no byte written
+ * over data that was not erased, and no handle left open. A resume that has
+ * every block already stored finishes without writing, and a corrupted block
+ * fails the verification. An image rebuilt by a delta engine, which writes the
+ * partition with esp_partition_write(), is verified without the handle.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_image_format.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "ota_flash_writer.h"
+#include "ota_image_file.h"
+
+#define PARTITION_SIZE (256U * 1024U)
+#define IMAGE_SIZE     (150U * 1024U + 123U)
+#define BLOCK_SIZE     1024U
+#define NUM_OF_BLOCKS  ((IMAGE_SIZE + BLOCK_SIZE - 1U) / BLOCK_SIZE)
+#define WINDOW_SIZE    8U
+
+#define CHECK(condition)                                                        \
+    do {                                                                        \
+        if (!(condition)) {                                                     \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition);         \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+static uint8_t prvImage[IMAGE_SIZE];
+
+/* Writes the blocks from first to last, those of a window in reverse order. */
+static void prvWriteBlocks(OtaFlashWriter_t* pWriter, uint32_t first, uint32_t last)
+{
+    for (uint32_t window = first; window < last; window += WINDOW_SIZE) {
+        uint32_t end = (window + WINDOW_SIZE < last) ? window + WINDOW_SIZE : last;
+
+        for (uint32_t blockId = end; blockId > window; blockId--) {
+            uint32_t offset = (blockId - 1U) * BLOCK_SIZE;
+            uint32_t length = (IMAGE_SIZE - offset < BLOCK_SIZE) ? IMAGE_SIZE - offset : BLOCK_SIZE;
+
+            CHECK(OtaFlashWriter_Write(pWriter, offset, prvImage + offset, length) == ESP_OK);
+        }
+    }
+}
+
+/* Opens the partition and writes the blocks from first to last, flushed as at a checkpoint. */
+static void prvDownload(const esp_partition_t* partition, bool resume, uint32_t first, uint32_t last, bool doubleBuffer,
+                        OtaImageFile_t* pFile)
+{
+    OtaFlashWriter_t writer;
+
+    CHECK(OtaImageFile_Open(pFile, partition, resume));
+    CHECK(OtaFlashWriter_Init(&writer, OtaImageFile_Write, pFile, doubleBuffer));
+    prvWriteBlocks(&writer, first, last);
+    CHECK(OtaFlashWriter_Flush(&writer) == ESP_OK);
+    OtaFlashWriter_Deinit(&writer);
+}
+
+static void prvCheckImage(const esp_partition_t* partition)
+{
+    CHECK(memcmp(HostPartition_Data(partition), prvImage, IMAGE_SIZE) == 0);
+    CHECK(HostPartition_BadWrites(partition) == 0U);
+    CHECK(HostOta_OpenHandles() == 0U);
+}
+
+static void prvCheckFullDownload(bool doubleBuffer)
+{
+    const esp_partition_t* partition = HostPartition_Create("ota_1", PARTITION_SIZE);
+    OtaImageFile_t file;
+
+    prvDownload(partition, false, 0U, NUM_OF_BLOCKS, doubleBuffer, &file);
+    CHECK(file.hasHandle);
+    CHECK(OtaImageFile_Finish(&file));
+    prvCheckImage(partition);
+
+    HostPartition_Free(partition);
+}
+
+/* The download is cut at resumedAt blocks, the rest is written after the restart. */
+static void prvCheckResume(uint32_t resumedAt, bool doubleBuffer)
+{
+    const esp_partition_t* partition = HostPartition_Create("ota_1", PARTITION_SIZE);
+    OtaImageFile_t file;
+
+    prvDownload(partition, false, 0U, resumedAt, doubleBuffer, &file);
+    HostOta_Restart();
+
+    prvDownload(partition, true, resumedAt, NUM_OF_BLOCKS, doubleBuffer, &file);
+    CHECK(!file.hasHandle);
+    CHECK(OtaImageFile_Finish(&file));
+    prvCheckImage(partition);
+
+    HostPartition_Free(partition);
+}
+
+/* The delta engines write the target sector by sector, a streamed patch resumes from a checkpoint. */
+static void prvCheckRebuiltImage(uint32_t resumedAt)
+{
+    const esp_partition_t* partition = HostPartition_Create("ota_1", PARTITION_SIZE);
+    OtaImageFile_t file;
+
+    CHECK(OtaImageFile_Open(&file, partition, false));
+    OtaImageFile_WriteDirectly(&file);
+    CHECK(HostOta_OpenHandles() == 0U);
+
+    for (uint32_t offset = 0; offset < IMAGE_SIZE; offset += OTA_FLASH_SECTOR_SIZE) {
+        uint32_t length = (IMAGE_SIZE - offset < OTA_FLASH_SECTOR_SIZE) ? IMAGE_SIZE - offset : OTA_FLASH_SECTOR_SIZE;
+
+        if (offset == resumedAt) {
+            HostOta_Restart();
+            CHECK(OtaImageFile_Open(&file, partition, true));
+            OtaImageFile_WriteDirectly(&file);
+        }
+        CHECK(esp_partition_write(partition, offset, prvImage + offset, length) == ESP_OK);
+    }
+
+    CHECK(OtaImageFile_Finish(&file));
+    prvCheckImage(partition);
+
+    HostPartition_Free(partition);
+}
+
+/* A block stored before the restart no longer holds what was written. */
+static void prvCheckResumeCorrupted(void)
+{
+    const esp_partition_t* partition = HostPartition_Create("ota_1", PARTITION_SIZE);
+    const uint8_t zero               = 0x00;
+    OtaImageFile_t file;
+
+    prvDownload(partition, false, 0U, NUM_OF_BLOCKS / 2U, false, &file);
+    HostOta_Restart();
+    CHECK(esp_partition_write(partition, 3U * BLOCK_SIZE + 17U, &zero, 1U) == ESP_OK);
+
+    prvDownload(partition, true, NUM_OF_BLOCKS / 2U, NUM_OF_BLOCKS, false, &file);
+    CHECK(!OtaImageFile_Finish(&file));
+
+    HostPartition_Free(partition);
+}
+
+/* An aborted file closes its handle, nothing written through it is checked. */
+static void prvCheckAbort(void)
+{
+    const esp_partition_t* partition = HostPartition_Create("ota_1", PARTITION_SIZE);
+    OtaImageFile_t file;
+
+    CHECK(OtaImageFile_Open(&file, partition, false));
+    CHECK(HostOta_OpenHandles() == 1U);
+    OtaImageFile_Abort(&file);
+    CHECK(HostOta_OpenHandles() == 0U);
+
+    /* esp_ota_end() fails a handle nothing was written through. */
+    CHECK(OtaImageFile_Open(&file, partition, false));
+    CHECK(!OtaImageFile_Finish(&file));
+    CHECK(HostOta_OpenHandles() == 0U);
+
+    HostPartition_Free(partition);
+}
+
+int main(void)
+{
+    HostImage_Build(prvImage, IMAGE_SIZE, 1U);
+
+    for (int doubleBuffer = 0; doubleBuffer <= 1; doubleBuffer++) {
+        prvCheckFullDownload(doubleBuffer != 0);
+        prvCheckResume(NUM_OF_BLOCKS / 3U, doubleBuffer != 0);
+        prvCheckResume(1U, doubleBuffer != 0);
+
+        /* Every block was stored before the restart, nothing is written after it. */
+        prvCheckResume(NUM_OF_BLOCKS, doubleBuffer != 0);
+    }
+    prvCheckRebuiltImage(IMAGE_SIZE);
+    prvCheckRebuiltImage(8U * OTA_FLASH_SECTOR_SIZE);
+    prvCheckResumeCorrupted();
+    prvCheckAbort();
+
+    printf("image file: full, resumed, complete resumed and rebuilt images verified\n");
+    return 0;
+}
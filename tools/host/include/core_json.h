@@ -0,0 +1,34 @@
+#ifndef CORE_JSON_H
+#define CORE_JSON_H
+
+/*
+ * The part of coreJSON the OTA agent sources use, for host builds without
+ * Libs/coreJSON. core_json_stub.c finds nothing, so JSON paths are skipped.
+ */
+#include <stddef.h>
+
+typedef enum {
+    JSONPartial = 0,
+    JSONSuccess,
+    JSONIllegalDocument,
+    JSONMaxDepthExceeded,
+    JSONNotFound,
+    JSONNullParameter,
+    JSONBadParameter
+} JSONStatus_t;
+
+typedef enum {
+    JSONInvalid = 0,
+    JSONString,
+    JSONNumber,
+    JSONTrue,
+    JSONFalse,
+    JSONNull,
+    JSONObject,
+    JSONArray
+} JSONTypes_t;
+
+JSONStatus_t JSON_SearchConst(const char* buf, size_t max, const char* query, size_t queryLength, const char** outValue,
+                              size_t* outValueLength, JSONTypes_t* outType);
+
+#endif
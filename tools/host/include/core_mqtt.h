@@ -0,0 +1,25 @@
+#ifndef CORE_MQTT_H
+#define CORE_MQTT_H
+
+/* The part of coreMQTT the subscription manager uses, for host builds without Libs/coreMQTT-Agent. */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum MQTTQoS {
+    MQTTQoS0 = 0,
+    MQTTQoS1 = 1,
+    MQTTQoS2 = 2
+} MQTTQoS_t;
+
+typedef struct MQTTPublishInfo {
+    MQTTQoS_t qos;
+    bool retain;
+    bool dup;
+    const char* pTopicName;
+    uint16_t topicNameLength;
+    const void* pPayload;
+    size_t payloadLength;
+} MQTTPublishInfo_t;
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef ESP_ERR_H
+#define ESP_ERR_H
+
+/* The ESP-IDF error codes the OTA agent sources use, for host builds. */
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK               0
+#define ESP_FAIL             -1
+#define ESP_ERR_NO_MEM       0x101
+#define ESP_ERR_INVALID_ARG  0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND    0x105
+#define ESP_ERR_TIMEOUT      0x107
+
+static inline const char* esp_err_to_name(esp_err_t code)
+{
+    return (code == ESP_OK) ? "ESP_OK" : "ESP_ERR";
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef ESP_IMAGE_FORMAT_H
+#define ESP_IMAGE_FORMAT_H
+
+/*
+ * Image verification of bootloader_support for host builds: esp_ota_sim.c.
+ * A host image is the magic byte, its length on 4 bytes and its data,
+ * followed by the FNV-1a hash of all of it, HostImage_Build() makes one.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define ESP_IMAGE_HEADER_MAGIC 0xE9
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+} esp_partition_pos_t;
+
+typedef enum {
+    ESP_IMAGE_VERIFY,
+    ESP_IMAGE_VERIFY_SILENT,
+} esp_image_load_mode_t;
+
+typedef struct {
+    uint32_t start_addr;
+    uint32_t image_len;
+} esp_image_metadata_t;
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t* part, esp_image_metadata_t* data);
+
+/* Host only: fills pImage, of size bytes, with a valid image of pseudo-random data. */
+void HostImage_Build(uint8_t* pImage, uint32_t size, uint32_t seed);
+
+#endif
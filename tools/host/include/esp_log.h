@@ -0,0 +1,30 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+/* ESP-IDF logging for host builds, printed to stderr when HOST_LOG is set in the environment. */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline void HostLog(char level, const char* tag, const char* format, ...)
+{
+    va_list args;
+
+    if (getenv("HOST_LOG") == NULL) {
+        return;
+    }
+
+    va_start(args, format);
+    fprintf(stderr, "%c (%s) ", level, tag);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+#define ESP_LOGE(tag, ...) HostLog('E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) HostLog('W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) HostLog('I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) HostLog('D', tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) HostLog('V', tag, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ESP_OTA_OPS_H
+#define ESP_OTA_OPS_H
+
+/*
+ * The OTA handle of app_update for host builds, as in ESP-IDF 5.1: esp_ota_sim.c.
+ * esp_ota_write_with_offset() asserts the partition was erased by esp_ota_begin(),
+ * esp_ota_end() fails when nothing was written through the handle.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#define OTA_SIZE_UNKNOWN           0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+#define ESP_ERR_OTA_BASE            0x1500
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 0x03)
+
+typedef uint32_t esp_ota_handle_t;
+
+esp_err_t esp_ota_begin(const esp_partition_t* partition, size_t image_size, esp_ota_handle_t* out_handle);
+esp_err_t esp_ota_write_with_offset(esp_ota_handle_t handle, const void* data, size_t size, uint32_t offset);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+
+/* Host only: handles begun and not ended or aborted, and a restart of the device, which loses them. */
+uint32_t HostOta_OpenHandles(void);
+void HostOta_Restart(void);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef ESP_PARTITION_H
+#define ESP_PARTITION_H
+
+/* Partitions in RAM for host builds, with the rules of NOR flash: esp_ota_sim.c. */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct esp_partition {
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    bool encrypted;
+    struct HostFlash* flash; /* Host only */
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size);
+
+/* Host only: a partition of size bytes, a multiple of the sector, holding leftovers of a previous image. */
+const esp_partition_t* HostPartition_Create(const char* label, uint32_t size);
+void HostPartition_Free(const esp_partition_t* partition);
+
+/* Host only: the content, and the bytes written while not erased, which flash cannot program. */
+const uint8_t* HostPartition_Data(const esp_partition_t* partition);
+uint32_t HostPartition_BadWrites(const esp_partition_t* partition);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+/*
+ * The FreeRTOS kernel over POSIX threads, for host builds of the sources
+ * that use tasks, queues and semaphores. See freertos_posix.c.
+ */
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY      ((TickType_t)0xFFFFFFFFU)
+#define portTICK_PERIOD_MS 1U
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef FREERTOS_QUEUE_H
+#define FREERTOS_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct HostQueue* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+
+void vQueueDelete(QueueHandle_t queue);
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* pItem, TickType_t ticksToWait);
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* pItem, TickType_t ticksToWait);
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#define xQueueSend(queue, pItem, ticksToWait) xQueueSendToBack(queue, pItem, ticksToWait)
+
+#endif
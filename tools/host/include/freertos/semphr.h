@@ -0,0 +1,14 @@
+#ifndef FREERTOS_SEMPHR_H
+#define FREERTOS_SEMPHR_H
+
+#include "freertos/queue.h"
+
+/* As in FreeRTOS, a binary semaphore is a queue of one empty item. */
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary()               xQueueCreate(1U, 0U)
+#define vSemaphoreDelete(semaphore)            vQueueDelete(semaphore)
+#define xSemaphoreGive(semaphore)              xQueueSendToBack(semaphore, NULL, 0U)
+#define xSemaphoreTake(semaphore, ticksToWait) xQueueReceive(semaphore, NULL, ticksToWait)
+
+#endif
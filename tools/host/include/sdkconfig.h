@@ -0,0 +1,6 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/* No Kconfig options on the host, the sources fall back to their defaults or to -D flags. */
+
+#endif
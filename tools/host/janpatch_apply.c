@@ -0,0 +1,109 @@
+/*
+ * Builds janpatch.h over a MemStream_t. Compiled twice by the Makefile, once
+ * as is and once with JANPATCH_BYTE_COPY, with JANPATCH_APPLY and janpatch
+ * renamed so both fit in one program.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_stream.h"
+
+#define JANPATCH_STREAM MemStream_t
+#include "janpatch.h"
+
+static size_t prvRead(void* ptr, size_t size, size_t count, MemStream_t* pStream)
+{
+    size_t length = size * count;
+
+    if (pStream->position >= pStream->size) {
+        return 0;
+    }
+    if (length > pStream->size - pStream->position) {
+        length = pStream->size - pStream->position;
+    }
+
+    memcpy(ptr, pStream->data + pStream->position, length);
+    pStream->position += length;
+    return length / size;
+}
+
+static size_t prvWrite(const void* ptr, size_t size, size_t count, MemStream_t* pStream)
+{
+    size_t length = size * count;
+    size_t end    = pStream->position + length;
+
+    if (end > pStream->capacity) {
+        size_t capacity = (pStream->capacity == 0U) ? 4096U : pStream->capacity;
+        uint8_t* data;
+
+        while (capacity < end) {
+            capacity *= 2U;
+        }
+        if ((data = realloc(pStream->data, capacity)) == NULL) {
+            return 0;
+        }
+        pStream->data     = data;
+        pStream->capacity = capacity;
+    }
+
+    memcpy(pStream->data + pStream->position, ptr, length);
+    pStream->position = end;
+    if (end > pStream->size) {
+        pStream->size = end;
+    }
+    return count;
+}
+
+static int prvSeek(MemStream_t* pStream, long int offset, int origin)
+{
+    if (origin == SEEK_SET) {
+        pStream->position = (size_t)offset;
+    } else if (origin == SEEK_CUR) {
+        pStream->position += offset;
+    } else {
+        pStream->position = pStream->size + offset;
+    }
+    return 0;
+}
+
+static long prvTell(MemStream_t* pStream)
+{
+    return (long)pStream->position;
+}
+
+int JANPATCH_APPLY(MemStream_t* pSource, MemStream_t* pPatch, MemStream_t* pTarget, size_t pageSize)
+{
+    unsigned char* sourceBuffer = malloc(pageSize);
+    unsigned char* patchBuffer  = malloc(pageSize);
+    unsigned char* targetBuffer = malloc(pageSize);
+    int result                  = 1;
+
+    if ((sourceBuffer != NULL) && (patchBuffer != NULL) && (targetBuffer != NULL)) {
+        janpatch_ctx ctx = {
+            { sourceBuffer, pageSize, 0xffffffff, 0, NULL, 0 },
+            { patchBuffer, pageSize, 0xffffffff, 0, NULL, 0 },
+            { targetBuffer, pageSize, 0xffffffff, 0, NULL, 0 },
+            prvRead,
+            prvWrite,
+            prvSeek,
+            prvTell,
+            NULL,
+            0,
+            NULL
+        };
+
+        pSource->position = 0;
+        pPatch->position  = 0;
+        pTarget->position = 0;
+        pTarget->size     = 0;
+
+        result = janpatch(ctx, pSource, pPatch, pTarget);
+    }
+
+    free(sourceBuffer);
+    free(patchBuffer);
+    free(targetBuffer);
+
+    return result;
+}
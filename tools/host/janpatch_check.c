@@ -0,0 +1,259 @@
+/*
+ * Applies a JojoDiff patch with janpatch as built for the device, and with the
+ * byte by byte copy it used before (JANPATCH_BYTE_COPY). Both outputs have to
+ * match the new image, with device sized pages and with small pages crossing
+ * page boundaries inside every operation. Prints the time of each.
+ *
+ *     janpatch_check [OLD PATCH NEW]
+ *
+ * Without arguments a firmware sized pair is made up and its patch encoded
+ * here, with escaped ESC bytes, long EQL lengths, DEL and BKT. Give a patch
+ * made by jdiff to check real builds.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem_stream.h"
+
+#define ESC 0xa7U
+#define MOD 0xa6U
+#define INS 0xa5U
+#define DEL 0xa4U
+#define EQL 0xa3U
+#define BKT 0xa2U
+
+#define DEVICE_PAGE_SIZE 4096U /* OTA_PATCH_PAGE_SIZE */
+#define SMALL_PAGE_SIZE  64U
+#define SYNTHETIC_SIZE   (1024U * 1024U)
+#define TIMED_RUNS       5
+
+typedef int (*Apply_t)(MemStream_t*, MemStream_t*, MemStream_t*, size_t);
+
+static uint32_t prvRandomState = 1U;
+
+static uint32_t prvRandom(uint32_t bound)
+{
+    prvRandomState ^= prvRandomState << 13;
+    prvRandomState ^= prvRandomState >> 17;
+    prvRandomState ^= prvRandomState << 5;
+    return prvRandomState % bound;
+}
+
+static void prvPut(MemStream_t* pStream, uint8_t byte)
+{
+    if (pStream->size == pStream->capacity) {
+        pStream->capacity = (pStream->capacity == 0U) ? 4096U : pStream->capacity * 2U;
+        if ((pStream->data = realloc(pStream->data, pStream->capacity)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+    pStream->data[pStream->size++] = byte;
+}
+
+/* Firmware has plenty of ESC bytes, often followed by an operator byte. */
+static uint8_t prvRandomByte(void)
+{
+    uint32_t r = prvRandom(64U);
+
+    if (r == 0U) {
+        return ESC;
+    }
+    if (r == 1U) {
+        return (uint8_t)(BKT + prvRandom(6U));
+    }
+    return (uint8_t)prvRandom(256U);
+}
+
+static void prvPutLength(MemStream_t* pPatch, uint32_t length)
+{
+    if (length <= 252U) {
+        prvPut(pPatch, (uint8_t)(length - 1U));
+    } else if (length <= 508U) {
+        prvPut(pPatch, 252U);
+        prvPut(pPatch, (uint8_t)(length - 253U));
+    } else if (length <= 0xFFFFU) {
+        prvPut(pPatch, 253U);
+        prvPut(pPatch, (uint8_t)(length >> 8));
+        prvPut(pPatch, (uint8_t)length);
+    } else {
+        prvPut(pPatch, 254U);
+        prvPut(pPatch, (uint8_t)(length >> 24));
+        prvPut(pPatch, (uint8_t)(length >> 16));
+        prvPut(pPatch, (uint8_t)(length >> 8));
+        prvPut(pPatch, (uint8_t)length);
+    }
+}
+
+/*
+ * MOD and INS data ends at an ESC followed by an operator, so an ESC of the
+ * data is doubled when an operator or ESC byte follows it, or nothing does.
+ */
+static void prvPutData(MemStream_t* pPatch, const uint8_t* pData, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++) {
+        prvPut(pPatch, pData[i]);
+        if ((pData[i] == ESC) && ((i + 1U == length) || ((pData[i + 1U] >= BKT) && (pData[i + 1U] <= ESC)))) {
+            prvPut(pPatch, ESC);
+        }
+    }
+}
+
+static void prvMakeSynthetic(MemStream_t* pOld, MemStream_t* pPatch, MemStream_t* pNew)
+{
+    uint8_t data[512];
+    uint32_t oldPos = 0;
+
+    for (uint32_t i = 0; i < SYNTHETIC_SIZE; i++) {
+        prvPut(pOld, prvRandomByte());
+    }
+
+    while (oldPos < pOld->size) {
+        uint32_t left = (uint32_t)pOld->size - oldPos;
+        uint32_t r    = prvRandom(100U);
+        uint32_t length;
+
+        if (r < 70U) {
+            /* Mostly short runs between relocated addresses, some long and one in a while past 64 KB. */
+            length = 1U + prvRandom((r == 0U) ? 200000U : ((r < 10U) ? 16384U : 1024U));
+            length = (length > left) ? left : length;
+            prvPut(pPatch, ESC);
+            prvPut(pPatch, EQL);
+            prvPutLength(pPatch, length);
+            for (uint32_t i = 0; i < length; i++) {
+                prvPut(pNew, pOld->data[oldPos++]);
+            }
+        } else if (r < 90U) {
+            bool insert = (r >= 82U);
+            length      = 1U + prvRandom(insert ? 512U : 64U);
+            length      = (!insert && (length > left)) ? left : length;
+            for (uint32_t i = 0; i < length; i++) {
+                data[i] = prvRandomByte();
+                prvPut(pNew, data[i]);
+            }
+            prvPut(pPatch, ESC);
+            prvPut(pPatch, insert ? INS : MOD);
+            prvPutData(pPatch, data, length);
+            oldPos += insert ? 0U : length;
+        } else if (r < 96U) {
+            length = 1U + prvRandom(512U);
+            length = (length > left) ? left : length;
+            prvPut(pPatch, ESC);
+            prvPut(pPatch, DEL);
+            prvPutLength(pPatch, length);
+            oldPos += length;
+        } else if (oldPos > 0U) {
+            length = 1U + prvRandom((oldPos < 2048U) ? oldPos : 2048U);
+            prvPut(pPatch, ESC);
+            prvPut(pPatch, BKT);
+            prvPutLength(pPatch, length);
+            oldPos -= length;
+        }
+    }
+}
+
+static bool prvLoad(const char* path, MemStream_t* pStream)
+{
+    FILE* f = fopen(path, "rb");
+    uint8_t chunk[4096];
+    size_t n;
+
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0U) {
+        for (size_t i = 0; i < n; i++) {
+            prvPut(pStream, chunk[i]);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static double prvNowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+/* Applies the patch, checks the output and returns the best time of TIMED_RUNS, a negative time on a mismatch. */
+static double prvCheck(const char* name, Apply_t apply, MemStream_t* pOld, MemStream_t* pPatch, const MemStream_t* pNew,
+                       size_t pageSize)
+{
+    MemStream_t target = { 0 };
+    double best        = -1.0;
+
+    for (int run = 0; run < TIMED_RUNS; run++) {
+        double start = prvNowMs();
+        int result   = apply(pOld, pPatch, &target, pageSize);
+        double time  = prvNowMs() - start;
+
+        if (result != 0) {
+            printf("FAIL %s, %zu byte pages: janpatch returned %d\n", name, pageSize, result);
+            best = -1.0;
+            break;
+        }
+        if ((target.size != pNew->size) || (memcmp(target.data, pNew->data, pNew->size) != 0)) {
+            size_t at = 0;
+            while ((at < target.size) && (at < pNew->size) && (target.data[at] == pNew->data[at])) {
+                at++;
+            }
+            printf("FAIL %s, %zu byte pages: %zu bytes written, %zu expected, first difference at %zu\n", name, pageSize,
+                   target.size, pNew->size, at);
+            best = -1.0;
+            break;
+        }
+        best = ((best < 0.0) || (time < best)) ? time : best;
+    }
+
+    free(target.data);
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    MemStream_t oldImage = { 0 };
+    MemStream_t patch    = { 0 };
+    MemStream_t newImage = { 0 };
+    const size_t pageSizes[] = { DEVICE_PAGE_SIZE, SMALL_PAGE_SIZE };
+    bool ok = true;
+
+    if (argc == 4) {
+        if (!prvLoad(argv[1], &oldImage) || !prvLoad(argv[2], &patch) || !prvLoad(argv[3], &newImage)) {
+            return 2;
+        }
+    } else if (argc == 1) {
+        prvMakeSynthetic(&oldImage, &patch, &newImage);
+    } else {
+        fprintf(stderr, "usage: %s [OLD PATCH NEW]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%s: %zu byte image, %zu byte patch, %zu byte update\n", (argc == 4) ? argv[2] : "synthetic", oldImage.size,
+           patch.size, newImage.size);
+
+    for (size_t i = 0; i < sizeof(pageSizes) / sizeof(pageSizes[0]); i++) {
+        double byteWise = prvCheck("byte-wise", JanpatchApply_ByteWise, &oldImage, &patch, &newImage, pageSizes[i]);
+        double runs     = prvCheck("runs", JanpatchApply_Run, &oldImage, &patch, &newImage, pageSizes[i]);
+
+        if ((byteWise < 0.0) || (runs < 0.0)) {
+            ok = false;
+            continue;
+        }
+        printf("%5zu byte pages: byte-wise %7.2f ms, runs %7.2f ms, %.1fx\n", pageSizes[i], byteWise, runs,
+               byteWise / runs);
+    }
+
+    free(oldImage.data);
+    free(patch.data);
+    free(newImage.data);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "link_sim.h"
+
+static double prvRandom(LinkSim_t* pLink)
+{
+    pLink->random ^= pLink->random << 13;
+    pLink->random ^= pLink->random >> 17;
+    pLink->random ^= pLink->random << 5;
+    return (double)pLink->random / 4294967296.0;
+}
+
+static bool prvDelivered(LinkSim_t* pLink, uint32_t size)
+{
+    bool delivered = true;
+
+    /* Every segment draws, so runs of the same seed stay comparable whatever is lost. */
+    for (uint32_t sent = 0; sent < size; sent += LINK_SEGMENT_SIZE) {
+        delivered &= (prvRandom(pLink) >= pLink->loss);
+    }
+    return delivered;
+}
+
+static bool prvBefore(const LinkMessage_t* a, const LinkMessage_t* b)
+{
+    return (a->atMs < b->atMs) || ((a->atMs == b->atMs) && (a->order < b->order));
+}
+
+void LinkSim_Init(LinkSim_t* pLink, uint32_t seed, double rttMs, double bytesPerS, double loss)
+{
+    *pLink           = (LinkSim_t){ 0 };
+    pLink->random    = (seed * 2654435761U) | 1U;
+    pLink->delayMs   = rttMs / 2.0;
+    pLink->msPerByte = 1000.0 / bytesPerS;
+    pLink->loss      = loss;
+}
+
+void LinkSim_Free(LinkSim_t* pLink)
+{
+    free(pLink->queue);
+    *pLink = (LinkSim_t){ 0 };
+}
+
+bool LinkSim_SendRequest(LinkSim_t* pLink)
+{
+    return prvDelivered(pLink, LINK_REQUEST_SIZE);
+}
+
+void LinkSim_SendMessage(LinkSim_t* pLink, double nowMs, uint32_t blockId, uint32_t offset, uint32_t length)
+{
+    uint32_t size  = length + LINK_MESSAGE_OVERHEAD;
+    double startMs = nowMs + pLink->delayMs;
+    LinkMessage_t message;
+    size_t i;
+
+    /* The request reaches the server after the delay, its answer queues for the downlink. */
+    if (startMs < pLink->freeAtMs) {
+        startMs = pLink->freeAtMs;
+    }
+    pLink->freeAtMs = startMs + size * pLink->msPerByte;
+
+    if (!prvDelivered(pLink, size)) {
+        return;
+    }
+
+    message = (LinkMessage_t){ pLink->freeAtMs + pLink->delayMs, pLink->order++, blockId, offset, length };
+
+    if (pLink->count == pLink->capacity) {
+        pLink->capacity = (pLink->capacity == 0U) ? 64U : pLink->capacity * 2U;
+        if ((pLink->queue = realloc(pLink->queue, pLink->capacity * sizeof(LinkMessage_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+
+    for (i = pLink->count++; (i > 0U) && prvBefore(&message, &pLink->queue[(i - 1U) / 2U]); i = (i - 1U) / 2U) {
+        pLink->queue[i] = pLink->queue[(i - 1U) / 2U];
+    }
+    pLink->queue[i] = message;
+}
+
+bool LinkSim_NextArrival(const LinkSim_t* pLink, double* pAtMs)
+{
+    if (pLink->count == 0U) {
+        return false;
+    }
+    *pAtMs = pLink->queue[0].atMs;
+    return true;
+}
+
+bool LinkSim_Receive(LinkSim_t* pLink, LinkMessage_t* pMessage)
+{
+    LinkMessage_t last;
+    size_t i = 0;
+
+    if (pLink->count == 0U) {
+        return false;
+    }
+
+    *pMessage = pLink->queue[0];
+    last      = pLink->queue[--pLink->count];
+
+    while (2U * i + 1U < pLink->count) {
+        size_t child = 2U * i + 1U;
+
+        if ((child + 1U < pLink->count) && prvBefore(&pLink->queue[child + 1U], &pLink->queue[child])) {
+            child++;
+        }
+        if (!prvBefore(&pLink->queue[child], &last)) {
+            break;
+        }
+        pLink->queue[i] = pLink->queue[child];
+        i               = child;
+    }
+    pLink->queue[i] = last;
+
+    return true;
+}
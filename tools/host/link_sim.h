@@ -0,0 +1,56 @@
+#ifndef LINK_SIM_H
+#define LINK_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* TCP segment a loss applies to, and the bytes a stream message and a request take besides the payload. */
+#define LINK_SEGMENT_SIZE     1460U
+#define LINK_MESSAGE_OVERHEAD 80U
+#define LINK_REQUEST_SIZE     120U
+
+/* A stream message on its way down, carrying length bytes of the file from offset. */
+typedef struct LinkMessage {
+    double atMs;
+    uint64_t order;
+    uint32_t blockId; /* As the stream numbers it, in parts of the size requested */
+    uint32_t offset;
+    uint32_t length;
+} LinkMessage_t;
+
+/*
+ * The link between the device and the broker: half the round trip time each
+ * way and a downlink bandwidth the stream messages queue for. Every TCP segment
+ * is lost with the loss rate, a message with a lost segment is taken as never
+ * delivered, since it arrives after the request timed out.
+ */
+typedef struct LinkSim {
+    uint32_t random;
+    double delayMs;
+    double msPerByte;
+    double loss;
+    double freeAtMs;       /* The downlink is busy sending until then */
+    LinkMessage_t* queue;  /* Min-heap of the messages on their way, by arrival */
+    size_t count;
+    size_t capacity;
+    uint64_t order;
+} LinkSim_t;
+
+void LinkSim_Init(LinkSim_t* pLink, uint32_t seed, double rttMs, double bytesPerS, double loss);
+
+void LinkSim_Free(LinkSim_t* pLink);
+
+/* Sends a request of the device, false when it is lost. */
+bool LinkSim_SendRequest(LinkSim_t* pLink);
+
+/* Answers a request sent at nowMs with length bytes of the file from offset, in one message. */
+void LinkSim_SendMessage(LinkSim_t* pLink, double nowMs, uint32_t blockId, uint32_t offset, uint32_t length);
+
+/* Arrival time of the next message, false when none is on its way. */
+bool LinkSim_NextArrival(const LinkSim_t* pLink, double* pAtMs);
+
+/* Takes the next message to arrive. */
+bool LinkSim_Receive(LinkSim_t* pLink, LinkMessage_t* pMessage);
+
+#endif
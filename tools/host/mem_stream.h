@@ -0,0 +1,21 @@
+#ifndef MEM_STREAM_H
+#define MEM_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A growable in-memory file, the JANPATCH_STREAM of the host checks. */
+typedef struct MemStream {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    size_t position;
+} MemStream_t;
+
+/* Applies pPatch to pSource into pTarget with pages of pageSize bytes. Returns janpatch's result. */
+int JanpatchApply_Run(MemStream_t* pSource, MemStream_t* pPatch, MemStream_t* pTarget, size_t pageSize);
+
+/* The same with the byte by byte copy janpatch used before the runs (JANPATCH_BYTE_COPY). */
+int JanpatchApply_ByteWise(MemStream_t* pSource, MemStream_t* pPatch, MemStream_t* pTarget, size_t pageSize);
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * Compares the time an OTA download takes with a fixed block request size and
+ * with the adaptive size of ota_block_sizer.c, over the simulated lossy link
+ * of link_sim.c.
+ *
+ *     ota_block_bench [-s FILE_SIZE] [-b BLOCK_SIZE] [-m MIN_BLOCK_SIZE] [-w WINDOW]
+ *                     [-t RTT_MS] [-B BYTES_PER_S] [-r RUNS] [LOSS ...]
+ *
+ * ota_block_window.c and ota_block_sizer.c are built as they are. The code
+ * around them follows the OTA agent's main.c: prvRequestDataBlock(),
+ * prvLocateBlockPart(), prvCompleteBlockPart(), prvHandleBlockTimeouts() and
+ * prvRequestMissingParts(). Every LOSS rate of a TCP segment prints the mean
+ * time to complete over RUNS seeds, for each fixed part size and for the
+ * adaptive one.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "link_sim.h"
+#include "ota_block_sizer.h"
+#include "ota_block_window.h"
+
+#define MAX_LOSSES 16
+
+typedef struct Download {
+    BlockWindow_t window;
+    OtaBlockSizer_t sizer;
+    bool adaptive;      /* Sized by the sizer, or always in parts of fixedShift */
+    uint8_t fixedShift;
+    LinkSim_t link;
+    uint32_t fileSize;
+    uint32_t blockSize; /* mqttFileDownloader_CONFIG_BLOCK_SIZE */
+    uint32_t minBlockSize;
+    double nowMs;
+    bool failed;
+} Download_t;
+
+static uint8_t prvShift(const Download_t* pDownload)
+{
+    return pDownload->adaptive ? OtaBlockSizer_Shift(&pDownload->sizer) : pDownload->fixedShift;
+}
+
+static uint8_t prvMaxShift(const Download_t* pDownload)
+{
+    return pDownload->adaptive ? OtaBlockSizer_MaxShift(&pDownload->sizer) : pDownload->fixedShift;
+}
+
+/* prvGetMaxPartShift() */
+static uint8_t prvGetMaxPartShift(uint32_t fileSize, uint32_t blockSize, uint32_t minBlockSize)
+{
+    uint32_t lastByte = (fileSize > 0U) ? fileSize - 1U : 0U;
+    uint8_t shift     = 0;
+
+    while ((shift < OTA_BLOCK_SIZER_MAX_SHIFT) && ((blockSize >> (shift + 1U)) >= minBlockSize) &&
+           ((lastByte / (blockSize >> (shift + 1U))) <= UINT16_MAX)) {
+        shift++;
+    }
+    return shift;
+}
+
+/* prvGetNumOfParts() */
+static uint32_t prvGetNumOfParts(const Download_t* pDownload, uint32_t blockId, uint8_t partShift)
+{
+    uint32_t partSize    = pDownload->blockSize >> partShift;
+    uint32_t blockLength = pDownload->fileSize - (blockId * pDownload->blockSize);
+
+    if (blockLength > pDownload->blockSize) {
+        blockLength = pDownload->blockSize;
+    }
+    return (blockLength + partSize - 1U) / partSize;
+}
+
+/* prvPublishBlockRequest(), the stream service answering it over the link. */
+static void prvPublishBlockRequest(Download_t* pDownload, uint32_t partOffset, uint32_t numOfParts, uint8_t partShift)
+{
+    uint32_t partSize  = pDownload->blockSize >> partShift;
+    uint32_t fileParts = (pDownload->fileSize + partSize - 1U) / partSize;
+
+    if ((partOffset + numOfParts) > fileParts) {
+        numOfParts = fileParts - partOffset;
+    }
+
+    if ((partOffset > UINT16_MAX) || !LinkSim_SendRequest(&pDownload->link)) {
+        return;
+    }
+
+    for (uint32_t part = partOffset; part < partOffset + numOfParts; part++) {
+        uint32_t offset = part * partSize;
+        uint32_t length = ((pDownload->fileSize - offset) > partSize) ? partSize : (pDownload->fileSize - offset);
+
+        LinkSim_SendMessage(&pDownload->link, pDownload->nowMs, part, offset, length);
+    }
+}
+
+/* prvRequestDataBlock(), without the bandwidth governor and the patch stream limit. */
+static void prvRequestDataBlock(Download_t* pDownload)
+{
+    BlockWindow_t* pWindow = &pDownload->window;
+    uint8_t partShift      = prvShift(pDownload);
+    uint32_t limit         = pWindow->numOfBlocks;
+    uint32_t blockOffset   = 0;
+    uint32_t numOfBlocks;
+
+    BlockWindow_SetRequestLimit(pWindow, (partShift != prvMaxShift(pDownload)) && (limit >= pWindow->numOfBlocks)
+                                             ? pWindow->numOfBlocks - 1U
+                                             : limit);
+    numOfBlocks = BlockWindow_ReserveNewBlocks(pWindow, (uint32_t)pDownload->nowMs, partShift, &blockOffset);
+
+    if ((numOfBlocks == 0) && (pWindow->requestLimit < limit)) {
+        partShift = prvMaxShift(pDownload);
+        BlockWindow_SetRequestLimit(pWindow, limit);
+        numOfBlocks = BlockWindow_ReserveNewBlocks(pWindow, (uint32_t)pDownload->nowMs, partShift, &blockOffset);
+    }
+
+    if (numOfBlocks > 0) {
+        prvPublishBlockRequest(pDownload, blockOffset << partShift, numOfBlocks << partShift, partShift);
+    }
+}
+
+/* prvLocateBlockPart() */
+static bool prvLocateBlockPart(const Download_t* pDownload, const LinkMessage_t* pMessage, uint32_t* pOffset)
+{
+    for (uint8_t shift = 0; shift <= prvMaxShift(pDownload); shift++) {
+        uint32_t partSize = pDownload->blockSize >> shift;
+        uint64_t offset   = (uint64_t)pMessage->blockId * partSize;
+        const BlockRequest_t* pRequest;
+        uint32_t part;
+
+        if (offset >= pDownload->fileSize) {
+            continue;
+        }
+
+        pRequest = BlockWindow_GetRequest(&pDownload->window, (uint32_t)(offset / pDownload->blockSize));
+
+        if ((pRequest == NULL) || (pRequest->partShift != shift) ||
+            (pMessage->length !=
+             (((pDownload->fileSize - offset) > partSize) ? partSize : (pDownload->fileSize - offset)))) {
+            continue;
+        }
+
+        part = (uint32_t)(offset % pDownload->blockSize) / partSize;
+
+        if ((pRequest->partsReceived & (1U << part)) != 0U) {
+            return false;
+        }
+        *pOffset = (uint32_t)offset;
+        return true;
+    }
+    return false;
+}
+
+/* prvCompleteBlockPart() */
+static void prvCompleteBlockPart(Download_t* pDownload, uint32_t offset)
+{
+    uint32_t blockId               = offset / pDownload->blockSize;
+    const BlockRequest_t* pRequest = BlockWindow_GetRequest(&pDownload->window, blockId);
+    uint8_t shift                  = pRequest->partShift;
+    uint32_t partSize              = pDownload->blockSize >> shift;
+    uint32_t nowMs                 = (uint32_t)pDownload->nowMs;
+
+    if (!BlockWindow_MarkPartReceived(&pDownload->window, blockId, (offset % pDownload->blockSize) / partSize,
+                                      prvGetNumOfParts(pDownload, blockId, shift))) {
+        return;
+    }
+
+    if (pDownload->adaptive) {
+        OtaBlockSizer_BlockReceived(&pDownload->sizer, shift, (pRequest->retries == 0U) ? (nowMs - pRequest->sentTimeMs) : 0U);
+    }
+    BlockWindow_MarkReceived(&pDownload->window, blockId, nowMs);
+}
+
+/* prvRequestMissingParts() */
+static void prvRequestMissingParts(Download_t* pDownload, uint32_t blockId, const BlockRequest_t* pRequest)
+{
+    uint32_t numOfParts = prvGetNumOfParts(pDownload, blockId, pRequest->partShift);
+    uint32_t first      = 0;
+    uint32_t last       = numOfParts;
+
+    while ((first < last) && ((pRequest->partsReceived & (1U << first)) != 0U)) {
+        first++;
+    }
+    while ((last > first) && ((pRequest->partsReceived & (1U << (last - 1U))) != 0U)) {
+        last--;
+    }
+
+    prvPublishBlockRequest(pDownload, (blockId << pRequest->partShift) + first, last - first, pRequest->partShift);
+}
+
+/* prvHandleBlockTimeouts() */
+static void prvHandleBlockTimeouts(Download_t* pDownload)
+{
+    uint32_t blockIds[BLOCK_WINDOW_MAX_SIZE];
+    bool giveUp      = false;
+    uint32_t expired = BlockWindow_CollectExpiredBlocks(&pDownload->window, (uint32_t)pDownload->nowMs, blockIds, &giveUp);
+
+    if (giveUp) {
+        pDownload->failed = true;
+        return;
+    }
+
+    for (uint32_t i = 0; i < expired; i++) {
+        const BlockRequest_t* pRequest = BlockWindow_GetRequest(&pDownload->window, blockIds[i]);
+
+        if (pDownload->adaptive) {
+            OtaBlockSizer_RequestLost(&pDownload->sizer, pRequest->partShift);
+        }
+        prvRequestMissingParts(pDownload, blockIds[i], pRequest);
+    }
+
+    prvRequestDataBlock(pDownload);
+}
+
+/* Runs the download to its end, returns the time it took in ms, a negative time when it was given up. */
+static double prvDownload(Download_t* pDownload)
+{
+    uint32_t numOfBlocks = (pDownload->fileSize + pDownload->blockSize - 1U) / pDownload->blockSize;
+
+    if (pDownload->adaptive) {
+        OtaBlockSizer_Init(&pDownload->sizer,
+                           prvGetMaxPartShift(pDownload->fileSize, pDownload->blockSize, pDownload->minBlockSize));
+    }
+    if (!BlockWindow_Init(&pDownload->window, numOfBlocks, pDownload->window.windowSize)) {
+        return -1.0;
+    }
+
+    prvRequestDataBlock(pDownload);
+
+    while (!BlockWindow_IsComplete(&pDownload->window) && !pDownload->failed) {
+        double expiryMs = pDownload->nowMs + BlockWindow_NextTimeoutMs(&pDownload->window, (uint32_t)pDownload->nowMs);
+        double arrivalMs;
+
+        if (LinkSim_NextArrival(&pDownload->link, &arrivalMs) && (arrivalMs <= expiryMs)) {
+            LinkMessage_t message;
+            uint32_t offset;
+
+            LinkSim_Receive(&pDownload->link, &message);
+            pDownload->nowMs = message.atMs;
+
+            if (prvLocateBlockPart(pDownload, &message, &offset)) {
+                prvCompleteBlockPart(pDownload, offset);
+            }
+            prvRequestDataBlock(pDownload);
+        } else {
+            pDownload->nowMs = expiryMs;
+            prvHandleBlockTimeouts(pDownload);
+        }
+    }
+
+    BlockWindow_Free(&pDownload->window);
+
+    return pDownload->failed ? -1.0 : pDownload->nowMs;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t fileSize         = 1024U * 1024U;
+    uint32_t blockSize        = 4096U;
+    uint32_t minBlockSize     = 1024U;
+    uint8_t windowSize        = 4U;
+    double rttMs              = 150.0;
+    double bytesPerS          = 64.0 * 1024.0;
+    uint32_t runs             = 5U;
+    double losses[MAX_LOSSES] = { 0.0, 0.005, 0.02, 0.05 };
+    size_t numOfLosses        = 4U;
+    uint8_t maxShift;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:b:m:w:t:B:r:")) != -1) {
+        switch (option) {
+            case 's':
+                fileSize = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                blockSize = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                minBlockSize = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                windowSize = (uint8_t)strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                rttMs = atof(optarg);
+                break;
+            case 'B':
+                bytesPerS = atof(optarg);
+                break;
+            case 'r':
+                runs = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s FILE_SIZE] [-b BLOCK_SIZE] [-m MIN_BLOCK_SIZE] [-w WINDOW] [-t RTT_MS] "
+                                "[-B BYTES_PER_S] [-r RUNS] [LOSS ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind < argc) {
+        for (numOfLosses = 0; (optind < argc) && (numOfLosses < MAX_LOSSES); optind++) {
+            losses[numOfLosses++] = atof(argv[optind]);
+        }
+    }
+
+    maxShift = prvGetMaxPartShift(fileSize, blockSize, minBlockSize);
+
+    printf("%u KB file, %u byte blocks, window %u, %.0f ms round trip, %.0f KB/s down\n", fileSize / 1024U, blockSize,
+           windowSize, rttMs, bytesPerS / 1024.0);
+    printf("%-8s", "loss");
+    for (uint8_t shift = 0; shift <= maxShift; shift++) {
+        char label[16];
+
+        snprintf(label, sizeof(label), "fixed %u", blockSize >> shift);
+        printf("%16s", label);
+    }
+    printf("%16s\n", "adaptive");
+
+    for (size_t l = 0; l < numOfLosses; l++) {
+        printf("%5.1f%%  ", losses[l] * 100.0);
+
+        /* The fixed sizes, then the sizer. */
+        for (uint8_t column = 0; column <= maxShift + 1U; column++) {
+            double totalMs = 0.0;
+            uint32_t done  = 0;
+            char cell[32];
+            int length;
+
+            for (uint32_t run = 0; run < runs; run++) {
+                Download_t download = {
+                    .adaptive     = (column > maxShift),
+                    .fixedShift   = column,
+                    .fileSize     = fileSize,
+                    .blockSize    = blockSize,
+                    .minBlockSize = minBlockSize,
+                };
+                double timeMs;
+
+                download.window.windowSize = windowSize;
+                LinkSim_Init(&download.link, run + 1U, rttMs, bytesPerS, losses[l]);
+                timeMs = prvDownload(&download);
+                LinkSim_Free(&download.link);
+
+                if (timeMs >= 0.0) {
+                    totalMs += timeMs;
+                    done++;
+                }
+            }
+
+            length = (done > 0U) ? snprintf(cell, sizeof(cell), "%.1f s", totalMs / done / 1000.0)
+                                 : snprintf(cell, sizeof(cell), "failed");
+            if (done < runs) {
+                snprintf(cell + length, sizeof(cell) - (size_t)length, " (%u/%u)", done, runs);
+            }
+            printf("%16s", cell);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
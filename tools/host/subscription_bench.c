@@ -0,0 +1,365 @@
+/*
+ * Compares the cost of dispatching a publish with the linear scan the
+ * subscription manager used to do and with the topic trie of
+ * mqtt_subscription_manager.c, as the number of subscriptions grows.
+ *
+ *     subscription_bench [-t TOPICS] [-w WILDCARDS] [-s SEED] [COUNT ...]
+ *
+ * The trie is built as it is, with pools large enough for the largest COUNT.
+ * The subscriptions are device-like filters: jobs, certificate and stream
+ * topics of a thing, with job and stream ids to reach the count, and a share
+ * of WILDCARDS percent with a '+' or '#' level. The topics published are made
+ * from the filters, plus a fifth that match none.
+ *
+ * Before timing, every topic is dispatched with fan out and has to reach
+ * the same subscriptions as scanning the whole list, then again after half
+ * the subscriptions are removed. The scan matches with prvMatchTopic(), the
+ * rules of MQTT_MatchTopic(), as coreMQTT is not part of the tree.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mqtt_subscription_manager.h"
+
+#define THING      "esp32-cam-a1b2c3"
+#define MAX_FILTER 128U
+#define MAX_COUNTS 16
+
+typedef struct Filter {
+    char filter[MAX_FILTER];
+    uint16_t length;
+    bool subscribed;
+} Filter_t;
+
+static const char* const templates[] = {
+    "$aws/things/" THING "/jobs/notify-next",
+    "$aws/things/" THING "/jobs/%08x/update/accepted",
+    "$aws/things/" THING "/jobs/%08x/update/rejected",
+    "$aws/things/" THING "/streams/%08x/data/cbor",
+    "$aws/things/" THING "/streams/%08x/rejected/cbor",
+    "things/" THING "/certificate/create-from-csr/json/accepted",
+    "things/" THING "/certificate/revoke/json/%08x",
+    "camera/" THING "/%08x/frames",
+};
+
+static uint32_t prvRandomState;
+
+/* Callbacks reached by the last dispatch, by subscription index. */
+static uint32_t prvMatched[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
+static uint32_t prvNumOfMatched;
+
+static uint32_t prvRandom(void)
+{
+    prvRandomState ^= prvRandomState << 13;
+    prvRandomState ^= prvRandomState >> 17;
+    prvRandomState ^= prvRandomState << 5;
+    return prvRandomState;
+}
+
+static void prvCallback(void* pContext, MQTTPublishInfo_t* pPublishInfo)
+{
+    (void)pPublishInfo;
+    prvMatched[prvNumOfMatched++] = (uint32_t)(uintptr_t)pContext;
+}
+
+/*
+ * MQTT 3.1.1 section 4.7: '+' matches one level, '#' the rest of the topic
+ * and its parent level, and a filter starting with a wildcard does not match
+ * a topic starting with '$'.
+ */
+static bool prvMatchTopic(const char* pTopic, uint16_t topicLength, const char* pFilter, uint16_t filterLength)
+{
+    uint16_t t = 0;
+    uint16_t f = 0;
+
+    if ((topicLength > 0U) && (pTopic[0] == '$') && (filterLength > 0U) && ((pFilter[0] == '+') || (pFilter[0] == '#'))) {
+        return false;
+    }
+
+    while (f < filterLength) {
+        if (pFilter[f] == '#') {
+            return true;
+        }
+
+        if (pFilter[f] == '+') {
+            while ((t < topicLength) && (pTopic[t] != '/')) {
+                t++;
+            }
+            f++;
+        } else {
+            while ((f < filterLength) && (pFilter[f] != '/')) {
+                if ((t >= topicLength) || (pTopic[t] != pFilter[f])) {
+                    return false;
+                }
+                t++;
+                f++;
+            }
+        }
+
+        if (f == filterLength) {
+            return t == topicLength;
+        }
+        if (t == topicLength) {
+            return (f + 2U == filterLength) && (pFilter[f + 1U] == '#');
+        }
+        if (pTopic[t] != '/') {
+            return false;
+        }
+        t++;
+        f++;
+    }
+
+    return t == topicLength;
+}
+
+/* SubscriptionManager_HandleIncomingPublishes() before the trie, up to the first match unless fanning out. */
+static bool prvLinearDispatch(const Filter_t* pFilters, uint32_t count, MQTTPublishInfo_t* pPublishInfo, bool fanOut)
+{
+    bool handled = false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (pFilters[i].subscribed &&
+            prvMatchTopic(pPublishInfo->pTopicName, pPublishInfo->topicNameLength, pFilters[i].filter, pFilters[i].length)) {
+            prvCallback((void*)(uintptr_t)i, pPublishInfo);
+            handled = true;
+            if (!fanOut) {
+                break;
+            }
+        }
+    }
+    return handled;
+}
+
+static void prvMakeFilters(Filter_t* pFilters, uint32_t count, uint32_t wildcards)
+{
+    for (uint32_t made = 0; made < count;) {
+        Filter_t* pFilter = &pFilters[made];
+        bool duplicate    = false;
+        int length        = snprintf(pFilter->filter, MAX_FILTER, templates[prvRandom() % 8U], prvRandom());
+
+        if ((prvRandom() % 100U) < wildcards) {
+            uint32_t levels = 0;
+            uint32_t level;
+            char* pLevel;
+
+            for (int i = 0; i < length; i++) {
+                levels += (pFilter->filter[i] == '/') ? 1U : 0U;
+            }
+
+            /* A level other than the first becomes '+', or '#' ending the filter. */
+            level  = 1U + prvRandom() % levels;
+            pLevel = pFilter->filter;
+            for (uint32_t i = 0; i < level; i++) {
+                pLevel = strchr(pLevel, '/') + 1;
+            }
+
+            if ((prvRandom() % 2U) == 0U) {
+                char* pEnd = strchr(pLevel, '/');
+
+                memmove(pLevel + 1, (pEnd != NULL) ? pEnd : pLevel + strlen(pLevel), (pEnd != NULL) ? strlen(pEnd) + 1U : 1U);
+                *pLevel = '+';
+            } else {
+                pLevel[0] = '#';
+                pLevel[1] = '\0';
+            }
+            length = (int)strlen(pFilter->filter);
+        }
+
+        pFilter->length     = (uint16_t)length;
+        pFilter->subscribed = true;
+
+        for (uint32_t i = 0; (i < made) && !duplicate; i++) {
+            duplicate = (strcmp(pFilters[i].filter, pFilter->filter) == 0);
+        }
+        made += duplicate ? 0U : 1U;
+    }
+}
+
+/* A topic of one of the filters, its wildcards filled in, or one a fifth of the time that matches none. */
+static void prvMakeTopic(const Filter_t* pFilters, uint32_t count, char* pTopic)
+{
+    const char* pFilter = pFilters[prvRandom() % count].filter;
+
+    if ((prvRandom() % 5U) == 0U) {
+        sprintf(pTopic, "$aws/things/" THING "/jobs/%08x/get/accepted", prvRandom());
+        return;
+    }
+
+    for (; *pFilter != '\0'; pFilter++) {
+        if (*pFilter == '+') {
+            pTopic += sprintf(pTopic, "%08x", prvRandom());
+        } else if ((*pFilter == '#') && ((prvRandom() % 2U) == 0U)) {
+            pTopic += sprintf(pTopic, "%08x/data", prvRandom());
+        } else if (*pFilter == '#') {
+            /* '#' also matches the level it follows. */
+            pTopic--;
+        } else {
+            *pTopic++ = *pFilter;
+        }
+    }
+    *pTopic = '\0';
+}
+
+static int prvCompare(const void* a, const void* b)
+{
+    return (*(const uint32_t*)a > *(const uint32_t*)b) - (*(const uint32_t*)a < *(const uint32_t*)b);
+}
+
+/* Dispatches every topic with fan out through both, they have to reach the same subscriptions. */
+static bool prvCrossCheck(SubscriptionManager_t* pManager, const Filter_t* pFilters, uint32_t count, char (*pTopics)[MAX_FILTER * 2U],
+                          uint32_t numOfTopics)
+{
+    uint32_t expected[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
+
+    for (uint32_t i = 0; i < numOfTopics; i++) {
+        MQTTPublishInfo_t publishInfo = { .pTopicName = pTopics[i], .topicNameLength = (uint16_t)strlen(pTopics[i]) };
+        uint32_t numOfExpected;
+        bool handled;
+
+        prvNumOfMatched = 0;
+        prvLinearDispatch(pFilters, count, &publishInfo, true);
+        numOfExpected = prvNumOfMatched;
+        memcpy(expected, prvMatched, numOfExpected * sizeof(uint32_t));
+
+        prvNumOfMatched = 0;
+        handled         = SubscriptionManager_HandleIncomingPublishes(pManager, &publishInfo);
+        qsort(prvMatched, prvNumOfMatched, sizeof(uint32_t), prvCompare);
+
+        if ((handled != (numOfExpected > 0U)) || (prvNumOfMatched != numOfExpected) ||
+            (memcmp(prvMatched, expected, numOfExpected * sizeof(uint32_t)) != 0)) {
+            printf("FAIL %s: the trie reached %u subscriptions, the scan %u\n", pTopics[i], prvNumOfMatched, numOfExpected);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double prvNowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/* Mean time of a dispatch to the first match in ns, through the trie or, without pManager, the scan. */
+static double prvTimeDispatch(SubscriptionManager_t* pManager, const Filter_t* pFilters, uint32_t count,
+                              char (*pTopics)[MAX_FILTER * 2U], uint32_t numOfTopics)
+{
+    const uint32_t rounds = 20U;
+    double startNs        = prvNowNs();
+
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < numOfTopics; i++) {
+            MQTTPublishInfo_t publishInfo = { .pTopicName = pTopics[i], .topicNameLength = (uint16_t)strlen(pTopics[i]) };
+
+            prvNumOfMatched = 0;
+            if (pManager != NULL) {
+                SubscriptionManager_HandleIncomingPublishes(pManager, &publishInfo);
+            } else {
+                prvLinearDispatch(pFilters, count, &publishInfo, false);
+            }
+        }
+    }
+
+    return (prvNowNs() - startNs) / (rounds * numOfTopics);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t counts[MAX_COUNTS] = { 4U, 8U, 16U, 32U, 64U, 128U, 256U, 512U };
+    uint32_t numOfCounts        = 8U;
+    uint32_t numOfTopics        = 2000U;
+    uint32_t wildcards          = 10U;
+    uint32_t seed               = 1U;
+    SubscriptionManager_t* pTrie    = malloc(sizeof(SubscriptionManager_t));
+    SubscriptionManager_t* pFanOut  = malloc(sizeof(SubscriptionManager_t));
+    Filter_t* pFilters              = malloc(SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS * sizeof(Filter_t));
+    char (*pTopics)[MAX_FILTER * 2U];
+    int option;
+
+    while ((option = getopt(argc, argv, "t:w:s:")) != -1) {
+        switch (option) {
+            case 't':
+                numOfTopics = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                wildcards = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t TOPICS] [-w WILDCARDS] [-s SEED] [COUNT ...]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind < argc) {
+        for (numOfCounts = 0; (optind < argc) && (numOfCounts < MAX_COUNTS); optind++) {
+            counts[numOfCounts] = (uint32_t)strtoul(argv[optind], NULL, 0);
+            if ((counts[numOfCounts] == 0U) || (counts[numOfCounts] > SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS)) {
+                fprintf(stderr, "COUNT is 1 to %u\n", SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS);
+                return 2;
+            }
+            numOfCounts++;
+        }
+    }
+
+    pTopics = malloc(numOfTopics * sizeof(*pTopics));
+    if ((pTrie == NULL) || (pFanOut == NULL) || (pFilters == NULL) || (pTopics == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    printf("%-6s %12s %12s\n", "subs", "linear ns", "trie ns");
+
+    for (uint32_t c = 0; c < numOfCounts; c++) {
+        uint32_t count = counts[c];
+
+        prvRandomState = seed * 2654435761U | 1U;
+        prvMakeFilters(pFilters, count, wildcards);
+        for (uint32_t i = 0; i < numOfTopics; i++) {
+            prvMakeTopic(pFilters, count, pTopics[i]);
+        }
+
+        SubscriptionManager_Init(pTrie, false);
+        SubscriptionManager_Init(pFanOut, true);
+        for (uint32_t i = 0; i < count; i++) {
+            if (!SubscriptionManager_AddSubscription(pTrie, pFilters[i].filter, pFilters[i].length, prvCallback,
+                                                     (void*)(uintptr_t)i) ||
+                !SubscriptionManager_AddSubscription(pFanOut, pFilters[i].filter, pFilters[i].length, prvCallback,
+                                                     (void*)(uintptr_t)i)) {
+                printf("FAIL no room for %u subscriptions\n", count);
+                return 1;
+            }
+        }
+
+        if (!prvCrossCheck(pFanOut, pFilters, count, pTopics, numOfTopics)) {
+            return 1;
+        }
+
+        printf("%-6u %12.1f %12.1f\n", count, prvTimeDispatch(NULL, pFilters, count, pTopics, numOfTopics),
+               prvTimeDispatch(pTrie, pFilters, count, pTopics, numOfTopics));
+
+        /* Levels left by removed filters are pruned, the rest still dispatches the same. */
+        for (uint32_t i = 0; i < count; i += 2U) {
+            SubscriptionManager_RemoveSubscription(pFanOut, pFilters[i].filter, pFilters[i].length);
+            pFilters[i].subscribed = false;
+        }
+        if (!prvCrossCheck(pFanOut, pFilters, count, pTopics, numOfTopics)) {
+            return 1;
+        }
+    }
+
+    free(pTrie);
+    free(pFanOut);
+    free(pFilters);
+    free(pTopics);
+
+    return 0;
+}
@@ -0,0 +1,469 @@
+#!/usr/bin/env python3
+"""
+Makes and applies hsdiff patches, the compressed delta format applied by
+Components/tasks/ota_agent/src/ota_hsdiff.c, compresses full images for
+ota_heatshrink.c, and compares both with full images and JojoDiff patches
+over consecutive builds of the firmware.
+
+    hsdiff.py diff OLD NEW PATCH [-w WINDOW] [-l LOOKAHEAD]
+    hsdiff.py apply OLD PATCH NEW
+    hsdiff.py compress IMAGE IMAGE.bin.hs [-w WINDOW] [-l LOOKAHEAD]
+    hsdiff.py decompress IMAGE.bin.hs IMAGE
+    hsdiff.py bench BUILD1.bin BUILD2.bin [BUILD3.bin ...]
+
+A patch is a 16 byte header followed by a heatshrink stream of bsdiff records,
+see include/ota_hsdiff.h. A compressed image is a 12 byte header followed by
+the heatshrink compressed image, see include/ota_heatshrink.h. The device
+needs 2^WINDOW bytes to decode either.
+"""
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+MAGIC = b"HSDF"
+VERSION = 1
+HEADER = struct.Struct("<4sBBBBII")
+IMAGE_MAGIC = b"HSIM"
+IMAGE_HEADER = struct.Struct("<4sBBBBI")
+
+DEFAULT_WINDOW = 11
+DEFAULT_LOOKAHEAD = 4
+
+# Bytes hashed to find matches in the old image.
+BLOCK = 8
+# Mismatches allowed in a diff span before it is cut, see prv_extend().
+MISMATCH_SCORE = 8
+# Earlier positions of the same bytes tried by the compressor.
+CHAIN_LENGTH = 32
+
+
+def write_varint(out, value):
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return
+
+
+def zigzag(value):
+    return (value << 1) if value >= 0 else ((-value - 1) << 1) | 1
+
+
+class VarintReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.data[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                return value
+            shift += 7
+
+    def take(self, length):
+        chunk = self.data[self.pos:self.pos + length]
+        if len(chunk) != length:
+            raise ValueError("truncated patch")
+        self.pos += length
+        return chunk
+
+
+# ---------------------------------------------------------------------------
+# bsdiff records
+# ---------------------------------------------------------------------------
+
+def build_index(old):
+    index = {}
+    for pos in range(0, len(old) - BLOCK + 1):
+        index.setdefault(old[pos:pos + BLOCK], pos)
+    return index
+
+
+def match_length(old, old_pos, new, new_pos):
+    length = 0
+    limit = min(len(old) - old_pos, len(new) - new_pos)
+    while length < limit and old[old_pos + length] == new[new_pos + length]:
+        length += 1
+    return length
+
+
+def prv_extend(old, old_pos, new, new_pos, limit):
+    """Length of the approximate match from the positions, bsdiff style:
+    the span goes on while matches outnumber the mismatches."""
+    best = 0
+    score = 0
+    best_score = 0
+    length = 0
+    while length < limit and old_pos + length < len(old) and new_pos + length < len(new):
+        score += 1 if old[old_pos + length] == new[new_pos + length] else -MISMATCH_SCORE
+        length += 1
+        if score > best_score:
+            best_score = score
+            best = length
+        if score < best_score - 4 * MISMATCH_SCORE:
+            break
+    return best
+
+
+def find_match(index, old, new, scan, preferred):
+    """Next position of new from scan with a block found in old, as (old, new).
+    A match at preferred, where the current record would continue, wins."""
+    for pos in range(scan, len(new) - BLOCK + 1):
+        key = new[pos:pos + BLOCK]
+        candidate = index.get(key)
+        if candidate is None:
+            continue
+        continued = preferred + (pos - scan)
+        if old[continued:continued + BLOCK] == key:
+            candidate = continued
+        return candidate, pos
+    return None
+
+
+def make_records(old, new):
+    """Returns (diff, extra, adjustment) records rebuilding new from old."""
+    index = build_index(old)
+    records = []
+    old_pos = 0
+    new_pos = 0
+
+    while True:
+        # The diff span is the exact match followed by its approximate extension.
+        exact = match_length(old, old_pos, new, new_pos)
+        scan = new_pos + exact
+        found = find_match(index, old, new, scan, old_pos + exact)
+        match_old, match_new = found if found is not None else (len(old), len(new))
+        diff_length = exact + prv_extend(old, old_pos + exact, new, scan, match_new - scan)
+
+        # Grow the next match backward over the rest of the gap.
+        while (found is not None and match_new > new_pos + diff_length and match_old > 0 and
+               old[match_old - 1] == new[match_new - 1]):
+            match_old -= 1
+            match_new -= 1
+
+        diff = bytes((new[new_pos + i] - old[old_pos + i]) & 0xFF for i in range(diff_length))
+        extra = new[new_pos + diff_length:match_new]
+        records.append((diff, extra, match_old - (old_pos + diff_length)))
+
+        if found is None:
+            return records
+        old_pos = match_old
+        new_pos = match_new
+
+
+def serialize_records(records):
+    out = bytearray()
+    for i, (diff, extra, adjust) in enumerate(records):
+        write_varint(out, len(diff))
+        out += diff
+        write_varint(out, len(extra))
+        out += extra
+        if i != len(records) - 1:
+            write_varint(out, zigzag(adjust))
+    return bytes(out)
+
+
+def apply_records(old, stream, target_size):
+    reader = VarintReader(stream)
+    new = bytearray()
+    old_pos = 0
+    while len(new) < target_size:
+        diff_length = reader.varint()
+        if old_pos + diff_length > len(old) or len(new) + diff_length > target_size:
+            raise ValueError("diff out of bounds")
+        diff = reader.take(diff_length)
+        new += bytes((diff[i] + old[old_pos + i]) & 0xFF for i in range(diff_length))
+        old_pos += diff_length
+        extra_length = reader.varint()
+        if len(new) + extra_length > target_size:
+            raise ValueError("extra out of bounds")
+        new += reader.take(extra_length)
+        if len(new) == target_size:
+            break
+        adjust = reader.varint()
+        old_pos += (adjust >> 1) if not adjust & 1 else -((adjust >> 1) + 1)
+        if not 0 <= old_pos <= len(old):
+            raise ValueError("source position out of bounds")
+    return bytes(new)
+
+
+# ---------------------------------------------------------------------------
+# heatshrink
+# ---------------------------------------------------------------------------
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.byte = 0
+        self.bits = 0
+
+    def put(self, value, count):
+        for shift in range(count - 1, -1, -1):
+            self.byte = (self.byte << 1) | ((value >> shift) & 1)
+            self.bits += 1
+            if self.bits == 8:
+                self.out.append(self.byte)
+                self.byte = 0
+                self.bits = 0
+
+    def finish(self):
+        if self.bits:
+            self.out.append(self.byte << (8 - self.bits))
+        return bytes(self.out)
+
+
+def heatshrink_encode(data, window, lookahead):
+    """Greedy LZSS with the bit layout of heatshrink: 1 + 8 bit literal, or
+    0 + WINDOW bit distance - 1 + LOOKAHEAD bit count - 1."""
+    max_distance = 1 << window
+    max_count = 1 << lookahead
+    # A back-reference only pays off beyond this many bytes.
+    min_count = (1 + window + lookahead) // 9 + 1
+    writer = BitWriter()
+    chains = {}
+    pos = 0
+
+    while pos < len(data):
+        best_count = 0
+        best_distance = 0
+        if pos + min_count <= len(data):
+            key = data[pos:pos + min_count]
+            for candidate in reversed(chains.get(key, ())[-CHAIN_LENGTH:]):
+                distance = pos - candidate
+                if distance > max_distance:
+                    break
+                count = 0
+                # Overlapping copies are fine, the decoder copies byte by byte.
+                while (count < max_count and pos + count < len(data) and
+                       data[candidate + count] == data[pos + count]):
+                    count += 1
+                if count > best_count:
+                    best_count = count
+                    best_distance = distance
+                    if count == max_count:
+                        break
+
+        if best_count < min_count:
+            step = 1
+            writer.put(1, 1)
+            writer.put(data[pos], 8)
+        else:
+            step = best_count
+            writer.put(0, 1)
+            writer.put(best_distance - 1, window)
+            writer.put(best_count - 1, lookahead)
+
+        for i in range(pos, pos + step):
+            if i + min_count <= len(data):
+                chain = chains.setdefault(data[i:i + min_count], [])
+                chain.append(i)
+                if len(chain) > 2 * CHAIN_LENGTH:
+                    del chain[:CHAIN_LENGTH]
+        pos += step
+
+    return writer.finish()
+
+
+def heatshrink_decode(data, window, lookahead):
+    out = bytearray()
+    bit_pos = 0
+    total = len(data) * 8
+
+    def bits(count):
+        nonlocal bit_pos
+        if bit_pos + count > total:
+            return None
+        value = 0
+        for _ in range(count):
+            value = (value << 1) | ((data[bit_pos >> 3] >> (7 - (bit_pos & 7))) & 1)
+            bit_pos += 1
+        return value
+
+    while True:
+        tag = bits(1)
+        if tag is None:
+            break
+        if tag:
+            literal = bits(8)
+            if literal is None:
+                break
+            out.append(literal)
+        else:
+            index = bits(window)
+            count = bits(lookahead)
+            if index is None or count is None:
+                break
+            for _ in range(count + 1):
+                out.append(out[-(index + 1)] if index < len(out) else 0)
+    return bytes(out)
+
+
+# ---------------------------------------------------------------------------
+# Commands
+# ---------------------------------------------------------------------------
+
+def check_parameters(window, lookahead):
+    if not 4 <= window <= 12 or not 3 <= lookahead < window:
+        raise ValueError("window must be 4..12 and lookahead 3..window - 1")
+
+
+def diff(old, new, window=DEFAULT_WINDOW, lookahead=DEFAULT_LOOKAHEAD):
+    check_parameters(window, lookahead)
+    stream = serialize_records(make_records(old, new))
+    header = HEADER.pack(MAGIC, VERSION, window, lookahead, 0, len(old), len(new))
+    return header + heatshrink_encode(stream, window, lookahead)
+
+
+def apply(old, patch):
+    magic, version, window, lookahead, _, source_size, target_size = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not an hsdiff patch")
+    if source_size != len(old):
+        raise ValueError("patch made from a %d byte image, not %d" % (source_size, len(old)))
+    stream = heatshrink_decode(patch[HEADER.size:], window, lookahead)
+    return apply_records(old, stream, target_size)
+
+
+def compress(image, window=DEFAULT_WINDOW, lookahead=DEFAULT_LOOKAHEAD):
+    check_parameters(window, lookahead)
+    header = IMAGE_HEADER.pack(IMAGE_MAGIC, VERSION, window, lookahead, 0, len(image))
+    return header + heatshrink_encode(image, window, lookahead)
+
+
+def decompress(data):
+    magic, version, window, lookahead, _, size = IMAGE_HEADER.unpack_from(data)
+    if magic != IMAGE_MAGIC or version != VERSION:
+        raise ValueError("not a compressed image")
+    image = heatshrink_decode(data[IMAGE_HEADER.size:], window, lookahead)
+    if len(image) < size:
+        raise ValueError("truncated image")
+    return image[:size]
+
+
+def jdiff_size(old_path, new_path):
+    jdiff = shutil.which("jdiff")
+    if jdiff is None:
+        return None
+    with tempfile.NamedTemporaryFile() as patch:
+        subprocess.run([jdiff, old_path, new_path, patch.name], stdout=subprocess.DEVNULL, check=False)
+        return os.path.getsize(patch.name)
+
+
+def bench(paths, window, lookahead):
+    print("%-28s %9s %9s %7s %9s %7s %9s %7s %8s %8s" %
+          ("update", "full", ".bin.hs", "ratio", "hsdiff", "ratio", "jdiff", "ratio", "diff s", "apply s"))
+    for old_path, new_path in zip(paths, paths[1:]):
+        with open(old_path, "rb") as f:
+            old = f.read()
+        with open(new_path, "rb") as f:
+            new = f.read()
+
+        start = time.monotonic()
+        patch = diff(old, new, window, lookahead)
+        diff_time = time.monotonic() - start
+        start = time.monotonic()
+        if apply(old, patch) != new:
+            raise SystemExit("%s -> %s: patch does not rebuild the image" % (old_path, new_path))
+        apply_time = time.monotonic() - start
+
+        compressed = compress(new, window, lookahead)
+        if decompress(compressed) != new:
+            raise SystemExit("%s: compressed image does not decompress" % new_path)
+
+        jsize = jdiff_size(old_path, new_path)
+        name = "%s -> %s" % (os.path.basename(old_path), os.path.basename(new_path))
+        print("%-28s %9d %9d %6.1f%% %9d %6.1f%% %9s %6s %8.2f %8.2f" % (
+            name[-28:], len(new), len(compressed), 100.0 * len(compressed) / len(new),
+            len(patch), 100.0 * len(patch) / len(new),
+            "-" if jsize is None else jsize,
+            "-" if jsize is None else "%.1f%%" % (100.0 * jsize / len(new)),
+            diff_time, apply_time))
+
+    print("Device RAM to apply hsdiff: %d byte window + decoder buffers; "
+          "janpatch: 3 pages (CONFIG_OTA_AGENT_PATCH_PAGE_SIZE)" % (1 << window))
+    print("Apply times on the device are logged by delta_ota.c when the patch completes.")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("diff", help="make a patch")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("patch")
+    p.add_argument("-w", "--window", type=int, default=DEFAULT_WINDOW, help="heatshrink window, log2")
+    p.add_argument("-l", "--lookahead", type=int, default=DEFAULT_LOOKAHEAD, help="heatshrink lookahead, log2")
+
+    p = sub.add_parser("apply", help="rebuild an image from a patch")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("new")
+
+    p = sub.add_parser("compress", help="compress a full image")
+    p.add_argument("image")
+    p.add_argument("output")
+    p.add_argument("-w", "--window", type=int, default=DEFAULT_WINDOW, help="heatshrink window, log2")
+    p.add_argument("-l", "--lookahead", type=int, default=DEFAULT_LOOKAHEAD, help="heatshrink lookahead, log2")
+
+    p = sub.add_parser("decompress", help="decompress a full image")
+    p.add_argument("input")
+    p.add_argument("image")
+
+    p = sub.add_parser("bench", help="compare patch sizes over consecutive builds")
+    p.add_argument("builds", nargs="+")
+    p.add_argument("-w", "--window", type=int, default=DEFAULT_WINDOW)
+    p.add_argument("-l", "--lookahead", type=int, default=DEFAULT_LOOKAHEAD)
+
+    args = parser.parse_args()
+
+    if args.command == "diff":
+        with open(args.old, "rb") as f:
+            old = f.read()
+        with open(args.new, "rb") as f:
+            new = f.read()
+        patch = diff(old, new, args.window, args.lookahead)
+        with open(args.patch, "wb") as f:
+            f.write(patch)
+        print("%s: %d bytes, %.1f%% of the image" % (args.patch, len(patch), 100.0 * len(patch) / max(len(new), 1)))
+    elif args.command == "apply":
+        with open(args.old, "rb") as f:
+            old = f.read()
+        with open(args.patch, "rb") as f:
+            patch = f.read()
+        with open(args.new, "wb") as f:
+            f.write(apply(old, patch))
+    elif args.command == "compress":
+        with open(args.image, "rb") as f:
+            image = f.read()
+        data = compress(image, args.window, args.lookahead)
+        with open(args.output, "wb") as f:
+            f.write(data)
+        print("%s: %d bytes, %.1f%% of the image" % (args.output, len(data), 100.0 * len(data) / max(len(image), 1)))
+    elif args.command == "decompress":
+        with open(args.input, "rb") as f:
+            data = f.read()
+        with open(args.image, "wb") as f:
+            f.write(decompress(data))
+    else:
+        if len(args.builds) < 2:
+            parser.error("bench needs at least two builds")
+        bench(args.builds, args.window, args.lookahead)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Builds the chunk manifest of a full image, read by
+Components/tasks/ota_agent/src/ota_manifest.c, and simulates how much of the
+image devices running other versions copy instead of downloading.
+
+    ota_manifest.py build IMAGE MANIFEST [-c CHUNK_SIZE]
+    ota_manifest.py simulate BUILD1.bin BUILD2.bin [BUILD3.bin ...] [-c CHUNK_SIZE]
+
+The manifest is uploaded as a second file of the OTA stream and named in the
+job document next to the image:
+
+    "files": [{ ..., "fileid": 0, "manifest": {"fileid": 1, "filesize": 5416} }]
+
+The chunk size must be a multiple of the stream block size of the device,
+mqttFileDownloader_CONFIG_BLOCK_SIZE, or the device downloads the whole image.
+simulate reports, for every ordered pair of builds, the bytes a device running
+the first one downloads to update to the second one.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"OTAM"
+VERSION = 1
+HEADER = struct.Struct("<4sBBHII")
+ENTRY = struct.Struct("<I8s")
+
+DEFAULT_CHUNK_SIZE = 4096
+# Largest manifest the device accepts, OTA_MANIFEST_MAX_SIZE.
+MAX_MANIFEST_SIZE = 16 * 1024
+
+
+def checksum(data):
+    """rsync rolling checksum: a is the sum of the bytes, b the sum of the a values."""
+    a = sum(data) & 0xFFFF
+    b = sum((len(data) - i) * x for i, x in enumerate(data)) & 0xFFFF
+    return a | (b << 16)
+
+
+def strong(data):
+    return hashlib.sha256(data).digest()[:8]
+
+
+def build(image, chunk_size=DEFAULT_CHUNK_SIZE):
+    if chunk_size & (chunk_size - 1) or not 1024 <= chunk_size <= 65536:
+        raise ValueError("the chunk size must be a power of two from 1 KB to 64 KB")
+
+    chunks = [image[i:i + chunk_size] for i in range(0, len(image), chunk_size)]
+    out = bytearray(HEADER.pack(MAGIC, VERSION, chunk_size.bit_length() - 1, 0, len(image), len(chunks)))
+    for chunk in chunks:
+        out += ENTRY.pack(checksum(chunk), strong(chunk))
+
+    if len(out) > MAX_MANIFEST_SIZE:
+        raise ValueError("manifest of %d bytes is larger than the %d bytes the device accepts" %
+                         (len(out), MAX_MANIFEST_SIZE))
+    return bytes(out)
+
+
+def parse(manifest):
+    magic, version, chunk_bits, _, image_size, count = HEADER.unpack_from(manifest)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a chunk manifest")
+    entries = [ENTRY.unpack_from(manifest, HEADER.size + i * ENTRY.size) for i in range(count)]
+    return 1 << chunk_bits, image_size, entries
+
+
+def find_chunks(manifest, running):
+    """Same search as OtaManifest_FindChunks(): the rolling checksum of every
+    window of the running image is looked up, matches are confirmed with the
+    hash. Returns the offset of each chunk in the running image, or None."""
+    chunk_size, image_size, entries = parse(manifest)
+    offsets = [None] * len(entries)
+    wanted = {}
+    for index, (weak, _) in enumerate(entries):
+        if min(chunk_size, image_size - index * chunk_size) == chunk_size:
+            wanted.setdefault(weak, []).append(index)
+
+    if len(running) < chunk_size or not wanted:
+        return offsets
+
+    a = sum(running[:chunk_size]) & 0xFFFF
+    b = sum((chunk_size - i) * x for i, x in enumerate(running[:chunk_size])) & 0xFFFF
+    position = 0
+    while True:
+        candidates = wanted.get(a | (b << 16))
+        if candidates:
+            digest = strong(running[position:position + chunk_size])
+            for index in [i for i in candidates if entries[i][1] == digest]:
+                offsets[index] = position
+                candidates.remove(index)
+        if position + chunk_size >= len(running):
+            return offsets
+        out = running[position]
+        a = (a - out + running[position + chunk_size]) & 0xFFFF
+        b = (b - chunk_size * out + a) & 0xFFFF
+        position += 1
+
+
+def simulate(paths, chunk_size):
+    builds = []
+    for path in paths:
+        with open(path, "rb") as f:
+            builds.append((path, f.read()))
+
+    print("%-24s %-24s %9s %9s %9s %6s" % ("running", "update", "image", "manifest", "download", "saved"))
+    for new_path, new in builds:
+        manifest = build(new, chunk_size)
+        for old_path, old in builds:
+            if old_path == new_path:
+                continue
+            offsets = find_chunks(manifest, old)
+            copied = sum(chunk_size for offset in offsets if offset is not None)
+            download = len(new) - copied + len(manifest)
+            print("%-24s %-24s %9d %9d %9d %5.1f%%" % (
+                old_path[-24:], new_path[-24:], len(new), len(manifest), download,
+                100.0 * (len(new) - download) / len(new)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("build", help="make the manifest of an image")
+    p.add_argument("image")
+    p.add_argument("manifest")
+    p.add_argument("-c", "--chunk-size", type=int, default=DEFAULT_CHUNK_SIZE)
+
+    p = sub.add_parser("simulate", help="report the bytes downloaded between builds")
+    p.add_argument("builds", nargs="+")
+    p.add_argument("-c", "--chunk-size", type=int, default=DEFAULT_CHUNK_SIZE)
+
+    args = parser.parse_args()
+
+    if args.command == "build":
+        with open(args.image, "rb") as f:
+            image = f.read()
+        manifest = build(image, args.chunk_size)
+        with open(args.manifest, "wb") as f:
+            f.write(manifest)
+        print("%s: %d chunks, %d bytes" % (args.manifest, len(parse(manifest)[2]), len(manifest)))
+    else:
+        if len(args.builds) < 2:
+            parser.error("simulate needs at least two builds")
+        simulate(args.builds, args.chunk_size)
+
+
+if __name__ == "__main__":
+    sys.exit(main())